@@ -0,0 +1,472 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "air_aqi.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+/* no standard has more bands than this */
+#define AQI_MAX_BANDS 16
+/* values converted per pass of the batch evaluation */
+#define AQI_CHUNK 64
+
+/* Bands are kept sorted by their lower bound. Concentrations are handled in
+ * units of the table precision, where truncated values and breakpoints are
+ * whole numbers: the interpolation is then exact in float and halves round
+ * up as the standards want. */
+struct _AirAQITable
+{
+  int n_bands;
+  float scale;
+  float cmax;
+  float clow[AQI_MAX_BANDS];
+  float cspan[AQI_MAX_BANDS];
+  float ilow[AQI_MAX_BANDS];
+  float ispan[AQI_MAX_BANDS];
+  int truncate;
+};
+
+typedef struct _AirAQIBreakpoints
+{
+  const AirAQIBreakpoint *breakpoints;
+  int n_breakpoints;
+  float precision;
+} AirAQIBreakpoints;
+
+#define BREAKPOINTS(table, precision) \
+    { table, sizeof (table) / sizeof (table[0]), precision }
+
+static const AirAQIBreakpoint us_epa_pm25[] = {
+  {0.0,     9.0,   0,  50},
+  {9.1,    35.4,  51, 100},
+  {35.5,   55.4, 101, 150},
+  {55.5,  125.4, 151, 200},
+  {125.5, 225.4, 201, 300},
+  {225.5, 325.4, 301, 500},
+};
+
+static const AirAQIBreakpoint us_epa_legacy_pm25[] = {
+  {0.0,    12.0,   0,  50},
+  {12.1,   35.4,  51, 100},
+  {35.5,   55.4, 101, 150},
+  {55.5,  150.4, 151, 200},
+  {150.5, 250.4, 201, 300},
+  {250.5, 350.4, 301, 400},
+  {350.5, 500.4, 401, 500},
+};
+
+static const AirAQIBreakpoint us_epa_pm10[] = {
+  {0,    54,   0,  50},
+  {55,  154,  51, 100},
+  {155, 254, 101, 150},
+  {255, 354, 151, 200},
+  {355, 424, 201, 300},
+  {425, 504, 301, 400},
+  {505, 604, 401, 500},
+};
+
+static const AirAQIBreakpoint eu_caqi_pm25[] = {
+  {0,   15,   0,  25},
+  {15,  30,  25,  50},
+  {30,  55,  50,  75},
+  {55, 110,  75, 100},
+};
+
+static const AirAQIBreakpoint eu_caqi_pm10[] = {
+  {0,   25,   0,  25},
+  {25,  50,  25,  50},
+  {50,  90,  50,  75},
+  {90, 180,  75, 100},
+};
+
+static const AirAQIBreakpoint china_pm25[] = {
+  {0,    35,   0,  50},
+  {35,   75,  50, 100},
+  {75,  115, 100, 150},
+  {115, 150, 150, 200},
+  {150, 250, 200, 300},
+  {250, 350, 300, 400},
+  {350, 500, 400, 500},
+};
+
+static const AirAQIBreakpoint china_pm10[] = {
+  {0,    50,   0,  50},
+  {50,  150,  50, 100},
+  {150, 250, 100, 150},
+  {250, 350, 150, 200},
+  {350, 420, 200, 300},
+  {420, 500, 300, 400},
+  {500, 600, 400, 500},
+};
+
+static const AirAQIBreakpoint india_pm25[] = {
+  {0,    30,   0,  50},
+  {31,   60,  51, 100},
+  {61,   90, 101, 200},
+  {91,  120, 201, 300},
+  {121, 250, 301, 400},
+  {251, 380, 401, 500},
+};
+
+static const AirAQIBreakpoint india_pm10[] = {
+  {0,    50,   0,  50},
+  {51,  100,  51, 100},
+  {101, 250, 101, 200},
+  {251, 350, 201, 300},
+  {351, 430, 301, 400},
+  {431, 510, 401, 500},
+};
+
+static const AirAQIBreakpoints standards[AIR_AQI_STANDARDS][AIR_POLLUTANTS] = {
+  [AIR_AQI_US_EPA] = {
+    BREAKPOINTS (us_epa_pm25, 0.1),
+    BREAKPOINTS (us_epa_pm10, 1),
+  },
+  [AIR_AQI_US_EPA_LEGACY] = {
+    BREAKPOINTS (us_epa_legacy_pm25, 0.1),
+    BREAKPOINTS (us_epa_pm10, 1),
+  },
+  [AIR_AQI_EU_CAQI] = {
+    BREAKPOINTS (eu_caqi_pm25, 0),
+    BREAKPOINTS (eu_caqi_pm10, 0),
+  },
+  [AIR_AQI_CHINA] = {
+    BREAKPOINTS (china_pm25, 0),
+    BREAKPOINTS (china_pm10, 0),
+  },
+  [AIR_AQI_INDIA] = {
+    BREAKPOINTS (india_pm25, 1),
+    BREAKPOINTS (india_pm10, 1),
+  },
+};
+
+static const char *standard_str[] = {
+  "us-epa",
+  "us-epa-legacy",
+  "eu-caqi",
+  "china",
+  "india",
+};
+
+/* the tables of every standard, created on first use and never freed */
+static AirAQITable *builtin[AIR_AQI_STANDARDS][AIR_POLLUTANTS];
+static pthread_once_t builtin_once = PTHREAD_ONCE_INIT;
+
+static int
+compare_breakpoints (const void *a, const void *b)
+{
+  const AirAQIBreakpoint *x = a;
+  const AirAQIBreakpoint *y = b;
+
+  return x->clow < y->clow ? -1 : x->clow > y->clow;
+}
+
+AirAQITable*
+air_aqi_table_new (const AirAQIBreakpoint *breakpoints, int n_breakpoints,
+    float precision)
+{
+  AirAQIBreakpoint sorted[AQI_MAX_BANDS];
+  AirAQITable *table;
+  int i;
+
+  if (n_breakpoints < 1 || n_breakpoints > AQI_MAX_BANDS) {
+    fprintf (stderr, "Invalid number of AQI breakpoints: %d\n",
+        n_breakpoints);
+    return NULL;
+  }
+
+  memcpy (sorted, breakpoints, n_breakpoints * sizeof (AirAQIBreakpoint));
+  qsort (sorted, n_breakpoints, sizeof (AirAQIBreakpoint),
+      compare_breakpoints);
+
+  for (i = 0; i < n_breakpoints; i++) {
+    if (sorted[i].chigh <= sorted[i].clow ||
+        (i > 0 && sorted[i].clow < sorted[i - 1].chigh)) {
+      fprintf (stderr, "Invalid AQI breakpoint %g-%g\n", sorted[i].clow,
+          sorted[i].chigh);
+      return NULL;
+    }
+  }
+
+  table = calloc (1, sizeof (AirAQITable));
+  table->n_bands = n_breakpoints;
+  table->scale = precision > 0 ? roundf (1.0f / precision) : 1;
+
+  for (i = 0; i < n_breakpoints; i++) {
+    table->clow[i] = sorted[i].clow * table->scale;
+    table->cspan[i] = sorted[i].chigh * table->scale - table->clow[i];
+    table->ilow[i] = sorted[i].ilow;
+    table->ispan[i] = sorted[i].ihigh - sorted[i].ilow;
+    if (precision > 0) {
+      table->clow[i] = roundf (table->clow[i]);
+      table->cspan[i] = roundf (table->cspan[i]);
+    }
+  }
+  table->cmax = table->clow[n_breakpoints - 1] +
+      table->cspan[n_breakpoints - 1];
+  table->truncate = precision > 0;
+
+  return table;
+}
+
+AirAQITable*
+air_aqi_table_create (AirAQIStandard standard, AirPollutant pollutant)
+{
+  const AirAQIBreakpoints *set;
+
+  if (standard < 0 || standard >= AIR_AQI_STANDARDS ||
+      pollutant < 0 || pollutant >= AIR_POLLUTANTS) {
+    fprintf (stderr, "Unknown AQI standard %d or pollutant %d\n", standard,
+        pollutant);
+    return NULL;
+  }
+
+  set = &standards[standard][pollutant];
+
+  return air_aqi_table_new (set->breakpoints, set->n_breakpoints,
+      set->precision);
+}
+
+AirAQITable*
+air_aqi_table_load (const char *path, float precision)
+{
+  AirAQIBreakpoint breakpoints[AQI_MAX_BANDS];
+  char line[256];
+  char *p;
+  FILE *f;
+  int n = 0;
+
+  f = fopen (path, "r");
+  if (f == NULL) {
+    fprintf (stderr, "Unable to open %s\n", path);
+    return NULL;
+  }
+
+  while (fgets (line, sizeof (line), f) != NULL) {
+    if ((p = strchr (line, '#')) != NULL)
+      *p = '\0';
+    if (strspn (line, " \t\r\n") == strlen (line))
+      continue;
+
+    if (n == AQI_MAX_BANDS || sscanf (line, "%f %f %d %d",
+        &breakpoints[n].clow, &breakpoints[n].chigh, &breakpoints[n].ilow,
+        &breakpoints[n].ihigh) != 4) {
+      fprintf (stderr, "Invalid breakpoint in %s: %s", path, line);
+      fclose (f);
+      return NULL;
+    }
+    n++;
+  }
+  fclose (f);
+
+  return air_aqi_table_new (breakpoints, n, precision);
+}
+
+void
+air_aqi_table_free (AirAQITable *table)
+{
+  free (table);
+}
+
+static void
+builtin_init (void)
+{
+  int standard;
+  int pollutant;
+
+  for (standard = 0; standard < AIR_AQI_STANDARDS; standard++)
+    for (pollutant = 0; pollutant < AIR_POLLUTANTS; pollutant++)
+      builtin[standard][pollutant] = air_aqi_table_create (standard,
+          pollutant);
+}
+
+const AirAQITable*
+air_aqi_table_builtin (AirAQIStandard standard, AirPollutant pollutant)
+{
+  pthread_once (&builtin_once, builtin_init);
+
+  return builtin[standard][pollutant];
+}
+
+const char*
+air_aqi_standard_name (AirAQIStandard standard)
+{
+  if (standard < 0 || standard >= AIR_AQI_STANDARDS)
+    return "unknown";
+
+  return standard_str[standard];
+}
+
+int
+air_aqi_standard_from_name (const char *name)
+{
+  int standard;
+
+  for (standard = 0; standard < AIR_AQI_STANDARDS; standard++) {
+    if (strcmp (name, standard_str[standard]) == 0)
+      return standard;
+  }
+
+  return (-1);
+}
+
+/* converts to table units truncating to the precision of the table and
+ * clamps to its range, the epsilon keeps e.g. 12.1f from becoming 120 */
+static inline float
+aqi_units (const AirAQITable *table, float concentration)
+{
+  concentration *= table->scale;
+  if (table->truncate)
+    concentration = (int) (concentration + 0.001f);
+  concentration = concentration < 0 ? 0 : concentration;
+  concentration = concentration > table->cmax ? table->cmax : concentration;
+
+  return concentration;
+}
+
+/* ilow + ispan * (c - clow) / cspan rounded half up, c >= clow so the
+ * conversion truncates to the floor */
+static inline int
+aqi_interpolate (float c, float clow, float cspan, float ilow, float ispan)
+{
+  return (int) ((2 * ispan * (c - clow) + cspan) / (2 * cspan) + ilow);
+}
+
+int
+air_aqi_evaluate (const AirAQITable *table, float concentration)
+{
+  int low = 0;
+  int high = table->n_bands - 1;
+  int mid;
+
+  concentration = aqi_units (table, concentration);
+
+  /* last band starting at or below the concentration */
+  while (low < high) {
+    mid = (low + high + 1) / 2;
+    if (table->clow[mid] <= concentration)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+
+  return aqi_interpolate (concentration, table->clow[low], table->cspan[low],
+      table->ilow[low], table->ispan[low]);
+}
+
+/* one pass per band and field over a chunk of values, the inner loops are
+ * plain selects and vectorize */
+void
+air_aqi_evaluate_batch (const AirAQITable *table,
+    const float *concentrations, int *aqi, size_t n)
+{
+  float value[AQI_CHUNK];
+  float clow[AQI_CHUNK];
+  float cspan[AQI_CHUNK];
+  float ilow[AQI_CHUNK];
+  float ispan[AQI_CHUNK];
+  float band_clow;
+  float band_cspan;
+  float band_ilow;
+  float band_ispan;
+  size_t start;
+  size_t m;
+  size_t i;
+  int b;
+
+  for (start = 0; start < n; start += AQI_CHUNK) {
+    m = n - start < AQI_CHUNK ? n - start : AQI_CHUNK;
+
+    for (i = 0; i < m; i++) {
+      value[i] = aqi_units (table, concentrations[start + i]);
+      clow[i] = table->clow[0];
+      cspan[i] = table->cspan[0];
+      ilow[i] = table->ilow[0];
+      ispan[i] = table->ispan[0];
+    }
+
+    for (b = 1; b < table->n_bands; b++) {
+      band_clow = table->clow[b];
+      band_cspan = table->cspan[b];
+      band_ilow = table->ilow[b];
+      band_ispan = table->ispan[b];
+
+      for (i = 0; i < m; i++)
+        cspan[i] = value[i] >= band_clow ? band_cspan : cspan[i];
+      for (i = 0; i < m; i++)
+        ilow[i] = value[i] >= band_clow ? band_ilow : ilow[i];
+      for (i = 0; i < m; i++)
+        ispan[i] = value[i] >= band_clow ? band_ispan : ispan[i];
+      for (i = 0; i < m; i++)
+        clow[i] = value[i] >= band_clow ? band_clow : clow[i];
+    }
+
+    for (i = 0; i < m; i++)
+      aqi[start + i] = aqi_interpolate (value[i], clow[i], cspan[i], ilow[i],
+          ispan[i]);
+  }
+}
+
+/* the NowCast of the EPA Technical Assistance Document for the Reporting of
+ * Daily Air Quality (September 2018), https://www.airnow.gov/sites/default/
+ * files/2020-05/aqi-technical-assistance-document-sept2018.pdf */
+float
+air_aqi_nowcast (const float *hourly, int n_hours)
+{
+  float min = INFINITY;
+  float max = 0;
+  float weight;
+  float factor = 1;
+  float sum = 0;
+  float sum_weights = 0;
+  int recent = 0;
+  int i;
+
+  if (n_hours > 12)
+    n_hours = 12;
+
+  for (i = 0; i < n_hours; i++) {
+    if (isnan (hourly[i]))
+      continue;
+    if (i < 3)
+      recent++;
+    min = hourly[i] < min ? hourly[i] : min;
+    max = hourly[i] > max ? hourly[i] : max;
+  }
+
+  if (recent < 2)
+    return (-1);
+
+  weight = max > 0 ? min / max : 1;
+  if (weight < 0.5)
+    weight = 0.5;
+
+  /* missing hours still count for the age of the older ones */
+  for (i = 0; i < n_hours; i++) {
+    if (!isnan (hourly[i])) {
+      sum += factor * hourly[i];
+      sum_weights += factor;
+    }
+    factor *= weight;
+  }
+
+  return sum / sum_weights;
+}
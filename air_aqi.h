@@ -0,0 +1,84 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __AIR_AQI_H__
+#define __AIR_AQI_H__
+
+#include <stddef.h>
+
+/* Table driven air quality indices. A table holds the breakpoints of one
+ * pollutant in one standard, concentrations are μg/m3 averaged as the
+ * standard asks for (24h for most PM indices, 1h for CAQI, NowCast for the
+ * US hourly reports). Tables are immutable once created and can be shared
+ * between threads. */
+typedef enum AirAQIStandard
+{
+  AIR_AQI_US_EPA,               /* 2024 PM2.5 revision */
+  AIR_AQI_US_EPA_LEGACY,        /* 2012 breakpoints */
+  AIR_AQI_EU_CAQI,              /* hourly CAQI, 0-100 */
+  AIR_AQI_CHINA,                /* HJ 633-2012 IAQI */
+  AIR_AQI_INDIA,                /* CPCB National AQI */
+  AIR_AQI_STANDARDS,
+} AirAQIStandard;
+
+/* the breakpoints of pm25ugm32aqi () and pm10ugm32aqi () */
+#define AIR_AQI_DEFAULT AIR_AQI_US_EPA_LEGACY
+
+typedef enum AirPollutant
+{
+  AIR_POLLUTANT_PM25,
+  AIR_POLLUTANT_PM10,
+  AIR_POLLUTANTS,
+} AirPollutant;
+
+typedef struct _AirAQIBreakpoint
+{
+  float clow;
+  float chigh;
+  int ilow;
+  int ihigh;
+} AirAQIBreakpoint;
+
+typedef struct _AirAQITable AirAQITable;
+
+AirAQITable* air_aqi_table_create (AirAQIStandard standard,
+    AirPollutant pollutant);
+/* precision is the step concentrations are truncated to before the lookup
+ * (0.1 for EPA PM2.5), 0 to interpolate continuously */
+AirAQITable* air_aqi_table_new (const AirAQIBreakpoint *breakpoints,
+    int n_breakpoints, float precision);
+/* one "clow chigh ilow ihigh" breakpoint per line, # starts a comment */
+AirAQITable* air_aqi_table_load (const char *path, float precision);
+void air_aqi_table_free (AirAQITable *table);
+/* a table shared by all callers, not to be freed */
+const AirAQITable* air_aqi_table_builtin (AirAQIStandard standard,
+    AirPollutant pollutant);
+
+const char* air_aqi_standard_name (AirAQIStandard standard);
+/* the standard named like air_aqi_standard_name (), -1 if unknown */
+int air_aqi_standard_from_name (const char *name);
+
+int air_aqi_evaluate (const AirAQITable *table, float concentration);
+void air_aqi_evaluate_batch (const AirAQITable *table,
+    const float *concentrations, int *aqi, size_t n);
+
+/* EPA NowCast of up to 12 hourly means, hourly[0] being the latest hour and
+ * NAN marking missing hours. Returns -1 unless 2 of the latest 3 hours are
+ * known. */
+float air_aqi_nowcast (const float *hourly, int n_hours);
+
+#endif //__AIR_AQI_H__
@@ -0,0 +1,368 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "air_calib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* entries of the lookup table a piecewise curve is resampled into, linearly
+ * interpolated in between */
+#define CALIB_LUT_SIZE 1024
+/* the humidity correction diverges at saturation */
+#define CALIB_MAX_HUMIDITY 99.0f
+
+struct _AirCalib
+{
+  AirCalibCurve curve;
+  /* highest power first, for Horner */
+  float horner[AIR_CALIB_MAX_TERMS];
+  int n_terms;
+  /* piecewise curves, the table spans ratios from lut_min to lut_max */
+  float lut[CALIB_LUT_SIZE + 1];
+  float lut_min;
+  float lut_max;
+  float lut_scale;
+  float pcs2ugm3;
+  float gain;
+  float offset;
+  float kappa;
+  const AirAQITable *aqi[AIR_POLLUTANTS];
+};
+
+static void
+profile_init (AirCalibProfile *profile)
+{
+  *profile = (AirCalibProfile) { 0 };
+  profile->pcs2ugm3 = pm25pcs2ugm3 (1.0f);
+  profile->gain = 1.0f;
+}
+
+int
+air_calib_profile_builtin (const char *name, AirCalibProfile *profile)
+{
+  /* PPD42NS spec sheet */
+  static const float ppd42[] = { 0.62, 520, -3.8, 1.1 };
+
+  if (strcmp (name, "ppd42") != 0 && strcmp (name, "ppd42_pm10") != 0)
+    return (-1);
+
+  profile_init (profile);
+  profile->curve = AIR_CALIB_POLYNOMIAL;
+  memcpy (profile->coefficients, ppd42, sizeof (ppd42));
+  profile->n_coefficients = sizeof (ppd42) / sizeof (ppd42[0]);
+  if (strcmp (name, "ppd42_pm10") == 0)
+    profile->pcs2ugm3 = pm10pcs2ugm3 (1.0f);
+
+  return (0);
+}
+
+static int
+profile_parse (AirCalibProfile *profile, char *line)
+{
+  char key[16];
+  char *p;
+  char *end;
+  int n;
+
+  if (sscanf (line, "%15s%n", key, &n) != 1)
+    return (-1);
+  p = line + n;
+
+  if (strcmp (key, "polynomial") == 0) {
+    profile->curve = AIR_CALIB_POLYNOMIAL;
+    profile->n_coefficients = 0;
+    while (1) {
+      if (profile->n_coefficients == AIR_CALIB_MAX_TERMS)
+        return (-1);
+      profile->coefficients[profile->n_coefficients] = strtof (p, &end);
+      if (end == p)
+        break;
+      profile->n_coefficients++;
+      p = end;
+    }
+    return profile->n_coefficients > 0 ? 0 : -1;
+  } else if (strcmp (key, "point") == 0) {
+    if (profile->n_points == AIR_CALIB_MAX_POINTS ||
+        sscanf (p, "%f %f", &profile->points[profile->n_points][0],
+        &profile->points[profile->n_points][1]) != 2)
+      return (-1);
+    profile->curve = AIR_CALIB_PIECEWISE;
+    profile->n_points++;
+    return (0);
+  } else if (strcmp (key, "pcs2ugm3") == 0) {
+    return sscanf (p, "%f", &profile->pcs2ugm3) == 1 ? 0 : -1;
+  } else if (strcmp (key, "gain") == 0) {
+    return sscanf (p, "%f", &profile->gain) == 1 ? 0 : -1;
+  } else if (strcmp (key, "offset") == 0) {
+    return sscanf (p, "%f", &profile->offset) == 1 ? 0 : -1;
+  } else if (strcmp (key, "kappa") == 0) {
+    return sscanf (p, "%f", &profile->kappa) == 1 ? 0 : -1;
+  }
+
+  return (-1);
+}
+
+int
+air_calib_profile_load (const char *path, AirCalibProfile *profile)
+{
+  char line[256];
+  char *p;
+  FILE *f;
+
+  f = fopen (path, "r");
+  if (f == NULL) {
+    fprintf (stderr, "Unable to open %s\n", path);
+    return (-1);
+  }
+
+  profile_init (profile);
+  while (fgets (line, sizeof (line), f) != NULL) {
+    if ((p = strchr (line, '#')) != NULL)
+      *p = '\0';
+    if (strspn (line, " \t\r\n") == strlen (line))
+      continue;
+
+    if (profile_parse (profile, line) == -1) {
+      fprintf (stderr, "Invalid calibration in %s: %s", path, line);
+      fclose (f);
+      return (-1);
+    }
+  }
+  fclose (f);
+
+  if (profile->n_coefficients == 0 && profile->n_points == 0) {
+    fprintf (stderr, "%s has no curve\n", path);
+    return (-1);
+  }
+
+  return (0);
+}
+
+int
+air_calib_profile_get (const char *name, AirCalibProfile *profile)
+{
+  if (air_calib_profile_builtin (name, profile) == 0)
+    return (0);
+
+  return air_calib_profile_load (name, profile);
+}
+
+/* exact value of a piecewise curve, used to fill the lookup table */
+static float
+piecewise_eval (const AirCalibProfile *profile, float ratio)
+{
+  const float (*points)[2] = profile->points;
+  int i;
+
+  if (ratio <= points[0][0])
+    return points[0][1];
+
+  for (i = 1; i < profile->n_points; i++) {
+    if (ratio <= points[i][0])
+      return points[i - 1][1] + (ratio - points[i - 1][0]) *
+          (points[i][1] - points[i - 1][1]) / (points[i][0] - points[i - 1][0]);
+  }
+
+  return points[profile->n_points - 1][1];
+}
+
+AirCalib*
+air_calib_create (const AirCalibProfile *profile)
+{
+  AirCalib *calib;
+  int i;
+
+  if (profile->curve == AIR_CALIB_POLYNOMIAL &&
+      (profile->n_coefficients < 1 ||
+      profile->n_coefficients > AIR_CALIB_MAX_TERMS)) {
+    fprintf (stderr, "A polynomial needs 1 to %d coefficients\n",
+        AIR_CALIB_MAX_TERMS);
+    return NULL;
+  }
+
+  if (profile->curve == AIR_CALIB_PIECEWISE) {
+    if (profile->n_points < 2 || profile->n_points > AIR_CALIB_MAX_POINTS) {
+      fprintf (stderr, "A piecewise curve needs 2 to %d points\n",
+          AIR_CALIB_MAX_POINTS);
+      return NULL;
+    }
+    for (i = 1; i < profile->n_points; i++) {
+      if (profile->points[i][0] <= profile->points[i - 1][0]) {
+        fprintf (stderr, "Curve points must have ascending ratios\n");
+        return NULL;
+      }
+    }
+  }
+
+  if (profile->kappa < 0) {
+    fprintf (stderr, "Kappa must not be negative\n");
+    return NULL;
+  }
+
+  calib = calloc (1, sizeof (AirCalib));
+  calib->curve = profile->curve;
+  calib->pcs2ugm3 = profile->pcs2ugm3;
+  calib->gain = profile->gain;
+  calib->offset = profile->offset;
+  calib->kappa = profile->kappa;
+  air_calib_set_aqi_standard (calib, AIR_AQI_DEFAULT);
+
+  if (profile->curve == AIR_CALIB_POLYNOMIAL) {
+    calib->n_terms = profile->n_coefficients;
+    for (i = 0; i < calib->n_terms; i++)
+      calib->horner[i] = profile->coefficients[calib->n_terms - 1 - i];
+  } else {
+    calib->lut_min = profile->points[0][0];
+    calib->lut_max = profile->points[profile->n_points - 1][0];
+    calib->lut_scale = CALIB_LUT_SIZE / (calib->lut_max - calib->lut_min);
+    for (i = 0; i <= CALIB_LUT_SIZE; i++)
+      calib->lut[i] = piecewise_eval (profile, calib->lut_min +
+          i / calib->lut_scale);
+  }
+
+  return calib;
+}
+
+void
+air_calib_free (AirCalib *calib)
+{
+  free (calib);
+}
+
+void
+air_calib_set_aqi_standard (AirCalib *calib, AirAQIStandard standard)
+{
+  calib->aqi[AIR_POLLUTANT_PM25] = air_aqi_table_builtin (standard,
+      AIR_POLLUTANT_PM25);
+  calib->aqi[AIR_POLLUTANT_PM10] = air_aqi_table_builtin (standard,
+      AIR_POLLUTANT_PM10);
+}
+
+static inline float
+calib_pcs (const AirCalib *calib, float ratio)
+{
+  float pcs;
+  float x;
+  int i;
+
+  if (calib->curve == AIR_CALIB_POLYNOMIAL) {
+    pcs = calib->horner[0];
+    for (i = 1; i < calib->n_terms; i++)
+      pcs = pcs * ratio + calib->horner[i];
+    return pcs;
+  }
+
+  x = (ratio - calib->lut_min) * calib->lut_scale;
+  x = x < 0 ? 0 : x;
+  x = x > CALIB_LUT_SIZE ? CALIB_LUT_SIZE : x;
+  i = (int) x;
+  if (i == CALIB_LUT_SIZE)
+    return calib->lut[i];
+
+  return calib->lut[i] + (x - i) * (calib->lut[i + 1] - calib->lut[i]);
+}
+
+static inline float
+calib_ugm3 (const AirCalib *calib, float pcs, float humidity)
+{
+  float ugm3;
+
+  ugm3 = pcs * calib->pcs2ugm3 * calib->gain + calib->offset;
+  if (calib->kappa > 0 && humidity > 0) {
+    humidity = humidity > CALIB_MAX_HUMIDITY ? CALIB_MAX_HUMIDITY : humidity;
+    ugm3 /= 1.0f + calib->kappa / 1.65f / (100.0f / humidity - 1.0f);
+  }
+
+  return ugm3 < 0 ? 0 : ugm3;
+}
+
+float
+air_calib_pcs (const AirCalib *calib, float ratio)
+{
+  return calib_pcs (calib, ratio);
+}
+
+float
+air_calib_ugm3 (const AirCalib *calib, float pcs, float humidity)
+{
+  return calib_ugm3 (calib, pcs, humidity);
+}
+
+void
+air_calib_reading (const AirCalib *calib, float ratio, float humidity,
+    AirReading *reading)
+{
+  reading->concentration_pcs = calib_pcs (calib, ratio);
+  reading->concentration_ugm3 = calib_ugm3 (calib,
+      reading->concentration_pcs, humidity);
+  reading->aqi = air_aqi_evaluate (calib->aqi[AIR_POLLUTANT_PM25],
+      reading->concentration_ugm3);
+}
+
+/* P1 counts particles above 1 μm, P2 above 2.5 μm. The fine fraction is
+ * their difference, the coarse one is P2 alone, weighted by the mass of a
+ * PM10 particle relative to the PM2.5 one the profile converts for. PM10
+ * is the mass of both fractions, as measured by the reference methods. */
+void
+air_calib_split (const AirCalib *calib, float ratio_p1, float ratio_p2,
+    float humidity, AirReading *pm25, AirReading *pm10)
+{
+  float pcs_p1;
+  float pcs_p2;
+  float equivalent_pcs;
+
+  pcs_p1 = calib_pcs (calib, ratio_p1);
+  pcs_p2 = calib_pcs (calib, ratio_p2);
+  pcs_p2 = pcs_p2 < 0 ? 0 : pcs_p2;
+
+  pm25->concentration_pcs = pcs_p1 > pcs_p2 ? pcs_p1 - pcs_p2 : 0;
+  pm25->concentration_ugm3 = calib_ugm3 (calib, pm25->concentration_pcs,
+      humidity);
+  pm25->aqi = air_aqi_evaluate (calib->aqi[AIR_POLLUTANT_PM25],
+      pm25->concentration_ugm3);
+
+  /* in PM2.5 particle equivalents, so that the offset applies once */
+  equivalent_pcs = pm25->concentration_pcs +
+      pcs_p2 * pm10pcs2ugm3 (1.0f) / pm25pcs2ugm3 (1.0f);
+  pm10->concentration_pcs = pm25->concentration_pcs + pcs_p2;
+  pm10->concentration_ugm3 = calib_ugm3 (calib, equivalent_pcs, humidity);
+  pm10->aqi = air_aqi_evaluate (calib->aqi[AIR_POLLUTANT_PM10],
+      pm10->concentration_ugm3);
+}
+
+void
+air_calib_pcs_batch (const AirCalib *calib, const float *ratios, float *pcs,
+    size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    pcs[i] = calib_pcs (calib, ratios[i]);
+}
+
+void
+air_calib_ugm3_batch (const AirCalib *calib, const float *pcs,
+    const float *humidity, float *ugm3, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    ugm3[i] = calib_ugm3 (calib, pcs[i], humidity != NULL ? humidity[i] : NAN);
+}
@@ -0,0 +1,103 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __AIR_CALIB_H__
+#define __AIR_CALIB_H__
+
+#include "air_utils.h"
+#include "air_aqi.h"
+
+#include <stddef.h>
+
+/* Calibration profiles turning the low pulse occupancy of a sensor, in
+ * percent, into a reading. The curve gives pcs/0.01cf and is either a
+ * polynomial or piecewise linear through points of ascending ratio,
+ * clamped to the first and last point. The concentration is then converted
+ * to μg/m3, corrected by gain and offset and, when the humidity is known,
+ * for the growth of wet particles with the kappa-Köhler factor
+ * 1 + kappa / 1.65 / (100 / RH - 1).
+ *
+ * A profile is compiled once into an evaluator: polynomials in Horner form,
+ * piecewise curves into a lookup table. Evaluators are immutable and can be
+ * shared between threads. */
+#define AIR_CALIB_MAX_TERMS  8
+#define AIR_CALIB_MAX_POINTS 64
+
+typedef enum AirCalibCurve
+{
+  AIR_CALIB_POLYNOMIAL,
+  AIR_CALIB_PIECEWISE,
+} AirCalibCurve;
+
+typedef struct _AirCalibProfile
+{
+  AirCalibCurve curve;
+  float coefficients[AIR_CALIB_MAX_TERMS];  /* c0 + c1 r + c2 r^2 ... */
+  int n_coefficients;
+  float points[AIR_CALIB_MAX_POINTS][2];    /* ratio, pcs/0.01cf */
+  int n_points;
+  float pcs2ugm3;
+  float gain;
+  float offset;                             /* μg/m3 */
+  float kappa;                              /* 0 for no humidity correction */
+} AirCalibProfile;
+
+/* "ppd42" is the PPD42NS curve of the spec sheet with PM2.5 particles,
+ * "ppd42_pm10" the same curve with PM10 sized particles for the P2
+ * output. Returns -1 for unknown names. */
+int air_calib_profile_builtin (const char *name, AirCalibProfile *profile);
+/* one setting per line, # starts a comment:
+ *
+ *   polynomial c0 c1 c2 ...
+ *   point ratio pcs             once per point of a piecewise curve
+ *   pcs2ugm3 factor             defaults to PM2.5 particles
+ *   gain 1.0
+ *   offset 0.0
+ *   kappa 0.0
+ */
+int air_calib_profile_load (const char *path, AirCalibProfile *profile);
+/* a builtin profile name or the path of a profile file */
+int air_calib_profile_get (const char *name, AirCalibProfile *profile);
+
+typedef struct _AirCalib AirCalib;
+
+AirCalib* air_calib_create (const AirCalibProfile *profile);
+void air_calib_free (AirCalib *calib);
+/* the index readings get, AIR_AQI_DEFAULT unless set before the evaluator
+ * is shared */
+void air_calib_set_aqi_standard (AirCalib *calib, AirAQIStandard standard);
+
+float air_calib_pcs (const AirCalib *calib, float ratio);
+/* humidity is the relative humidity in percent, NAN when unknown */
+float air_calib_ugm3 (const AirCalib *calib, float pcs, float humidity);
+/* fills the concentrations and the AQI of reading */
+void air_calib_reading (const AirCalib *calib, float ratio, float humidity,
+    AirReading *reading);
+
+/* the readings of a dual channel sensor from the occupancies of its P1
+ * (above 1 μm) and P2 (above 2.5 μm) outputs, with the PM2.5 profile */
+void air_calib_split (const AirCalib *calib, float ratio_p1, float ratio_p2,
+    float humidity, AirReading *pm25, AirReading *pm10);
+
+/* the same over arrays, humidity may be NULL. Recomputing stored readings
+ * after a calibration change only needs their pcs while the curve stays. */
+void air_calib_pcs_batch (const AirCalib *calib, const float *ratios,
+    float *pcs, size_t n);
+void air_calib_ugm3_batch (const AirCalib *calib, const float *pcs,
+    const float *humidity, float *ugm3, size_t n);
+
+#endif //__AIR_CALIB_H__
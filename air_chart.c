@@ -0,0 +1,459 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "air_chart.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#define CHART_MAX_SERIES 8
+#define CHART_MIN_WIDTH 200
+#define CHART_MIN_HEIGHT 120
+#define CHART_MAX_SIZE 4096
+#define CHART_MARGIN_LEFT 56
+#define CHART_MARGIN_RIGHT 16
+#define CHART_MARGIN_TOP 36
+#define CHART_MARGIN_BOTTOM 40
+#define CHART_Y_TICKS 5
+#define CHART_X_TICKS 6
+
+typedef struct _ChartSeries
+{
+  int id;
+  AirChartPoint *points;
+  int n_points;
+  int size;
+} ChartSeries;
+
+typedef struct _ChartBuffer
+{
+  char *data;
+  size_t len;
+  size_t size;
+} ChartBuffer;
+
+struct _AirChart
+{
+  ChartSeries series[CHART_MAX_SERIES];
+  int n_series;
+  float max_value;
+  int64_t first_ms;
+  int64_t last_ms;
+  AirChartPoint *sampled;
+  int sampled_size;
+  ChartBuffer svg;
+};
+
+static const char *colors[CHART_MAX_SERIES] = {
+  "#1f77b4", "#d62728", "#2ca02c", "#ff7f0e",
+  "#9467bd", "#8c564b", "#e377c2", "#17becf"
+};
+
+/* time axis steps, the smallest giving at most CHART_X_TICKS ticks is used */
+static const int64_t time_steps[] = {
+  60000, 300000, 900000, 1800000, 3600000, 3 * 3600000, 6 * 3600000,
+  12 * 3600000, 86400000, 2 * 86400000LL, 7 * 86400000LL, 30 * 86400000LL,
+  365 * 86400000LL
+};
+
+static void
+buffer_reserve (ChartBuffer *buf, size_t len)
+{
+  if (buf->len + len + 1 <= buf->size)
+    return;
+
+  while (buf->len + len + 1 > buf->size)
+    buf->size = buf->size ? buf->size * 2 : 4096;
+  buf->data = realloc (buf->data, buf->size);
+}
+
+static void
+buffer_printf (ChartBuffer *buf, const char *format, ...)
+{
+  va_list args;
+  int len;
+
+  va_start (args, format);
+  len = vsnprintf (buf->data + buf->len, buf->size - buf->len, format, args);
+  va_end (args);
+
+  if (buf->len + len + 1 > buf->size) {
+    buffer_reserve (buf, len);
+    va_start (args, format);
+    vsnprintf (buf->data + buf->len, buf->size - buf->len, format, args);
+    va_end (args);
+  }
+  buf->len += len;
+}
+
+/* characters with a meaning in XML are dropped from text */
+static void
+buffer_text (ChartBuffer *buf, const char *text)
+{
+  buffer_reserve (buf, strlen (text));
+  for (; *text != '\0'; text++) {
+    if (strchr ("<>&\"'", *text) == NULL)
+      buf->data[buf->len++] = *text;
+  }
+  buf->data[buf->len] = '\0';
+}
+
+/* 1, 2 or 5 times a power of ten, at least range / n_ticks */
+static double
+nice_step (double range, int n_ticks)
+{
+  double step = range / n_ticks;
+  double magnitude = pow (10, floor (log10 (step)));
+  double fraction = step / magnitude;
+
+  if (fraction <= 1)
+    return magnitude;
+  else if (fraction <= 2)
+    return 2 * magnitude;
+  else if (fraction <= 5)
+    return 5 * magnitude;
+  return 10 * magnitude;
+}
+
+int
+air_chart_lttb (const AirChartPoint *points, int n, AirChartPoint *sampled,
+    int threshold)
+{
+  double every;
+  double avg_x;
+  double avg_y;
+  double area;
+  double max_area;
+  double ax;
+  double ay;
+  int avg_start;
+  int avg_end;
+  int start;
+  int end;
+  int max_i;
+  int a = 0;
+  int n_sampled = 0;
+  int i;
+  int j;
+
+  if (threshold >= n || threshold < 3) {
+    memcpy (sampled, points, n * sizeof (AirChartPoint));
+    return n;
+  }
+
+  /* first and last points are kept, the rest is split in equal buckets and
+   * the point of each bucket forming the largest triangle with the point
+   * kept from the previous bucket and the mean of the next one is kept */
+  every = (double) (n - 2) / (threshold - 2);
+  sampled[n_sampled++] = points[0];
+
+  for (i = 0; i < threshold - 2; i++) {
+    avg_start = (int) ((i + 1) * every) + 1;
+    avg_end = (int) ((i + 2) * every) + 1;
+    if (avg_end > n)
+      avg_end = n;
+
+    avg_x = 0;
+    avg_y = 0;
+    for (j = avg_start; j < avg_end; j++) {
+      avg_x += points[j].timestamp_ms - points[0].timestamp_ms;
+      avg_y += points[j].value;
+    }
+    avg_x /= avg_end - avg_start;
+    avg_y /= avg_end - avg_start;
+
+    start = (int) (i * every) + 1;
+    end = (int) ((i + 1) * every) + 1;
+    ax = points[a].timestamp_ms - points[0].timestamp_ms;
+    ay = points[a].value;
+
+    max_area = -1;
+    max_i = start;
+    for (j = start; j < end; j++) {
+      area = fabs ((ax - avg_x) * (points[j].value - ay) -
+          (ax - (points[j].timestamp_ms - points[0].timestamp_ms)) *
+          (avg_y - ay));
+      if (area > max_area) {
+        max_area = area;
+        max_i = j;
+      }
+    }
+
+    sampled[n_sampled++] = points[max_i];
+    a = max_i;
+  }
+
+  sampled[n_sampled++] = points[n - 1];
+
+  return n_sampled;
+}
+
+AirChart*
+air_chart_create (void)
+{
+  AirChart *chart;
+
+  chart = calloc (1, sizeof (AirChart));
+  air_chart_reset (chart);
+
+  return chart;
+}
+
+void
+air_chart_free (AirChart *chart)
+{
+  int i;
+
+  for (i = 0; i < CHART_MAX_SERIES; i++)
+    free (chart->series[i].points);
+  free (chart->sampled);
+  free (chart->svg.data);
+  free (chart);
+}
+
+void
+air_chart_reset (AirChart *chart)
+{
+  int i;
+
+  for (i = 0; i < CHART_MAX_SERIES; i++)
+    chart->series[i].n_points = 0;
+  chart->n_series = 0;
+  chart->max_value = 0;
+  chart->first_ms = INT64_MAX;
+  chart->last_ms = INT64_MIN;
+}
+
+int
+air_chart_add (AirChart *chart, int series, int64_t timestamp_ms,
+    float value)
+{
+  ChartSeries *s;
+  int i;
+
+  for (i = 0; i < chart->n_series && chart->series[i].id != series; i++);
+  if (i == chart->n_series) {
+    if (i == CHART_MAX_SERIES)
+      return (-1);
+    chart->series[i].id = series;
+    chart->n_series++;
+  }
+
+  s = &chart->series[i];
+  if (s->n_points == s->size) {
+    s->size = s->size ? s->size * 2 : 1024;
+    s->points = realloc (s->points, s->size * sizeof (AirChartPoint));
+  }
+  s->points[s->n_points].timestamp_ms = timestamp_ms;
+  s->points[s->n_points].value = value;
+  s->n_points++;
+
+  if (value > chart->max_value)
+    chart->max_value = value;
+  if (timestamp_ms < chart->first_ms)
+    chart->first_ms = timestamp_ms;
+  if (timestamp_ms > chart->last_ms)
+    chart->last_ms = timestamp_ms;
+
+  return (0);
+}
+
+int
+air_chart_n_points (AirChart *chart)
+{
+  int n = 0;
+  int i;
+
+  for (i = 0; i < chart->n_series; i++)
+    n += chart->series[i].n_points;
+
+  return n;
+}
+
+static void
+render_time_axis (AirChart *chart, int64_t from_ms, int64_t to_ms,
+    double x0, double y0, double plot_width)
+{
+  ChartBuffer *svg = &chart->svg;
+  const char *format;
+  struct tm tm;
+  time_t t;
+  int64_t step = time_steps[0];
+  int64_t offset_ms;
+  int64_t tick;
+  char label[32];
+  double x;
+  size_t i;
+
+  for (i = 0; i < sizeof (time_steps) / sizeof (time_steps[0]); i++) {
+    step = time_steps[i];
+    if ((to_ms - from_ms) / step < CHART_X_TICKS)
+      break;
+  }
+  if ((to_ms - from_ms) / step >= CHART_X_TICKS)
+    step *= (to_ms - from_ms) / step / CHART_X_TICKS + 1;
+
+  if (step >= 86400000)
+    format = "%Y-%m-%d";
+  else if (to_ms - from_ms > 86400000)
+    format = "%m-%d %H:%M";
+  else
+    format = "%H:%M";
+
+  /* ticks on round local times */
+  t = from_ms / 1000;
+  localtime_r (&t, &tm);
+  offset_ms = (int64_t) tm.tm_gmtoff * 1000;
+
+  tick = (from_ms + offset_ms + step - 1) / step * step - offset_ms;
+  for (; tick <= to_ms; tick += step) {
+    x = x0 + (double) (tick - from_ms) / (to_ms - from_ms) * plot_width;
+    t = tick / 1000;
+    localtime_r (&t, &tm);
+    strftime (label, sizeof (label), format, &tm);
+
+    buffer_printf (svg, "<line x1=\"%.1f\" y1=\"%.1f\" x2=\"%.1f\" "
+        "y2=\"%.1f\" stroke=\"#888\"/>\n", x, y0, x, y0 + 4);
+    buffer_printf (svg, "<text x=\"%.1f\" y=\"%.1f\" "
+        "text-anchor=\"middle\">%s</text>\n", x, y0 + 18, label);
+  }
+}
+
+const char*
+air_chart_render_svg (AirChart *chart, const AirChartConfig *config,
+    size_t *len)
+{
+  ChartBuffer *svg = &chart->svg;
+  ChartSeries *s;
+  AirChartPoint *p;
+  int64_t from_ms = config->from_ms;
+  int64_t to_ms = config->to_ms;
+  double plot_width;
+  double plot_height;
+  double x0;
+  double y0;
+  double step;
+  double max_value;
+  double value;
+  double y;
+  int width = config->width;
+  int height = config->height;
+  int n;
+  int i;
+  int j;
+
+  width = width < CHART_MIN_WIDTH ? CHART_MIN_WIDTH :
+      width > CHART_MAX_SIZE ? CHART_MAX_SIZE : width;
+  height = height < CHART_MIN_HEIGHT ? CHART_MIN_HEIGHT :
+      height > CHART_MAX_SIZE ? CHART_MAX_SIZE : height;
+  plot_width = width - CHART_MARGIN_LEFT - CHART_MARGIN_RIGHT;
+  plot_height = height - CHART_MARGIN_TOP - CHART_MARGIN_BOTTOM;
+  x0 = CHART_MARGIN_LEFT;
+  y0 = CHART_MARGIN_TOP + plot_height;
+
+  if (from_ms == 0 && to_ms == 0) {
+    from_ms = chart->first_ms;
+    to_ms = chart->last_ms;
+  }
+  if (from_ms >= to_ms) {
+    from_ms = to_ms == INT64_MIN ? 0 : to_ms - 60000;
+    to_ms = from_ms + 60000;
+  }
+
+  step = nice_step (chart->max_value > 0 ? chart->max_value : 1,
+      CHART_Y_TICKS);
+  max_value = ceil (chart->max_value / step) * step;
+  if (max_value <= 0)
+    max_value = step;
+
+  svg->len = 0;
+  buffer_printf (svg, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" "
+      "viewBox=\"0 0 %d %d\" font-family=\"sans-serif\" font-size=\"11\">\n"
+      "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n",
+      width, height, width, height);
+
+  if (config->title != NULL) {
+    buffer_printf (svg, "<text x=\"%d\" y=\"22\" text-anchor=\"middle\" "
+        "font-size=\"16\">", width / 2);
+    buffer_text (svg, config->title);
+    buffer_printf (svg, "</text>\n");
+  }
+
+  /* value axis and grid */
+  for (value = 0; value <= max_value + step / 2; value += step) {
+    y = y0 - value / max_value * plot_height;
+    buffer_printf (svg, "<line x1=\"%.1f\" y1=\"%.1f\" x2=\"%.1f\" "
+        "y2=\"%.1f\" stroke=\"#ddd\"/>\n", x0, y, x0 + plot_width, y);
+    buffer_printf (svg, "<text x=\"%.1f\" y=\"%.1f\" "
+        "text-anchor=\"end\">%g</text>\n", x0 - 6, y + 4, value);
+  }
+  buffer_printf (svg, "<rect x=\"%.1f\" y=\"%d\" width=\"%.1f\" "
+      "height=\"%.1f\" fill=\"none\" stroke=\"#888\"/>\n", x0,
+      CHART_MARGIN_TOP, plot_width, plot_height);
+
+  render_time_axis (chart, from_ms, to_ms, x0, y0, plot_width);
+
+  if (chart->n_series == 0)
+    buffer_printf (svg, "<text x=\"%.1f\" y=\"%.1f\" "
+        "text-anchor=\"middle\" fill=\"#888\">no data</text>\n",
+        x0 + plot_width / 2, y0 - plot_height / 2);
+
+  /* one point per pixel is all that can be seen */
+  if (chart->sampled_size < (int) plot_width) {
+    chart->sampled_size = plot_width;
+    chart->sampled = realloc (chart->sampled,
+        chart->sampled_size * sizeof (AirChartPoint));
+  }
+
+  for (i = 0; i < chart->n_series; i++) {
+    s = &chart->series[i];
+    /* the buffer may be wider, it is kept for the widest chart so far */
+    if (s->n_points > (int) plot_width) {
+      n = air_chart_lttb (s->points, s->n_points, chart->sampled,
+          (int) plot_width);
+      p = chart->sampled;
+    } else {
+      n = s->n_points;
+      p = s->points;
+    }
+
+    buffer_printf (svg, "<polyline fill=\"none\" stroke=\"%s\" "
+        "stroke-width=\"1.5\" stroke-linejoin=\"round\" points=\"",
+        colors[i]);
+    for (j = 0; j < n; j++)
+      buffer_printf (svg, "%.1f,%.1f ", x0 + (double) (p[j].timestamp_ms -
+          from_ms) / (to_ms - from_ms) * plot_width,
+          y0 - p[j].value / max_value * plot_height);
+    buffer_printf (svg, "\"/>\n");
+
+    buffer_printf (svg, "<text x=\"%.1f\" y=\"%d\" text-anchor=\"end\" "
+        "fill=\"%s\">pin %d</text>\n", x0 + plot_width - 4,
+        CHART_MARGIN_TOP + 14 * (i + 1), colors[i], s->id);
+  }
+
+  buffer_printf (svg, "</svg>\n");
+
+  if (len != NULL)
+    *len = svg->len;
+
+  return svg->data;
+}
@@ -0,0 +1,61 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __AIR_CHART_H__
+#define __AIR_CHART_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Time series charts rendered to SVG. Points are added per series in time
+ * order and every series is reduced with largest-triangle-three-buckets to
+ * at most one point per horizontal pixel before it is drawn, so rendering
+ * costs one pass over the points however many there are. The chart keeps
+ * its buffers between renders, reset it and add new points to reuse it. */
+typedef struct _AirChart AirChart;
+
+typedef struct _AirChartPoint
+{
+  int64_t timestamp_ms;
+  float value;
+} AirChartPoint;
+
+typedef struct _AirChartConfig
+{
+  int width;                    /* pixels */
+  int height;
+  const char *title;
+  int64_t from_ms;              /* time axis, 0 to fit the points */
+  int64_t to_ms;
+} AirChartConfig;
+
+AirChart* air_chart_create (void);
+void air_chart_free (AirChart *chart);
+void air_chart_reset (AirChart *chart);
+/* series is a caller chosen id, e.g. the pin, drawn as "pin <series>" */
+int air_chart_add (AirChart *chart, int series, int64_t timestamp_ms,
+    float value);
+int air_chart_n_points (AirChart *chart);
+/* returns the SVG document, valid until the next call on chart */
+const char* air_chart_render_svg (AirChart *chart,
+    const AirChartConfig *config, size_t *len);
+
+/* downsamples n points to threshold points, returns the number written */
+int air_chart_lttb (const AirChartPoint *points, int n,
+    AirChartPoint *sampled, int threshold);
+
+#endif //__AIR_CHART_H__
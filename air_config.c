@@ -0,0 +1,481 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "air_config.h"
+#include "air_shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#define CONFIG_LINE_MAX 512
+
+#define DEFAULT_THREADS 1
+#define DEFAULT_TSDB_DIR "airquality.tsdb"
+#define DEFAULT_HTTP_PORT 8080
+#define DEFAULT_STATS_INTERVAL_S 60
+#define DEFAULT_CHIP "/dev/gpiochip0"
+#define DEFAULT_WINDOW_MS 30000
+#define DEFAULT_HOP_MS 30000
+#define DEFAULT_SINKS (AIR_SINK_TSDB | AIR_SINK_ROLLUP | AIR_SINK_HTTP | \
+    AIR_SINK_SHM | AIR_SINK_STREAM)
+#define DEFAULT_SHM_HISTORY 4096
+#define DEFAULT_OUTLIER_RATIO 4.0
+#define DEFAULT_PROFILE "ppd42"
+
+typedef enum
+{
+  SECTION_NONE,
+  SECTION_DAEMON,
+  SECTION_SENSOR
+} ConfigSection;
+
+static char*
+strip (char *s)
+{
+  char *end;
+
+  while (isspace ((unsigned char) *s))
+    s++;
+  end = s + strlen (s);
+  while (end > s && isspace ((unsigned char) end[-1]))
+    end--;
+  *end = '\0';
+
+  return s;
+}
+
+static int
+parse_long (const char *value, long min, long max, long *result)
+{
+  char *end;
+
+  errno = 0;
+  *result = strtol (value, &end, 10);
+
+  return errno == 0 && end != value && *end == '\0' && *result >= min &&
+      *result <= max ? 0 : -1;
+}
+
+static int
+copy_string (char *dest, const char *value, size_t size)
+{
+  if (strlen (value) >= size)
+    return (-1);
+  strcpy (dest, value);
+
+  return (0);
+}
+
+static int
+parse_sinks (char *value, unsigned int *sinks)
+{
+  char *save;
+  char *sink;
+
+  *sinks = 0;
+  for (sink = strtok_r (value, " \t,", &save); sink != NULL;
+      sink = strtok_r (NULL, " \t,", &save)) {
+    if (strcmp (sink, "stdout") == 0)
+      *sinks |= AIR_SINK_STDOUT;
+    else if (strcmp (sink, "tsdb") == 0)
+      *sinks |= AIR_SINK_TSDB;
+    else if (strcmp (sink, "rollup") == 0)
+      *sinks |= AIR_SINK_ROLLUP;
+    else if (strcmp (sink, "http") == 0)
+      *sinks |= AIR_SINK_HTTP;
+    else if (strcmp (sink, "shm") == 0)
+      *sinks |= AIR_SINK_SHM;
+    else if (strcmp (sink, "stream") == 0)
+      *sinks |= AIR_SINK_STREAM;
+    else
+      return (-1);
+  }
+
+  return (0);
+}
+
+static int
+parse_calibration (const char *value, AirSensorConfig *sensor)
+{
+  char *end;
+
+  sensor->calibration_gain = strtof (value, &end);
+  if (end == value)
+    return (-1);
+  value = end;
+  sensor->calibration_offset = strtof (value, &end);
+  if (end == value)
+    sensor->calibration_offset = 0;
+
+  return *strip (end) == '\0' ? 0 : -1;
+}
+
+static int
+parse_daemon (AirConfig *config, const char *key, char *value)
+{
+  long number;
+
+  if (strcmp (key, "threads") == 0) {
+    if (parse_long (value, 1, 64, &number) == -1)
+      return (-1);
+    config->n_threads = number;
+  } else if (strcmp (key, "tsdb") == 0) {
+    return copy_string (config->tsdb_dir, value, AIR_CONFIG_MAX_PATH);
+  } else if (strcmp (key, "http_address") == 0) {
+    return copy_string (config->http_address, value, AIR_CONFIG_MAX_NAME);
+  } else if (strcmp (key, "http_port") == 0) {
+    if (parse_long (value, 0, 65535, &number) == -1)
+      return (-1);
+    config->http_port = number;
+  } else if (strcmp (key, "http_history") == 0) {
+    if (parse_long (value, 0, 100000000, &number) == -1)
+      return (-1);
+    config->http_history = number;
+  } else if (strcmp (key, "shm") == 0) {
+    return copy_string (config->shm_name, value, AIR_CONFIG_MAX_PATH);
+  } else if (strcmp (key, "shm_history") == 0) {
+    if (parse_long (value, 1, 1000000, &number) == -1)
+      return (-1);
+    config->shm_history = number;
+  } else if (strcmp (key, "stream_unix") == 0) {
+    return copy_string (config->stream_unix, value, AIR_CONFIG_MAX_PATH);
+  } else if (strcmp (key, "stream_tcp") == 0) {
+    return copy_string (config->stream_tcp, value, AIR_CONFIG_MAX_PATH);
+  } else if (strcmp (key, "stream_format") == 0) {
+    if (strcmp (value, "influx") == 0)
+      config->stream_format = AIR_STREAM_INFLUX;
+    else if (strcmp (value, "graphite") == 0)
+      config->stream_format = AIR_STREAM_GRAPHITE;
+    else
+      return (-1);
+  } else if (strcmp (key, "stream_backlog") == 0) {
+    if (parse_long (value, 1024, 64 * 1024 * 1024, &number) == -1)
+      return (-1);
+    config->stream_backlog = number;
+  } else if (strcmp (key, "stream_pulses") == 0) {
+    if (parse_long (value, 0, 1, &number) == -1)
+      return (-1);
+    config->stream_pulses = number;
+  } else if (strcmp (key, "stats_interval") == 0) {
+    if (parse_long (value, 0, 86400, &number) == -1)
+      return (-1);
+    config->stats_interval_s = number;
+  } else if (strcmp (key, "realtime_priority") == 0) {
+    if (parse_long (value, 0, 99, &number) == -1)
+      return (-1);
+    config->realtime_priority = number;
+  } else if (strcmp (key, "realtime_cpu") == 0) {
+    if (parse_long (value, -1, 1023, &number) == -1)
+      return (-1);
+    config->realtime_cpu = number;
+  } else if (strcmp (key, "lock_memory") == 0) {
+    if (parse_long (value, 0, 1, &number) == -1)
+      return (-1);
+    config->lock_memory = number;
+  } else {
+    return (-1);
+  }
+
+  return (0);
+}
+
+static int
+parse_sensor (AirSensorConfig *sensor, const char *key, char *value)
+{
+  long number;
+  char *end;
+
+  if (strcmp (key, "pin") == 0) {
+    if (parse_long (value, 0, 65535, &number) == -1)
+      return (-1);
+    sensor->pin = number;
+  } else if (strcmp (key, "pin_p2") == 0) {
+    if (parse_long (value, -1, 65535, &number) == -1)
+      return (-1);
+    sensor->pin_p2 = number;
+  } else if (strcmp (key, "chip") == 0) {
+    return copy_string (sensor->chip, value, AIR_CONFIG_MAX_PATH);
+  } else if (strcmp (key, "window_ms") == 0) {
+    if (parse_long (value, 1000, 3600000, &number) == -1)
+      return (-1);
+    sensor->window_ms = number;
+  } else if (strcmp (key, "hop_ms") == 0) {
+    if (parse_long (value, 100, 3600000, &number) == -1)
+      return (-1);
+    sensor->hop_ms = number;
+  } else if (strcmp (key, "profile") == 0) {
+    if (copy_string (sensor->profile, value, AIR_CONFIG_MAX_PATH) == -1)
+      return (-1);
+    return air_calib_profile_get (value, &sensor->calibration);
+  } else if (strcmp (key, "calibration") == 0) {
+    return parse_calibration (value, sensor);
+  } else if (strcmp (key, "humidity_file") == 0) {
+    return copy_string (sensor->humidity_file, value, AIR_CONFIG_MAX_PATH);
+  } else if (strcmp (key, "aqi_standard") == 0) {
+    if ((number = air_aqi_standard_from_name (value)) == -1)
+      return (-1);
+    sensor->aqi_standard = number;
+  } else if (strcmp (key, "sinks") == 0) {
+    return parse_sinks (value, &sensor->sinks);
+  } else if (strcmp (key, "trace") == 0) {
+    return copy_string (sensor->trace, value, AIR_CONFIG_MAX_PATH);
+  } else if (strcmp (key, "speed") == 0) {
+    sensor->speed = strtod (value, &end);
+    if (end == value || *end != '\0' || sensor->speed < 0)
+      return (-1);
+  } else if (strcmp (key, "debounce_us") == 0) {
+    if (parse_long (value, 0, 1000000, &number) == -1)
+      return (-1);
+    sensor->filter.debounce_us = number;
+  } else if (strcmp (key, "min_pulse_us") == 0) {
+    if (parse_long (value, 0, 10000000, &number) == -1)
+      return (-1);
+    sensor->filter.min_pulse_us = number;
+  } else if (strcmp (key, "max_pulse_us") == 0) {
+    if (parse_long (value, 0, 10000000, &number) == -1)
+      return (-1);
+    sensor->filter.max_pulse_us = number;
+  } else if (strcmp (key, "median_window") == 0) {
+    if (parse_long (value, 0, LNGPIO_FILTER_MAX_MEDIAN, &number) == -1)
+      return (-1);
+    sensor->filter.median_window = number;
+  } else if (strcmp (key, "outlier_ratio") == 0) {
+    sensor->filter.outlier_ratio = strtof (value, &end);
+    if (end == value || *end != '\0' || sensor->filter.outlier_ratio <= 1)
+      return (-1);
+  } else {
+    return (-1);
+  }
+
+  return (0);
+}
+
+static AirSensorConfig*
+add_sensor (AirConfig *config, const char *name)
+{
+  AirSensorConfig *sensor;
+
+  config->sensors = realloc (config->sensors,
+      (config->n_sensors + 1) * sizeof (AirSensorConfig));
+  sensor = &config->sensors[config->n_sensors++];
+
+  *sensor = (AirSensorConfig) { 0 };
+  if (copy_string (sensor->name, name, AIR_CONFIG_MAX_NAME) == -1)
+    return NULL;
+  strcpy (sensor->chip, DEFAULT_CHIP);
+  sensor->speed = 1.0;
+  sensor->pin = -1;
+  sensor->pin_p2 = -1;
+  sensor->window_ms = DEFAULT_WINDOW_MS;
+  sensor->hop_ms = DEFAULT_HOP_MS;
+  strcpy (sensor->profile, DEFAULT_PROFILE);
+  air_calib_profile_builtin (DEFAULT_PROFILE, &sensor->calibration);
+  sensor->calibration_gain = 1.0;
+  sensor->aqi_standard = AIR_AQI_DEFAULT;
+  sensor->sinks = DEFAULT_SINKS;
+  /* the PPD42 pulls its output low */
+  sensor->filter.level = 0;
+  sensor->filter.outlier_ratio = DEFAULT_OUTLIER_RATIO;
+
+  return sensor;
+}
+
+int
+air_sensor_config_has_filter (const AirSensorConfig *sensor)
+{
+  return sensor->filter.debounce_us > 0 || sensor->filter.min_pulse_us > 0 ||
+      sensor->filter.max_pulse_us > 0 || sensor->filter.median_window > 0;
+}
+
+AirCalib*
+air_sensor_config_calib (const AirSensorConfig *sensor)
+{
+  AirCalibProfile profile = sensor->calibration;
+  AirCalib *calib;
+
+  profile.gain *= sensor->calibration_gain;
+  profile.offset = profile.offset * sensor->calibration_gain +
+      sensor->calibration_offset;
+
+  calib = air_calib_create (&profile);
+  if (calib != NULL)
+    air_calib_set_aqi_standard (calib, sensor->aqi_standard);
+
+  return calib;
+}
+
+static int
+config_shares_pin (const AirSensorConfig *a, const AirSensorConfig *b)
+{
+  return a->pin == b->pin || (b->pin_p2 != -1 && a->pin == b->pin_p2) ||
+      (a->pin_p2 != -1 && (a->pin_p2 == b->pin || a->pin_p2 == b->pin_p2));
+}
+
+static int
+check_sensors (const char *path, AirConfig *config)
+{
+  AirSensorConfig *sensor;
+  AirCalib *calib;
+  int i;
+  int j;
+
+  for (i = 0; i < config->n_sensors; i++) {
+    sensor = &config->sensors[i];
+    if (sensor->pin == -1) {
+      fprintf (stderr, "%s: sensor %s has no pin\n", path, sensor->name);
+      return (-1);
+    }
+    calib = air_sensor_config_calib (sensor);
+    if (calib == NULL) {
+      fprintf (stderr, "%s: sensor %s has an invalid profile\n", path,
+          sensor->name);
+      return (-1);
+    }
+    air_calib_free (calib);
+    if (sensor->filter.max_pulse_us > 0 &&
+        sensor->filter.max_pulse_us < sensor->filter.min_pulse_us) {
+      fprintf (stderr, "%s: sensor %s max_pulse_us is below min_pulse_us\n",
+          path, sensor->name);
+      return (-1);
+    }
+    if (sensor->hop_ms > sensor->window_ms) {
+      fprintf (stderr, "%s: sensor %s hop is longer than its window\n", path,
+          sensor->name);
+      return (-1);
+    }
+    if (sensor->pin_p2 != -1) {
+      if (sensor->pin_p2 == sensor->pin) {
+        fprintf (stderr, "%s: sensor %s has P1 and P2 on pin %d\n", path,
+            sensor->name, sensor->pin);
+        return (-1);
+      }
+      if (air_sensor_config_has_filter (sensor)) {
+        fprintf (stderr, "%s: sensor %s filters a dual channel sensor\n",
+            path, sensor->name);
+        return (-1);
+      }
+    }
+    for (j = 0; j < i; j++) {
+      if (config_shares_pin (&config->sensors[j], sensor)) {
+        fprintf (stderr, "%s: sensors %s and %s share a pin\n", path,
+            config->sensors[j].name, sensor->name);
+        return (-1);
+      }
+    }
+  }
+
+  return (0);
+}
+
+AirConfig*
+air_config_load (const char *path)
+{
+  AirConfig *config;
+  AirSensorConfig *sensor = NULL;
+  ConfigSection section = SECTION_NONE;
+  char buf[CONFIG_LINE_MAX];
+  char *line;
+  char *key;
+  char *value;
+  char *end;
+  FILE *file;
+  int n_line = 0;
+
+  file = fopen (path, "r");
+  if (file == NULL) {
+    fprintf (stderr, "Unable to open %s\n", path);
+    return NULL;
+  }
+
+  config = calloc (1, sizeof (AirConfig));
+  config->n_threads = DEFAULT_THREADS;
+  strcpy (config->tsdb_dir, DEFAULT_TSDB_DIR);
+  config->http_port = DEFAULT_HTTP_PORT;
+  strcpy (config->shm_name, AIR_SHM_DEFAULT_NAME);
+  config->shm_history = DEFAULT_SHM_HISTORY;
+  config->stats_interval_s = DEFAULT_STATS_INTERVAL_S;
+  config->realtime_cpu = -1;
+
+  while (fgets (buf, sizeof (buf), file) != NULL) {
+    n_line++;
+    end = strchr (buf, '#');
+    if (end != NULL)
+      *end = '\0';
+    line = strip (buf);
+    if (*line == '\0')
+      continue;
+
+    if (*line == '[') {
+      end = strchr (line, ']');
+      if (end == NULL || end[1] != '\0')
+        goto syntax_error;
+      *end = '\0';
+      line = strip (line + 1);
+
+      if (strcmp (line, "daemon") == 0) {
+        section = SECTION_DAEMON;
+      } else if (strncmp (line, "sensor", 6) == 0 &&
+          isspace ((unsigned char) line[6])) {
+        section = SECTION_SENSOR;
+        sensor = add_sensor (config, strip (line + 6));
+        if (sensor == NULL)
+          goto syntax_error;
+      } else {
+        goto syntax_error;
+      }
+      continue;
+    }
+
+    value = strchr (line, '=');
+    if (value == NULL)
+      goto syntax_error;
+    *value++ = '\0';
+    key = strip (line);
+    value = strip (value);
+
+    if ((section == SECTION_DAEMON && parse_daemon (config, key, value) ==
+        -1) || (section == SECTION_SENSOR && parse_sensor (sensor, key,
+        value) == -1) || section == SECTION_NONE)
+      goto syntax_error;
+  }
+
+  fclose (file);
+
+  if (check_sensors (path, config) == -1) {
+    air_config_free (config);
+    return NULL;
+  }
+
+  return config;
+
+syntax_error:
+  fprintf (stderr, "%s:%d: invalid line\n", path, n_line);
+  fclose (file);
+  air_config_free (config);
+
+  return NULL;
+}
+
+void
+air_config_free (AirConfig *config)
+{
+  free (config->sensors);
+  free (config);
+}
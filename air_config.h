@@ -0,0 +1,137 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __AIR_CONFIG_H__
+#define __AIR_CONFIG_H__
+
+#include "lngpio_filter.h"
+#include "air_calib.h"
+#include "air_stream.h"
+
+/* Configuration of grove_dustd, read from a file with one [daemon] section
+ * and one [sensor <name>] section per sensor:
+ *
+ *   [daemon]
+ *   threads = 1                 engine threads shared by all sensors
+ *   tsdb = airquality.tsdb      directory of the time series database
+ *   http_address = 0.0.0.0
+ *   http_port = 8080            0 disables the http server
+ *   http_history = 0            readings kept in memory, 0 for 24h
+ *   shm = /grove_dustd          shared memory segment of the live readings,
+ *                               empty to disable, see air_shm.h
+ *   shm_history = 4096          recent readings kept in the segment
+ *   stream_unix = path          Unix domain socket streaming readings as
+ *                               lines, see air_stream.h
+ *   stream_tcp = host:port      line protocol target to push readings to
+ *   stream_format = influx      influx or graphite
+ *   stream_backlog = 65536      bytes queued per stream subscriber
+ *   stream_pulses = 0           1 to stream the occupancy and out of
+ *                               bounds pulses of every reading too
+ *   stats_interval = 60         seconds between metrics log lines, 0 off
+ *   realtime_priority = 0       SCHED_FIFO priority of the engine threads
+ *   realtime_cpu = -1           core the engine threads are pinned to
+ *   lock_memory = 0             1 to mlockall and prefault the threads
+ *
+ *   [sensor kitchen]
+ *   pin = 17
+ *   pin_p2 = 27                 P2 output of a dual channel sensor, pin is
+ *                               then P1. -1 for P1 only, see ppd42.h
+ *   chip = /dev/gpiochip0
+ *   window_ms = 30000
+ *   hop_ms = 5000
+ *   profile = ppd42             builtin curve or profile file, air_calib.h
+ *   calibration = 1.0 0.0       μg/m3 gain and offset of this unit
+ *   humidity_file = path        relative humidity in thousandths of a
+ *                               percent, as IIO humidity sensors report it
+ *   aqi_standard = us-epa-legacy
+ *                               us-epa, us-epa-legacy, eu-caqi, china or
+ *                               india, see air_aqi.h
+ *   sinks = tsdb rollup http shm stream
+ *                               any of stdout, tsdb, rollup, http, shm
+ *                               and stream
+ *   trace = kitchen.trc         replay a trace instead of the pin
+ *   speed = 1.0                 trace replay speed, 0 as fast as possible
+ *   debounce_us = 0             edge filter of the low pulses, see
+ *   min_pulse_us = 0            lngpio_filter.h, all off by default
+ *   max_pulse_us = 0
+ *   median_window = 0
+ *   outlier_ratio = 4.0
+ *
+ * Everything after a # is a comment. */
+#define AIR_CONFIG_MAX_NAME 64
+#define AIR_CONFIG_MAX_PATH 256
+
+typedef enum AirSinks
+{
+  AIR_SINK_STDOUT = 1 << 0,
+  AIR_SINK_TSDB   = 1 << 1,
+  AIR_SINK_ROLLUP = 1 << 2,
+  AIR_SINK_HTTP   = 1 << 3,
+  AIR_SINK_SHM    = 1 << 4,
+  AIR_SINK_STREAM = 1 << 5,
+} AirSinks;
+
+typedef struct _AirSensorConfig
+{
+  char name[AIR_CONFIG_MAX_NAME];
+  char chip[AIR_CONFIG_MAX_PATH];
+  char trace[AIR_CONFIG_MAX_PATH];  /* empty for the pin itself */
+  double speed;
+  int pin;
+  int pin_p2;                       /* -1 for single channel sensors */
+  unsigned int window_ms;
+  unsigned int hop_ms;
+  char profile[AIR_CONFIG_MAX_PATH];
+  AirCalibProfile calibration;      /* loaded from profile */
+  float calibration_gain;
+  float calibration_offset;
+  char humidity_file[AIR_CONFIG_MAX_PATH];
+  AirAQIStandard aqi_standard;
+  unsigned int sinks;               /* AirSinks */
+  LNGPIOFilter filter;
+} AirSensorConfig;
+
+int air_sensor_config_has_filter (const AirSensorConfig *sensor);
+/* the profile with the gain and offset of the unit applied */
+AirCalib* air_sensor_config_calib (const AirSensorConfig *sensor);
+
+typedef struct _AirConfig
+{
+  int n_threads;
+  char tsdb_dir[AIR_CONFIG_MAX_PATH];
+  char http_address[AIR_CONFIG_MAX_NAME];
+  int http_port;
+  int http_history;
+  char shm_name[AIR_CONFIG_MAX_PATH];
+  int shm_history;
+  char stream_unix[AIR_CONFIG_MAX_PATH];
+  char stream_tcp[AIR_CONFIG_MAX_PATH];
+  AirStreamFormat stream_format;
+  int stream_backlog;
+  int stream_pulses;
+  int stats_interval_s;
+  int realtime_priority;
+  int realtime_cpu;
+  int lock_memory;
+  AirSensorConfig *sensors;
+  int n_sensors;
+} AirConfig;
+
+AirConfig* air_config_load (const char *path);
+void air_config_free (AirConfig *config);
+
+#endif //__AIR_CONFIG_H__
@@ -0,0 +1,1178 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "air_httpd.h"
+#include "air_chart.h"
+#include "air_metrics.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define HTTPD_REQUEST_MAX 4096
+#define HTTPD_MAX_EVENTS 32
+#define HTTPD_MAX_CONNECTIONS 256
+#define HTTPD_DEFAULT_HISTORY 4096
+/* /range without from/to covers the last hour */
+#define HTTPD_DEFAULT_RANGE_MS 3600000
+#define HTTPD_MAX_ROWS 100000
+#define HTTPD_MAX_BUCKETS 10000
+/* a year of 30 s readings */
+#define HTTPD_MAX_CHART_ROWS 1100000
+#define HTTPD_CHART_WIDTH 800
+#define HTTPD_CHART_HEIGHT 400
+/* stream clients with more than this queued are too slow and dropped */
+#define HTTPD_STREAM_BACKLOG (256 * 1024)
+/* pins reported by /latest */
+#define HTTPD_MAX_PINS 64
+/* rollup buckets read at once */
+#define HTTPD_ROLLUP_BATCH 4096
+
+typedef struct _HTTPDBuffer
+{
+  char *data;
+  size_t len;
+  size_t size;
+} HTTPDBuffer;
+
+typedef struct _HTTPDConnection HTTPDConnection;
+
+struct _HTTPDConnection
+{
+  HTTPDConnection *next;
+  int fd;
+  char request[HTTPD_REQUEST_MAX];
+  size_t n_request;
+  HTTPDBuffer out;
+  size_t sent;
+  uint32_t events;
+  int keep_alive;
+  int streaming;
+  int stream_pin;
+  /* closed at the end of the current epoll batch */
+  int dead;
+};
+
+struct _AirHTTPD
+{
+  pthread_t thread;
+  int listen_fd;
+  int epoll_fd;
+  int wakeup_fd;
+  AirTSDB *tsdb;
+  AirRollup *rollup;
+
+  /* ring of published readings, shared with the publishers */
+  pthread_mutex_t lock;
+  AirReading *history;
+  int history_size;
+  uint64_t n_published;
+  int stop;
+
+  /* owned by the server thread */
+  uint64_t n_streamed;
+  HTTPDConnection *connections;
+  int n_connections;
+  HTTPDBuffer body;
+  AirTSDBAggregate *buckets;
+  AirRollupBucket *rollup_buckets;
+  AirChart *chart;
+  AirMetricsSnapshot *metrics;
+};
+
+typedef struct _HTTPDRange
+{
+  HTTPDBuffer *body;
+  int pin;
+  int n_rows;
+} HTTPDRange;
+
+typedef struct _HTTPDAggregate
+{
+  AirTSDBAggregate *buckets;
+  int n_buckets;
+  int64_t from_ms;
+  int64_t step_ms;
+} HTTPDAggregate;
+
+typedef void (*HTTPDRollupFunc) (const AirRollupBucket *, void *);
+
+typedef enum
+{
+  HTTPD_CHART_AQI,
+  HTTPD_CHART_UGM3,
+  HTTPD_CHART_PCS
+} HTTPDChartValue;
+
+typedef struct _HTTPDChart
+{
+  AirChart *chart;
+  HTTPDChartValue value;
+  int pin;
+  int n_rows;
+} HTTPDChart;
+
+static void
+buffer_reserve (HTTPDBuffer *buf, size_t len)
+{
+  if (buf->len + len + 1 <= buf->size)
+    return;
+
+  while (buf->len + len + 1 > buf->size)
+    buf->size = buf->size ? buf->size * 2 : 1024;
+  buf->data = realloc (buf->data, buf->size);
+}
+
+static void
+buffer_append (HTTPDBuffer *buf, const char *data, size_t len)
+{
+  buffer_reserve (buf, len);
+  memcpy (buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+static void
+buffer_printf (HTTPDBuffer *buf, const char *format, ...)
+{
+  va_list args;
+  int len;
+
+  va_start (args, format);
+  len = vsnprintf (buf->data + buf->len, buf->size - buf->len, format, args);
+  va_end (args);
+
+  if (buf->len + len + 1 > buf->size) {
+    buffer_reserve (buf, len);
+    va_start (args, format);
+    vsnprintf (buf->data + buf->len, buf->size - buf->len, format, args);
+    va_end (args);
+  }
+  buf->len += len;
+}
+
+static int64_t
+realtime_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* returns 1 and the value of the integer parameter name in query */
+static int
+query_int64 (const char *query, const char *name, int64_t *value)
+{
+  size_t len = strlen (name);
+  const char *p = query;
+  char *end;
+
+  while (p != NULL && *p != '\0') {
+    if (strncmp (p, name, len) == 0 && p[len] == '=') {
+      *value = strtoll (p + len + 1, &end, 10);
+      return end != p + len + 1 && (*end == '\0' || *end == '&');
+    }
+    p = strchr (p, '&');
+    if (p != NULL)
+      p++;
+  }
+
+  return 0;
+}
+
+/* returns 1 if the parameter name in query has the value value */
+static int
+query_is (const char *query, const char *name, const char *value)
+{
+  size_t len = strlen (name);
+  size_t value_len = strlen (value);
+  const char *p = query;
+
+  while (p != NULL && *p != '\0') {
+    if (strncmp (p, name, len) == 0 && p[len] == '=')
+      return strncmp (p + len + 1, value, value_len) == 0 &&
+          (p[len + 1 + value_len] == '\0' || p[len + 1 + value_len] == '&');
+    p = strchr (p, '&');
+    if (p != NULL)
+      p++;
+  }
+
+  return 0;
+}
+
+static void
+json_reading (HTTPDBuffer *buf, const AirReading *reading)
+{
+  buffer_printf (buf, "{\"timestamp\":%lld,\"pin\":%d,\"pcs\":%.3f,"
+      "\"ugm3\":%.3f,\"aqi\":%d}", (long long) reading->timestamp_ms,
+      reading->pin, reading->concentration_pcs, reading->concentration_ugm3,
+      reading->aqi);
+}
+
+static void
+json_bucket (HTTPDBuffer *buf, const AirTSDBAggregate *bucket)
+{
+  buffer_printf (buf, "{\"timestamp\":%lld,\"count\":%u,\"pcs_mean\":%.3f,"
+      "\"ugm3_min\":%.3f,\"ugm3_max\":%.3f,\"ugm3_mean\":%.3f,"
+      "\"aqi_max\":%d}", (long long) bucket->timestamp_ms, bucket->count,
+      bucket->pcs_mean, bucket->ugm3_min, bucket->ugm3_max,
+      bucket->ugm3_mean, bucket->aqi_max);
+}
+
+static void
+respond (HTTPDConnection *conn, int status, const char *reason,
+    const char *content_type, const char *body, size_t len)
+{
+  buffer_printf (&conn->out, "HTTP/1.1 %d %s\r\n"
+      "Content-Type: %s\r\n"
+      "Content-Length: %zu\r\n"
+      "Cache-Control: no-cache\r\n"
+      "Access-Control-Allow-Origin: *\r\n"
+      "Connection: %s\r\n\r\n", status, reason, content_type, len,
+      conn->keep_alive ? "keep-alive" : "close");
+  buffer_append (&conn->out, body, len);
+}
+
+static void
+respond_error (HTTPDConnection *conn, int status, const char *reason)
+{
+  char body[64];
+  int len;
+
+  len = snprintf (body, sizeof (body), "%d %s\n", status, reason);
+  respond (conn, status, reason, "text/plain", body, len);
+}
+
+/* newest reading of each pin, newest pin first */
+static void
+handle_latest (AirHTTPD *httpd, HTTPDConnection *conn, const char *query)
+{
+  HTTPDBuffer *body = &httpd->body;
+  int pins[HTTPD_MAX_PINS];
+  int n_pins = 0;
+  const AirReading *reading;
+  int64_t pin = -1;
+  uint64_t seq;
+  uint64_t oldest;
+  int i;
+
+  query_int64 (query, "pin", &pin);
+
+  body->len = 0;
+  buffer_printf (body, "{\"readings\":[");
+
+  pthread_mutex_lock (&httpd->lock);
+  oldest = httpd->n_published > (uint64_t) httpd->history_size ?
+      httpd->n_published - httpd->history_size : 0;
+  for (seq = httpd->n_published; seq > oldest && n_pins < HTTPD_MAX_PINS;
+      seq--) {
+    reading = &httpd->history[(seq - 1) % httpd->history_size];
+    if (pin != -1 && reading->pin != pin)
+      continue;
+    for (i = 0; i < n_pins && pins[i] != reading->pin; i++);
+    if (i < n_pins)
+      continue;
+
+    if (n_pins > 0)
+      buffer_append (body, ",", 1);
+    json_reading (body, reading);
+    pins[n_pins++] = reading->pin;
+    if (pin != -1)
+      break;
+  }
+  pthread_mutex_unlock (&httpd->lock);
+
+  buffer_printf (body, "]}\n");
+  respond (conn, 200, "OK", "application/json", body->data, body->len);
+}
+
+static void
+range_reading (const AirReading *reading, void *user_data)
+{
+  HTTPDRange *range = (HTTPDRange *)user_data;
+
+  if (range->pin != -1 && reading->pin != range->pin)
+    return;
+  if (range->n_rows == HTTPD_MAX_ROWS)
+    return;
+
+  if (range->n_rows > 0)
+    buffer_append (range->body, ",", 1);
+  json_reading (range->body, reading);
+  range->n_rows++;
+}
+
+static void
+memory_aggregate (AirTSDBAggregate *buckets, int n_buckets, int64_t from_ms,
+    int64_t step_ms, const AirReading *reading)
+{
+  AirTSDBAggregate *bucket;
+  int64_t i;
+
+  i = (reading->timestamp_ms - from_ms) / step_ms;
+  if (i < 0 || i >= n_buckets)
+    return;
+
+  bucket = &buckets[i];
+  if (bucket->count == 0) {
+    bucket->ugm3_min = reading->concentration_ugm3;
+    bucket->ugm3_max = reading->concentration_ugm3;
+    bucket->aqi_max = reading->aqi;
+  }
+  bucket->count++;
+  /* running means */
+  bucket->pcs_mean += (reading->concentration_pcs - bucket->pcs_mean) /
+      bucket->count;
+  bucket->ugm3_mean += (reading->concentration_ugm3 - bucket->ugm3_mean) /
+      bucket->count;
+  if (reading->concentration_ugm3 < bucket->ugm3_min)
+    bucket->ugm3_min = reading->concentration_ugm3;
+  if (reading->concentration_ugm3 > bucket->ugm3_max)
+    bucket->ugm3_max = reading->concentration_ugm3;
+  if (reading->aqi > bucket->aqi_max)
+    bucket->aqi_max = reading->aqi;
+}
+
+/* the coarsest rollup with buckets no longer than bucket_ms, -1 if raw
+ * readings are needed */
+static int
+rollup_level (AirHTTPD *httpd, int64_t bucket_ms)
+{
+  int level;
+
+  if (httpd->rollup == NULL)
+    return -1;
+
+  for (level = AIR_ROLLUP_LEVELS - 1; level >= 0; level--) {
+    if (air_rollup_level_ms (level) <= bucket_ms)
+      return level;
+  }
+
+  return -1;
+}
+
+/* calls func for the rollup buckets of pin (all pins if -1) starting in
+ * [from_ms, to_ms) */
+static int
+rollup_foreach (AirHTTPD *httpd, AirRollupLevel level, int pin,
+    int64_t from_ms, int64_t to_ms, HTTPDRollupFunc func, void *user_data)
+{
+  int pins[HTTPD_MAX_PINS];
+  int64_t start_ms;
+  int n_pins = 1;
+  int n;
+  int i;
+  int j;
+
+  pins[0] = pin;
+  if (pin == -1)
+    n_pins = air_rollup_pins (httpd->rollup, pins, HTTPD_MAX_PINS);
+  if (n_pins == -1)
+    return (-1);
+
+  for (i = 0; i < n_pins; i++) {
+    start_ms = from_ms;
+    do {
+      n = air_rollup_query (httpd->rollup, level, pins[i], start_ms, to_ms,
+          httpd->rollup_buckets, HTTPD_ROLLUP_BATCH);
+      if (n == -1)
+        return (-1);
+      for (j = 0; j < n; j++)
+        func (&httpd->rollup_buckets[j], user_data);
+      if (n > 0)
+        start_ms = httpd->rollup_buckets[n - 1].timestamp_ms + 1;
+    } while (n == HTTPD_ROLLUP_BATCH);
+  }
+
+  return (0);
+}
+
+static void
+rollup_aggregate (const AirRollupBucket *rollup, void *user_data)
+{
+  HTTPDAggregate *aggregate = (HTTPDAggregate *)user_data;
+  AirTSDBAggregate *bucket;
+  int64_t i;
+  uint32_t count;
+
+  /* a rollup bucket straddling from_ms goes into the first one */
+  i = (rollup->timestamp_ms - aggregate->from_ms) / aggregate->step_ms;
+  if (i < 0)
+    i = 0;
+  if (i >= aggregate->n_buckets || rollup->count == 0)
+    return;
+
+  bucket = &aggregate->buckets[i];
+  if (bucket->count == 0 || rollup->ugm3_min < bucket->ugm3_min)
+    bucket->ugm3_min = rollup->ugm3_min;
+  if (bucket->count == 0 || rollup->ugm3_max > bucket->ugm3_max)
+    bucket->ugm3_max = rollup->ugm3_max;
+  if (bucket->count == 0 || rollup->aqi_max > bucket->aqi_max)
+    bucket->aqi_max = rollup->aqi_max;
+
+  /* means weighted by the readings behind them */
+  count = bucket->count + rollup->count;
+  bucket->pcs_mean += (rollup->pcs_mean - bucket->pcs_mean) *
+      rollup->count / count;
+  bucket->ugm3_mean += (rollup->ugm3_mean - bucket->ugm3_mean) *
+      rollup->count / count;
+  bucket->count = count;
+}
+
+/* readings in [from_ms, to_ms), from memory when it reaches back far enough,
+ * from the rollups for steps of a minute or more and from the database
+ * otherwise */
+static void
+handle_range (AirHTTPD *httpd, HTTPDConnection *conn, const char *query)
+{
+  HTTPDBuffer *body = &httpd->body;
+  HTTPDRange range;
+  HTTPDAggregate aggregate;
+  const AirReading *reading;
+  int64_t from_ms;
+  int64_t to_ms;
+  int64_t step_ms = 0;
+  int64_t pin = -1;
+  uint64_t seq;
+  uint64_t oldest;
+  int n_buckets = 0;
+  int in_memory;
+  int level;
+  int i;
+
+  if (!query_int64 (query, "to", &to_ms))
+    to_ms = realtime_ms () + 1;
+  if (!query_int64 (query, "from", &from_ms))
+    from_ms = to_ms - HTTPD_DEFAULT_RANGE_MS;
+  query_int64 (query, "step", &step_ms);
+  query_int64 (query, "pin", &pin);
+
+  if (from_ms >= to_ms || step_ms < 0) {
+    respond_error (conn, 400, "Bad Request");
+    return;
+  }
+
+  if (step_ms > 0) {
+    if ((to_ms - from_ms + step_ms - 1) / step_ms > HTTPD_MAX_BUCKETS) {
+      respond_error (conn, 400, "Bad Request");
+      return;
+    }
+    n_buckets = (to_ms - from_ms + step_ms - 1) / step_ms;
+    memset (httpd->buckets, 0, n_buckets * sizeof (AirTSDBAggregate));
+    for (i = 0; i < n_buckets; i++)
+      httpd->buckets[i].timestamp_ms = from_ms + i * step_ms;
+  }
+
+  body->len = 0;
+  range.body = body;
+  range.pin = pin;
+  range.n_rows = 0;
+
+  if (step_ms > 0)
+    buffer_printf (body, "{\"from\":%lld,\"to\":%lld,\"step\":%lld,"
+        "\"buckets\":[", (long long) from_ms, (long long) to_ms,
+        (long long) step_ms);
+  else
+    buffer_printf (body, "{\"from\":%lld,\"to\":%lld,\"readings\":[",
+        (long long) from_ms, (long long) to_ms);
+
+  pthread_mutex_lock (&httpd->lock);
+  oldest = httpd->n_published > (uint64_t) httpd->history_size ?
+      httpd->n_published - httpd->history_size : 0;
+  in_memory = httpd->tsdb == NULL || (httpd->n_published > 0 &&
+      httpd->history[oldest % httpd->history_size].timestamp_ms <= from_ms);
+  if (in_memory) {
+    for (seq = oldest; seq < httpd->n_published; seq++) {
+      reading = &httpd->history[seq % httpd->history_size];
+      if (reading->timestamp_ms < from_ms || reading->timestamp_ms >= to_ms)
+        continue;
+      if (step_ms > 0) {
+        if (pin == -1 || reading->pin == pin)
+          memory_aggregate (httpd->buckets, n_buckets, from_ms, step_ms,
+              reading);
+      } else {
+        range_reading (reading, &range);
+      }
+    }
+  }
+  pthread_mutex_unlock (&httpd->lock);
+
+  level = step_ms > 0 ? rollup_level (httpd, step_ms) : -1;
+  if (!in_memory && level != -1) {
+    aggregate.buckets = httpd->buckets;
+    aggregate.n_buckets = n_buckets;
+    aggregate.from_ms = from_ms;
+    aggregate.step_ms = step_ms;
+    if (rollup_foreach (httpd, level, pin,
+        from_ms - air_rollup_level_ms (level) + 1, to_ms, rollup_aggregate,
+        &aggregate) == -1)
+      fprintf (stderr, "Unable to read rollups\n");
+  } else if (!in_memory) {
+    if (step_ms > 0)
+      n_buckets = air_tsdb_aggregate (httpd->tsdb, pin, from_ms, to_ms,
+          step_ms, httpd->buckets, n_buckets);
+    else
+      air_tsdb_scan (httpd->tsdb, pin, from_ms, to_ms, range_reading, &range);
+  }
+
+  for (i = 0; i < n_buckets; i++) {
+    if (httpd->buckets[i].count == 0)
+      continue;
+    if (range.n_rows++ > 0)
+      buffer_append (body, ",", 1);
+    json_bucket (body, &httpd->buckets[i]);
+  }
+
+  buffer_printf (body, "]}\n");
+  respond (conn, 200, "OK", "application/json", body->data, body->len);
+}
+
+static void
+chart_reading (const AirReading *reading, void *user_data)
+{
+  HTTPDChart *chart = (HTTPDChart *)user_data;
+  float value;
+
+  if (chart->pin != -1 && reading->pin != chart->pin)
+    return;
+  if (++chart->n_rows > HTTPD_MAX_CHART_ROWS)
+    return;
+
+  if (chart->value == HTTPD_CHART_UGM3)
+    value = reading->concentration_ugm3;
+  else if (chart->value == HTTPD_CHART_PCS)
+    value = reading->concentration_pcs;
+  else
+    value = reading->aqi;
+  air_chart_add (chart->chart, reading->pin, reading->timestamp_ms, value);
+}
+
+/* long ranges are drawn from rollup buckets, AQI charts show the highest
+ * AQI of each bucket */
+static void
+chart_bucket (const AirRollupBucket *bucket, void *user_data)
+{
+  HTTPDChart *chart = (HTTPDChart *)user_data;
+  float value;
+
+  if (++chart->n_rows > HTTPD_MAX_CHART_ROWS)
+    return;
+
+  if (chart->value == HTTPD_CHART_UGM3)
+    value = bucket->ugm3_mean;
+  else if (chart->value == HTTPD_CHART_PCS)
+    value = bucket->pcs_mean;
+  else
+    value = bucket->aqi_max;
+  air_chart_add (chart->chart, bucket->pin, bucket->timestamp_ms, value);
+}
+
+/* readings in [from_ms, to_ms) drawn as SVG, downsampled to the width. Once
+ * a pixel covers a minute or more the rollups are drawn instead. */
+static void
+handle_chart (AirHTTPD *httpd, HTTPDConnection *conn, const char *query)
+{
+  static const char *titles[] = {
+    "AQI (Air Quality index)", "PM2.5 (μg/m³)", "PM2.5 (pcs/0.01cf)"
+  };
+  AirChartConfig config = { 0 };
+  HTTPDChart chart;
+  const AirReading *reading;
+  const char *svg;
+  int64_t from_ms;
+  int64_t to_ms;
+  int64_t width = HTTPD_CHART_WIDTH;
+  int64_t height = HTTPD_CHART_HEIGHT;
+  int64_t pin = -1;
+  uint64_t seq;
+  uint64_t oldest;
+  size_t len;
+  int in_memory;
+  int level;
+
+  if (!query_int64 (query, "to", &to_ms))
+    to_ms = realtime_ms () + 1;
+  if (!query_int64 (query, "from", &from_ms))
+    from_ms = to_ms - HTTPD_DEFAULT_RANGE_MS;
+  query_int64 (query, "width", &width);
+  query_int64 (query, "height", &height);
+  query_int64 (query, "pin", &pin);
+
+  if (from_ms >= to_ms) {
+    respond_error (conn, 400, "Bad Request");
+    return;
+  }
+
+  chart.chart = httpd->chart;
+  chart.pin = pin;
+  chart.n_rows = 0;
+  if (query_is (query, "value", "ugm3"))
+    chart.value = HTTPD_CHART_UGM3;
+  else if (query_is (query, "value", "pcs"))
+    chart.value = HTTPD_CHART_PCS;
+  else
+    chart.value = HTTPD_CHART_AQI;
+  air_chart_reset (httpd->chart);
+
+  pthread_mutex_lock (&httpd->lock);
+  oldest = httpd->n_published > (uint64_t) httpd->history_size ?
+      httpd->n_published - httpd->history_size : 0;
+  in_memory = httpd->tsdb == NULL || (httpd->n_published > 0 &&
+      httpd->history[oldest % httpd->history_size].timestamp_ms <= from_ms);
+  if (in_memory) {
+    for (seq = oldest; seq < httpd->n_published; seq++) {
+      reading = &httpd->history[seq % httpd->history_size];
+      if (reading->timestamp_ms >= from_ms && reading->timestamp_ms < to_ms)
+        chart_reading (reading, &chart);
+    }
+  }
+  pthread_mutex_unlock (&httpd->lock);
+
+  level = width > 0 ? rollup_level (httpd, (to_ms - from_ms) / width) : -1;
+  if (!in_memory && level != -1) {
+    if (rollup_foreach (httpd, level, pin, from_ms, to_ms, chart_bucket,
+        &chart) == -1)
+      fprintf (stderr, "Unable to read rollups\n");
+  } else if (!in_memory) {
+    air_tsdb_scan (httpd->tsdb, pin, from_ms, to_ms, chart_reading, &chart);
+  }
+
+  if (chart.n_rows > HTTPD_MAX_CHART_ROWS) {
+    respond_error (conn, 400, "Bad Request");
+    return;
+  }
+
+  config.width = width;
+  config.height = height;
+  config.title = titles[chart.value];
+  config.from_ms = from_ms;
+  config.to_ms = to_ms;
+  svg = air_chart_render_svg (httpd->chart, &config, &len);
+  respond (conn, 200, "OK", "image/svg+xml", svg, len);
+}
+
+static void
+handle_metrics (AirHTTPD *httpd, HTTPDConnection *conn)
+{
+  HTTPDBuffer *body = &httpd->body;
+  size_t len;
+
+  air_metrics_snapshot (httpd->metrics);
+
+  body->len = 0;
+  len = air_metrics_format_prometheus (httpd->metrics, NULL, 0);
+  buffer_reserve (body, len);
+  air_metrics_format_prometheus (httpd->metrics, body->data, body->size);
+  body->len = len;
+
+  respond (conn, 200, "OK", "text/plain; version=0.0.4", body->data,
+      body->len);
+}
+
+static void
+handle_stream (AirHTTPD *httpd, HTTPDConnection *conn, const char *query)
+{
+  int64_t pin = -1;
+
+  query_int64 (query, "pin", &pin);
+
+  buffer_printf (&conn->out, "HTTP/1.1 200 OK\r\n"
+      "Content-Type: text/event-stream\r\n"
+      "Cache-Control: no-cache\r\n"
+      "Access-Control-Allow-Origin: *\r\n"
+      "Connection: keep-alive\r\n\r\n");
+  conn->streaming = 1;
+  conn->stream_pin = pin;
+}
+
+/* parses one complete request of len bytes and queues the response */
+static void
+handle_request (AirHTTPD *httpd, HTTPDConnection *conn, char *request)
+{
+  char *method;
+  char *target;
+  char *version;
+  char *query;
+  char *save;
+
+  method = strtok_r (request, " ", &save);
+  target = strtok_r (NULL, " ", &save);
+  version = strtok_r (NULL, "\r\n", &save);
+
+  if (method == NULL || target == NULL || version == NULL) {
+    conn->keep_alive = 0;
+    respond_error (conn, 400, "Bad Request");
+    return;
+  }
+
+  /* HTTP/1.1 defaults to keep-alive, 1.0 to close */
+  conn->keep_alive = strcmp (version, "HTTP/1.1") == 0;
+  if (strcasestr (save, "\nConnection: close") != NULL)
+    conn->keep_alive = 0;
+  else if (strcasestr (save, "\nConnection: keep-alive") != NULL)
+    conn->keep_alive = 1;
+
+  air_metrics_count (AIR_METRIC_HTTP_REQUESTS, 1);
+
+  if (strcmp (method, "GET") != 0) {
+    respond_error (conn, 405, "Method Not Allowed");
+    return;
+  }
+
+  query = strchr (target, '?');
+  if (query != NULL)
+    *query++ = '\0';
+  else
+    query = "";
+
+  if (strcmp (target, "/latest") == 0)
+    handle_latest (httpd, conn, query);
+  else if (strcmp (target, "/range") == 0)
+    handle_range (httpd, conn, query);
+  else if (strcmp (target, "/chart.svg") == 0)
+    handle_chart (httpd, conn, query);
+  else if (strcmp (target, "/metrics") == 0)
+    handle_metrics (httpd, conn);
+  else if (strcmp (target, "/stream") == 0)
+    handle_stream (httpd, conn, query);
+  else
+    respond_error (conn, 404, "Not Found");
+}
+
+static void
+connection_free (AirHTTPD *httpd, HTTPDConnection *conn)
+{
+  epoll_ctl (httpd->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close (conn->fd);
+  free (conn->out.data);
+  free (conn);
+  httpd->n_connections--;
+}
+
+/* events for conn may still be pending in the current batch, so it is only
+ * marked here and freed by server_reap () */
+static void
+connection_close (AirHTTPD *httpd, HTTPDConnection *conn)
+{
+  conn->dead = 1;
+  epoll_ctl (httpd->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+}
+
+static void
+connection_watch (AirHTTPD *httpd, HTTPDConnection *conn, uint32_t events)
+{
+  struct epoll_event event = { 0 };
+
+  if (events == conn->events)
+    return;
+
+  event.events = events;
+  event.data.ptr = conn;
+  epoll_ctl (httpd->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+  conn->events = events;
+}
+
+/* returns -1 when the connection has to be closed */
+static int
+connection_flush (AirHTTPD *httpd, HTTPDConnection *conn)
+{
+  ssize_t bytes;
+
+  while (conn->sent < conn->out.len) {
+    bytes = send (conn->fd, conn->out.data + conn->sent,
+        conn->out.len - conn->sent, MSG_NOSIGNAL);
+    if (bytes < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return (-1);
+    }
+    conn->sent += bytes;
+  }
+
+  /* requests are not read until the response is out, a full request buffer
+   * would otherwise keep the connection readable */
+  if (conn->sent < conn->out.len) {
+    connection_watch (httpd, conn, EPOLLOUT);
+    return (0);
+  }
+
+  conn->out.len = 0;
+  conn->sent = 0;
+  connection_watch (httpd, conn, EPOLLIN);
+
+  return conn->keep_alive || conn->streaming ? 0 : -1;
+}
+
+/* handles the complete requests buffered on conn */
+static int
+connection_process (AirHTTPD *httpd, HTTPDConnection *conn)
+{
+  char *end;
+  size_t len;
+
+  /* one response at a time, the rest waits in the request buffer */
+  while (!conn->streaming && conn->out.len == 0) {
+    conn->request[conn->n_request] = '\0';
+    end = strstr (conn->request, "\r\n\r\n");
+    if (end == NULL) {
+      if (conn->n_request == HTTPD_REQUEST_MAX - 1) {
+        conn->keep_alive = 0;
+        respond_error (conn, 431, "Request Header Fields Too Large");
+        return connection_flush (httpd, conn);
+      }
+      return (0);
+    }
+
+    len = end + 4 - conn->request;
+    end[2] = '\0';
+    handle_request (httpd, conn, conn->request);
+    memmove (conn->request, conn->request + len, conn->n_request - len);
+    conn->n_request -= len;
+
+    if (connection_flush (httpd, conn) == -1)
+      return (-1);
+  }
+
+  return (0);
+}
+
+static int
+connection_read (AirHTTPD *httpd, HTTPDConnection *conn)
+{
+  ssize_t bytes;
+
+  while (1) {
+    if (conn->n_request == HTTPD_REQUEST_MAX - 1) {
+      /* stream clients have nothing to say, drop what they send */
+      if (!conn->streaming)
+        break;
+      conn->n_request = 0;
+    }
+
+    bytes = recv (conn->fd, conn->request + conn->n_request,
+        HTTPD_REQUEST_MAX - 1 - conn->n_request, 0);
+    if (bytes == 0)
+      return (-1);
+    if (bytes < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return (-1);
+    }
+    conn->n_request += bytes;
+  }
+
+  return connection_process (httpd, conn);
+}
+
+static void
+server_accept (AirHTTPD *httpd)
+{
+  struct epoll_event event = { 0 };
+  HTTPDConnection *conn;
+  int fd;
+
+  while ((fd = accept4 (httpd->listen_fd, NULL, NULL,
+      SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    if (httpd->n_connections == HTTPD_MAX_CONNECTIONS) {
+      close (fd);
+      continue;
+    }
+
+    conn = calloc (1, sizeof (HTTPDConnection));
+    conn->fd = fd;
+    conn->events = EPOLLIN;
+
+    event.events = EPOLLIN;
+    event.data.ptr = conn;
+    if (epoll_ctl (httpd->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      close (fd);
+      free (conn);
+      continue;
+    }
+
+    conn->next = httpd->connections;
+    httpd->connections = conn;
+    httpd->n_connections++;
+  }
+}
+
+/* pushes the readings published since the last call to stream clients */
+static void
+server_stream (AirHTTPD *httpd)
+{
+  HTTPDConnection *conn;
+  HTTPDConnection *next;
+  HTTPDBuffer *event = &httpd->body;
+  AirReading reading;
+  uint64_t n_published;
+
+  while (1) {
+    pthread_mutex_lock (&httpd->lock);
+    n_published = httpd->n_published;
+    /* readings overwritten in the meantime are lost to streams */
+    if (n_published - httpd->n_streamed > (uint64_t) httpd->history_size)
+      httpd->n_streamed = n_published - httpd->history_size;
+    if (httpd->n_streamed < n_published)
+      reading = httpd->history[httpd->n_streamed % httpd->history_size];
+    pthread_mutex_unlock (&httpd->lock);
+
+    if (httpd->n_streamed == n_published)
+      break;
+    httpd->n_streamed++;
+
+    event->len = 0;
+    buffer_printf (event, "data: ");
+    json_reading (event, &reading);
+    buffer_printf (event, "\n\n");
+
+    for (conn = httpd->connections; conn != NULL; conn = next) {
+      next = conn->next;
+      if (conn->dead || !conn->streaming || (conn->stream_pin != -1 &&
+          conn->stream_pin != reading.pin))
+        continue;
+
+      if (conn->out.len - conn->sent > HTTPD_STREAM_BACKLOG) {
+        connection_close (httpd, conn);
+        continue;
+      }
+
+      buffer_append (&conn->out, event->data, event->len);
+      if (connection_flush (httpd, conn) == -1)
+        connection_close (httpd, conn);
+    }
+  }
+}
+
+static void
+server_reap (AirHTTPD *httpd)
+{
+  HTTPDConnection **link = &httpd->connections;
+  HTTPDConnection *conn;
+
+  while (*link != NULL) {
+    conn = *link;
+    if (conn->dead) {
+      *link = conn->next;
+      connection_free (httpd, conn);
+    } else {
+      link = &conn->next;
+    }
+  }
+}
+
+static void*
+server_thread (void *data)
+{
+  AirHTTPD *httpd = (AirHTTPD *)data;
+  struct epoll_event events[HTTPD_MAX_EVENTS];
+  HTTPDConnection *conn;
+  uint64_t value;
+  int stop;
+  int n;
+  int i;
+
+  while (1) {
+    n = epoll_wait (httpd->epoll_fd, events, HTTPD_MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf (stderr, "Error on epoll_wait!\n");
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == &httpd->listen_fd) {
+        server_accept (httpd);
+      } else if (events[i].data.ptr == &httpd->wakeup_fd) {
+        if (read (httpd->wakeup_fd, &value, sizeof (value)) < 0 &&
+            errno != EAGAIN)
+          fprintf (stderr, "Unable to read eventfd\n");
+
+        pthread_mutex_lock (&httpd->lock);
+        stop = httpd->stop;
+        pthread_mutex_unlock (&httpd->lock);
+        if (stop)
+          return NULL;
+
+        server_stream (httpd);
+      } else {
+        conn = events[i].data.ptr;
+        if (conn->dead)
+          continue;
+        if ((events[i].events & (EPOLLERR | EPOLLHUP)) ||
+            ((events[i].events & EPOLLOUT) &&
+                (connection_flush (httpd, conn) == -1 ||
+                connection_process (httpd, conn) == -1)) ||
+            ((events[i].events & EPOLLIN) &&
+                connection_read (httpd, conn) == -1))
+          connection_close (httpd, conn);
+      }
+    }
+
+    server_reap (httpd);
+  }
+
+  return NULL;
+}
+
+AirHTTPD*
+air_httpd_create (const AirHTTPDConfig *config)
+{
+  struct sockaddr_in addr = { 0 };
+  struct epoll_event event = { 0 };
+  AirHTTPD *httpd;
+  int one = 1;
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (config->port);
+  addr.sin_addr.s_addr = htonl (INADDR_ANY);
+  if (config->address != NULL &&
+      inet_pton (AF_INET, config->address, &addr.sin_addr) != 1) {
+    fprintf (stderr, "Invalid address %s\n", config->address);
+    return NULL;
+  }
+
+  httpd = calloc (1, sizeof (AirHTTPD));
+  httpd->tsdb = config->tsdb;
+  httpd->rollup = config->rollup;
+  httpd->history_size = config->history_size > 0 ? config->history_size :
+      HTTPD_DEFAULT_HISTORY;
+  httpd->history = malloc (httpd->history_size * sizeof (AirReading));
+  httpd->buckets = malloc (HTTPD_MAX_BUCKETS * sizeof (AirTSDBAggregate));
+  httpd->rollup_buckets = malloc (HTTPD_ROLLUP_BATCH *
+      sizeof (AirRollupBucket));
+  httpd->chart = air_chart_create ();
+  httpd->metrics = malloc (sizeof (AirMetricsSnapshot));
+  pthread_mutex_init (&httpd->lock, NULL);
+  httpd->epoll_fd = -1;
+  httpd->wakeup_fd = -1;
+
+  httpd->listen_fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+      SOCK_CLOEXEC, 0);
+  if (httpd->listen_fd == -1) {
+    fprintf (stderr, "Unable to create socket\n");
+    goto fail;
+  }
+
+  setsockopt (httpd->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+  if (bind (httpd->listen_fd, (struct sockaddr *) &addr, sizeof (addr)) ==
+      -1 || listen (httpd->listen_fd, 64) == -1) {
+    fprintf (stderr, "Unable to listen on port %d\n", config->port);
+    goto fail;
+  }
+
+  httpd->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  httpd->wakeup_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (httpd->epoll_fd == -1 || httpd->wakeup_fd == -1) {
+    fprintf (stderr, "Unable to create epoll instance\n");
+    goto fail;
+  }
+
+  event.events = EPOLLIN;
+  event.data.ptr = &httpd->listen_fd;
+  epoll_ctl (httpd->epoll_fd, EPOLL_CTL_ADD, httpd->listen_fd, &event);
+  event.data.ptr = &httpd->wakeup_fd;
+  epoll_ctl (httpd->epoll_fd, EPOLL_CTL_ADD, httpd->wakeup_fd, &event);
+
+  if (pthread_create (&httpd->thread, NULL, server_thread, httpd)) {
+    fprintf (stderr, "Unable to create server thread\n");
+    goto fail;
+  }
+
+  return httpd;
+
+fail:
+  if (httpd->wakeup_fd != -1)
+    close (httpd->wakeup_fd);
+  if (httpd->epoll_fd != -1)
+    close (httpd->epoll_fd);
+  if (httpd->listen_fd != -1)
+    close (httpd->listen_fd);
+  pthread_mutex_destroy (&httpd->lock);
+  air_chart_free (httpd->chart);
+  free (httpd->metrics);
+  free (httpd->buckets);
+  free (httpd->rollup_buckets);
+  free (httpd->history);
+  free (httpd);
+
+  return NULL;
+}
+
+/* called for every new reading, from any thread */
+void
+air_httpd_publish (AirHTTPD *httpd, const AirReading *reading)
+{
+  uint64_t one = 1;
+
+  pthread_mutex_lock (&httpd->lock);
+  httpd->history[httpd->n_published % httpd->history_size] = *reading;
+  httpd->n_published++;
+  pthread_mutex_unlock (&httpd->lock);
+
+  if (write (httpd->wakeup_fd, &one, sizeof (one)) == -1)
+    fprintf (stderr, "Unable to wake up http server\n");
+}
+
+void
+air_httpd_stop (AirHTTPD *httpd)
+{
+  uint64_t one = 1;
+
+  pthread_mutex_lock (&httpd->lock);
+  httpd->stop = 1;
+  pthread_mutex_unlock (&httpd->lock);
+
+  if (write (httpd->wakeup_fd, &one, sizeof (one)) == -1)
+    fprintf (stderr, "Unable to wake up http server\n");
+  pthread_join (httpd->thread, NULL);
+
+  while (httpd->connections != NULL) {
+    httpd->connections->dead = 1;
+    server_reap (httpd);
+  }
+
+  close (httpd->wakeup_fd);
+  close (httpd->epoll_fd);
+  close (httpd->listen_fd);
+  pthread_mutex_destroy (&httpd->lock);
+  free (httpd->body.data);
+  air_chart_free (httpd->chart);
+  free (httpd->metrics);
+  free (httpd->buckets);
+  free (httpd->rollup_buckets);
+  free (httpd->history);
+  free (httpd);
+}
@@ -0,0 +1,55 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __AIR_HTTPD_H__
+#define __AIR_HTTPD_H__
+
+#include "air_utils.h"
+#include "air_tsdb.h"
+#include "air_rollup.h"
+
+/* Embedded HTTP server for readings. Recent readings are kept in memory,
+ * older ones are read from the time series database, or from the rollups
+ * when steps or chart pixels span a minute or more. One thread serves all
+ * connections from an epoll loop.
+ *
+ *   GET /latest[?pin=]                        latest reading of every pin
+ *   GET /range?from=&to=[&step=][&pin=]       readings or step ms aggregates,
+ *                                             from/to in ms since the Epoch
+ *   GET /chart.svg?from=&to=[&pin=]           readings drawn as SVG,
+ *       [&value=aqi|ugm3|pcs][&width=][&height=]
+ *   GET /metrics                              counters and latencies in the
+ *                                             Prometheus text format
+ *   GET /stream[?pin=]                        server-sent events, one per
+ *                                             published reading
+ */
+typedef struct _AirHTTPD AirHTTPD;
+
+typedef struct _AirHTTPDConfig
+{
+  const char *address;          /* NULL for all interfaces */
+  int port;
+  int history_size;             /* readings kept in memory */
+  AirTSDB *tsdb;                /* NULL to serve from memory only */
+  AirRollup *rollup;            /* NULL to aggregate raw readings */
+} AirHTTPDConfig;
+
+AirHTTPD* air_httpd_create (const AirHTTPDConfig *config);
+void air_httpd_publish (AirHTTPD *httpd, const AirReading *reading);
+void air_httpd_stop (AirHTTPD *httpd);
+
+#endif //__AIR_HTTPD_H__
@@ -0,0 +1,330 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "air_metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define METRICS_PREFIX "grove_dust_"
+#define SUB_BITS 3
+#define SUB_BUCKETS (1 << SUB_BITS)
+/* larger values land in the last bucket */
+#define MAX_VALUE ((UINT64_C (1) << 40) - 1)
+
+typedef struct _MetricsShard MetricsShard;
+
+/* written by its thread only, read by snapshots */
+struct _MetricsShard
+{
+  MetricsShard *next;
+  _Atomic uint64_t counters[AIR_METRIC_COUNTERS];
+  _Atomic uint64_t buckets[AIR_METRIC_HISTOGRAMS][AIR_METRICS_BUCKETS];
+  _Atomic uint64_t count[AIR_METRIC_HISTOGRAMS];
+  _Atomic uint64_t sum_ns[AIR_METRIC_HISTOGRAMS];
+};
+
+typedef struct _MetricInfo
+{
+  const char *name;
+  const char *help;
+} MetricInfo;
+
+static const MetricInfo counter_info[AIR_METRIC_COUNTERS] = {
+  { "wakeups_total", "Pin wakeups, from epoll or poll." },
+  { "spurious_wakeups_total", "Pin wakeups that read no edge." },
+  { "edges_total", "Edges read from pins." },
+  { "pin_errors_total", "Pins no longer watched after a failed read." },
+  { "filtered_edges_total", "Edges dropped by pin filters." },
+  { "pulses_total", "Low pulses fed to sensors." },
+  { "out_of_bounds_pulses_total", "Pulses outside of the sensor's range." },
+  { "readings_total", "Readings computed." },
+  { "db_errors_total", "Failed database writes." },
+  { "http_requests_total", "HTTP requests served." },
+  { "stream_drops_total", "Lines not delivered to slow or disconnected "
+      "stream subscribers." },
+};
+
+static const MetricInfo histogram_info[AIR_METRIC_HISTOGRAMS] = {
+  { "callback_seconds", "Time spent in the edge callbacks of a wakeup." },
+  { "reading_seconds", "Time to compute a reading from the window." },
+  { "tsdb_append_seconds", "Time to append a reading to the database." },
+  { "rollup_add_seconds", "Time to add a reading to the rollups." },
+  { "db_write_seconds", "Time of a MySQL batch insert." },
+  { "wakeup_latency_seconds", "Time from an edge to the engine thread "
+      "handling it." },
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static MetricsShard *shards;
+static __thread MetricsShard *thread_shard;
+
+/* shards outlive their threads so that no counts are lost, there is one per
+ * thread that ever counted something */
+static MetricsShard*
+shard_get (void)
+{
+  MetricsShard *shard = thread_shard;
+
+  if (shard != NULL)
+    return shard;
+
+  shard = calloc (1, sizeof (MetricsShard));
+  pthread_mutex_lock (&shards_lock);
+  shard->next = shards;
+  shards = shard;
+  pthread_mutex_unlock (&shards_lock);
+  thread_shard = shard;
+
+  return shard;
+}
+
+/* single writer, a plain add without a locked instruction */
+static void
+shard_add (_Atomic uint64_t *value, uint64_t n)
+{
+  atomic_store_explicit (value, atomic_load_explicit (value,
+      memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static int
+bucket_of (uint64_t value)
+{
+  int shift;
+
+  if (value < 2 * SUB_BUCKETS)
+    return value;
+  if (value > MAX_VALUE)
+    value = MAX_VALUE;
+
+  shift = 63 - __builtin_clzll (value) - SUB_BITS;
+
+  return (shift + 1) * SUB_BUCKETS + (value >> shift) - SUB_BUCKETS;
+}
+
+/* middle of the values falling into bucket */
+static uint64_t
+bucket_value (int bucket)
+{
+  int shift;
+
+  if (bucket < 2 * SUB_BUCKETS)
+    return bucket;
+
+  shift = bucket / SUB_BUCKETS - 1;
+
+  return ((uint64_t) (bucket % SUB_BUCKETS + SUB_BUCKETS) << shift) +
+      ((UINT64_C (1) << shift) >> 1);
+}
+
+uint64_t
+air_metrics_now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+air_metrics_count (AirMetricCounter counter, uint64_t n)
+{
+  shard_add (&shard_get ()->counters[counter], n);
+}
+
+void
+air_metrics_record (AirMetricHistogram histogram, uint64_t ns)
+{
+  MetricsShard *shard = shard_get ();
+
+  shard_add (&shard->buckets[histogram][bucket_of (ns)], 1);
+  shard_add (&shard->count[histogram], 1);
+  shard_add (&shard->sum_ns[histogram], ns);
+}
+
+void
+air_metrics_record_since (AirMetricHistogram histogram, uint64_t start_ns)
+{
+  air_metrics_record (histogram, air_metrics_now_ns () - start_ns);
+}
+
+void
+air_metrics_snapshot (AirMetricsSnapshot *snapshot)
+{
+  MetricsShard *shard;
+  int i;
+  int j;
+
+  memset (snapshot, 0, sizeof (AirMetricsSnapshot));
+
+  pthread_mutex_lock (&shards_lock);
+  for (shard = shards; shard != NULL; shard = shard->next) {
+    for (i = 0; i < AIR_METRIC_COUNTERS; i++)
+      snapshot->counters[i] += atomic_load_explicit (&shard->counters[i],
+          memory_order_relaxed);
+    for (i = 0; i < AIR_METRIC_HISTOGRAMS; i++) {
+      for (j = 0; j < AIR_METRICS_BUCKETS; j++)
+        snapshot->buckets[i][j] += atomic_load_explicit (
+            &shard->buckets[i][j], memory_order_relaxed);
+      snapshot->count[i] += atomic_load_explicit (&shard->count[i],
+          memory_order_relaxed);
+      snapshot->sum_ns[i] += atomic_load_explicit (&shard->sum_ns[i],
+          memory_order_relaxed);
+    }
+  }
+  pthread_mutex_unlock (&shards_lock);
+}
+
+uint64_t
+air_metrics_quantile (const AirMetricsSnapshot *snapshot,
+    AirMetricHistogram histogram, double quantile)
+{
+  const uint64_t *buckets = snapshot->buckets[histogram];
+  uint64_t total = 0;
+  uint64_t rank;
+  uint64_t seen = 0;
+  int i;
+
+  /* the bucket counts, not count, so a snapshot racing with a writer stays
+   * consistent */
+  for (i = 0; i < AIR_METRICS_BUCKETS; i++)
+    total += buckets[i];
+  if (total == 0)
+    return 0;
+
+  rank = quantile * total;
+  if (rank >= total)
+    rank = total - 1;
+
+  for (i = 0; i < AIR_METRICS_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen > rank)
+      break;
+  }
+
+  return bucket_value (i);
+}
+
+static void
+text_append (char *buf, size_t size, size_t *len, const char *format, ...)
+{
+  va_list args;
+  int n;
+
+  va_start (args, format);
+  n = vsnprintf (*len < size ? buf + *len : NULL,
+      *len < size ? size - *len : 0, format, args);
+  va_end (args);
+
+  if (n > 0)
+    *len += n;
+}
+
+size_t
+air_metrics_format_prometheus (const AirMetricsSnapshot *snapshot,
+    char *buf, size_t size)
+{
+  const MetricInfo *info;
+  size_t len = 0;
+  size_t q;
+  int i;
+
+  for (i = 0; i < AIR_METRIC_COUNTERS; i++) {
+    info = &counter_info[i];
+    text_append (buf, size, &len, "# HELP " METRICS_PREFIX "%s %s\n"
+        "# TYPE " METRICS_PREFIX "%s counter\n"
+        METRICS_PREFIX "%s %llu\n", info->name, info->help, info->name,
+        info->name, (unsigned long long) snapshot->counters[i]);
+  }
+
+  for (i = 0; i < AIR_METRIC_HISTOGRAMS; i++) {
+    info = &histogram_info[i];
+    text_append (buf, size, &len, "# HELP " METRICS_PREFIX "%s %s\n"
+        "# TYPE " METRICS_PREFIX "%s summary\n", info->name, info->help,
+        info->name);
+    for (q = 0; q < sizeof (quantiles) / sizeof (quantiles[0]); q++)
+      text_append (buf, size, &len, METRICS_PREFIX "%s{quantile=\"%g\"} "
+          "%.9f\n", info->name, quantiles[q],
+          air_metrics_quantile (snapshot, i, quantiles[q]) / 1e9);
+    text_append (buf, size, &len, METRICS_PREFIX "%s_sum %.9f\n"
+        METRICS_PREFIX "%s_count %llu\n", info->name,
+        snapshot->sum_ns[i] / 1e9, info->name,
+        (unsigned long long) snapshot->count[i]);
+  }
+
+  return len;
+}
+
+size_t
+air_metrics_format_log (const AirMetricsSnapshot *snapshot,
+    const AirMetricsSnapshot *previous, char *buf, size_t size)
+{
+  static const char *short_names[AIR_METRIC_HISTOGRAMS] = {
+    "callback", "reading", "tsdb", "rollup", "db", "wakeup"
+  };
+  AirMetricsSnapshot *delta;
+  size_t len = 0;
+  int i;
+  int j;
+
+  delta = malloc (sizeof (AirMetricsSnapshot));
+  *delta = *snapshot;
+  if (previous != NULL) {
+    for (i = 0; i < AIR_METRIC_COUNTERS; i++)
+      delta->counters[i] -= previous->counters[i];
+    for (i = 0; i < AIR_METRIC_HISTOGRAMS; i++) {
+      for (j = 0; j < AIR_METRICS_BUCKETS; j++)
+        delta->buckets[i][j] -= previous->buckets[i][j];
+      delta->count[i] -= previous->count[i];
+    }
+  }
+
+  text_append (buf, size, &len, "wakeups %llu (%llu spurious), edges %llu "
+      "(%llu filtered), pulses %llu (%llu out of bounds), readings %llu, "
+      "db errors %llu, http requests %llu, stream drops %llu",
+      (unsigned long long) delta->counters[AIR_METRIC_WAKEUPS],
+      (unsigned long long) delta->counters[AIR_METRIC_SPURIOUS_WAKEUPS],
+      (unsigned long long) delta->counters[AIR_METRIC_EDGES],
+      (unsigned long long) delta->counters[AIR_METRIC_FILTERED_EDGES],
+      (unsigned long long) delta->counters[AIR_METRIC_PULSES],
+      (unsigned long long) delta->counters[AIR_METRIC_OUT_OF_BOUNDS],
+      (unsigned long long) delta->counters[AIR_METRIC_READINGS],
+      (unsigned long long) delta->counters[AIR_METRIC_DB_ERRORS],
+      (unsigned long long) delta->counters[AIR_METRIC_HTTP_REQUESTS],
+      (unsigned long long) delta->counters[AIR_METRIC_STREAM_DROPS]);
+
+  /* p50/p99 in microseconds of the histograms that saw values */
+  for (i = 0; i < AIR_METRIC_HISTOGRAMS; i++) {
+    if (delta->count[i] == 0)
+      continue;
+    text_append (buf, size, &len, ", %s p50 %.1fus p99 %.1fus",
+        short_names[i], air_metrics_quantile (delta, i, 0.5) / 1e3,
+        air_metrics_quantile (delta, i, 0.99) / 1e3);
+  }
+
+  free (delta);
+
+  return len;
+}
@@ -0,0 +1,86 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __AIR_METRICS_H__
+#define __AIR_METRICS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Counters and latency histograms for the hot paths. Every thread updates
+ * its own shard with plain relaxed stores, no locks and no shared cache
+ * lines, so counting costs a few nanoseconds and can always stay on.
+ * Snapshots sum the shards of all threads. Histograms are log-linear, 8
+ * buckets per power of two (12.5% precision) from 1 ns to 18 minutes. */
+typedef enum AirMetricCounter
+{
+  AIR_METRIC_WAKEUPS,           /* pin wakeups, from epoll or poll */
+  AIR_METRIC_SPURIOUS_WAKEUPS,  /* wakeups that read no edge */
+  AIR_METRIC_EDGES,
+  AIR_METRIC_PIN_ERRORS,        /* pins the engine stopped watching */
+  AIR_METRIC_FILTERED_EDGES,    /* edges dropped by pin filters */
+  AIR_METRIC_PULSES,            /* low pulses fed to sensors */
+  AIR_METRIC_OUT_OF_BOUNDS,     /* pulses outside the sensor's range */
+  AIR_METRIC_READINGS,
+  AIR_METRIC_DB_ERRORS,
+  AIR_METRIC_HTTP_REQUESTS,
+  AIR_METRIC_STREAM_DROPS,      /* lines slow stream subscribers lost */
+  AIR_METRIC_COUNTERS,
+} AirMetricCounter;
+
+typedef enum AirMetricHistogram
+{
+  AIR_METRIC_CALLBACK,          /* edge callbacks of one wakeup */
+  AIR_METRIC_READING,           /* computing a reading from the window */
+  AIR_METRIC_TSDB_APPEND,
+  AIR_METRIC_ROLLUP_ADD,
+  AIR_METRIC_DB_WRITE,          /* one MySQL batch insert */
+  AIR_METRIC_WAKEUP_LATENCY,    /* from an edge to the thread handling it */
+  AIR_METRIC_HISTOGRAMS,
+} AirMetricHistogram;
+
+#define AIR_METRICS_BUCKETS 304
+
+typedef struct _AirMetricsSnapshot
+{
+  uint64_t counters[AIR_METRIC_COUNTERS];
+  uint64_t buckets[AIR_METRIC_HISTOGRAMS][AIR_METRICS_BUCKETS];
+  uint64_t count[AIR_METRIC_HISTOGRAMS];
+  uint64_t sum_ns[AIR_METRIC_HISTOGRAMS];
+} AirMetricsSnapshot;
+
+uint64_t air_metrics_now_ns (void);
+void air_metrics_count (AirMetricCounter counter, uint64_t n);
+void air_metrics_record (AirMetricHistogram histogram, uint64_t ns);
+/* records the time elapsed since start_ns, from air_metrics_now_ns () */
+void air_metrics_record_since (AirMetricHistogram histogram,
+    uint64_t start_ns);
+
+void air_metrics_snapshot (AirMetricsSnapshot *snapshot);
+uint64_t air_metrics_quantile (const AirMetricsSnapshot *snapshot,
+    AirMetricHistogram histogram, double quantile);
+
+/* both return the length of the full text like snprintf (), which is
+ * truncated to size */
+size_t air_metrics_format_prometheus (const AirMetricsSnapshot *snapshot,
+    char *buf, size_t size);
+/* one line with the counters and latencies since previous, all time when
+ * previous is NULL */
+size_t air_metrics_format_log (const AirMetricsSnapshot *snapshot,
+    const AirMetricsSnapshot *previous, char *buf, size_t size);
+
+#endif //__AIR_METRICS_H__
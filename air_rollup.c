@@ -0,0 +1,366 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "air_rollup.h"
+#include "air_metrics.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define PATH_MAX_LEN 512
+/* how often an open bucket is written out, in reading time */
+#define OPEN_WRITE_MS 60000
+
+static const int64_t level_ms[] = {
+  60000LL,
+  3600000LL,
+  86400000LL,
+};
+
+static const char *level_str[] = {
+  "1m",
+  "1h",
+  "1d",
+};
+
+typedef struct _RollupSeries
+{
+  int pin;
+  int fds[AIR_ROLLUP_LEVELS];
+  /* the open buckets, means hold sums until the bucket is closed */
+  AirRollupBucket open[AIR_ROLLUP_LEVELS];
+  /* the closed buckets end and the open one is kept at this offset */
+  off_t ends[AIR_ROLLUP_LEVELS];
+  /* reading time the open bucket was last written at */
+  int64_t written_ms[AIR_ROLLUP_LEVELS];
+} RollupSeries;
+
+struct _AirRollup
+{
+  pthread_mutex_t lock;
+  char *dir;
+  RollupSeries *series;
+  int n_series;
+};
+
+static int64_t
+bucket_start (int64_t timestamp_ms, AirRollupLevel level)
+{
+  int64_t start = timestamp_ms - timestamp_ms % level_ms[level];
+
+  if (timestamp_ms < 0 && start != timestamp_ms)
+    start -= level_ms[level];
+
+  return start;
+}
+
+static void
+bucket_finish (const AirRollupBucket *open, AirRollupBucket *bucket)
+{
+  *bucket = *open;
+  if (bucket->count > 0) {
+    bucket->ugm3_mean /= bucket->count;
+    bucket->pcs_mean /= bucket->count;
+  }
+}
+
+/* writes the open bucket in place of its last copy, a crash leaves either
+ * copy but never loses the bucket */
+static int
+series_write (RollupSeries *series, AirRollupLevel level)
+{
+  AirRollupBucket bucket;
+
+  bucket_finish (&series->open[level], &bucket);
+
+  if (pwrite (series->fds[level], &bucket, sizeof (bucket),
+      series->ends[level]) != sizeof (bucket)) {
+    fprintf (stderr, "Unable to write %s rollup for pin %d\n",
+        level_str[level], series->pin);
+    return (-1);
+  }
+
+  return 0;
+}
+
+/* the last bucket written before a restart may still be open, take it back
+ * so that readings for it keep going into the same bucket. It stays on disk
+ * and is rewritten in place, a torn record after it is overwritten. */
+static void
+series_resume (RollupSeries *series, AirRollupLevel level)
+{
+  AirRollupBucket *open = &series->open[level];
+  off_t size;
+
+  size = lseek (series->fds[level], 0, SEEK_END);
+  if (size < (off_t) sizeof (AirRollupBucket))
+    return;
+
+  size -= size % sizeof (AirRollupBucket);
+  if (pread (series->fds[level], open, sizeof (AirRollupBucket),
+      size - sizeof (AirRollupBucket)) != sizeof (AirRollupBucket)) {
+    *open = (AirRollupBucket) { 0 };
+    series->ends[level] = size;
+    return;
+  }
+
+  series->ends[level] = size - sizeof (AirRollupBucket);
+  open->ugm3_mean *= open->count;
+  open->pcs_mean *= open->count;
+}
+
+/* the series of pin, its files are only created when create is set.
+ * Without them NULL is returned with errno ENOENT. */
+static RollupSeries*
+rollup_get_series (AirRollup *rollup, int pin, int create)
+{
+  char path[PATH_MAX_LEN];
+  RollupSeries *series;
+  int level;
+  int i;
+
+  for (i = 0; i < rollup->n_series; i++) {
+    if (rollup->series[i].pin == pin)
+      return &rollup->series[i];
+  }
+
+  rollup->series = realloc (rollup->series,
+      (rollup->n_series + 1) * sizeof (RollupSeries));
+  series = &rollup->series[rollup->n_series];
+  *series = (RollupSeries) { 0 };
+  series->pin = pin;
+
+  for (level = 0; level < AIR_ROLLUP_LEVELS; level++) {
+    snprintf (path, PATH_MAX_LEN, "%s/rollup-%d-%s.dat", rollup->dir, pin,
+        level_str[level]);
+    series->fds[level] = open (path, O_RDWR | O_CLOEXEC |
+        (create ? O_CREAT : 0), 0644);
+    if (series->fds[level] == -1) {
+      if (create || errno != ENOENT)
+        fprintf (stderr, "Unable to open %s\n", path);
+      while (level--)
+        close (series->fds[level]);
+      return NULL;
+    }
+    series_resume (series, level);
+  }
+
+  rollup->n_series++;
+
+  return series;
+}
+
+AirRollup*
+air_rollup_open (const char *dir)
+{
+  AirRollup *rollup;
+
+  if (mkdir (dir, 0755) == -1 && errno != EEXIST) {
+    fprintf (stderr, "Unable to create %s\n", dir);
+    return NULL;
+  }
+
+  rollup = calloc (1, sizeof (AirRollup));
+  rollup->dir = strdup (dir);
+  pthread_mutex_init (&rollup->lock, NULL);
+
+  return rollup;
+}
+
+int
+air_rollup_add (AirRollup *rollup, const AirReading *reading)
+{
+  RollupSeries *series;
+  AirRollupBucket *open;
+  int64_t start;
+  uint64_t start_ns = air_metrics_now_ns ();
+  int ret = 0;
+  int level;
+
+  pthread_mutex_lock (&rollup->lock);
+  series = rollup_get_series (rollup, reading->pin, 1);
+  if (series == NULL) {
+    pthread_mutex_unlock (&rollup->lock);
+    return (-1);
+  }
+
+  for (level = 0; level < AIR_ROLLUP_LEVELS; level++) {
+    open = &series->open[level];
+    start = bucket_start (reading->timestamp_ms, level);
+
+    /* late readings for an already closed bucket go into the open one */
+    if (open->count > 0 && start > open->timestamp_ms) {
+      if (series_write (series, level) == -1)
+        ret = -1;
+      else
+        series->ends[level] += sizeof (AirRollupBucket);
+      open->count = 0;
+    }
+
+    if (open->count == 0) {
+      *open = (AirRollupBucket) { 0 };
+      series->written_ms[level] = reading->timestamp_ms;
+      open->timestamp_ms = start;
+      open->pin = reading->pin;
+      open->ugm3_min = reading->concentration_ugm3;
+      open->ugm3_max = reading->concentration_ugm3;
+      open->aqi_max = reading->aqi;
+    }
+
+    if (reading->concentration_ugm3 < open->ugm3_min)
+      open->ugm3_min = reading->concentration_ugm3;
+    if (reading->concentration_ugm3 > open->ugm3_max)
+      open->ugm3_max = reading->concentration_ugm3;
+    if (reading->aqi > open->aqi_max)
+      open->aqi_max = reading->aqi;
+    open->ugm3_mean += reading->concentration_ugm3;
+    open->pcs_mean += reading->concentration_pcs;
+    open->count++;
+
+    /* so that a crash loses at most a minute of the bucket */
+    if (reading->timestamp_ms - series->written_ms[level] >= OPEN_WRITE_MS) {
+      if (series_write (series, level) == -1)
+        ret = -1;
+      series->written_ms[level] = reading->timestamp_ms;
+    }
+  }
+  pthread_mutex_unlock (&rollup->lock);
+
+  air_metrics_record_since (AIR_METRIC_ROLLUP_ADD, start_ns);
+
+  return ret;
+}
+
+int
+air_rollup_query (AirRollup *rollup, AirRollupLevel level, int pin,
+    int64_t from_ms, int64_t to_ms, AirRollupBucket *buckets,
+    int max_buckets)
+{
+  RollupSeries *series;
+  AirRollupBucket *records;
+  size_t n_records;
+  size_t low;
+  size_t high;
+  size_t mid;
+  int n = 0;
+
+  pthread_mutex_lock (&rollup->lock);
+  series = rollup_get_series (rollup, pin, 0);
+  if (series == NULL) {
+    pthread_mutex_unlock (&rollup->lock);
+    /* a pin without readings */
+    return errno == ENOENT ? 0 : -1;
+  }
+
+  /* without the copy of the open bucket, it is added from memory below */
+  n_records = series->ends[level] / sizeof (AirRollupBucket);
+  if (n_records > 0) {
+    records = mmap (NULL, n_records * sizeof (AirRollupBucket), PROT_READ,
+        MAP_SHARED, series->fds[level], 0);
+    if (records == MAP_FAILED) {
+      pthread_mutex_unlock (&rollup->lock);
+      return (-1);
+    }
+
+    /* buckets of one series are written in time order */
+    low = 0;
+    high = n_records;
+    while (low < high) {
+      mid = low + (high - low) / 2;
+      if (records[mid].timestamp_ms < from_ms)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+    while (low < n_records && n < max_buckets &&
+        records[low].timestamp_ms < to_ms)
+      buckets[n++] = records[low++];
+
+    munmap (records, n_records * sizeof (AirRollupBucket));
+  }
+
+  if (n < max_buckets && series->open[level].count > 0 &&
+      series->open[level].timestamp_ms >= from_ms &&
+      series->open[level].timestamp_ms < to_ms)
+    bucket_finish (&series->open[level], &buckets[n++]);
+  pthread_mutex_unlock (&rollup->lock);
+
+  return n;
+}
+
+int
+air_rollup_pins (AirRollup *rollup, int *pins, int max_pins)
+{
+  DIR *dir;
+  struct dirent *entry;
+  char level[8];
+  int pin;
+  int n = 0;
+
+  dir = opendir (rollup->dir);
+  if (dir == NULL)
+    return (-1);
+
+  while (n < max_pins && (entry = readdir (dir)) != NULL) {
+    if (sscanf (entry->d_name, "rollup-%d-%7[^.].dat", &pin, level) == 2 &&
+        strcmp (level, level_str[AIR_ROLLUP_MINUTE]) == 0)
+      pins[n++] = pin;
+  }
+  closedir (dir);
+
+  return n;
+}
+
+int64_t
+air_rollup_level_ms (AirRollupLevel level)
+{
+  return level_ms[level];
+}
+
+void
+air_rollup_close (AirRollup *rollup)
+{
+  RollupSeries *series;
+  int level;
+  int i;
+
+  /* open buckets are written too, they are resumed on the next start */
+  for (i = 0; i < rollup->n_series; i++) {
+    series = &rollup->series[i];
+    for (level = 0; level < AIR_ROLLUP_LEVELS; level++) {
+      if (series->open[level].count > 0)
+        series_write (series, level);
+      fdatasync (series->fds[level]);
+      close (series->fds[level]);
+    }
+  }
+
+  pthread_mutex_destroy (&rollup->lock);
+  free (rollup->series);
+  free (rollup->dir);
+  free (rollup);
+}
@@ -0,0 +1,62 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __AIR_ROLLUP_H__
+#define __AIR_ROLLUP_H__
+
+#include "air_utils.h"
+
+/* Per pin rollups of readings at 1 minute, 1 hour and 1 day resolution,
+ * updated as every reading comes in. Buckets are appended to one file per
+ * pin and resolution (rollup-<pin>-<resolution>.dat) next to the raw data.
+ * The open bucket is the last record, rewritten in place at least once a
+ * minute of readings and when it closes, and resumed after a restart. */
+typedef enum AirRollupLevel
+{
+  AIR_ROLLUP_MINUTE,
+  AIR_ROLLUP_HOUR,
+  AIR_ROLLUP_DAY,
+  AIR_ROLLUP_LEVELS,
+} AirRollupLevel;
+
+typedef struct _AirRollupBucket
+{
+  int64_t timestamp_ms;         /* start of the bucket */
+  int32_t pin;
+  uint32_t count;
+  float ugm3_min;
+  float ugm3_max;
+  float ugm3_mean;
+  float pcs_mean;
+  int32_t aqi_max;
+} AirRollupBucket;
+
+typedef struct _AirRollup AirRollup;
+
+AirRollup* air_rollup_open (const char *dir);
+int air_rollup_add (AirRollup *rollup, const AirReading *reading);
+/* buckets of pin starting in [from_ms, to_ms) in time order, none for a pin
+ * that never had a reading */
+int air_rollup_query (AirRollup *rollup, AirRollupLevel level, int pin,
+    int64_t from_ms, int64_t to_ms, AirRollupBucket *buckets,
+    int max_buckets);
+/* the pins with rollups in the directory */
+int air_rollup_pins (AirRollup *rollup, int *pins, int max_pins);
+int64_t air_rollup_level_ms (AirRollupLevel level);
+void air_rollup_close (AirRollup *rollup);
+
+#endif //__AIR_ROLLUP_H__
@@ -0,0 +1,401 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "air_shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHM_MAGIC   0x4d485347  /* "GSHM" */
+#define SHM_VERSION 1
+#define SHM_CACHE_LINE 64
+
+/* The layout is shared with readers built separately, fields are only ever
+ * appended in a new version. The seqlock and the futex word have their own
+ * cache lines, readers spinning on one do not slow down the other. */
+typedef struct _AirShmSegment
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t history_size;
+  uint32_t closed;
+  _Alignas (SHM_CACHE_LINE) atomic_uint seq;  /* odd while writing */
+  _Alignas (SHM_CACHE_LINE) atomic_uint generation;
+  _Alignas (SHM_CACHE_LINE) uint64_t n_readings;
+  uint32_t n_pins;
+  AirReading latest[AIR_SHM_MAX_PINS];
+  AirReading history[];
+} AirShmSegment;
+
+struct _AirShm
+{
+  char name[NAME_MAX];
+  AirShmSegment *segment;
+  size_t size;
+  pthread_mutex_t lock;
+};
+
+struct _AirShmReader
+{
+  const AirShmSegment *segment;
+  size_t size;
+};
+
+static size_t
+segment_size (unsigned int history)
+{
+  return sizeof (AirShmSegment) + (size_t) history * sizeof (AirReading);
+}
+
+static int
+futex (atomic_uint *word, int op, unsigned int value,
+    const struct timespec *timeout)
+{
+  /* not FUTEX_PRIVATE_FLAG, the waiters are other processes */
+  return syscall (SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+AirShm*
+air_shm_create (const char *name, unsigned int history)
+{
+  AirShm *shm;
+  int fd;
+
+  if (history == 0 || strlen (name) >= NAME_MAX) {
+    fprintf (stderr, "Invalid shared memory segment %s\n", name);
+    return NULL;
+  }
+
+  shm = calloc (1, sizeof (AirShm));
+  strcpy (shm->name, name);
+  shm->size = segment_size (history);
+
+  /* readers of a previous publisher keep their mapping of the old segment,
+   * they find it closed */
+  shm_unlink (name);
+  fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    fprintf (stderr, "Unable to create shared memory segment %s\n", name);
+    free (shm);
+    return NULL;
+  }
+
+  if (ftruncate (fd, shm->size) == -1) {
+    fprintf (stderr, "Unable to size shared memory segment %s\n", name);
+    goto fail;
+  }
+
+  shm->segment = mmap (NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+      fd, 0);
+  if (shm->segment == MAP_FAILED) {
+    fprintf (stderr, "Unable to map shared memory segment %s\n", name);
+    goto fail;
+  }
+  close (fd);
+
+  /* the segment is zeroed, readers refuse it until the magic is set */
+  shm->segment->version = SHM_VERSION;
+  shm->segment->history_size = history;
+  atomic_store_explicit (&shm->segment->generation, 1, memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+  shm->segment->magic = SHM_MAGIC;
+
+  pthread_mutex_init (&shm->lock, NULL);
+
+  return shm;
+
+fail:
+  close (fd);
+  shm_unlink (name);
+  free (shm);
+
+  return NULL;
+}
+
+void
+air_shm_publish (AirShm *shm, const AirReading *reading)
+{
+  AirShmSegment *segment = shm->segment;
+  unsigned int seq;
+  unsigned int generation;
+  uint32_t i;
+
+  /* one writer at a time, readers are not held up by the lock */
+  pthread_mutex_lock (&shm->lock);
+
+  for (i = 0; i < segment->n_pins; i++) {
+    if (segment->latest[i].pin == reading->pin)
+      break;
+  }
+
+  seq = atomic_load_explicit (&segment->seq, memory_order_relaxed);
+  atomic_store_explicit (&segment->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+
+  if (i < AIR_SHM_MAX_PINS) {
+    segment->latest[i] = *reading;
+    if (i == segment->n_pins)
+      segment->n_pins++;
+  }
+  segment->history[segment->n_readings % segment->history_size] = *reading;
+  segment->n_readings++;
+
+  atomic_store_explicit (&segment->seq, seq + 2, memory_order_release);
+
+  /* 0 is never a generation, so that readers starting from 0 return at
+   * once */
+  generation = atomic_load_explicit (&segment->generation,
+      memory_order_relaxed) + 1;
+  atomic_store_explicit (&segment->generation, generation ? generation : 1,
+      memory_order_release);
+
+  pthread_mutex_unlock (&shm->lock);
+
+  /* readers map the segment read only and cannot announce themselves, a
+   * wake without waiters costs about a microsecond once per reading */
+  futex (&segment->generation, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+void
+air_shm_free (AirShm *shm)
+{
+  shm->segment->closed = 1;
+  atomic_fetch_add_explicit (&shm->segment->generation, 1,
+      memory_order_release);
+  futex (&shm->segment->generation, FUTEX_WAKE, INT_MAX, NULL);
+
+  shm_unlink (shm->name);
+  munmap (shm->segment, shm->size);
+  pthread_mutex_destroy (&shm->lock);
+  free (shm);
+}
+
+AirShmReader*
+air_shm_reader_open (const char *name)
+{
+  AirShmReader *reader;
+  const AirShmSegment *segment;
+  struct stat st;
+  int fd;
+
+  fd = shm_open (name, O_RDONLY | O_CLOEXEC, 0);
+  if (fd == -1) {
+    fprintf (stderr, "Unable to open shared memory segment %s\n", name);
+    return NULL;
+  }
+
+  if (fstat (fd, &st) == -1 || st.st_size < sizeof (AirShmSegment)) {
+    fprintf (stderr, "Invalid shared memory segment %s\n", name);
+    close (fd);
+    return NULL;
+  }
+
+  segment = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (segment == MAP_FAILED) {
+    fprintf (stderr, "Unable to map shared memory segment %s\n", name);
+    return NULL;
+  }
+
+  if (segment->magic != SHM_MAGIC || segment->version != SHM_VERSION ||
+      st.st_size < segment_size (segment->history_size)) {
+    fprintf (stderr, "Invalid shared memory segment %s\n", name);
+    munmap ((void *) segment, st.st_size);
+    return NULL;
+  }
+  atomic_thread_fence (memory_order_acquire);
+
+  reader = malloc (sizeof (AirShmReader));
+  reader->segment = segment;
+  reader->size = st.st_size;
+
+  return reader;
+}
+
+void
+air_shm_reader_close (AirShmReader *reader)
+{
+  munmap ((void *) reader->segment, reader->size);
+  free (reader);
+}
+
+/* the read side of the seqlock: wait for an even sequence, copy, and retry
+ * if the sequence moved. The copies race with the publisher by design, torn
+ * copies are thrown away. */
+static unsigned int
+read_begin (const AirShmReader *reader)
+{
+  atomic_uint *seq = (atomic_uint *) &reader->segment->seq;
+  unsigned int value;
+
+  while ((value = atomic_load_explicit (seq, memory_order_acquire)) & 1)
+    ;
+
+  return value;
+}
+
+static int
+read_retry (const AirShmReader *reader, unsigned int value)
+{
+  atomic_uint *seq = (atomic_uint *) &reader->segment->seq;
+
+  atomic_thread_fence (memory_order_acquire);
+
+  return atomic_load_explicit (seq, memory_order_relaxed) != value;
+}
+
+int
+air_shm_reader_latest (AirShmReader *reader, int pin, AirReading *reading)
+{
+  const AirShmSegment *segment = reader->segment;
+  unsigned int seq;
+  uint32_t n_pins;
+  uint32_t i;
+  int found;
+
+  if (segment->closed)
+    return (-1);
+
+  do {
+    seq = read_begin (reader);
+    found = 0;
+    n_pins = segment->n_pins;
+    for (i = 0; i < n_pins && i < AIR_SHM_MAX_PINS; i++) {
+      if (segment->latest[i].pin == pin) {
+        *reading = segment->latest[i];
+        found = 1;
+        break;
+      }
+    }
+  } while (read_retry (reader, seq));
+
+  return found;
+}
+
+int
+air_shm_reader_latest_all (AirShmReader *reader, AirReading *readings,
+    int max)
+{
+  const AirShmSegment *segment = reader->segment;
+  unsigned int seq;
+  uint32_t n;
+
+  if (segment->closed)
+    return (-1);
+
+  do {
+    seq = read_begin (reader);
+    n = segment->n_pins;
+    n = n > AIR_SHM_MAX_PINS ? AIR_SHM_MAX_PINS : n;
+    n = n > max ? max : n;
+    memcpy (readings, segment->latest, n * sizeof (AirReading));
+  } while (read_retry (reader, seq));
+
+  return n;
+}
+
+int
+air_shm_reader_history (AirShmReader *reader, AirReading *readings, int max,
+    uint64_t *since)
+{
+  const AirShmSegment *segment = reader->segment;
+  uint32_t size = segment->history_size;
+  unsigned int seq;
+  uint64_t end;
+  uint64_t start;
+  uint64_t i;
+
+  if (segment->closed)
+    return (-1);
+
+  do {
+    seq = read_begin (reader);
+    end = segment->n_readings;
+    start = end > size ? end - size : 0;
+    if (since != NULL && *since > start)
+      start = *since > end ? end : *since;
+    if (end - start > max)
+      start = end - max;
+    for (i = start; i < end; i++)
+      readings[i - start] = segment->history[i % size];
+  } while (read_retry (reader, seq));
+
+  if (since != NULL)
+    *since = end;
+
+  return end - start;
+}
+
+static int64_t
+monotonic_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+air_shm_reader_wait (AirShmReader *reader, uint32_t *generation,
+    int timeout_ms)
+{
+  atomic_uint *word = (atomic_uint *) &reader->segment->generation;
+  struct timespec timeout;
+  int64_t deadline = 0;
+  int64_t left;
+  unsigned int current;
+
+  if (timeout_ms >= 0)
+    deadline = monotonic_ms () + timeout_ms;
+
+  while (1) {
+    current = atomic_load_explicit (word, memory_order_acquire);
+    if (reader->segment->closed)
+      return (-1);
+    if (current != *generation) {
+      *generation = current;
+      return (1);
+    }
+
+    if (timeout_ms >= 0) {
+      left = deadline - monotonic_ms ();
+      if (left <= 0)
+        return (0);
+      timeout.tv_sec = left / 1000;
+      timeout.tv_nsec = (left % 1000) * 1000000;
+    }
+
+    /* returns at once if a reading came in since the load above */
+    if (futex (word, FUTEX_WAIT, current, timeout_ms >= 0 ? &timeout : NULL)
+        == -1 && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+      fprintf (stderr, "Unable to wait for readings\n");
+      return (-1);
+    }
+  }
+}
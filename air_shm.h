@@ -0,0 +1,71 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __AIR_SHM_H__
+#define __AIR_SHM_H__
+
+#include "air_utils.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Live readings in a POSIX shared memory segment, for local consumers that
+ * want the current value without a database or a socket. The publisher
+ * keeps the latest reading of every pin and a ring of recent readings
+ * behind a seqlock: readers copy what they need and retry if a reading was
+ * published meanwhile, so they take no locks, make no syscalls and never
+ * hold up the publisher. Readers map the segment read only.
+ *
+ * A futex word is bumped for every published reading, readers can sleep on
+ * it with air_shm_reader_wait () instead of polling. When the publisher
+ * goes away the segment is marked closed and unlinked, readers see -1 and
+ * reopen it to follow the next publisher. */
+#define AIR_SHM_DEFAULT_NAME "/grove_dustd"
+#define AIR_SHM_MAX_PINS     64
+
+typedef struct _AirShm AirShm;
+typedef struct _AirShmReader AirShmReader;
+
+/* name is a shm_open () name, history the readings kept in the ring */
+AirShm* air_shm_create (const char *name, unsigned int history);
+void air_shm_publish (AirShm *shm, const AirReading *reading);
+void air_shm_free (AirShm *shm);
+
+AirShmReader* air_shm_reader_open (const char *name);
+void air_shm_reader_close (AirShmReader *reader);
+
+/* 1 and the latest reading of pin, 0 when the pin has published nothing
+ * yet, -1 once the segment is closed */
+int air_shm_reader_latest (AirShmReader *reader, int pin,
+    AirReading *reading);
+/* the latest reading of every pin, returns how many or -1 */
+int air_shm_reader_latest_all (AirShmReader *reader, AirReading *readings,
+    int max);
+/* up to max of the most recent readings of all pins, oldest first. Returns
+ * how many or -1. With since set only readings published after the
+ * sequence number in *since are returned and *since is advanced, readings
+ * that dropped out of the ring in between are lost. */
+int air_shm_reader_history (AirShmReader *reader, AirReading *readings,
+    int max, uint64_t *since);
+
+/* sleeps until a reading is published after *generation was taken, then
+ * updates it. Start with 0 to return at once. Returns 1, 0 on timeout
+ * (timeout_ms -1 waits forever) and -1 once the segment is closed. */
+int air_shm_reader_wait (AirShmReader *reader, uint32_t *generation,
+    int timeout_ms);
+
+#endif //__AIR_SHM_H__
@@ -0,0 +1,393 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "air_spool.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#define SPOOL_MAGIC "GDSPOOL1"
+#define SPOOL_VERSION 1
+#define SPOOL_HEADER_SIZE 4096
+#define SPOOL_GROW_RECORDS 2048
+
+typedef struct _AirSpoolHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t head;
+  uint32_t head_seq;
+  uint32_t crc;
+} AirSpoolHeader;
+
+typedef struct _AirSpoolRecord
+{
+  int64_t timestamp_ms;
+  float concentration_pcs;
+  float concentration_ugm3;
+  int32_t aqi;
+  int32_t pin;
+  uint32_t seq;
+  uint32_t crc;
+} AirSpoolRecord;
+
+struct _AirSpool
+{
+  pthread_mutex_t lock;
+  int fd;
+  char *map;
+  size_t map_size;
+  uint64_t capacity;
+  /* records [head, tail) are unacknowledged, seq of head is head_seq */
+  uint64_t head;
+  uint64_t tail;
+  uint32_t head_seq;
+  /* first record not yet flushed to disk */
+  uint64_t synced;
+  int fsync_records;
+  int fsync_interval_ms;
+  struct timespec last_sync;
+};
+
+static AirSpoolHeader*
+spool_header (AirSpool *spool)
+{
+  return (AirSpoolHeader *) spool->map;
+}
+
+static AirSpoolRecord*
+spool_record (AirSpool *spool, uint64_t index)
+{
+  return (AirSpoolRecord *) (spool->map + SPOOL_HEADER_SIZE) + index;
+}
+
+static int
+spool_record_valid (AirSpool *spool, uint64_t index, uint32_t seq)
+{
+  AirSpoolRecord *record = spool_record (spool, index);
+
+  return record->seq == seq &&
+      record->crc == air_crc32 (record, offsetof (AirSpoolRecord, crc));
+}
+
+static int
+spool_map (AirSpool *spool, uint64_t capacity)
+{
+  size_t size = SPOOL_HEADER_SIZE + capacity * sizeof (AirSpoolRecord);
+
+  if (ftruncate (spool->fd, size) == -1)
+    return (-1);
+
+  if (spool->map != NULL)
+    munmap (spool->map, spool->map_size);
+
+  spool->map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+      spool->fd, 0);
+  if (spool->map == MAP_FAILED) {
+    spool->map = NULL;
+    return (-1);
+  }
+
+  spool->map_size = size;
+  spool->capacity = capacity;
+
+  return (0);
+}
+
+/* flush the byte range [start, end) of the mapping */
+static int
+spool_msync (AirSpool *spool, size_t start, size_t end)
+{
+  long page = sysconf (_SC_PAGESIZE);
+
+  start -= start % page;
+
+  return msync (spool->map + start, end - start, MS_SYNC);
+}
+
+static int
+spool_write_header (AirSpool *spool)
+{
+  AirSpoolHeader *header = spool_header (spool);
+
+  header->head = spool->head;
+  header->head_seq = spool->head_seq;
+  header->crc = air_crc32 (header, offsetof (AirSpoolHeader, crc));
+
+  return spool_msync (spool, 0, sizeof (AirSpoolHeader));
+}
+
+static int
+spool_flush (AirSpool *spool)
+{
+  size_t start;
+  size_t end;
+
+  if (spool->synced < spool->tail) {
+    start = (char *) spool_record (spool, spool->synced) - spool->map;
+    end = (char *) spool_record (spool, spool->tail) - spool->map;
+    if (spool_msync (spool, start, end) == -1)
+      return (-1);
+    spool->synced = spool->tail;
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &spool->last_sync);
+
+  return (0);
+}
+
+static void
+spool_recover (AirSpool *spool)
+{
+  AirSpoolHeader *header = spool_header (spool);
+  uint64_t index;
+
+  if (header->crc == air_crc32 (header, offsetof (AirSpoolHeader, crc)) &&
+      header->head <= spool->capacity) {
+    spool->head = header->head;
+    spool->head_seq = header->head_seq;
+  } else {
+    /* torn header, start over from the first intact record, readings may be
+     * delivered twice but none are lost */
+    fprintf (stderr, "Spool header damaged, rescanning\n");
+    spool->head = 0;
+    spool->head_seq = spool_record (spool, 0)->seq;
+  }
+
+  index = spool->head;
+  while (index < spool->capacity &&
+      spool_record_valid (spool, index,
+          spool->head_seq + (uint32_t) (index - spool->head)))
+    index++;
+
+  spool->tail = index;
+  spool->synced = index;
+}
+
+AirSpool*
+air_spool_open (const char *path, int fsync_records, int fsync_interval_ms)
+{
+  AirSpool *spool;
+  AirSpoolHeader *header;
+  struct stat st;
+  uint64_t capacity;
+
+  spool = calloc (1, sizeof (AirSpool));
+  spool->fsync_records = fsync_records < 1 ? 1 : fsync_records;
+  spool->fsync_interval_ms = fsync_interval_ms;
+
+  spool->fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (spool->fd == -1 || fstat (spool->fd, &st) == -1) {
+    fprintf (stderr, "Unable to open spool %s\n", path);
+    goto error;
+  }
+
+  if (st.st_size < SPOOL_HEADER_SIZE) {
+    if (spool_map (spool, SPOOL_GROW_RECORDS) == -1)
+      goto map_error;
+
+    header = spool_header (spool);
+    memcpy (header->magic, SPOOL_MAGIC, sizeof (header->magic));
+    header->version = SPOOL_VERSION;
+    header->record_size = sizeof (AirSpoolRecord);
+    spool_write_header (spool);
+  } else {
+    capacity = (st.st_size - SPOOL_HEADER_SIZE) / sizeof (AirSpoolRecord);
+    if (spool_map (spool, capacity) == -1)
+      goto map_error;
+
+    header = spool_header (spool);
+    if (memcmp (header->magic, SPOOL_MAGIC, sizeof (header->magic)) != 0 ||
+        header->record_size != sizeof (AirSpoolRecord)) {
+      fprintf (stderr, "%s is not a spool file\n", path);
+      goto error;
+    }
+    spool_recover (spool);
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &spool->last_sync);
+  pthread_mutex_init (&spool->lock, NULL);
+
+  return spool;
+
+map_error:
+  fprintf (stderr, "Unable to map spool %s\n", path);
+error:
+  if (spool->map != NULL)
+    munmap (spool->map, spool->map_size);
+  if (spool->fd != -1)
+    close (spool->fd);
+  free (spool);
+  return NULL;
+}
+
+int
+air_spool_append (AirSpool *spool, const AirReading *reading)
+{
+  AirSpoolRecord *record;
+  struct timespec now;
+  long elapsed_ms;
+  int ret = 0;
+
+  pthread_mutex_lock (&spool->lock);
+  if (spool->tail == spool->capacity &&
+      spool_map (spool, spool->capacity + SPOOL_GROW_RECORDS) == -1) {
+    pthread_mutex_unlock (&spool->lock);
+    fprintf (stderr, "Unable to grow spool\n");
+    return (-1);
+  }
+
+  record = spool_record (spool, spool->tail);
+  record->timestamp_ms = reading->timestamp_ms;
+  record->concentration_pcs = reading->concentration_pcs;
+  record->concentration_ugm3 = reading->concentration_ugm3;
+  record->aqi = reading->aqi;
+  record->pin = reading->pin;
+  record->seq = spool->head_seq + (uint32_t) (spool->tail - spool->head);
+  record->crc = air_crc32 (record, offsetof (AirSpoolRecord, crc));
+  spool->tail++;
+
+  /* group commit */
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  elapsed_ms = (now.tv_sec - spool->last_sync.tv_sec) * 1000 +
+      (now.tv_nsec - spool->last_sync.tv_nsec) / 1000000;
+  if (spool->tail - spool->synced >= (uint64_t) spool->fsync_records ||
+      elapsed_ms >= spool->fsync_interval_ms)
+    ret = spool_flush (spool);
+  pthread_mutex_unlock (&spool->lock);
+
+  return ret;
+}
+
+int
+air_spool_peek (AirSpool *spool, AirReading *readings, int max_readings)
+{
+  AirSpoolRecord *record;
+  int n = 0;
+
+  pthread_mutex_lock (&spool->lock);
+  while (n < max_readings && spool->head + n < spool->tail) {
+    record = spool_record (spool, spool->head + n);
+    readings[n].timestamp_ms = record->timestamp_ms;
+    readings[n].pin = record->pin;
+    readings[n].concentration_pcs = record->concentration_pcs;
+    readings[n].concentration_ugm3 = record->concentration_ugm3;
+    readings[n].aqi = record->aqi;
+    n++;
+  }
+  pthread_mutex_unlock (&spool->lock);
+
+  return n;
+}
+
+int
+air_spool_ack (AirSpool *spool, int n_readings)
+{
+  int ret;
+
+  pthread_mutex_lock (&spool->lock);
+  if (n_readings > spool->tail - spool->head)
+    n_readings = spool->tail - spool->head;
+
+  spool->head += n_readings;
+  spool->head_seq += n_readings;
+
+  if (spool->head == spool->tail) {
+    /* drained, give the space back, regrown regions read back as zeros */
+    spool_flush (spool);
+    spool->head = 0;
+    spool->tail = 0;
+    spool->synced = 0;
+    if (spool_map (spool, 0) == -1 ||
+        spool_map (spool, SPOOL_GROW_RECORDS) == -1) {
+      pthread_mutex_unlock (&spool->lock);
+      fprintf (stderr, "Unable to truncate spool\n");
+      return (-1);
+    }
+  }
+
+  ret = spool_write_header (spool);
+  pthread_mutex_unlock (&spool->lock);
+
+  return ret;
+}
+
+int
+air_spool_count (AirSpool *spool)
+{
+  int count;
+
+  pthread_mutex_lock (&spool->lock);
+  count = spool->tail - spool->head;
+  pthread_mutex_unlock (&spool->lock);
+
+  return count;
+}
+
+int
+air_spool_sync (AirSpool *spool)
+{
+  int ret;
+
+  pthread_mutex_lock (&spool->lock);
+  ret = spool_flush (spool);
+  pthread_mutex_unlock (&spool->lock);
+
+  return ret;
+}
+
+int
+air_spool_sync_deadline (AirSpool *spool, struct timespec *deadline)
+{
+  int pending;
+
+  pthread_mutex_lock (&spool->lock);
+  pending = spool->synced < spool->tail;
+  if (pending) {
+    *deadline = spool->last_sync;
+    deadline->tv_sec += spool->fsync_interval_ms / 1000;
+    deadline->tv_nsec += (spool->fsync_interval_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+      deadline->tv_sec++;
+      deadline->tv_nsec -= 1000000000L;
+    }
+  }
+  pthread_mutex_unlock (&spool->lock);
+
+  return pending;
+}
+
+void
+air_spool_close (AirSpool *spool)
+{
+  spool_flush (spool);
+  spool_write_header (spool);
+  munmap (spool->map, spool->map_size);
+  close (spool->fd);
+  pthread_mutex_destroy (&spool->lock);
+  free (spool);
+}
@@ -0,0 +1,47 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __AIR_SPOOL_H__
+#define __AIR_SPOOL_H__
+
+#include "air_utils.h"
+
+#include <time.h>
+
+/* Append-only, mmap backed file of fixed-size checksummed reading records.
+ * Readings are appended at the tail and consumed in order from the head,
+ * acknowledged records are dropped and the file is truncated once it has been
+ * drained. Records are flushed to disk in groups, every fsync_records
+ * appended records or fsync_interval_ms, whichever comes first. Appends only
+ * check the interval, a writer that may stop appending waits for
+ * air_spool_sync_deadline () and calls air_spool_sync (). After a crash the
+ * spool is recovered up to the last complete record. */
+typedef struct _AirSpool AirSpool;
+
+AirSpool* air_spool_open (const char *path, int fsync_records,
+    int fsync_interval_ms);
+int air_spool_append (AirSpool *spool, const AirReading *reading);
+int air_spool_peek (AirSpool *spool, AirReading *readings, int max_readings);
+int air_spool_ack (AirSpool *spool, int n_readings);
+int air_spool_count (AirSpool *spool);
+int air_spool_sync (AirSpool *spool);
+/* 1 and the CLOCK_MONOTONIC time the unsynced records are due on disk, 0 if
+ * everything is synced */
+int air_spool_sync_deadline (AirSpool *spool, struct timespec *deadline);
+void air_spool_close (AirSpool *spool);
+
+#endif //__AIR_SPOOL_H__
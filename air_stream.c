@@ -0,0 +1,818 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "air_stream.h"
+#include "air_metrics.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/* records queued between the publishers and the stream thread */
+#define STREAM_QUEUE 1024
+#define STREAM_MAX_NAME 64
+#define STREAM_MAX_EVENTS 32
+#define STREAM_MAX_SUBSCRIBERS 64
+#define STREAM_DEFAULT_BACKLOG (64 * 1024)
+#define STREAM_RECONNECT_MS 5000
+#define STREAM_GRAPHITE_PREFIX "grove_dust"
+
+typedef enum
+{
+  STREAM_READING,
+  STREAM_PULSES
+} StreamRecordType;
+
+typedef struct _StreamRecord
+{
+  StreamRecordType type;
+  char name[STREAM_MAX_NAME];
+  AirReading reading;           /* pin and timestamp of pulse records too */
+  float ratio;
+  uint64_t out_of_bounds;
+} StreamRecord;
+
+typedef struct _StreamBuffer
+{
+  char *data;
+  size_t len;
+  size_t size;
+} StreamBuffer;
+
+typedef struct _StreamSubscriber StreamSubscriber;
+
+struct _StreamSubscriber
+{
+  StreamSubscriber *next;
+  int fd;
+  /* what the socket did not take yet, out.data + sent on */
+  StreamBuffer out;
+  size_t sent;
+  uint32_t events;
+  int connecting;
+  /* closed at the end of the current epoll batch */
+  int dead;
+};
+
+struct _AirStream
+{
+  pthread_t thread;
+  int listen_fd;
+  int epoll_fd;
+  int wakeup_fd;
+  char unix_path[sizeof (((struct sockaddr_un *) 0)->sun_path)];
+  AirStreamFormat format;
+  size_t backlog;
+
+  /* the TCP target, fd is -1 while disconnected */
+  StreamSubscriber *target;
+  struct sockaddr_storage target_addr;
+  socklen_t target_len;
+  int64_t next_connect_ms;
+
+  /* queue of published records, shared with the publishers */
+  pthread_mutex_t lock;
+  StreamRecord *queue;
+  uint64_t n_published;
+  int stop;
+
+  /* owned by the stream thread */
+  uint64_t n_streamed;
+  StreamSubscriber *subscribers;
+  int n_subscribers;
+  StreamBuffer batch;
+};
+
+static void
+buffer_reserve (StreamBuffer *buf, size_t len)
+{
+  if (buf->len + len + 1 <= buf->size)
+    return;
+
+  while (buf->len + len + 1 > buf->size)
+    buf->size = buf->size ? buf->size * 2 : 1024;
+  buf->data = realloc (buf->data, buf->size);
+}
+
+static void
+buffer_append (StreamBuffer *buf, const char *data, size_t len)
+{
+  buffer_reserve (buf, len);
+  memcpy (buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+static void
+buffer_printf (StreamBuffer *buf, const char *format, ...)
+{
+  va_list args;
+  int len;
+
+  va_start (args, format);
+  len = vsnprintf (buf->data + buf->len, buf->size - buf->len, format, args);
+  va_end (args);
+
+  if (buf->len + len + 1 > buf->size) {
+    buffer_reserve (buf, len);
+    va_start (args, format);
+    vsnprintf (buf->data + buf->len, buf->size - buf->len, format, args);
+    va_end (args);
+  }
+  buf->len += len;
+}
+
+static int64_t
+monotonic_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t
+realtime_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t
+count_lines (const char *data, size_t len)
+{
+  const char *end = data + len;
+  uint64_t n = 0;
+
+  while ((data = memchr (data, '\n', end - data)) != NULL) {
+    data++;
+    n++;
+  }
+
+  return n;
+}
+
+/* influx tag values escape their separators, graphite paths have none */
+static void
+append_name (StreamBuffer *buf, AirStreamFormat format, const char *name)
+{
+  const char *c;
+
+  for (c = name; *c != '\0'; c++) {
+    if (format == AIR_STREAM_INFLUX) {
+      if (*c == ',' || *c == '=' || *c == ' ')
+        buffer_append (buf, "\\", 1);
+      buffer_append (buf, c, 1);
+    } else {
+      buffer_append (buf, *c == '.' || *c == ' ' || *c == '/' ? "_" : c, 1);
+    }
+  }
+}
+
+static void
+append_graphite (StreamBuffer *buf, const StreamRecord *record,
+    const char *metric, const char *value)
+{
+  buffer_printf (buf, STREAM_GRAPHITE_PREFIX ".");
+  append_name (buf, AIR_STREAM_GRAPHITE, record->name);
+  buffer_printf (buf, ".%d.%s %s %lld\n", record->reading.pin, metric, value,
+      (long long) (record->reading.timestamp_ms / 1000));
+}
+
+static void
+format_record (StreamBuffer *buf, AirStreamFormat format,
+    const StreamRecord *record)
+{
+  const AirReading *reading = &record->reading;
+  char value[32];
+
+  if (format == AIR_STREAM_INFLUX) {
+    buffer_printf (buf, record->type == STREAM_READING ?
+        "particles,sensor=" : "pulses,sensor=");
+    append_name (buf, format, record->name);
+    if (record->type == STREAM_READING)
+      buffer_printf (buf, ",pin=%d pcs=%f,ugm3=%f,aqi=%di %lld000000\n",
+          reading->pin, reading->concentration_pcs,
+          reading->concentration_ugm3, reading->aqi,
+          (long long) reading->timestamp_ms);
+    else
+      buffer_printf (buf, ",pin=%d ratio=%f,out_of_bounds=%llui "
+          "%lld000000\n", reading->pin, record->ratio,
+          (unsigned long long) record->out_of_bounds,
+          (long long) reading->timestamp_ms);
+    return;
+  }
+
+  if (record->type == STREAM_READING) {
+    snprintf (value, sizeof (value), "%f", reading->concentration_pcs);
+    append_graphite (buf, record, "pcs", value);
+    snprintf (value, sizeof (value), "%f", reading->concentration_ugm3);
+    append_graphite (buf, record, "ugm3", value);
+    snprintf (value, sizeof (value), "%d", reading->aqi);
+    append_graphite (buf, record, "aqi", value);
+  } else {
+    snprintf (value, sizeof (value), "%f", record->ratio);
+    append_graphite (buf, record, "ratio", value);
+    snprintf (value, sizeof (value), "%llu",
+        (unsigned long long) record->out_of_bounds);
+    append_graphite (buf, record, "out_of_bounds", value);
+  }
+}
+
+static void
+subscriber_watch (AirStream *stream, StreamSubscriber *sub, uint32_t events)
+{
+  struct epoll_event event = { 0 };
+
+  if (events == sub->events)
+    return;
+
+  event.events = events;
+  event.data.ptr = sub;
+  epoll_ctl (stream->epoll_fd, EPOLL_CTL_MOD, sub->fd, &event);
+  sub->events = events;
+}
+
+/* sends the backlog of sub followed by data with one call, whatever the
+ * socket does not take is queued. Returns -1 when the connection failed or
+ * the subscriber fell behind by more than the backlog. */
+static int
+subscriber_write (AirStream *stream, StreamSubscriber *sub, const char *data,
+    size_t len)
+{
+  struct msghdr msg = { 0 };
+  struct iovec iov[2];
+  size_t pending = sub->out.len - sub->sent;
+  ssize_t bytes = 0;
+
+  if (!sub->connecting && pending + len > 0) {
+    msg.msg_iov = iov;
+    if (pending > 0) {
+      iov[msg.msg_iovlen].iov_base = sub->out.data + sub->sent;
+      iov[msg.msg_iovlen++].iov_len = pending;
+    }
+    if (len > 0) {
+      iov[msg.msg_iovlen].iov_base = (void *) data;
+      iov[msg.msg_iovlen++].iov_len = len;
+    }
+
+    /* writev () with MSG_NOSIGNAL, a subscriber going away must not raise
+     * SIGPIPE */
+    do {
+      bytes = sendmsg (sub->fd, &msg, MSG_NOSIGNAL);
+    } while (bytes < 0 && errno == EINTR);
+    if (bytes < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return (-1);
+      bytes = 0;
+    }
+  }
+
+  if (bytes >= pending) {
+    sub->out.len = 0;
+    sub->sent = 0;
+    data += bytes - pending;
+    len -= bytes - pending;
+  } else {
+    sub->sent += bytes;
+  }
+
+  if (len > 0) {
+    if (sub->out.len - sub->sent + len > stream->backlog)
+      return (-1);
+    if (sub->sent > 0) {
+      memmove (sub->out.data, sub->out.data + sub->sent,
+          sub->out.len - sub->sent);
+      sub->out.len -= sub->sent;
+      sub->sent = 0;
+    }
+    buffer_append (&sub->out, data, len);
+  }
+
+  if (!sub->connecting)
+    subscriber_watch (stream, sub, sub->out.len > sub->sent ?
+        EPOLLIN | EPOLLOUT : EPOLLIN);
+
+  return (0);
+}
+
+static void
+subscriber_drop (AirStream *stream, StreamSubscriber *sub, const char *data,
+    size_t len)
+{
+  air_metrics_count (AIR_METRIC_STREAM_DROPS, count_lines (data, len) +
+      count_lines (sub->out.data + sub->sent, sub->out.len - sub->sent));
+  sub->out.len = 0;
+  sub->sent = 0;
+}
+
+static void
+target_disconnect (AirStream *stream)
+{
+  StreamSubscriber *target = stream->target;
+
+  epoll_ctl (stream->epoll_fd, EPOLL_CTL_DEL, target->fd, NULL);
+  close (target->fd);
+  target->fd = -1;
+  target->connecting = 0;
+  stream->next_connect_ms = monotonic_ms () + STREAM_RECONNECT_MS;
+}
+
+static void
+target_connect (AirStream *stream)
+{
+  StreamSubscriber *target = stream->target;
+  struct epoll_event event = { 0 };
+
+  target->fd = socket (stream->target_addr.ss_family, SOCK_STREAM |
+      SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (target->fd == -1) {
+    stream->next_connect_ms = monotonic_ms () + STREAM_RECONNECT_MS;
+    return;
+  }
+
+  target->connecting = 1;
+  if (connect (target->fd, (struct sockaddr *) &stream->target_addr,
+      stream->target_len) == 0)
+    target->connecting = 0;
+  else if (errno != EINPROGRESS) {
+    close (target->fd);
+    target->fd = -1;
+    target->connecting = 0;
+    stream->next_connect_ms = monotonic_ms () + STREAM_RECONNECT_MS;
+    return;
+  }
+
+  /* writable once connected */
+  target->events = EPOLLIN | EPOLLOUT;
+  event.events = target->events;
+  event.data.ptr = target;
+  epoll_ctl (stream->epoll_fd, EPOLL_CTL_ADD, target->fd, &event);
+}
+
+/* returns -1 when the target has to be reconnected */
+static int
+target_writable (AirStream *stream)
+{
+  StreamSubscriber *target = stream->target;
+  socklen_t len = sizeof (int);
+  int error = 0;
+
+  if (target->connecting) {
+    if (getsockopt (target->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 ||
+        error != 0)
+      return (-1);
+    target->connecting = 0;
+  }
+
+  return subscriber_write (stream, target, NULL, 0);
+}
+
+static void
+subscriber_close (AirStream *stream, StreamSubscriber *sub)
+{
+  sub->dead = 1;
+  epoll_ctl (stream->epoll_fd, EPOLL_CTL_DEL, sub->fd, NULL);
+}
+
+/* subscribers have nothing to say, drop what they send */
+static int
+subscriber_read (StreamSubscriber *sub)
+{
+  char buf[256];
+  ssize_t bytes;
+
+  while (1) {
+    bytes = recv (sub->fd, buf, sizeof (buf), 0);
+    if (bytes == 0)
+      return (-1);
+    if (bytes < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return (0);
+      return (-1);
+    }
+  }
+}
+
+static void
+stream_accept (AirStream *stream)
+{
+  struct epoll_event event = { 0 };
+  StreamSubscriber *sub;
+  int fd;
+
+  while ((fd = accept4 (stream->listen_fd, NULL, NULL,
+      SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    if (stream->n_subscribers == STREAM_MAX_SUBSCRIBERS) {
+      close (fd);
+      continue;
+    }
+
+    sub = calloc (1, sizeof (StreamSubscriber));
+    sub->fd = fd;
+    sub->events = EPOLLIN;
+
+    event.events = EPOLLIN;
+    event.data.ptr = sub;
+    if (epoll_ctl (stream->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      close (fd);
+      free (sub);
+      continue;
+    }
+
+    sub->next = stream->subscribers;
+    stream->subscribers = sub;
+    stream->n_subscribers++;
+  }
+}
+
+/* formats the records published since the last call into one batch and
+ * hands it to every subscriber */
+static void
+stream_flush (AirStream *stream)
+{
+  StreamBuffer *batch = &stream->batch;
+  StreamSubscriber *target = stream->target;
+  StreamSubscriber *sub;
+  StreamRecord record;
+  uint64_t n_published;
+
+  batch->len = 0;
+  while (1) {
+    pthread_mutex_lock (&stream->lock);
+    n_published = stream->n_published;
+    /* records overwritten in the meantime are lost to everyone */
+    if (n_published - stream->n_streamed > STREAM_QUEUE) {
+      air_metrics_count (AIR_METRIC_STREAM_DROPS,
+          n_published - stream->n_streamed - STREAM_QUEUE);
+      stream->n_streamed = n_published - STREAM_QUEUE;
+    }
+    if (stream->n_streamed < n_published)
+      record = stream->queue[stream->n_streamed % STREAM_QUEUE];
+    pthread_mutex_unlock (&stream->lock);
+
+    if (stream->n_streamed == n_published)
+      break;
+    stream->n_streamed++;
+
+    format_record (batch, stream->format, &record);
+  }
+
+  if (batch->len == 0)
+    return;
+
+  if (target != NULL) {
+    if (target->fd == -1) {
+      subscriber_drop (stream, target, batch->data, batch->len);
+    } else if (subscriber_write (stream, target, batch->data, batch->len) ==
+        -1) {
+      subscriber_drop (stream, target, batch->data, batch->len);
+      target_disconnect (stream);
+    }
+  }
+
+  for (sub = stream->subscribers; sub != NULL; sub = sub->next) {
+    if (sub->dead)
+      continue;
+    if (subscriber_write (stream, sub, batch->data, batch->len) == -1) {
+      subscriber_drop (stream, sub, batch->data, batch->len);
+      subscriber_close (stream, sub);
+    }
+  }
+}
+
+static void
+stream_reap (AirStream *stream)
+{
+  StreamSubscriber **link = &stream->subscribers;
+  StreamSubscriber *sub;
+
+  while (*link != NULL) {
+    sub = *link;
+    if (sub->dead) {
+      *link = sub->next;
+      close (sub->fd);
+      free (sub->out.data);
+      free (sub);
+      stream->n_subscribers--;
+    } else {
+      link = &sub->next;
+    }
+  }
+}
+
+static void
+stream_event (AirStream *stream, StreamSubscriber *sub, uint32_t events)
+{
+  if (sub == stream->target) {
+    if ((events & (EPOLLERR | EPOLLHUP)) ||
+        ((events & EPOLLOUT) && target_writable (stream) == -1) ||
+        ((events & EPOLLIN) && subscriber_read (sub) == -1)) {
+      subscriber_drop (stream, sub, NULL, 0);
+      target_disconnect (stream);
+    }
+    return;
+  }
+
+  if (sub->dead)
+    return;
+  if ((events & (EPOLLERR | EPOLLHUP)) ||
+      ((events & EPOLLOUT) && subscriber_write (stream, sub, NULL, 0) == -1) ||
+      ((events & EPOLLIN) && subscriber_read (sub) == -1)) {
+    subscriber_drop (stream, sub, NULL, 0);
+    subscriber_close (stream, sub);
+  }
+}
+
+static void*
+stream_thread (void *data)
+{
+  AirStream *stream = (AirStream *)data;
+  struct epoll_event events[STREAM_MAX_EVENTS];
+  uint64_t value;
+  int64_t now;
+  int timeout;
+  int stop;
+  int n;
+  int i;
+
+  while (1) {
+    timeout = -1;
+    if (stream->target != NULL && stream->target->fd == -1) {
+      now = monotonic_ms ();
+      if (now >= stream->next_connect_ms)
+        target_connect (stream);
+      if (stream->target->fd == -1)
+        timeout = stream->next_connect_ms - now;
+    }
+
+    n = epoll_wait (stream->epoll_fd, events, STREAM_MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf (stderr, "Error on epoll_wait!\n");
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == &stream->listen_fd) {
+        stream_accept (stream);
+      } else if (events[i].data.ptr == &stream->wakeup_fd) {
+        if (read (stream->wakeup_fd, &value, sizeof (value)) < 0 &&
+            errno != EAGAIN)
+          fprintf (stderr, "Unable to read eventfd\n");
+
+        pthread_mutex_lock (&stream->lock);
+        stop = stream->stop;
+        pthread_mutex_unlock (&stream->lock);
+        if (stop)
+          return NULL;
+
+        stream_flush (stream);
+      } else {
+        stream_event (stream, events[i].data.ptr, events[i].events);
+      }
+    }
+
+    stream_reap (stream);
+  }
+
+  return NULL;
+}
+
+static int
+stream_listen (AirStream *stream, const char *path)
+{
+  struct sockaddr_un addr = { 0 };
+
+  if (strlen (path) >= sizeof (addr.sun_path)) {
+    fprintf (stderr, "Socket path %s is too long\n", path);
+    return (-1);
+  }
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+
+  stream->listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+      SOCK_CLOEXEC, 0);
+  if (stream->listen_fd == -1) {
+    fprintf (stderr, "Unable to create socket\n");
+    return (-1);
+  }
+
+  /* a socket left behind by a previous run */
+  unlink (path);
+  if (bind (stream->listen_fd, (struct sockaddr *) &addr, sizeof (addr)) ==
+      -1 || listen (stream->listen_fd, 16) == -1) {
+    fprintf (stderr, "Unable to listen on %s\n", path);
+    return (-1);
+  }
+  strcpy (stream->unix_path, path);
+
+  return (0);
+}
+
+static int
+stream_resolve (AirStream *stream, const char *target)
+{
+  struct addrinfo hints = { 0 };
+  struct addrinfo *result;
+  char host[256];
+  const char *port;
+
+  port = strrchr (target, ':');
+  if (port == NULL || port - target >= sizeof (host)) {
+    fprintf (stderr, "Invalid stream target %s, need host:port\n", target);
+    return (-1);
+  }
+  memcpy (host, target, port - target);
+  host[port - target] = '\0';
+  port++;
+
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo (host, port, &hints, &result) != 0) {
+    fprintf (stderr, "Unable to resolve stream target %s\n", target);
+    return (-1);
+  }
+  memcpy (&stream->target_addr, result->ai_addr, result->ai_addrlen);
+  stream->target_len = result->ai_addrlen;
+  freeaddrinfo (result);
+
+  stream->target = calloc (1, sizeof (StreamSubscriber));
+  stream->target->fd = -1;
+
+  return (0);
+}
+
+static void
+stream_free (AirStream *stream)
+{
+  StreamSubscriber *target = stream->target;
+
+  if (target != NULL) {
+    if (target->fd != -1)
+      close (target->fd);
+    free (target->out.data);
+    free (target);
+  }
+  if (stream->wakeup_fd != -1)
+    close (stream->wakeup_fd);
+  if (stream->epoll_fd != -1)
+    close (stream->epoll_fd);
+  if (stream->listen_fd != -1)
+    close (stream->listen_fd);
+  if (stream->unix_path[0] != '\0')
+    unlink (stream->unix_path);
+  pthread_mutex_destroy (&stream->lock);
+  free (stream->batch.data);
+  free (stream->queue);
+  free (stream);
+}
+
+AirStream*
+air_stream_create (const AirStreamConfig *config)
+{
+  struct epoll_event event = { 0 };
+  AirStream *stream;
+
+  stream = calloc (1, sizeof (AirStream));
+  stream->format = config->format;
+  stream->backlog = config->backlog > 0 ? config->backlog :
+      STREAM_DEFAULT_BACKLOG;
+  stream->queue = malloc (STREAM_QUEUE * sizeof (StreamRecord));
+  pthread_mutex_init (&stream->lock, NULL);
+  stream->listen_fd = -1;
+  stream->epoll_fd = -1;
+  stream->wakeup_fd = -1;
+
+  if (config->unix_path != NULL &&
+      stream_listen (stream, config->unix_path) == -1)
+    goto fail;
+
+  if (config->tcp_target != NULL &&
+      stream_resolve (stream, config->tcp_target) == -1)
+    goto fail;
+
+  stream->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  stream->wakeup_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (stream->epoll_fd == -1 || stream->wakeup_fd == -1) {
+    fprintf (stderr, "Unable to create epoll instance\n");
+    goto fail;
+  }
+
+  event.events = EPOLLIN;
+  event.data.ptr = &stream->wakeup_fd;
+  epoll_ctl (stream->epoll_fd, EPOLL_CTL_ADD, stream->wakeup_fd, &event);
+  if (stream->listen_fd != -1) {
+    event.data.ptr = &stream->listen_fd;
+    epoll_ctl (stream->epoll_fd, EPOLL_CTL_ADD, stream->listen_fd, &event);
+  }
+
+  if (pthread_create (&stream->thread, NULL, stream_thread, stream)) {
+    fprintf (stderr, "Unable to create stream thread\n");
+    goto fail;
+  }
+
+  return stream;
+
+fail:
+  stream_free (stream);
+
+  return NULL;
+}
+
+static void
+stream_queue (AirStream *stream, StreamRecordType type, const char *name,
+    const AirReading *reading, float ratio, uint64_t out_of_bounds)
+{
+  StreamRecord *record;
+  uint64_t one = 1;
+
+  pthread_mutex_lock (&stream->lock);
+  record = &stream->queue[stream->n_published % STREAM_QUEUE];
+  record->type = type;
+  snprintf (record->name, sizeof (record->name), "%s", name);
+  record->reading = *reading;
+  record->ratio = ratio;
+  record->out_of_bounds = out_of_bounds;
+  stream->n_published++;
+  pthread_mutex_unlock (&stream->lock);
+
+  if (write (stream->wakeup_fd, &one, sizeof (one)) == -1)
+    fprintf (stderr, "Unable to wake up stream thread\n");
+}
+
+void
+air_stream_publish (AirStream *stream, const char *name,
+    const AirReading *reading)
+{
+  stream_queue (stream, STREAM_READING, name, reading, 0, 0);
+}
+
+void
+air_stream_publish_pulses (AirStream *stream, const char *name, int pin,
+    float ratio, uint64_t out_of_bounds)
+{
+  AirReading reading = { 0 };
+
+  reading.timestamp_ms = realtime_ms ();
+  reading.pin = pin;
+  stream_queue (stream, STREAM_PULSES, name, &reading, ratio, out_of_bounds);
+}
+
+void
+air_stream_stop (AirStream *stream)
+{
+  uint64_t one = 1;
+
+  pthread_mutex_lock (&stream->lock);
+  stream->stop = 1;
+  pthread_mutex_unlock (&stream->lock);
+
+  if (write (stream->wakeup_fd, &one, sizeof (one)) == -1)
+    fprintf (stderr, "Unable to wake up stream thread\n");
+  pthread_join (stream->thread, NULL);
+
+  /* what was published before the stop still goes out, as far as the
+   * sockets take it without blocking */
+  stream_flush (stream);
+
+  while (stream->subscribers != NULL) {
+    stream->subscribers->dead = 1;
+    stream_reap (stream);
+  }
+
+  stream_free (stream);
+}
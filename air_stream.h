@@ -0,0 +1,68 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __AIR_STREAM_H__
+#define __AIR_STREAM_H__
+
+#include "air_utils.h"
+
+#include <stdint.h>
+
+/* Streaming output of readings as text lines, to any number of subscribers
+ * connected to a Unix domain socket and to one TCP target such as an
+ * InfluxDB or Graphite line protocol listener. Publishing only queues the
+ * reading and wakes the stream thread, which formats a batch of lines and
+ * hands it to every subscriber with one writev (). Each subscriber has a
+ * bounded backlog, a subscriber that falls behind by more is disconnected
+ * and the TCP target reconnected, the capture path is never held up.
+ *
+ * Lines, in the influx format (timestamps in ns):
+ *
+ *   particles,sensor=<name>,pin=<pin> pcs=..,ugm3=..,aqi=..i <timestamp>
+ *   pulses,sensor=<name>,pin=<pin> ratio=..,out_of_bounds=..i <timestamp>
+ *
+ * and in the graphite format (timestamps in s), one line per value:
+ *
+ *   grove_dust.<name>.<pin>.ugm3 <value> <timestamp>
+ */
+typedef enum AirStreamFormat
+{
+  AIR_STREAM_INFLUX,
+  AIR_STREAM_GRAPHITE,
+} AirStreamFormat;
+
+typedef struct _AirStream AirStream;
+
+typedef struct _AirStreamConfig
+{
+  const char *unix_path;        /* NULL for no Unix domain socket */
+  const char *tcp_target;       /* host:port, NULL for none */
+  AirStreamFormat format;
+  int backlog;                  /* bytes queued per subscriber, 0 default */
+} AirStreamConfig;
+
+AirStream* air_stream_create (const AirStreamConfig *config);
+/* called for every new reading, from any thread */
+void air_stream_publish (AirStream *stream, const char *name,
+    const AirReading *reading);
+/* the low pulse occupancy of a reading and the sensor's out of bounds
+ * pulses so far */
+void air_stream_publish_pulses (AirStream *stream, const char *name,
+    int pin, float ratio, uint64_t out_of_bounds);
+void air_stream_stop (AirStream *stream);
+
+#endif //__AIR_STREAM_H__
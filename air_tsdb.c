@@ -0,0 +1,1007 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "air_tsdb.h"
+#include "air_metrics.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define CHUNK_MAGIC 0x32544447 /* GDT2, the CRC covers the header */
+/* chunks written before, the CRC covers the columns only */
+#define CHUNK_MAGIC_V1 0x53544447 /* GDTS */
+#define CHUNK_POINTS 1024
+/* the head chunk is sealed once its first point is this old, which bounds
+ * what a crash loses */
+#define CHUNK_MAX_AGE_MS (5 * 60 * 1000)
+#define MS_PER_DAY 86400000LL
+#define PATH_MAX_LEN 512
+
+/* chunks start 8 byte aligned in the file so headers can be used in place */
+#define CHUNK_ALIGN(size) (((size) + 7) & ~(size_t) 7)
+
+enum
+{
+  COLUMN_TIMESTAMP,
+  COLUMN_PIN,
+  COLUMN_PCS,
+  COLUMN_UGM3,
+  COLUMN_AQI,
+  N_COLUMNS
+};
+
+/* chunk header as stored on disk, followed by the columns */
+typedef struct _ChunkHeader
+{
+  uint32_t magic;
+  uint32_t n_points;
+  int64_t t_min;
+  int64_t t_max;
+  double pcs_sum;
+  double ugm3_sum;
+  float ugm3_min;
+  float ugm3_max;
+  int32_t pin_min;
+  int32_t pin_max;
+  int32_t aqi_max;
+  uint32_t column_size[N_COLUMNS];
+  uint32_t crc;
+} ChunkHeader;
+
+typedef struct _BitWriter
+{
+  uint8_t *data;
+  size_t bits;
+  size_t alloc;
+} BitWriter;
+
+typedef struct _BitReader
+{
+  const uint8_t *data;
+  size_t pos;
+  size_t end;
+} BitReader;
+
+/* state of the XOR float encoding, the window of meaningful bits of the
+ * previous value */
+typedef struct _XorState
+{
+  uint32_t prev;
+  int lead;
+  int trail;
+  int valid;
+} XorState;
+
+typedef struct _ChunkPoints
+{
+  int n;
+  int64_t timestamp[CHUNK_POINTS];
+  int32_t pin[CHUNK_POINTS];
+  float pcs[CHUNK_POINTS];
+  float ugm3[CHUNK_POINTS];
+  int32_t aqi[CHUNK_POINTS];
+} ChunkPoints;
+
+typedef int (*ChunkFunc) (const ChunkHeader *, const uint8_t * const *,
+    void *);
+
+struct _AirTSDB
+{
+  pthread_mutex_t lock;
+  char *dir;
+
+  /* held for reading while partitions are mapped and for writing while a
+   * torn chunk is cut off one, readers would get SIGBUS past the new end */
+  pthread_rwlock_t files_lock;
+  /* the partition whose tail has been checked for a torn chunk */
+  int64_t checked_day;
+
+  /* the chunk being filled */
+  int64_t head_day;
+  ChunkHeader head;
+  BitWriter columns[N_COLUMNS];
+  int64_t prev_timestamp;
+  int64_t prev_delta;
+  int32_t prev_pin;
+  int32_t prev_aqi;
+  XorState pcs;
+  XorState ugm3;
+};
+
+static void
+put_bits (BitWriter *bw, uint64_t value, int n)
+{
+  size_t byte;
+  int free_bits;
+  int take;
+
+  if (bw->bits + n > bw->alloc * 8) {
+    bw->alloc = bw->alloc ? bw->alloc * 2 : 256;
+    bw->data = realloc (bw->data, bw->alloc);
+  }
+
+  while (n > 0) {
+    byte = bw->bits / 8;
+    free_bits = 8 - bw->bits % 8;
+    if (free_bits == 8)
+      bw->data[byte] = 0;
+    take = n < free_bits ? n : free_bits;
+    bw->data[byte] |= ((value >> (n - take)) & ((1u << take) - 1)) <<
+        (free_bits - take);
+    bw->bits += take;
+    n -= take;
+  }
+}
+
+static uint64_t
+get_bits (BitReader *br, int n)
+{
+  uint64_t value = 0;
+  int avail;
+  int take;
+
+  if (br->pos + n > br->end) {
+    br->pos = br->end + 1;
+    return 0;
+  }
+
+  while (n > 0) {
+    avail = 8 - br->pos % 8;
+    take = n < avail ? n : avail;
+    value = (value << take) |
+        ((br->data[br->pos / 8] >> (avail - take)) & ((1u << take) - 1));
+    br->pos += take;
+    n -= take;
+  }
+
+  return value;
+}
+
+/* small values in few bits: 0, 10+7, 110+9, 1110+12 or 1111+64 bits */
+static void
+put_varint (BitWriter *bw, int64_t value)
+{
+  uint64_t zz = ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+
+  if (zz == 0) {
+    put_bits (bw, 0, 1);
+  } else if (zz < (1 << 7)) {
+    put_bits (bw, 0x2, 2);
+    put_bits (bw, zz, 7);
+  } else if (zz < (1 << 9)) {
+    put_bits (bw, 0x6, 3);
+    put_bits (bw, zz, 9);
+  } else if (zz < (1 << 12)) {
+    put_bits (bw, 0xe, 4);
+    put_bits (bw, zz, 12);
+  } else {
+    put_bits (bw, 0xf, 4);
+    put_bits (bw, zz, 64);
+  }
+}
+
+static int64_t
+get_varint (BitReader *br)
+{
+  uint64_t zz;
+  int prefix = 0;
+
+  while (prefix < 4 && get_bits (br, 1))
+    prefix++;
+
+  switch (prefix) {
+    case 0:
+      zz = 0;
+      break;
+    case 1:
+      zz = get_bits (br, 7);
+      break;
+    case 2:
+      zz = get_bits (br, 9);
+      break;
+    case 3:
+      zz = get_bits (br, 12);
+      break;
+    default:
+      zz = get_bits (br, 64);
+      break;
+  }
+
+  return (int64_t) (zz >> 1) ^ -(int64_t) (zz & 1);
+}
+
+static uint32_t
+float_bits (float value)
+{
+  uint32_t bits;
+
+  memcpy (&bits, &value, sizeof (bits));
+
+  return bits;
+}
+
+static float
+bits_float (uint32_t bits)
+{
+  float value;
+
+  memcpy (&value, &bits, sizeof (value));
+
+  return value;
+}
+
+/* 0 for the same value, 10 + bits inside the previous window, or
+ * 11 + 5 bits leading zeros + 5 bits length - 1 + bits */
+static void
+put_float (BitWriter *bw, XorState *state, float value)
+{
+  uint32_t bits = float_bits (value);
+  uint32_t x = bits ^ state->prev;
+  int lead;
+  int trail;
+
+  state->prev = bits;
+
+  if (x == 0) {
+    put_bits (bw, 0, 1);
+    return;
+  }
+
+  lead = __builtin_clz (x);
+  trail = __builtin_ctz (x);
+
+  if (state->valid && lead >= state->lead && trail >= state->trail) {
+    put_bits (bw, 0x2, 2);
+    put_bits (bw, x >> state->trail, 32 - state->lead - state->trail);
+    return;
+  }
+
+  put_bits (bw, 0x3, 2);
+  put_bits (bw, lead, 5);
+  put_bits (bw, 32 - lead - trail - 1, 5);
+  put_bits (bw, x >> trail, 32 - lead - trail);
+
+  state->lead = lead;
+  state->trail = trail;
+  state->valid = 1;
+}
+
+static float
+get_float (BitReader *br, XorState *state)
+{
+  int len;
+
+  if (get_bits (br, 1)) {
+    if (get_bits (br, 1)) {
+      state->lead = get_bits (br, 5);
+      len = get_bits (br, 5) + 1;
+      state->trail = 32 - state->lead - len;
+    }
+    state->prev ^= (uint32_t) get_bits (br,
+        32 - state->lead - state->trail) << state->trail;
+  }
+
+  return bits_float (state->prev);
+}
+
+static int
+decode_chunk (const ChunkHeader *header, const uint8_t * const *columns,
+    ChunkPoints *points)
+{
+  BitReader br[N_COLUMNS];
+  XorState pcs = { 0 };
+  XorState ugm3 = { 0 };
+  int64_t timestamp = 0;
+  int64_t delta = 0;
+  int32_t pin = 0;
+  int32_t aqi = 0;
+  uint32_t i;
+  int c;
+
+  if (header->n_points > CHUNK_POINTS)
+    return (-1);
+
+  for (c = 0; c < N_COLUMNS; c++) {
+    br[c].data = columns[c];
+    br[c].pos = 0;
+    br[c].end = header->column_size[c] * 8;
+  }
+
+  for (i = 0; i < header->n_points; i++) {
+    delta += get_varint (&br[COLUMN_TIMESTAMP]);
+    timestamp += delta;
+    if (i == 0)
+      delta = 0;
+    pin += get_varint (&br[COLUMN_PIN]);
+    aqi += get_varint (&br[COLUMN_AQI]);
+
+    points->timestamp[i] = timestamp;
+    points->pin[i] = pin;
+    points->pcs[i] = get_float (&br[COLUMN_PCS], &pcs);
+    points->ugm3[i] = get_float (&br[COLUMN_UGM3], &ugm3);
+    points->aqi[i] = aqi;
+  }
+
+  for (c = 0; c < N_COLUMNS; c++) {
+    if (br[c].pos > br[c].end)
+      return (-1);
+  }
+
+  points->n = header->n_points;
+
+  return (0);
+}
+
+static int64_t
+day_of (int64_t timestamp_ms)
+{
+  if (timestamp_ms < 0)
+    return (timestamp_ms + 1) / MS_PER_DAY - 1;
+
+  return timestamp_ms / MS_PER_DAY;
+}
+
+static void
+partition_path (AirTSDB *db, int64_t day, char *path)
+{
+  time_t t = day * 86400;
+  struct tm tm;
+
+  gmtime_r (&t, &tm);
+  snprintf (path, PATH_MAX_LEN, "%s/%04d%02d%02d.tsc", db->dir,
+      tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+}
+
+static int
+compare_days (const void *a, const void *b)
+{
+  int64_t da = *(const int64_t *) a;
+  int64_t db = *(const int64_t *) b;
+
+  return da < db ? -1 : da > db;
+}
+
+/* days in [from_day, to_day] for which a partition exists, sorted */
+static int
+list_partitions (AirTSDB *db, int64_t from_day, int64_t to_day,
+    int64_t **days)
+{
+  DIR *dir;
+  struct dirent *entry;
+  struct tm tm;
+  int year, month, mday;
+  int64_t day;
+  int n = 0;
+  int alloc = 0;
+
+  *days = NULL;
+
+  dir = opendir (db->dir);
+  if (dir == NULL)
+    return (-1);
+
+  while ((entry = readdir (dir)) != NULL) {
+    if (strlen (entry->d_name) != 12 ||
+        strcmp (entry->d_name + 8, ".tsc") != 0 ||
+        sscanf (entry->d_name, "%4d%2d%2d", &year, &month, &mday) != 3)
+      continue;
+
+    tm = (struct tm) { 0 };
+    tm.tm_year = year - 1900;
+    tm.tm_mon = month - 1;
+    tm.tm_mday = mday;
+    day = timegm (&tm) / 86400;
+    if (day < from_day || day > to_day)
+      continue;
+
+    if (n == alloc) {
+      alloc = alloc ? alloc * 2 : 64;
+      *days = realloc (*days, alloc * sizeof (int64_t));
+    }
+    (*days)[n++] = day;
+  }
+  closedir (dir);
+
+  qsort (*days, n, sizeof (int64_t), compare_days);
+
+  return n;
+}
+
+/* queries aggregate from the header alone, so it is covered up to the crc */
+static uint32_t
+chunk_crc (const ChunkHeader *header, int with_header, const uint8_t *payload,
+    size_t payload_size)
+{
+  uint32_t crc = 0;
+
+  if (with_header)
+    crc = air_crc32 (header, offsetof (ChunkHeader, crc));
+
+  return air_crc32_update (crc, payload, payload_size);
+}
+
+/* the size of the chunk at offset with its column pointers, 0 if there is
+ * no complete chunk there */
+static size_t
+chunk_at (const uint8_t *map, size_t size, size_t offset,
+    const uint8_t **columns)
+{
+  const ChunkHeader *header;
+  const uint8_t *payload;
+  size_t payload_size = 0;
+  int c;
+
+  if (offset + sizeof (ChunkHeader) > size)
+    return 0;
+
+  header = (const ChunkHeader *) (map + offset);
+  if (header->magic != CHUNK_MAGIC && header->magic != CHUNK_MAGIC_V1)
+    return 0;
+
+  payload = map + offset + sizeof (ChunkHeader);
+  for (c = 0; c < N_COLUMNS; c++) {
+    columns[c] = payload + payload_size;
+    payload_size += header->column_size[c];
+  }
+
+  /* a torn chunk at the end of the file after a crash */
+  if (offset + sizeof (ChunkHeader) + payload_size > size ||
+      chunk_crc (header, header->magic == CHUNK_MAGIC, payload,
+      payload_size) != header->crc)
+    return 0;
+
+  return sizeof (ChunkHeader) + CHUNK_ALIGN (payload_size);
+}
+
+static int
+foreach_file_chunk (const char *path, int64_t from_ms, int64_t to_ms,
+    ChunkFunc func, void *user_data)
+{
+  const ChunkHeader *header;
+  const uint8_t *columns[N_COLUMNS];
+  struct stat st;
+  uint8_t *map;
+  size_t offset = 0;
+  size_t chunk_size;
+  int ret = 0;
+  int fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return (-1);
+
+  if (fstat (fd, &st) == -1 || st.st_size == 0) {
+    close (fd);
+    return 0;
+  }
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return (-1);
+
+  while (ret == 0 &&
+      (chunk_size = chunk_at (map, st.st_size, offset, columns)) != 0) {
+    header = (const ChunkHeader *) (map + offset);
+    if (header->t_max >= from_ms && header->t_min < to_ms)
+      ret = func (header, columns, user_data);
+
+    offset += chunk_size;
+  }
+
+  munmap (map, st.st_size);
+
+  return ret;
+}
+
+/* cuts a partition back to its last complete chunk, chunks appended after a
+ * torn one would never be read */
+static int
+partition_repair (const char *path)
+{
+  const uint8_t *columns[N_COLUMNS];
+  struct stat st;
+  uint8_t *map;
+  size_t offset = 0;
+  size_t chunk_size;
+  int fd;
+
+  fd = open (path, O_RDWR | O_CLOEXEC);
+  if (fd == -1)
+    return errno == ENOENT ? 0 : -1;
+
+  if (fstat (fd, &st) == -1) {
+    close (fd);
+    return (-1);
+  }
+  if (st.st_size == 0) {
+    close (fd);
+    return 0;
+  }
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close (fd);
+    return (-1);
+  }
+
+  while ((chunk_size = chunk_at (map, st.st_size, offset, columns)) != 0)
+    offset += chunk_size;
+  munmap (map, st.st_size);
+
+  if (offset < (size_t) st.st_size) {
+    fprintf (stderr, "Dropping %zu bytes of torn chunk at the end of %s\n",
+        (size_t) st.st_size - offset, path);
+    if (ftruncate (fd, offset) == -1 || fdatasync (fd) == -1) {
+      close (fd);
+      return (-1);
+    }
+  }
+  close (fd);
+
+  return 0;
+}
+
+static void
+head_finish (AirTSDB *db)
+{
+  int c;
+
+  for (c = 0; c < N_COLUMNS; c++)
+    db->head.column_size[c] = (db->columns[c].bits + 7) / 8;
+}
+
+/* calls func for the chunks overlapping [from_ms, to_ms) in time order */
+static int
+foreach_chunk (AirTSDB *db, int64_t from_ms, int64_t to_ms, ChunkFunc func,
+    void *user_data)
+{
+  char path[PATH_MAX_LEN];
+  const uint8_t *columns[N_COLUMNS];
+  int64_t *days;
+  int n_days;
+  int ret = 0;
+  int i;
+  int c;
+
+  if (from_ms >= to_ms)
+    return 0;
+
+  n_days = list_partitions (db, day_of (from_ms), day_of (to_ms - 1), &days);
+  /* not held with the lock, head_seal () takes them the other way round */
+  pthread_rwlock_rdlock (&db->files_lock);
+  for (i = 0; ret == 0 && i < n_days; i++) {
+    partition_path (db, days[i], path);
+    if (foreach_file_chunk (path, from_ms, to_ms, func, user_data) == -1)
+      fprintf (stderr, "Unable to read %s\n", path);
+  }
+  pthread_rwlock_unlock (&db->files_lock);
+  free (days);
+
+  pthread_mutex_lock (&db->lock);
+  if (ret == 0 && db->head.n_points > 0 && db->head.t_max >= from_ms &&
+      db->head.t_min < to_ms) {
+    head_finish (db);
+    for (c = 0; c < N_COLUMNS; c++)
+      columns[c] = db->columns[c].data;
+    ret = func (&db->head, columns, user_data);
+  }
+  pthread_mutex_unlock (&db->lock);
+
+  return ret;
+}
+
+static void
+head_reset (AirTSDB *db)
+{
+  int c;
+
+  for (c = 0; c < N_COLUMNS; c++)
+    db->columns[c].bits = 0;
+
+  db->head = (ChunkHeader) { 0 };
+  db->head.magic = CHUNK_MAGIC;
+  db->prev_timestamp = 0;
+  db->prev_delta = 0;
+  db->prev_pin = 0;
+  db->prev_aqi = 0;
+  db->pcs = (XorState) { 0 };
+  db->ugm3 = (XorState) { 0 };
+}
+
+/* appends the head chunk to its day partition, must hold the lock */
+static int
+head_seal (AirTSDB *db)
+{
+  char path[PATH_MAX_LEN];
+  uint8_t *payload;
+  size_t payload_size = 0;
+  ssize_t ret;
+  int fd;
+  int c;
+
+  if (db->head.n_points == 0)
+    return 0;
+
+  head_finish (db);
+  for (c = 0; c < N_COLUMNS; c++)
+    payload_size += db->head.column_size[c];
+
+  payload = calloc (1, sizeof (ChunkHeader) + CHUNK_ALIGN (payload_size));
+  payload_size = sizeof (ChunkHeader);
+  for (c = 0; c < N_COLUMNS; c++) {
+    memcpy (payload + payload_size, db->columns[c].data,
+        db->head.column_size[c]);
+    payload_size += db->head.column_size[c];
+  }
+  db->head.crc = chunk_crc (&db->head, 1, payload + sizeof (ChunkHeader),
+      payload_size - sizeof (ChunkHeader));
+  memcpy (payload, &db->head, sizeof (ChunkHeader));
+  payload_size = sizeof (ChunkHeader) + CHUNK_ALIGN (payload_size -
+      sizeof (ChunkHeader));
+
+  partition_path (db, db->head_day, path);
+  if (db->checked_day != db->head_day) {
+    pthread_rwlock_wrlock (&db->files_lock);
+    ret = partition_repair (path);
+    pthread_rwlock_unlock (&db->files_lock);
+    if (ret == -1) {
+      fprintf (stderr, "Unable to check %s\n", path);
+      free (payload);
+      return (-1);
+    }
+    db->checked_day = db->head_day;
+  }
+
+  fd = open (path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    fprintf (stderr, "Unable to open %s\n", path);
+    free (payload);
+    return (-1);
+  }
+
+  ret = write (fd, payload, payload_size);
+  free (payload);
+  if (ret != (ssize_t) payload_size || fdatasync (fd) == -1) {
+    fprintf (stderr, "Unable to write chunk to %s\n", path);
+    close (fd);
+    return (-1);
+  }
+  close (fd);
+
+  head_reset (db);
+
+  return 0;
+}
+
+AirTSDB*
+air_tsdb_open (const char *dir)
+{
+  AirTSDB *db;
+
+  if (mkdir (dir, 0755) == -1 && errno != EEXIST) {
+    fprintf (stderr, "Unable to create %s\n", dir);
+    return NULL;
+  }
+
+  db = calloc (1, sizeof (AirTSDB));
+  db->dir = strdup (dir);
+  db->checked_day = -1;
+  pthread_mutex_init (&db->lock, NULL);
+  pthread_rwlock_init (&db->files_lock, NULL);
+  head_reset (db);
+
+  return db;
+}
+
+int
+air_tsdb_append (AirTSDB *db, const AirReading *reading)
+{
+  ChunkHeader *head = &db->head;
+  int64_t day = day_of (reading->timestamp_ms);
+  int64_t delta;
+  uint64_t start_ns = air_metrics_now_ns ();
+  int ret = 0;
+
+  pthread_mutex_lock (&db->lock);
+  if (head->n_points == CHUNK_POINTS || (head->n_points > 0 &&
+      (day != db->head_day ||
+      reading->timestamp_ms - head->t_min >= CHUNK_MAX_AGE_MS)))
+    ret = head_seal (db);
+
+  if (head->n_points == 0) {
+    db->head_day = day;
+    head->t_min = reading->timestamp_ms;
+    head->t_max = reading->timestamp_ms;
+    head->ugm3_min = reading->concentration_ugm3;
+    head->ugm3_max = reading->concentration_ugm3;
+    head->pin_min = reading->pin;
+    head->pin_max = reading->pin;
+    head->aqi_max = reading->aqi;
+  }
+
+  delta = reading->timestamp_ms - db->prev_timestamp;
+  put_varint (&db->columns[COLUMN_TIMESTAMP], delta - db->prev_delta);
+  db->prev_delta = head->n_points == 0 ? 0 : delta;
+  db->prev_timestamp = reading->timestamp_ms;
+
+  put_varint (&db->columns[COLUMN_PIN], reading->pin - db->prev_pin);
+  db->prev_pin = reading->pin;
+
+  put_float (&db->columns[COLUMN_PCS], &db->pcs,
+      reading->concentration_pcs);
+  put_float (&db->columns[COLUMN_UGM3], &db->ugm3,
+      reading->concentration_ugm3);
+
+  put_varint (&db->columns[COLUMN_AQI], reading->aqi - db->prev_aqi);
+  db->prev_aqi = reading->aqi;
+
+  head->n_points++;
+  if (reading->timestamp_ms < head->t_min)
+    head->t_min = reading->timestamp_ms;
+  if (reading->timestamp_ms > head->t_max)
+    head->t_max = reading->timestamp_ms;
+  head->pcs_sum += reading->concentration_pcs;
+  head->ugm3_sum += reading->concentration_ugm3;
+  if (reading->concentration_ugm3 < head->ugm3_min)
+    head->ugm3_min = reading->concentration_ugm3;
+  if (reading->concentration_ugm3 > head->ugm3_max)
+    head->ugm3_max = reading->concentration_ugm3;
+  if (reading->pin < head->pin_min)
+    head->pin_min = reading->pin;
+  if (reading->pin > head->pin_max)
+    head->pin_max = reading->pin;
+  if (reading->aqi > head->aqi_max)
+    head->aqi_max = reading->aqi;
+  pthread_mutex_unlock (&db->lock);
+
+  air_metrics_record_since (AIR_METRIC_TSDB_APPEND, start_ns);
+
+  return ret;
+}
+
+int
+air_tsdb_flush (AirTSDB *db)
+{
+  int ret;
+
+  pthread_mutex_lock (&db->lock);
+  ret = head_seal (db);
+  pthread_mutex_unlock (&db->lock);
+
+  return ret;
+}
+
+/* seals the head chunk if it is too old, for writers whose readings may
+ * stop coming */
+int
+air_tsdb_expire (AirTSDB *db, int64_t now_ms)
+{
+  int ret = 0;
+
+  pthread_mutex_lock (&db->lock);
+  if (db->head.n_points > 0 && now_ms - db->head.t_min >= CHUNK_MAX_AGE_MS)
+    ret = head_seal (db);
+  pthread_mutex_unlock (&db->lock);
+
+  return ret;
+}
+
+void
+air_tsdb_close (AirTSDB *db)
+{
+  int c;
+
+  air_tsdb_flush (db);
+
+  for (c = 0; c < N_COLUMNS; c++)
+    free (db->columns[c].data);
+  pthread_mutex_destroy (&db->lock);
+  pthread_rwlock_destroy (&db->files_lock);
+  free (db->dir);
+  free (db);
+}
+
+typedef struct _ScanData
+{
+  int pin;
+  int64_t from_ms;
+  int64_t to_ms;
+  AirTSDBScanFunc func;
+  void *user_data;
+  ChunkPoints *points;
+} ScanData;
+
+static int
+scan_chunk (const ChunkHeader *header, const uint8_t * const *columns,
+    void *user_data)
+{
+  ScanData *scan = (ScanData *) user_data;
+  ChunkPoints *points = scan->points;
+  AirReading reading;
+  int i;
+
+  if (scan->pin != -1 &&
+      (scan->pin < header->pin_min || scan->pin > header->pin_max))
+    return 0;
+
+  if (decode_chunk (header, columns, points) == -1)
+    return 0;
+
+  for (i = 0; i < points->n; i++) {
+    if (points->timestamp[i] < scan->from_ms ||
+        points->timestamp[i] >= scan->to_ms ||
+        (scan->pin != -1 && points->pin[i] != scan->pin))
+      continue;
+
+    reading.timestamp_ms = points->timestamp[i];
+    reading.pin = points->pin[i];
+    reading.concentration_pcs = points->pcs[i];
+    reading.concentration_ugm3 = points->ugm3[i];
+    reading.aqi = points->aqi[i];
+    scan->func (&reading, scan->user_data);
+  }
+
+  return 0;
+}
+
+int
+air_tsdb_scan (AirTSDB *db, int pin, int64_t from_ms, int64_t to_ms,
+    AirTSDBScanFunc func, void *user_data)
+{
+  ScanData scan;
+  int ret;
+
+  scan.pin = pin;
+  scan.from_ms = from_ms;
+  scan.to_ms = to_ms;
+  scan.func = func;
+  scan.user_data = user_data;
+  scan.points = malloc (sizeof (ChunkPoints));
+
+  ret = foreach_chunk (db, from_ms, to_ms, scan_chunk, &scan);
+
+  free (scan.points);
+
+  return ret;
+}
+
+typedef struct _AggregateData
+{
+  int pin;
+  int64_t from_ms;
+  int64_t step_ms;
+  int n_buckets;
+  AirTSDBAggregate *buckets;
+  ChunkPoints *points;
+} AggregateData;
+
+static void
+aggregate_add (AirTSDBAggregate *bucket, unsigned int count, double pcs_sum,
+    double ugm3_sum, float ugm3_min, float ugm3_max, int aqi_max)
+{
+  if (bucket->count == 0 || ugm3_min < bucket->ugm3_min)
+    bucket->ugm3_min = ugm3_min;
+  if (bucket->count == 0 || ugm3_max > bucket->ugm3_max)
+    bucket->ugm3_max = ugm3_max;
+  if (bucket->count == 0 || aqi_max > bucket->aqi_max)
+    bucket->aqi_max = aqi_max;
+
+  /* means hold the sums until air_tsdb_aggregate () is done */
+  bucket->pcs_mean += pcs_sum;
+  bucket->ugm3_mean += ugm3_sum;
+  bucket->count += count;
+}
+
+static int
+aggregate_chunk (const ChunkHeader *header, const uint8_t * const *columns,
+    void *user_data)
+{
+  AggregateData *agg = (AggregateData *) user_data;
+  ChunkPoints *points = agg->points;
+  int64_t first;
+  int64_t last;
+  int64_t index;
+  int i;
+
+  if (agg->pin != -1 &&
+      (agg->pin < header->pin_min || agg->pin > header->pin_max))
+    return 0;
+
+  /* the whole chunk falls into one bucket, its header is enough */
+  first = (header->t_min - agg->from_ms) / agg->step_ms;
+  last = (header->t_max - agg->from_ms) / agg->step_ms;
+  if (header->t_min >= agg->from_ms && first == last &&
+      last < agg->n_buckets &&
+      (agg->pin == -1 || header->pin_min == header->pin_max)) {
+    aggregate_add (&agg->buckets[first], header->n_points, header->pcs_sum,
+        header->ugm3_sum, header->ugm3_min, header->ugm3_max,
+        header->aqi_max);
+    return 0;
+  }
+
+  if (decode_chunk (header, columns, points) == -1)
+    return 0;
+
+  for (i = 0; i < points->n; i++) {
+    if (points->timestamp[i] < agg->from_ms ||
+        (agg->pin != -1 && points->pin[i] != agg->pin))
+      continue;
+
+    index = (points->timestamp[i] - agg->from_ms) / agg->step_ms;
+    if (index >= agg->n_buckets)
+      continue;
+
+    aggregate_add (&agg->buckets[index], 1, points->pcs[i], points->ugm3[i],
+        points->ugm3[i], points->ugm3[i], points->aqi[i]);
+  }
+
+  return 0;
+}
+
+int
+air_tsdb_aggregate (AirTSDB *db, int pin, int64_t from_ms, int64_t to_ms,
+    int64_t step_ms, AirTSDBAggregate *buckets, int max_buckets)
+{
+  AggregateData agg;
+  int64_t n_buckets;
+  int i;
+
+  if (step_ms <= 0 || from_ms >= to_ms)
+    return 0;
+
+  n_buckets = (to_ms - from_ms + step_ms - 1) / step_ms;
+  if (n_buckets > max_buckets)
+    n_buckets = max_buckets;
+
+  for (i = 0; i < n_buckets; i++) {
+    buckets[i] = (AirTSDBAggregate) { 0 };
+    buckets[i].timestamp_ms = from_ms + i * step_ms;
+  }
+
+  agg.pin = pin;
+  agg.from_ms = from_ms;
+  agg.step_ms = step_ms;
+  agg.n_buckets = n_buckets;
+  agg.buckets = buckets;
+  agg.points = malloc (sizeof (ChunkPoints));
+
+  foreach_chunk (db, from_ms, from_ms + n_buckets * step_ms,
+      aggregate_chunk, &agg);
+
+  free (agg.points);
+
+  for (i = 0; i < n_buckets; i++) {
+    if (buckets[i].count > 0) {
+      buckets[i].pcs_mean /= buckets[i].count;
+      buckets[i].ugm3_mean /= buckets[i].count;
+    }
+  }
+
+  return n_buckets;
+}
@@ -0,0 +1,62 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __AIR_TSDB_H__
+#define __AIR_TSDB_H__
+
+#include "air_utils.h"
+
+/* Compact time series storage for readings. Readings are kept in one file per
+ * UTC day holding sealed chunks of up to a thousand points. Inside a chunk
+ * every field is stored as its own column, timestamps as delta-of-delta,
+ * pin and AQI as deltas and concentrations XOR-ed with the previous value,
+ * which for 30 s readings comes down to a few bytes per reading. Each chunk
+ * header carries the time range, min/max and sums of its values so scans can
+ * skip chunks and aggregates can often use the header alone.
+ * The chunk being filled lives in memory until it is full, the day changes,
+ * its first point is five minutes old or air_tsdb_flush () is called. A
+ * chunk torn by a crash is cut off before the next one is appended. */
+typedef struct _AirTSDB AirTSDB;
+
+typedef struct _AirTSDBAggregate
+{
+  int64_t timestamp_ms;         /* start of the bucket */
+  unsigned int count;
+  float pcs_mean;
+  float ugm3_min;
+  float ugm3_max;
+  float ugm3_mean;
+  int aqi_max;
+} AirTSDBAggregate;
+
+typedef void (*AirTSDBScanFunc) (const AirReading *, void *);
+
+AirTSDB* air_tsdb_open (const char *dir);
+int air_tsdb_append (AirTSDB *db, const AirReading *reading);
+int air_tsdb_flush (AirTSDB *db);
+/* seals the chunk being filled once it is as old as an append would let it
+ * get, now_ms is the wall clock */
+int air_tsdb_expire (AirTSDB *db, int64_t now_ms);
+void air_tsdb_close (AirTSDB *db);
+
+/* pin -1 matches all pins, the range is [from_ms, to_ms) */
+int air_tsdb_scan (AirTSDB *db, int pin, int64_t from_ms, int64_t to_ms,
+    AirTSDBScanFunc func, void *user_data);
+int air_tsdb_aggregate (AirTSDB *db, int pin, int64_t from_ms, int64_t to_ms,
+    int64_t step_ms, AirTSDBAggregate *buckets, int max_buckets);
+
+#endif //__AIR_TSDB_H__
@@ -16,54 +16,104 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <math.h>
+#include <pthread.h>
 
 #include "air_utils.h"
+#include "air_aqi.h"
+
+/* mass of a PM2.5 particle assumed spherical with radius 0.44 μm and
+ * density 1.65e12 μg/m3, times 3531.5 to go from 0.01cf to m3 */
+#define PM25_PI      3.14159
+#define PM25_DENSITY 1.65e12
+#define PM25_RADIUS  0.44e-6
+#define PM25_K       3531.5
+#define PM25_PCS2UGM3 ((float) (PM25_K * PM25_DENSITY * (4.0 / 3.0) * \
+    PM25_PI * PM25_RADIUS * PM25_RADIUS * PM25_RADIUS))
+/* the same for PM10 particles, radius 2.6 μm */
+#define PM10_RADIUS  2.6e-6
+#define PM10_PCS2UGM3 ((float) (PM25_K * PM25_DENSITY * (4.0 / 3.0) * \
+    PM25_PI * PM10_RADIUS * PM10_RADIUS * PM10_RADIUS))
 
 /* convert pcs/0.01cf to μg/m3 */
 float
 pm25pcs2ugm3 (float concentration_pcs)
 {
-  double pi = 3.14159;
-  double density = 1.65 * pow (10, 12);
-  double r25 = 0.44 * pow (10, -6);
-  double vol25 = (4/3) * pi * pow (r25, 3);
-  double mass25 = density * vol25;
-  double K = 3531.5;
-
-  return (concentration_pcs) * K * mass25;
+  return concentration_pcs * PM25_PCS2UGM3;
 }
 
-#define AQI_LEVELS 7
-
-static struct pm25aqi {
-    float clow;
-    float chigh;
-    int llow;
-    int lhigh;
-} pm25aqi[] = {
-  {0.0,    12.0,   0, 50},
-  {12.1,   35.4,  51, 100},
-  {35.5,   55.4, 101, 150},
-  {55.5,  150.4, 151, 200},
-  {150.5, 250.4, 201, 300},
-  {250.5, 350.4, 301, 350},
-  {350.5, 500.4, 401, 500},
-};
+float
+pm10pcs2ugm3 (float concentration_pcs)
+{
+  return concentration_pcs * PM10_PCS2UGM3;
+}
+
+void
+pm25pcs2ugm3_batch (const float *concentration_pcs, float *concentration_ugm3,
+    size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    concentration_ugm3[i] = concentration_pcs[i] * PM25_PCS2UGM3;
+}
 
 /* calculate AQI (Air Quality Index) based on μg/m3 concentration */
 int
 pm25ugm32aqi (float concentration_ugm3)
 {
+  return air_aqi_evaluate (air_aqi_table_builtin (AIR_AQI_DEFAULT,
+      AIR_POLLUTANT_PM25), concentration_ugm3);
+}
+
+int
+pm10ugm32aqi (float concentration_ugm3)
+{
+  return air_aqi_evaluate (air_aqi_table_builtin (AIR_AQI_DEFAULT,
+      AIR_POLLUTANT_PM10), concentration_ugm3);
+}
+
+void
+pm25ugm32aqi_batch (const float *concentration_ugm3, int *aqi, size_t n)
+{
+  air_aqi_evaluate_batch (air_aqi_table_builtin (AIR_AQI_DEFAULT,
+      AIR_POLLUTANT_PM25), concentration_ugm3, aqi, n);
+}
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void
+crc_init (void)
+{
+  uint32_t c;
   int i;
+  int k;
 
-  for (i = 0; i < AQI_LEVELS; i++) {
-    if (concentration_ugm3 >= pm25aqi[i].clow &&
-        concentration_ugm3 <= pm25aqi[i].chigh) {
-      return ((pm25aqi[i].lhigh - pm25aqi[i].llow) /
-          (pm25aqi[i].chigh - pm25aqi[i].clow)) *
-              (concentration_ugm3 - pm25aqi[i].clow) + pm25aqi[i].llow;
-    }
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (k = 0; k < 8; k++)
+      c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
   }
+}
+
+/* CRC-32 (IEEE 802.3) used to detect torn records in on-disk files */
+uint32_t
+air_crc32 (const void *data, size_t len)
+{
+  return air_crc32_update (0, data, len);
+}
+
+uint32_t
+air_crc32_update (uint32_t crc, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  uint32_t c = crc ^ 0xffffffff;
+
+  pthread_once (&crc_once, crc_init);
+
+  while (len--)
+    c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
 
-  return 0;
+  return c ^ 0xffffffff;
 }
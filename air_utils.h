@@ -18,7 +18,33 @@
 #ifndef __AIR_UTILS_H__
 #define __AIR_UTILS_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
+/* one concentration sample as produced at the end of a sampling window */
+typedef struct _AirReading
+{
+  int64_t timestamp_ms;         /* milliseconds since the Epoch */
+  int pin;
+  float concentration_pcs;      /* pcs/0.01cf */
+  float concentration_ugm3;     /* μg/m3 */
+  int aqi;
+} AirReading;
+
 float pm25pcs2ugm3 (float concentration_pcs);
+/* the AIR_AQI_DEFAULT index, see air_aqi.h for the other standards */
 int pm25ugm32aqi (float concentration_ugm3);
+/* the same for PM10, with the EPA PM10 breakpoints */
+float pm10pcs2ugm3 (float concentration_pcs);
+int pm10ugm32aqi (float concentration_ugm3);
+
+/* the same conversions over arrays, for backfills and recomputation */
+void pm25pcs2ugm3_batch (const float *concentration_pcs,
+    float *concentration_ugm3, size_t n);
+void pm25ugm32aqi_batch (const float *concentration_ugm3, int *aqi, size_t n);
+
+uint32_t air_crc32 (const void *data, size_t len);
+/* continues crc, the CRC of the data before, over len more bytes */
+uint32_t air_crc32_update (uint32_t crc, const void *data, size_t len);
 
 #endif //__AIR_UTILS_H__
@@ -0,0 +1,820 @@
+/*
+ * (c) 2016 Ognyan Tonchev otonchev@gmail.com
+ * End to end benchmark of the sensor pipeline without any hardware.
+ * Synthetic PPD42NS signals are written to traces, replayed through an
+ * lngpio engine into PPD42Sensors and the resulting readings are stored in a
+ * time series database with rollups.
+ *
+ * usage: grove_bench [-n sensors] [-d seconds] [-t threads] [-s speed]
+ *                    [-R priority] [-C cpu]
+ *   -n  number of sensors, default 32
+ *   -d  seconds of signal per sensor, default 300
+ *   -t  engine threads, default 2
+ *   -s  replay speed of the latency run, default 100 (x real time)
+ *   -R  run the latency run's engine threads SCHED_FIFO with priority and
+ *       locked memory
+ *   -C  pin the latency run's engine threads to cpu
+ *
+ * Reports edges/s and allocations per reading of an as fast as possible
+ * replay, the CPU a sensor costs at real time rate and edge to reading
+ * and wakeup latency percentiles of a replay at the given speed. Finally the batch
+ * conversion of concentrations to μg/m3 and to the indices of every AQI
+ * standard is timed, as are chart rendering, the metrics hot path,
+ * sampling pin levels through a file standing in for the GPIO registers and
+ * publishing and reading live readings through shared memory. Last, a pin
+ * monitor is stopped from its own callback.
+ */
+#include "lngpio.h"
+#include "ppd42.h"
+#include "ppd42_gen.h"
+#include "air_aqi.h"
+#include "air_calib.h"
+#include "air_tsdb.h"
+#include "air_rollup.h"
+#include "air_chart.h"
+#include "air_metrics.h"
+#include "air_shm.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+#define SAMPLETIME_MS 30000 /* 30s */
+#define HOPTIME_MS    5000 /* new reading every hop */
+
+#define GEN_RATIO_START   2.0
+#define GEN_RATIO_END     12.0
+#define GEN_JITTER_US     5000
+#define GEN_OUT_OF_BOUNDS 0.01
+
+/* concentrations converted by the batch conversion benchmark */
+#define CONVERT_VALUES 1000000
+/* charts of a day and of a year of 30 s readings */
+#define CHART_DAY_POINTS  2880
+#define CHART_YEAR_POINTS (365 * CHART_DAY_POINTS)
+#define CHART_WIDTH       800
+#define METRICS_UPDATES   10000000
+/* level reads of the value file and bulk samples of the registers */
+#define SAMPLER_READS     100000
+#define SAMPLER_SAMPLES   10000000
+/* readings published and read through shared memory */
+#define SHM_PINS          8
+#define SHM_HISTORY       4096
+#define SHM_READS         10000000
+/* how long the monitor stopped from its callback may take to go away */
+#define MONITOR_TIMEOUT_MS 10000
+
+/* allocations are counted by wrapping malloc at link time, see Makefile */
+static atomic_uint_fast64_t n_allocations;
+
+void *__real_malloc (size_t size);
+void *__real_calloc (size_t n, size_t size);
+void *__real_realloc (void *ptr, size_t size);
+
+void*
+__wrap_malloc (size_t size)
+{
+  atomic_fetch_add_explicit (&n_allocations, 1, memory_order_relaxed);
+  return __real_malloc (size);
+}
+
+void*
+__wrap_calloc (size_t n, size_t size)
+{
+  atomic_fetch_add_explicit (&n_allocations, 1, memory_order_relaxed);
+  return __real_calloc (n, size);
+}
+
+void*
+__wrap_realloc (void *ptr, size_t size)
+{
+  atomic_fetch_add_explicit (&n_allocations, 1, memory_order_relaxed);
+  return __real_realloc (ptr, size);
+}
+
+typedef struct _Bench Bench;
+
+typedef struct _BenchSensor
+{
+  Bench *bench;
+  PPD42Sensor *sensor;
+  /* the first replayed edge is stamped with the start of the replay */
+  uint64_t first_ns;
+} BenchSensor;
+
+struct _Bench
+{
+  int n_sensors;
+  int n_threads;
+  LNGPIORealtime realtime;
+  unsigned int duration_ms;
+  char dir[64];
+  int64_t n_edges;
+  BenchSensor *sensors;
+
+  /* per run */
+  double speed;
+  atomic_int_fast64_t edges_done;
+  atomic_int_fast64_t readings;
+  pthread_mutex_t lock;
+  AirTSDB *tsdb;
+  AirRollup *rollup;
+  uint64_t *latencies;
+  int n_latencies;
+  int max_latencies;
+};
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double
+cpu_seconds (void)
+{
+  struct rusage usage;
+
+  getrusage (RUSAGE_SELF, &usage);
+
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+      usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void
+trace_path (Bench *bench, int pin, char *path, size_t len)
+{
+  snprintf (path, len, "%s/sensor-%d.trace", bench->dir, pin);
+}
+
+static void
+edge_detected (const LNGPIOEdge *edge, void *user_data)
+{
+  BenchSensor *bs = (BenchSensor *)user_data;
+  Bench *bench = bs->bench;
+  AirReading reading;
+  uint64_t due;
+
+  if (bs->first_ns == 0)
+    bs->first_ns = edge->timestamp_ns;
+
+  ppd42_sensor_feed_edge (bs->sensor, edge);
+
+  if (ppd42_sensor_poll (bs->sensor, &reading)) {
+    pthread_mutex_lock (&bench->lock);
+    air_tsdb_append (bench->tsdb, &reading);
+    air_rollup_add (bench->rollup, &reading);
+
+    if (bench->speed > 0 && bench->n_latencies < bench->max_latencies) {
+      due = bs->first_ns +
+          (uint64_t) ((edge->timestamp_ns - bs->first_ns) / bench->speed);
+      bench->latencies[bench->n_latencies++] = now_ns () - due;
+    }
+    pthread_mutex_unlock (&bench->lock);
+
+    atomic_fetch_add_explicit (&bench->readings, 1, memory_order_relaxed);
+  }
+
+  atomic_fetch_add_explicit (&bench->edges_done, 1, memory_order_release);
+}
+
+static int
+bench_generate (Bench *bench)
+{
+  PPD42GenConfig config = { 0 };
+  char path[128];
+  int64_t n;
+  int i;
+
+  config.duration_ms = bench->duration_ms;
+  config.ratio_start = GEN_RATIO_START;
+  config.ratio_end = GEN_RATIO_END;
+  config.jitter_us = GEN_JITTER_US;
+  config.out_of_bounds = GEN_OUT_OF_BOUNDS;
+
+  for (i = 0; i < bench->n_sensors; i++) {
+    config.seed = i + 1;
+    config.pin = i;
+    trace_path (bench, i, path, sizeof (path));
+
+    n = ppd42_gen_write_trace (&config, path);
+    if (n < 0)
+      return (-1);
+    bench->n_edges += n;
+  }
+
+  return (0);
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double
+percentile_us (Bench *bench, double p)
+{
+  int i;
+
+  i = (int) (p * (bench->n_latencies - 1) + 0.5);
+
+  return bench->latencies[i] / 1000.0;
+}
+
+static int
+bench_run (Bench *bench, double speed)
+{
+  LNGPIOEngine *engine;
+  LNGPIOPinData *data;
+  AirMetricsSnapshot *metrics;
+  char path[128];
+  uint64_t start;
+  uint64_t elapsed;
+  uint64_t timeout_ns;
+  uint64_t allocations;
+  double cpu;
+  int64_t readings;
+  int i;
+
+  bench->speed = speed;
+  bench->n_latencies = 0;
+  atomic_store (&bench->edges_done, 0);
+  atomic_store (&bench->readings, 0);
+
+  snprintf (path, sizeof (path), "%s/tsdb-%s", bench->dir,
+      speed > 0 ? "latency" : "asap");
+  bench->tsdb = air_tsdb_open (path);
+  if (bench->tsdb == NULL)
+    return (-1);
+  bench->rollup = air_rollup_open (path);
+  if (bench->rollup == NULL)
+    return (-1);
+
+  for (i = 0; i < bench->n_sensors; i++) {
+    bench->sensors[i].bench = bench;
+    bench->sensors[i].first_ns = 0;
+    bench->sensors[i].sensor = ppd42_sensor_create (i, SAMPLETIME_MS,
+        HOPTIME_MS);
+  }
+
+  /* real-time settings only matter when edges are due at a given time */
+  engine = lngpio_engine_create_full (bench->n_threads,
+      speed > 0 ? &bench->realtime : NULL);
+  if (engine == NULL)
+    return (-1);
+
+  metrics = calloc (2, sizeof (AirMetricsSnapshot));
+  air_metrics_snapshot (&metrics[0]);
+
+  cpu = cpu_seconds ();
+  allocations = atomic_load (&n_allocations);
+  start = now_ns ();
+
+  for (i = 0; i < bench->n_sensors; i++) {
+    trace_path (bench, i, path, sizeof (path));
+    data = lngpio_pin_open_trace (path, i, speed);
+    if (data == NULL)
+      return (-1);
+    if (lngpio_engine_add_pin_data (engine, data, edge_detected,
+        &bench->sensors[i]) == -1)
+      return (-1);
+  }
+
+  if (speed > 0)
+    timeout_ns = (bench->duration_ms / speed + 10000) * 1000000ULL;
+  else
+    timeout_ns = 600 * 1000000000ULL;
+
+  while (atomic_load_explicit (&bench->edges_done, memory_order_acquire) <
+      bench->n_edges) {
+    if (now_ns () - start > timeout_ns) {
+      fprintf (stderr, "Replay timed out, %lld of %lld edges\n",
+          (long long) atomic_load (&bench->edges_done),
+          (long long) bench->n_edges);
+      break;
+    }
+    usleep (1000);
+  }
+
+  elapsed = now_ns () - start;
+  cpu = cpu_seconds () - cpu;
+  allocations = atomic_load (&n_allocations) - allocations;
+  readings = atomic_load (&bench->readings);
+
+  lngpio_engine_stop (engine);
+  air_metrics_snapshot (&metrics[1]);
+
+  if (speed <= 0) {
+    printf ("throughput:   %lld edges in %.3f s, %.0f edges/s, "
+        "%lld readings\n", (long long) bench->n_edges, elapsed / 1e9,
+        bench->n_edges / (elapsed / 1e9), (long long) readings);
+    printf ("cpu:          %.4f%% of a core per sensor at real time\n",
+        100.0 * cpu / (bench->n_sensors * (bench->duration_ms / 1000.0)));
+    printf ("allocations:  %.2f per reading (%llu in total)\n",
+        readings > 0 ? (double) allocations / readings : 0.0,
+        (unsigned long long) allocations);
+  } else if (bench->n_latencies > 0) {
+    qsort (bench->latencies, bench->n_latencies, sizeof (uint64_t),
+        compare_u64);
+    printf ("latency:      p50 %.1f us, p90 %.1f us, p99 %.1f us, "
+        "max %.1f us (%gx, %d readings)\n", percentile_us (bench, 0.5),
+        percentile_us (bench, 0.9), percentile_us (bench, 0.99),
+        percentile_us (bench, 1.0), speed, bench->n_latencies);
+
+    /* wakeups of this run only */
+    for (i = 0; i < AIR_METRICS_BUCKETS; i++)
+      metrics[1].buckets[AIR_METRIC_WAKEUP_LATENCY][i] -=
+          metrics[0].buckets[AIR_METRIC_WAKEUP_LATENCY][i];
+    printf ("wakeup:       p50 %.1f us, p99 %.1f us, p99.9 %.1f us%s\n",
+        air_metrics_quantile (&metrics[1], AIR_METRIC_WAKEUP_LATENCY, 0.5) /
+        1e3, air_metrics_quantile (&metrics[1], AIR_METRIC_WAKEUP_LATENCY,
+        0.99) / 1e3, air_metrics_quantile (&metrics[1],
+        AIR_METRIC_WAKEUP_LATENCY, 0.999) / 1e3,
+        bench->realtime.priority > 0 ? " (SCHED_FIFO)" : "");
+  }
+  free (metrics);
+
+  for (i = 0; i < bench->n_sensors; i++)
+    ppd42_sensor_free (bench->sensors[i].sensor);
+
+  air_rollup_close (bench->rollup);
+  air_tsdb_close (bench->tsdb);
+
+  return (0);
+}
+
+/* the spec sheet cubic with pow () as the sensor code used to evaluate it,
+ * then compiled calibration profiles */
+static int
+bench_calib (float *ratios, float *pcs)
+{
+  AirCalibProfile profile;
+  AirCalib *calib;
+  uint64_t start;
+  uint64_t elapsed;
+  float sum = 0;
+  int i;
+
+  /* 0 to 30% occupancy */
+  for (i = 0; i < CONVERT_VALUES; i++)
+    ratios[i] = (i % 30000) * 0.001f;
+
+  start = now_ns ();
+  for (i = 0; i < CONVERT_VALUES; i++)
+    sum += 1.1 * pow (ratios[i], 3) - 3.8 * pow (ratios[i], 2) +
+        520 * ratios[i] + 0.62;
+  elapsed = now_ns () - start;
+  printf ("ratio2pcs pow %.1f M values/s (%g)\n",
+      CONVERT_VALUES / (elapsed / 1e3), sum);
+
+  air_calib_profile_builtin ("ppd42", &profile);
+  calib = air_calib_create (&profile);
+  start = now_ns ();
+  air_calib_pcs_batch (calib, ratios, pcs, CONVERT_VALUES);
+  elapsed = now_ns () - start;
+  printf ("calib horner  %.1f M values/s\n",
+      CONVERT_VALUES / (elapsed / 1e3));
+  air_calib_free (calib);
+
+  /* the same curve as 31 points */
+  profile.curve = AIR_CALIB_PIECEWISE;
+  profile.n_points = 31;
+  for (i = 0; i < profile.n_points; i++) {
+    profile.points[i][0] = i;
+    profile.points[i][1] = ppd42_ratio2pcs (i);
+  }
+  calib = air_calib_create (&profile);
+  if (calib == NULL)
+    return (-1);
+  start = now_ns ();
+  air_calib_pcs_batch (calib, ratios, pcs, CONVERT_VALUES);
+  elapsed = now_ns () - start;
+  printf ("calib lut     %.1f M values/s\n",
+      CONVERT_VALUES / (elapsed / 1e3));
+  air_calib_free (calib);
+
+  return (0);
+}
+
+static int
+bench_convert (void)
+{
+  AirAQITable *table;
+  float *pcs;
+  float *ugm3;
+  int *aqi;
+  uint64_t start;
+  uint64_t elapsed;
+  int standard;
+  int i;
+
+  pcs = malloc (CONVERT_VALUES * sizeof (float));
+  ugm3 = malloc (CONVERT_VALUES * sizeof (float));
+  aqi = malloc (CONVERT_VALUES * sizeof (int));
+
+  /* 0 to 300 μg/m3 */
+  for (i = 0; i < CONVERT_VALUES; i++)
+    pcs[i] = (i % 150000) * 1.0f;
+
+  start = now_ns ();
+  pm25pcs2ugm3_batch (pcs, ugm3, CONVERT_VALUES);
+  elapsed = now_ns () - start;
+  printf ("pcs2ugm3:     %.1f M values/s\n",
+      CONVERT_VALUES / (elapsed / 1e3));
+
+  for (standard = 0; standard < AIR_AQI_STANDARDS; standard++) {
+    table = air_aqi_table_create (standard, AIR_POLLUTANT_PM25);
+    if (table == NULL)
+      return (-1);
+
+    start = now_ns ();
+    air_aqi_evaluate_batch (table, ugm3, aqi, CONVERT_VALUES);
+    elapsed = now_ns () - start;
+    printf ("aqi %-13s %.1f M values/s\n", air_aqi_standard_name (standard),
+        CONVERT_VALUES / (elapsed / 1e3));
+
+    air_aqi_table_free (table);
+  }
+
+  if (bench_calib (pcs, ugm3) == -1)
+    return (-1);
+
+  free (aqi);
+  free (ugm3);
+  free (pcs);
+
+  return (0);
+}
+
+static void
+bench_chart (void)
+{
+  static const int points[] = { CHART_DAY_POINTS, CHART_YEAR_POINTS };
+  AirChartConfig config = { 0 };
+  AirChart *chart;
+  uint64_t start;
+  uint64_t elapsed;
+  size_t len;
+  int i;
+  int j;
+
+  config.width = CHART_WIDTH;
+  config.height = CHART_WIDTH / 2;
+  config.title = "AQI";
+
+  chart = air_chart_create ();
+  for (i = 0; i < 2; i++) {
+    air_chart_reset (chart);
+    for (j = 0; j < points[i]; j++)
+      air_chart_add (chart, 0, j * (int64_t) SAMPLETIME_MS, (j * 7919) % 300);
+
+    start = now_ns ();
+    air_chart_render_svg (chart, &config, &len);
+    elapsed = now_ns () - start;
+    printf ("chart %7d points: %.2f ms, %zu bytes\n", points[i],
+        elapsed / 1e6, len);
+  }
+  air_chart_free (chart);
+}
+
+/* cost of the instrumentation on the hot path */
+static void
+bench_metrics (void)
+{
+  AirMetricsSnapshot *snapshot;
+  char line[512];
+  uint64_t start;
+  uint64_t elapsed;
+  int i;
+
+  /* what the runs above recorded */
+  snapshot = malloc (sizeof (AirMetricsSnapshot));
+  air_metrics_snapshot (snapshot);
+  air_metrics_format_log (snapshot, NULL, line, sizeof (line));
+  printf ("metrics: %s\n", line);
+  free (snapshot);
+
+  start = now_ns ();
+  for (i = 0; i < METRICS_UPDATES; i++)
+    air_metrics_count (AIR_METRIC_EDGES, 0);
+  elapsed = now_ns () - start;
+  printf ("metrics count:  %.1f ns\n", (double) elapsed / METRICS_UPDATES);
+
+  start = now_ns ();
+  for (i = 0; i < METRICS_UPDATES; i++)
+    air_metrics_record (AIR_METRIC_CALLBACK, 0);
+  elapsed = now_ns () - start;
+  printf ("metrics record: %.1f ns\n", (double) elapsed / METRICS_UPDATES);
+
+  start = now_ns ();
+  for (i = 0; i < METRICS_UPDATES; i++)
+    air_metrics_now_ns ();
+  elapsed = now_ns () - start;
+  printf ("metrics clock:  %.1f ns\n", (double) elapsed / METRICS_UPDATES);
+}
+
+/* the value file read the way lngpio_read () used to and the way it does
+ * now, then all pins of a PPD42 array sampled from a stand-in for the GPIO
+ * registers with one load */
+static int
+bench_sampler (Bench *bench)
+{
+  static const int pins[] = { 4, 17, 18, 22, 23, 24, 25, 27 };
+  const int n_pins = sizeof (pins) / sizeof (pins[0]);
+  uint32_t registers[4096 / 4] = { 0 };
+  uint8_t levels[sizeof (pins) / sizeof (pins[0])];
+  LNGPIOSampler *sampler;
+  char path[128];
+  char buf[2];
+  uint64_t start;
+  uint64_t elapsed;
+  FILE *f;
+  int value;
+  int fd;
+  int i;
+
+  snprintf (path, sizeof (path), "%s/value", bench->dir);
+  fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1 || write (fd, "1\n", 2) != 2) {
+    fprintf (stderr, "Unable to write %s\n", path);
+    return (-1);
+  }
+
+  start = now_ns ();
+  for (i = 0; i < SAMPLER_READS; i++) {
+    f = fopen (path, "r");
+    if (fscanf (f, "%d", &value) != 1)
+      value = -1;
+    fclose (f);
+  }
+  elapsed = now_ns () - start;
+  printf ("value fopen:    %.0f ns\n", (double) elapsed / SAMPLER_READS);
+
+  start = now_ns ();
+  for (i = 0; i < SAMPLER_READS; i++) {
+    if (pread (fd, buf, sizeof (buf), 0) < 1)
+      break;
+  }
+  elapsed = now_ns () - start;
+  printf ("value pread:    %.0f ns\n", (double) elapsed / SAMPLER_READS);
+  close (fd);
+
+  /* GPLEV0 with every other pin of the array high */
+  for (i = 0; i < n_pins; i += 2)
+    registers[0x34 / 4] |= 1u << pins[i];
+  snprintf (path, sizeof (path), "%s/gpiomem", bench->dir);
+  fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1 || write (fd, registers, sizeof (registers)) !=
+      sizeof (registers)) {
+    fprintf (stderr, "Unable to write %s\n", path);
+    return (-1);
+  }
+  close (fd);
+
+  sampler = lngpio_sampler_create_gpiomem (path, pins, n_pins);
+  if (sampler == NULL)
+    return (-1);
+
+  lngpio_sampler_read (sampler, levels);
+  for (i = 0; i < n_pins; i++) {
+    if (levels[i] != !(i % 2)) {
+      fprintf (stderr, "Pin %d sampled %d\n", pins[i], levels[i]);
+      lngpio_sampler_free (sampler);
+      return (-1);
+    }
+  }
+
+  start = now_ns ();
+  for (i = 0; i < SAMPLER_SAMPLES; i++)
+    lngpio_sampler_read (sampler, levels);
+  elapsed = now_ns () - start;
+  printf ("gpiomem sample: %.1f ns for %d pins, %.1f M samples/s\n",
+      (double) elapsed / SAMPLER_SAMPLES, n_pins,
+      SAMPLER_SAMPLES * 1e3 / elapsed);
+  lngpio_sampler_free (sampler);
+
+  return (0);
+}
+
+typedef struct _BenchMonitor
+{
+  _Atomic (LNGPIOPinMonitor *) monitor;
+  atomic_int stopped;
+} BenchMonitor;
+
+static void
+monitor_edge_detected (const LNGPIOEdge *edge, void *user_data)
+{
+  BenchMonitor *bm = (BenchMonitor *)user_data;
+  LNGPIOPinMonitor *monitor;
+
+  /* the first edges may arrive before the monitor is stored */
+  monitor = atomic_exchange (&bm->monitor, NULL);
+  if (monitor == NULL)
+    return;
+
+  atomic_store (&bm->stopped, lngpio_pin_monitor_stop (monitor) == 0 ? 1 : -1);
+}
+
+/* the last pin monitor stopped from its own callback takes the default
+ * engine down with it, a new monitor then has to get a fresh engine */
+static int
+bench_monitor_stop (Bench *bench)
+{
+  BenchMonitor bm = { 0 };
+  BenchMonitor idle = { 0 };
+  LNGPIOPinMonitor *monitor;
+  LNGPIOPinData *data;
+  char path[128];
+  int i;
+
+  trace_path (bench, 0, path, sizeof (path));
+  data = lngpio_pin_open_trace (path, 0, LNGPIO_TRACE_SPEED_ASAP);
+  if (data == NULL)
+    return (-1);
+  monitor = lngpio_pin_monitor_create_full (data, monitor_edge_detected, &bm);
+  if (monitor == NULL)
+    return (-1);
+  atomic_store (&bm.monitor, monitor);
+
+  for (i = 0; i < MONITOR_TIMEOUT_MS && atomic_load (&bm.stopped) == 0; i++)
+    usleep (1000);
+  if (atomic_load (&bm.stopped) != 1) {
+    fprintf (stderr, "Pin monitor not stopped from its callback\n");
+    return (-1);
+  }
+
+  data = lngpio_pin_open_trace (path, 0, LNGPIO_TRACE_SPEED_ASAP);
+  if (data == NULL)
+    return (-1);
+  monitor = lngpio_pin_monitor_create_full (data, monitor_edge_detected,
+      &idle);
+  if (monitor == NULL || lngpio_pin_monitor_stop (monitor) == -1) {
+    fprintf (stderr, "Pin monitor not restarted after the engine stopped\n");
+    return (-1);
+  }
+  printf ("monitor stop:   stopped from its callback\n");
+
+  return (0);
+}
+
+/* what a local consumer pays for the current value of a pin */
+static int
+bench_shm (void)
+{
+  AirReading readings[SHM_PINS];
+  AirReading reading = { 0 };
+  AirShmReader *reader;
+  AirShm *shm;
+  char name[64];
+  uint64_t start;
+  uint64_t elapsed;
+  int i;
+
+  snprintf (name, sizeof (name), "/grove_bench.%d", (int) getpid ());
+  shm = air_shm_create (name, SHM_HISTORY);
+  if (shm == NULL)
+    return (-1);
+
+  start = now_ns ();
+  for (i = 0; i < SHM_HISTORY; i++) {
+    reading.pin = i % SHM_PINS;
+    reading.aqi = i;
+    air_shm_publish (shm, &reading);
+  }
+  elapsed = now_ns () - start;
+  printf ("shm publish:    %.0f ns\n", (double) elapsed / SHM_HISTORY);
+
+  reader = air_shm_reader_open (name);
+  if (reader == NULL) {
+    air_shm_free (shm);
+    return (-1);
+  }
+
+  start = now_ns ();
+  for (i = 0; i < SHM_READS; i++)
+    air_shm_reader_latest (reader, i % SHM_PINS, &reading);
+  elapsed = now_ns () - start;
+  printf ("shm latest:     %.1f ns\n", (double) elapsed / SHM_READS);
+
+  start = now_ns ();
+  for (i = 0; i < SHM_READS; i++)
+    air_shm_reader_latest_all (reader, readings, SHM_PINS);
+  elapsed = now_ns () - start;
+  printf ("shm latest all: %.1f ns for %d pins\n",
+      (double) elapsed / SHM_READS, SHM_PINS);
+
+  air_shm_reader_close (reader);
+  air_shm_free (shm);
+
+  return (0);
+}
+
+int
+main (int argc, char * argv[])
+{
+  Bench bench = { 0 };
+  char command[128];
+  double speed = 100;
+  int opt;
+
+  bench.n_sensors = 32;
+  bench.n_threads = 2;
+  bench.duration_ms = 300000;
+  bench.realtime.cpu = -1;
+
+  while ((opt = getopt (argc, argv, "n:d:t:s:R:C:")) != -1) {
+    switch (opt) {
+      case 'n':
+        bench.n_sensors = atoi (optarg);
+        break;
+      case 'd':
+        bench.duration_ms = atoi (optarg) * 1000;
+        break;
+      case 't':
+        bench.n_threads = atoi (optarg);
+        break;
+      case 's':
+        speed = atof (optarg);
+        break;
+      case 'R':
+        bench.realtime.priority = atoi (optarg);
+        bench.realtime.lock_memory = 1;
+        break;
+      case 'C':
+        bench.realtime.cpu = atoi (optarg);
+        break;
+      default:
+        fprintf (stderr, "usage: %s [-n sensors] [-d seconds] [-t threads] "
+            "[-s speed] [-R priority] [-C cpu]\n", argv[0]);
+        return (1);
+    }
+  }
+
+  if (bench.n_sensors < 1 || bench.duration_ms < SAMPLETIME_MS ||
+      speed <= 0) {
+    fprintf (stderr, "Need at least one sensor, %d s of signal and a "
+        "positive speed\n", SAMPLETIME_MS / 1000);
+    return (1);
+  }
+
+  strcpy (bench.dir, "/tmp/grove_bench.XXXXXX");
+  if (mkdtemp (bench.dir) == NULL) {
+    fprintf (stderr, "Unable to create %s\n", bench.dir);
+    return (1);
+  }
+
+  pthread_mutex_init (&bench.lock, NULL);
+  bench.sensors = calloc (bench.n_sensors, sizeof (BenchSensor));
+  bench.max_latencies = bench.n_sensors *
+      (bench.duration_ms / HOPTIME_MS + 1);
+  bench.latencies = malloc (bench.max_latencies * sizeof (uint64_t));
+
+  if (bench_generate (&bench) == -1)
+    return (1);
+
+  printf ("sensors:      %d, %u s of signal each, %lld edges, %d threads\n",
+      bench.n_sensors, bench.duration_ms / 1000, (long long) bench.n_edges,
+      bench.n_threads);
+
+  if (bench_run (&bench, LNGPIO_TRACE_SPEED_ASAP) == -1)
+    return (1);
+  if (bench_run (&bench, speed) == -1)
+    return (1);
+  if (bench_convert () == -1)
+    return (1);
+  bench_chart ();
+  bench_metrics ();
+  if (bench_sampler (&bench) == -1)
+    return (1);
+  if (bench_shm () == -1)
+    return (1);
+  if (bench_monitor_stop (&bench) == -1)
+    return (1);
+
+  snprintf (command, sizeof (command), "rm -rf %s", bench.dir);
+  if (system (command) != 0)
+    fprintf (stderr, "Unable to remove %s\n", bench.dir);
+
+  free (bench.latencies);
+  free (bench.sensors);
+  pthread_mutex_destroy (&bench.lock);
+
+  return (0);
+}
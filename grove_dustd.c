@@ -0,0 +1,644 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "lngpio.h"
+#include "lngpio_filter.h"
+#include "ppd42.h"
+#include "air_calib.h"
+#include "air_config.h"
+#include "air_tsdb.h"
+#include "air_rollup.h"
+#include "air_httpd.h"
+#include "air_shm.h"
+#include "air_stream.h"
+#include "air_metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/time.h>
+
+#define DEFAULT_CONFIG "grove_dustd.conf"
+/* the http server keeps 24h of readings in memory by default */
+#define HTTPD_HISTORY_MS (24 * 3600 * 1000)
+/* the timer period when no stats lines are logged */
+#define DUSTD_TICK_S 60
+
+typedef struct _Dustd Dustd;
+typedef struct _DustdSensor DustdSensor;
+
+/* A running sensor. config and calib are replaced on reload under lock, the
+ * sensor is only touched from the engine thread dispatching the pin. Dual
+ * channel sensors have both outputs on one handle and use dual instead. */
+struct _DustdSensor
+{
+  DustdSensor *next;
+  Dustd *dustd;
+  PPD42Sensor *sensor;
+  PPD42DualSensor *dual;
+  int use_sysfs;
+
+  pthread_mutex_t lock;
+  AirSensorConfig config;
+  AirCalib *calib;
+};
+
+struct _Dustd
+{
+  const char *config_path;
+  AirConfig *config;
+  LNGPIOEngine *engine;
+  AirTSDB *tsdb;
+  AirRollup *rollup;
+  AirHTTPD *httpd;
+  AirShm *shm;
+  AirStream *stream;
+  int stream_pulses;
+  DustdSensor *sensors;
+  AirMetricsSnapshot *stats;
+  AirMetricsSnapshot *previous_stats;
+};
+
+/* NAN when there is no humidity sensor or it cannot be read */
+static float
+read_humidity (const char *path)
+{
+  FILE *f;
+  long milli_percent;
+  int ret;
+
+  if (path[0] == '\0')
+    return NAN;
+
+  f = fopen (path, "r");
+  if (f == NULL)
+    return NAN;
+  ret = fscanf (f, "%ld", &milli_percent);
+  fclose (f);
+
+  return ret == 1 ? milli_percent / 1000.0f : NAN;
+}
+
+static void
+publish (Dustd *dustd, const char *name, const char *fraction,
+    unsigned int sinks, const AirReading *reading)
+{
+  if (sinks & AIR_SINK_STDOUT)
+    printf ("%s%s: %f pcs/0.01cf, %f μg/m3, %d AQI\n", name, fraction,
+        reading->concentration_pcs, reading->concentration_ugm3, reading->aqi);
+  if (sinks & AIR_SINK_TSDB)
+    air_tsdb_append (dustd->tsdb, reading);
+  if (sinks & AIR_SINK_ROLLUP)
+    air_rollup_add (dustd->rollup, reading);
+  if ((sinks & AIR_SINK_HTTP) && dustd->httpd != NULL)
+    air_httpd_publish (dustd->httpd, reading);
+  if ((sinks & AIR_SINK_SHM) && dustd->shm != NULL)
+    air_shm_publish (dustd->shm, reading);
+  if ((sinks & AIR_SINK_STREAM) && dustd->stream != NULL)
+    air_stream_publish (dustd->stream, name, reading);
+}
+
+static void
+publish_pulses (Dustd *dustd, const char *name, unsigned int sinks, int pin,
+    float ratio, uint64_t out_of_bounds)
+{
+  if ((sinks & AIR_SINK_STREAM) && dustd->stream != NULL &&
+      dustd->stream_pulses)
+    air_stream_publish_pulses (dustd->stream, name, pin, ratio,
+        out_of_bounds);
+}
+
+static void
+edge_detected (const LNGPIOEdge *edge, void *user_data)
+{
+  DustdSensor *sensor = (DustdSensor *)user_data;
+  AirReading reading;
+  char name[AIR_CONFIG_MAX_NAME];
+  float humidity;
+  unsigned int sinks;
+
+  ppd42_sensor_feed_edge (sensor->sensor, edge);
+  if (!ppd42_sensor_poll (sensor->sensor, &reading))
+    return;
+
+  /* once per hop, the lock is not contended */
+  pthread_mutex_lock (&sensor->lock);
+  humidity = read_humidity (sensor->config.humidity_file);
+  air_calib_reading (sensor->calib, ppd42_sensor_ratio (sensor->sensor),
+      humidity, &reading);
+  sinks = sensor->config.sinks;
+  strcpy (name, sensor->config.name);
+  pthread_mutex_unlock (&sensor->lock);
+
+  publish (sensor->dustd, name, "", sinks, &reading);
+  publish_pulses (sensor->dustd, name, sinks, reading.pin,
+      ppd42_sensor_ratio (sensor->sensor),
+      ppd42_sensor_out_of_bounds (sensor->sensor));
+}
+
+/* both fractions are stored as readings of their pin, with the same
+ * timestamp */
+static void
+dual_edge_detected (const LNGPIOEdge *edge, void *user_data)
+{
+  DustdSensor *sensor = (DustdSensor *)user_data;
+  PPD42DualReading reading;
+  char name[AIR_CONFIG_MAX_NAME];
+  float humidity;
+  unsigned int sinks;
+
+  ppd42_dual_sensor_feed_edge (sensor->dual, edge);
+  if (!ppd42_dual_sensor_poll (sensor->dual, &reading))
+    return;
+
+  pthread_mutex_lock (&sensor->lock);
+  humidity = read_humidity (sensor->config.humidity_file);
+  air_calib_split (sensor->calib, reading.ratio_p1, reading.ratio_p2,
+      humidity, &reading.pm25, &reading.pm10);
+  sinks = sensor->config.sinks;
+  strcpy (name, sensor->config.name);
+  pthread_mutex_unlock (&sensor->lock);
+
+  publish (sensor->dustd, name, " PM2.5", sinks, &reading.pm25);
+  publish (sensor->dustd, name, " PM10", sinks, &reading.pm10);
+  publish_pulses (sensor->dustd, name, sinks, reading.pm25.pin,
+      reading.ratio_p1, ppd42_dual_sensor_out_of_bounds (sensor->dual));
+  publish_pulses (sensor->dustd, name, sinks, reading.pm10.pin,
+      reading.ratio_p2, ppd42_dual_sensor_out_of_bounds (sensor->dual));
+}
+
+static int
+sensor_configure (DustdSensor *sensor, const AirSensorConfig *config)
+{
+  AirCalib *calib;
+
+  calib = air_sensor_config_calib (config);
+  if (calib == NULL)
+    return (-1);
+
+  pthread_mutex_lock (&sensor->lock);
+  sensor->config = *config;
+  if (sensor->calib != NULL)
+    air_calib_free (sensor->calib);
+  sensor->calib = calib;
+  pthread_mutex_unlock (&sensor->lock);
+
+  return (0);
+}
+
+static DustdSensor*
+sensor_start (Dustd *dustd, const AirSensorConfig *config)
+{
+  DustdSensor *sensor;
+  LNGPIOPinData *data;
+
+  sensor = calloc (1, sizeof (DustdSensor));
+  sensor->dustd = dustd;
+  pthread_mutex_init (&sensor->lock, NULL);
+  if (sensor_configure (sensor, config) == -1)
+    goto fail;
+
+  if (config->pin_p2 != -1)
+    sensor->dual = ppd42_dual_sensor_create (config->pin, config->pin_p2,
+        config->window_ms, config->hop_ms);
+  else
+    sensor->sensor = ppd42_sensor_create (config->pin, config->window_ms,
+        config->hop_ms);
+  if (sensor->sensor == NULL && sensor->dual == NULL)
+    goto fail;
+
+  /* the edges of both outputs of a dual sensor come through one handle
+   * known by the P1 pin */
+  if (config->trace[0] != '\0' && sensor->dual != NULL) {
+    int lines[2] = { config->pin, config->pin_p2 };
+
+    data = lngpio_pin_open_trace_lines (config->trace, lines, 2,
+        config->speed);
+  } else if (config->trace[0] != '\0')
+    data = lngpio_pin_open_trace (config->trace, config->pin, config->speed);
+  else if (sensor->dual != NULL)
+    data = ppd42_dual_pin_open (config->chip, config->pin, config->pin_p2);
+  else
+    data = ppd42_pin_open (config->chip, config->pin, &sensor->use_sysfs);
+  if (data == NULL)
+    goto fail;
+
+  if (air_sensor_config_has_filter (config) &&
+      lngpio_pin_set_filter (data, &config->filter) == -1) {
+    lngpio_pin_release (data);
+    goto fail;
+  }
+
+  if (lngpio_engine_add_pin_data (dustd->engine, data,
+      sensor->dual != NULL ? dual_edge_detected : edge_detected,
+      sensor) == -1)
+    goto fail;
+
+  if (sensor->dual != NULL)
+    printf ("sensor %s on pins %d and %d started\n", config->name,
+        config->pin, config->pin_p2);
+  else
+    printf ("sensor %s on pin %d started\n", config->name, config->pin);
+
+  return sensor;
+
+fail:
+  fprintf (stderr, "Unable to start sensor %s\n", config->name);
+  if (sensor->use_sysfs)
+    lngpio_unexport (config->pin);
+  if (sensor->sensor != NULL)
+    ppd42_sensor_free (sensor->sensor);
+  if (sensor->dual != NULL)
+    ppd42_dual_sensor_free (sensor->dual);
+  if (sensor->calib != NULL)
+    air_calib_free (sensor->calib);
+  pthread_mutex_destroy (&sensor->lock);
+  free (sensor);
+
+  return NULL;
+}
+
+static void
+sensor_stop (Dustd *dustd, DustdSensor *sensor)
+{
+  /* a source the engine cannot find may still call back, keep the sensor */
+  if (lngpio_engine_remove_pin (dustd->engine, sensor->config.pin) == -1) {
+    fprintf (stderr, "Unable to stop sensor %s on pin %d\n",
+        sensor->config.name, sensor->config.pin);
+    return;
+  }
+  if (sensor->use_sysfs && lngpio_unexport (sensor->config.pin) == -1)
+    fprintf (stderr, "Unable to unexport pin %d\n", sensor->config.pin);
+
+  printf ("sensor %s on pin %d stopped\n", sensor->config.name,
+      sensor->config.pin);
+
+  if (sensor->dual != NULL)
+    ppd42_dual_sensor_free (sensor->dual);
+  else
+    ppd42_sensor_free (sensor->sensor);
+  air_calib_free (sensor->calib);
+  pthread_mutex_destroy (&sensor->lock);
+  free (sensor);
+}
+
+/* a sensor keeps running over a reload when only its calibration, sinks or
+ * name change, anything else needs a new sensor and window */
+static int
+sensor_restart_needed (const AirSensorConfig *old, const AirSensorConfig *new)
+{
+  return strcmp (old->chip, new->chip) != 0 || old->pin_p2 != new->pin_p2 ||
+      strcmp (old->trace, new->trace) != 0 || old->speed != new->speed ||
+      old->window_ms != new->window_ms || old->hop_ms != new->hop_ms ||
+      memcmp (&old->filter, &new->filter, sizeof (LNGPIOFilter)) != 0;
+}
+
+static const AirSensorConfig*
+config_find_pin (const AirConfig *config, int pin)
+{
+  int i;
+
+  for (i = 0; i < config->n_sensors; i++) {
+    if (config->sensors[i].pin == pin)
+      return &config->sensors[i];
+  }
+
+  return NULL;
+}
+
+static DustdSensor*
+dustd_find_pin (Dustd *dustd, int pin)
+{
+  DustdSensor *sensor;
+
+  for (sensor = dustd->sensors; sensor != NULL; sensor = sensor->next) {
+    if (sensor->config.pin == pin)
+      return sensor;
+  }
+
+  return NULL;
+}
+
+static void
+dustd_apply (Dustd *dustd, const AirConfig *config)
+{
+  const AirSensorConfig *sensor_config;
+  DustdSensor **link;
+  DustdSensor *sensor;
+  int i;
+
+  /* stop sensors that are gone or changed */
+  link = &dustd->sensors;
+  while (*link != NULL) {
+    sensor = *link;
+    sensor_config = config_find_pin (config, sensor->config.pin);
+    if (sensor_config == NULL ||
+        sensor_restart_needed (&sensor->config, sensor_config)) {
+      *link = sensor->next;
+      sensor_stop (dustd, sensor);
+    } else {
+      if (sensor_configure (sensor, sensor_config) == -1)
+        fprintf (stderr, "Keeping the configuration of sensor %s\n",
+            sensor->config.name);
+      link = &sensor->next;
+    }
+  }
+
+  /* and start the new ones */
+  for (i = 0; i < config->n_sensors; i++) {
+    if (dustd_find_pin (dustd, config->sensors[i].pin) != NULL)
+      continue;
+    sensor = sensor_start (dustd, &config->sensors[i]);
+    if (sensor == NULL)
+      continue;
+    sensor->next = dustd->sensors;
+    dustd->sensors = sensor;
+  }
+}
+
+/* the timer drives the stats lines and seals database chunks whose sensors
+ * stopped reporting, it keeps ticking with the stats off */
+static void
+dustd_arm_stats (Dustd *dustd)
+{
+  struct itimerval timer = { { 0 } };
+  int interval_s = dustd->config->stats_interval_s;
+
+  if (interval_s == 0)
+    interval_s = DUSTD_TICK_S;
+  timer.it_interval.tv_sec = interval_s;
+  timer.it_value.tv_sec = interval_s;
+  if (setitimer (ITIMER_REAL, &timer, NULL) == -1)
+    fprintf (stderr, "Unable to arm the stats timer\n");
+}
+
+/* counters and latencies since the previous stats line */
+static void
+dustd_log_stats (Dustd *dustd)
+{
+  AirMetricsSnapshot *swap;
+  char line[512];
+
+  air_metrics_snapshot (dustd->stats);
+  air_metrics_format_log (dustd->stats, dustd->previous_stats, line,
+      sizeof (line));
+  printf ("stats: %s\n", line);
+
+  swap = dustd->previous_stats;
+  dustd->previous_stats = dustd->stats;
+  dustd->stats = swap;
+}
+
+static void
+dustd_tick (Dustd *dustd)
+{
+  struct timespec now;
+
+  if (dustd->config->stats_interval_s > 0)
+    dustd_log_stats (dustd);
+
+  clock_gettime (CLOCK_REALTIME, &now);
+  if (air_tsdb_expire (dustd->tsdb, now.tv_sec * 1000LL +
+      now.tv_nsec / 1000000) == -1)
+    fprintf (stderr, "Unable to seal the database chunk\n");
+}
+
+static void
+dustd_reload (Dustd *dustd)
+{
+  AirConfig *config;
+  AirConfig *old = dustd->config;
+
+  config = air_config_load (dustd->config_path);
+  if (config == NULL) {
+    fprintf (stderr, "Keeping the previous configuration\n");
+    return;
+  }
+
+  if (config->n_threads != old->n_threads ||
+      strcmp (config->tsdb_dir, old->tsdb_dir) != 0 ||
+      strcmp (config->http_address, old->http_address) != 0 ||
+      config->http_port != old->http_port ||
+      config->http_history != old->http_history ||
+      strcmp (config->shm_name, old->shm_name) != 0 ||
+      config->shm_history != old->shm_history ||
+      strcmp (config->stream_unix, old->stream_unix) != 0 ||
+      strcmp (config->stream_tcp, old->stream_tcp) != 0 ||
+      config->stream_format != old->stream_format ||
+      config->stream_backlog != old->stream_backlog ||
+      config->stream_pulses != old->stream_pulses ||
+      config->realtime_priority != old->realtime_priority ||
+      config->realtime_cpu != old->realtime_cpu ||
+      config->lock_memory != old->lock_memory)
+    fprintf (stderr, "[daemon] changes take effect after a restart\n");
+
+  dustd_apply (dustd, config);
+  dustd->config = config;
+  air_config_free (old);
+  dustd_arm_stats (dustd);
+
+  printf ("configuration reloaded\n");
+}
+
+static int
+dustd_start (Dustd *dustd)
+{
+  AirConfig *config = dustd->config;
+  AirHTTPDConfig httpd_config = { 0 };
+  AirStreamConfig stream_config = { 0 };
+  LNGPIORealtime realtime;
+  unsigned int min_hop_ms = HTTPD_HISTORY_MS;
+  int n_series;
+  int i;
+
+  dustd->tsdb = air_tsdb_open (config->tsdb_dir);
+  if (dustd->tsdb == NULL)
+    return (-1);
+
+  dustd->rollup = air_rollup_open (config->tsdb_dir);
+  if (dustd->rollup == NULL)
+    return (-1);
+
+  if (config->http_port != 0) {
+    /* dual channel sensors publish two readings per hop */
+    n_series = config->n_sensors;
+    for (i = 0; i < config->n_sensors; i++) {
+      if (config->sensors[i].hop_ms < min_hop_ms)
+        min_hop_ms = config->sensors[i].hop_ms;
+      if (config->sensors[i].pin_p2 != -1)
+        n_series++;
+    }
+
+    httpd_config.address = config->http_address[0] != '\0' ?
+        config->http_address : NULL;
+    httpd_config.port = config->http_port;
+    httpd_config.history_size = config->http_history != 0 ?
+        config->http_history :
+        HTTPD_HISTORY_MS / min_hop_ms * (n_series + 1);
+    httpd_config.tsdb = dustd->tsdb;
+    httpd_config.rollup = dustd->rollup;
+    dustd->httpd = air_httpd_create (&httpd_config);
+    if (dustd->httpd == NULL)
+      return (-1);
+  }
+
+  if (config->shm_name[0] != '\0') {
+    dustd->shm = air_shm_create (config->shm_name, config->shm_history);
+    if (dustd->shm == NULL)
+      return (-1);
+  }
+
+  if (config->stream_unix[0] != '\0' || config->stream_tcp[0] != '\0') {
+    stream_config.unix_path = config->stream_unix[0] != '\0' ?
+        config->stream_unix : NULL;
+    stream_config.tcp_target = config->stream_tcp[0] != '\0' ?
+        config->stream_tcp : NULL;
+    stream_config.format = config->stream_format;
+    stream_config.backlog = config->stream_backlog;
+    dustd->stream = air_stream_create (&stream_config);
+    if (dustd->stream == NULL)
+      return (-1);
+    dustd->stream_pulses = config->stream_pulses;
+  }
+
+  realtime.priority = config->realtime_priority;
+  realtime.cpu = config->realtime_cpu;
+  realtime.lock_memory = config->lock_memory;
+  dustd->engine = lngpio_engine_create_full (config->n_threads, &realtime);
+  if (dustd->engine == NULL)
+    return (-1);
+
+  dustd_apply (dustd, config);
+
+  dustd->stats = calloc (1, sizeof (AirMetricsSnapshot));
+  dustd->previous_stats = calloc (1, sizeof (AirMetricsSnapshot));
+  dustd_arm_stats (dustd);
+
+  return (0);
+}
+
+static void
+dustd_stop (Dustd *dustd)
+{
+  DustdSensor *sensor;
+
+  while (dustd->sensors != NULL) {
+    sensor = dustd->sensors;
+    dustd->sensors = sensor->next;
+    sensor_stop (dustd, sensor);
+  }
+
+  if (dustd->engine != NULL)
+    lngpio_engine_stop (dustd->engine);
+  if (dustd->httpd != NULL)
+    air_httpd_stop (dustd->httpd);
+  if (dustd->shm != NULL)
+    air_shm_free (dustd->shm);
+  if (dustd->stream != NULL)
+    air_stream_stop (dustd->stream);
+  if (dustd->rollup != NULL)
+    air_rollup_close (dustd->rollup);
+  if (dustd->tsdb != NULL)
+    air_tsdb_close (dustd->tsdb);
+  air_config_free (dustd->config);
+  free (dustd->previous_stats);
+  free (dustd->stats);
+}
+
+int
+main (int argc, char * argv[])
+{
+  Dustd dustd = { 0 };
+  struct signalfd_siginfo info;
+  sigset_t signals;
+  int signal_fd;
+  int ret = 0;
+  int opt;
+
+  dustd.config_path = DEFAULT_CONFIG;
+
+  while ((opt = getopt (argc, argv, "c:")) != -1) {
+    switch (opt) {
+      case 'c':
+        dustd.config_path = optarg;
+        break;
+      default:
+        fprintf (stderr, "usage: %s [-c config]\n", argv[0]);
+        return (1);
+    }
+  }
+
+  /* blocked before any thread is created so that only the signalfd sees
+   * them */
+  sigemptyset (&signals);
+  sigaddset (&signals, SIGTERM);
+  sigaddset (&signals, SIGINT);
+  sigaddset (&signals, SIGHUP);
+  sigaddset (&signals, SIGALRM);
+  if (pthread_sigmask (SIG_BLOCK, &signals, NULL) != 0) {
+    fprintf (stderr, "Unable to block signals\n");
+    return (1);
+  }
+
+  signal_fd = signalfd (-1, &signals, SFD_CLOEXEC);
+  if (signal_fd == -1) {
+    fprintf (stderr, "Unable to create signalfd\n");
+    return (1);
+  }
+
+  /* readings are printed one per line, also when logging to a file */
+  setvbuf (stdout, NULL, _IOLBF, 0);
+
+  dustd.config = air_config_load (dustd.config_path);
+  if (dustd.config == NULL)
+    return (1);
+
+  if (dustd_start (&dustd) == -1) {
+    dustd_stop (&dustd);
+    return (1);
+  }
+
+  /* everything happens on the engine and http threads, this one only waits
+   * for signals */
+  while (1) {
+    if (read (signal_fd, &info, sizeof (info)) != sizeof (info)) {
+      fprintf (stderr, "Unable to read signalfd\n");
+      ret = 1;
+      break;
+    }
+
+    if (info.ssi_signo == SIGHUP) {
+      dustd_reload (&dustd);
+    } else if (info.ssi_signo == SIGALRM) {
+      dustd_tick (&dustd);
+    } else {
+      printf ("shutting down\n");
+      break;
+    }
+  }
+
+  dustd_stop (&dustd);
+  close (signal_fd);
+
+  return (ret);
+}
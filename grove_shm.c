@@ -0,0 +1,124 @@
+/*
+ * (c) 2016 Ognyan Tonchev otonchev@gmail.com
+ * Example client of the live readings grove_dustd publishes in shared
+ * memory, see air_shm.h. Prints the latest reading of every pin, or with -f
+ * every new reading as it is published. The segment is reopened when the
+ * daemon restarts.
+ *
+ * usage: grove_shm [-n name] [-f] [-H readings]
+ *   -n  shared memory segment, default /grove_dustd
+ *   -f  follow new readings
+ *   -H  print up to this many recent readings first
+ */
+#include "air_shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#define MAX_READINGS 4096
+/* how often a missing segment is retried while following */
+#define REOPEN_MS 1000
+
+static void
+print_reading (const AirReading *reading)
+{
+  printf ("%lld pin %d: %f pcs/0.01cf, %f μg/m3, %d AQI\n",
+      (long long) reading->timestamp_ms, reading->pin,
+      reading->concentration_pcs, reading->concentration_ugm3, reading->aqi);
+}
+
+static int
+follow (const char *name, AirShmReader *reader)
+{
+  AirReading *readings;
+  uint64_t since;
+  uint32_t generation = 0;
+  int n;
+  int i;
+
+  readings = malloc (MAX_READINGS * sizeof (AirReading));
+
+  /* only what is published from now on */
+  since = 0;
+  air_shm_reader_history (reader, readings, 0, &since);
+
+  while (1) {
+    if (air_shm_reader_wait (reader, &generation, -1) == 1) {
+      n = air_shm_reader_history (reader, readings, MAX_READINGS, &since);
+      for (i = 0; i < n; i++)
+        print_reading (&readings[i]);
+      fflush (stdout);
+      if (n >= 0)
+        continue;
+    }
+
+    /* the daemon went away */
+    air_shm_reader_close (reader);
+    while ((reader = air_shm_reader_open (name)) == NULL)
+      usleep (REOPEN_MS * 1000);
+    since = 0;
+    generation = 0;
+  }
+
+  free (readings);
+
+  return (0);
+}
+
+int
+main (int argc, char * argv[])
+{
+  const char *name = AIR_SHM_DEFAULT_NAME;
+  AirShmReader *reader;
+  AirReading *readings;
+  int n_history = 0;
+  int follow_mode = 0;
+  int opt;
+  int n;
+  int i;
+
+  while ((opt = getopt (argc, argv, "n:fH:")) != -1) {
+    switch (opt) {
+      case 'n':
+        name = optarg;
+        break;
+      case 'f':
+        follow_mode = 1;
+        break;
+      case 'H':
+        n_history = atoi (optarg);
+        break;
+      default:
+        fprintf (stderr, "usage: %s [-n name] [-f] [-H readings]\n", argv[0]);
+        return (1);
+    }
+  }
+
+  if (n_history < 0 || n_history > MAX_READINGS) {
+    fprintf (stderr, "At most %d readings of history\n", MAX_READINGS);
+    return (1);
+  }
+
+  reader = air_shm_reader_open (name);
+  if (reader == NULL)
+    return (1);
+
+  readings = malloc (MAX_READINGS * sizeof (AirReading));
+  if (n_history > 0)
+    n = air_shm_reader_history (reader, readings, n_history, NULL);
+  else
+    n = air_shm_reader_latest_all (reader, readings, AIR_SHM_MAX_PINS);
+  for (i = 0; i < n; i++)
+    print_reading (&readings[i]);
+  fflush (stdout);
+  free (readings);
+
+  if (follow_mode)
+    return follow (name, reader);
+
+  air_shm_reader_close (reader);
+
+  return (0);
+}
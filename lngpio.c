@@ -15,19 +15,35 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
 #include "lngpio.h"
+#include "lngpio_trace.h"
+#include "lngpio_filter.h"
+#include "air_metrics.h"
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <math.h>
+#include <time.h>
 #include <poll.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
 #include<pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
 
 static const char *pin_dir_str[] = {
   "in",
@@ -41,20 +57,116 @@ static const char *pin_edge_str[] = {
   "both",
 };
 
+#define LNGPIO_EDGE_BATCH 64
+#define LNGPIO_CDEV_EVENT_BUFFER 256
+
+typedef struct _LNGPIOBackend
+{
+  short events;
+  int (*read_edges) (LNGPIOPinData *data, LNGPIOEdge *edges, int max_edges);
+  int (*read_level) (LNGPIOPinData *data);
+  /* frees backend_data, may be NULL */
+  void (*release) (LNGPIOPinData *data);
+  /* when an edge was due on the monotonic clock, 0 if unknown. NULL when
+   * timestamps are taken on wakeup and tell nothing about the latency. */
+  uint64_t (*due_ns) (LNGPIOPinData *data, const LNGPIOEdge *edge);
+} LNGPIOBackend;
+
 struct _LNGPIOPinData
 {
   int fd;
-  struct pollfd fds;
+  /* the backend fd and the cancel eventfd */
+  struct pollfd fds[2];
+  const LNGPIOBackend *backend;
+  void *backend_data;
+  int pin;
+  int level;
+  /* lines of a multi line request, the first one is pin */
+  int n_lines;
+  LNGPIOEdgeFilter *filter;
+  /* edges read from the backend but not yet returned by
+   * lngpio_pin_next_edge () */
+  LNGPIOEdge pending[LNGPIO_EDGE_BATCH + LNGPIO_FILTER_SLACK];
+  int n_pending;
+  int next_pending;
+  /* start of the pulse being measured, kept across timeouts */
+  uint64_t pulse_start_ns;
+  int pulse_level;
+  /* the backend failed or the replay ended, nothing more to wait for */
+  int failed;
 };
 
 struct _LNGPIOPinMonitor
 {
-  pthread_t thread_id;
-  pthread_mutex_t lock;
-  LNGPIOPinStatusChanged callback;
+  int pin;
+};
+
+typedef struct _LNGPIOEngineSource LNGPIOEngineSource;
+
+struct _LNGPIOEngineSource
+{
+  LNGPIOEngineSource *next;
   LNGPIOPinData *pin_data;
-  int stop_thread;
+  LNGPIOPinStatusChanged status_changed;
+  LNGPIOPinEdgeDetected edge_detected;
+  void *user_data;
+  uint64_t id;
   int pin;
+  int busy;
+  int removed;
+  int orphaned;
+  pthread_t dispatcher;
+};
+
+#define ENGINE_WAKEUP_ID 0
+#define ENGINE_MAX_EVENTS 16
+/* callbacks are timed on one dispatch out of CALLBACK_SAMPLE per thread,
+ * reading the clock twice per edge would cost more than the callback */
+#define CALLBACK_SAMPLE 16
+/* real-time threads get small stacks, locked memory is resident memory */
+#define ENGINE_RT_STACK_SIZE (256 * 1024)
+#define ENGINE_RT_PREFAULT (64 * 1024)
+
+struct _LNGPIOEngine
+{
+  pthread_t *threads;
+  int n_threads;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  LNGPIOEngineSource *sources;
+  uint64_t next_id;
+  int epoll_fd;
+  int wakeup_fd;
+  LNGPIORealtime realtime;
+};
+
+/* all pin monitors share one engine so that they do not need one thread per
+ * pin */
+static pthread_mutex_t default_engine_lock = PTHREAD_MUTEX_INITIALIZER;
+static LNGPIOEngine *default_engine;
+static int default_engine_users;
+static LNGPIORealtime default_engine_realtime = { 0, -1, 0 };
+
+/* value files kept open by lngpio_read (), indexed by pin. Stored as fd + 1
+ * so that the zeroed table means not opened yet. */
+#define LNGPIO_VALUE_FDS 1024
+static atomic_int value_fds[LNGPIO_VALUE_FDS];
+
+/* Raspberry Pi GPIO registers, as 32 bit words from the start of the block */
+#define GPIOMEM_SIZE 4096
+#define GPIOMEM_GPLEV0 (0x34 / 4)
+#define GPIOMEM_N_PINS 54
+
+struct _LNGPIOSampler
+{
+  int n_pins;
+  /* sysfs value fds, NULL when sampling the registers */
+  int *fds;
+  volatile uint32_t *registers;
+  /* GPLEV register and bit of every pin */
+  uint8_t *words;
+  uint8_t *bits;
+  int n_words;
 };
 
 int
@@ -108,6 +220,13 @@ lngpio_unexport (int pin)
   ssize_t ret;
   int fd;
 
+  /* the value file goes away with the pin */
+  if (pin >= 0 && pin < LNGPIO_VALUE_FDS) {
+    fd = atomic_exchange (&value_fds[pin], 0) - 1;
+    if (fd != -1)
+      close (fd);
+  }
+
   fd = open ("/sys/class/gpio/unexport", O_WRONLY);
   if (-1 == fd) {
     fprintf (stderr, "Failed to open unexport for writing!\n");
@@ -200,76 +319,491 @@ lngpio_set_edge (int pin, LNGPIOPinEdge edge)
   return (0);
 }
 
-int
-lngpio_read (int pin)
+/* the value file holds "0\n" or "1\n", pread () saves the lseek () */
+static int
+pin_read_level (int fd)
+{
+  char buf[2];
+
+  if (pread (fd, buf, sizeof (buf), 0) < 1)
+    return -1;
+
+  switch (buf[0]) {
+    case '0':
+      return 0;
+    case '1':
+      return 1;
+    default:
+      return -1;
+  }
+}
+
+static int
+pin_open_value (int pin)
 {
-  #define VALUE_MAX 30
+  #define VALUE_MAX 64
   char path[VALUE_MAX];
-  FILE *f;
-  int result;
+  int fd;
 
   snprintf (path, VALUE_MAX, "/sys/class/gpio/gpio%d/value", pin);
-  f = fopen (path, "rw");
-  fscanf (f, "%d", &result);
-  fclose (f);
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    fprintf (stderr, "Unable to open %s\n", path);
+
+  return fd;
+}
+
+/* the value file is opened on the first read and kept open until the pin is
+ * unexported */
+int
+lngpio_read (int pin)
+{
+  int expected = 0;
+  int level;
+  int fd;
+
+  if (pin < 0 || pin >= LNGPIO_VALUE_FDS) {
+    fd = pin_open_value (pin);
+    if (fd == -1)
+      return (-1);
+    level = pin_read_level (fd);
+    close (fd);
+    return level;
+  }
+
+  fd = atomic_load (&value_fds[pin]) - 1;
+  if (fd == -1) {
+    fd = pin_open_value (pin);
+    if (fd == -1)
+      return (-1);
+    if (!atomic_compare_exchange_strong (&value_fds[pin], &expected,
+        fd + 1)) {
+      /* another thread opened it first */
+      close (fd);
+      fd = expected - 1;
+    }
+  }
+
+  return pin_read_level (fd);
+}
+
+static uint64_t
+clock_now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the sysfs value file only tells the current level, edges are derived from
+ * level changes and timestamped when we wake up */
+static int
+sysfs_read_edges (LNGPIOPinData *data, LNGPIOEdge *edges, int max_edges)
+{
+  int level;
+
+  level = pin_read_level (data->fd);
+  if (level < 0)
+    return -1;
+
+  if (level == data->level)
+    return 0;
 
-  return result;
+  data->level = level;
+  edges[0].timestamp_ns = clock_now_ns ();
+  edges[0].pin = data->pin;
+  edges[0].level = level;
+
+  return 1;
+}
+
+static int
+sysfs_read_level (LNGPIOPinData *data)
+{
+  return pin_read_level (data->fd);
 }
 
+/* the character device timestamps edges in the kernel when they happen and
+ * queues them, a single read returns a whole batch */
 static int
-pin_get_level (int fd, struct pollfd *fds)
+cdev_read_edges (LNGPIOPinData *data, LNGPIOEdge *edges, int max_edges)
 {
-  int res;
-  int rc;
-  char buf[3];
+  struct gpio_v2_line_event events[LNGPIO_EDGE_BATCH];
   ssize_t bytes;
+  int n;
+  int i;
+
+  if (max_edges > LNGPIO_EDGE_BATCH)
+    max_edges = LNGPIO_EDGE_BATCH;
 
-  rc = poll (fds, 1, 100000);
-  if (rc < 0) {
-    fprintf (stderr, "Error on poll!\n");
+  bytes = read (data->fd, events, max_edges * sizeof (events[0]));
+  if (bytes < 0) {
+    if (errno == EAGAIN || errno == EINTR)
+      return 0;
     return -1;
   }
 
-  lseek (fd, 0, SEEK_SET);
-  bytes = read (fd, buf, 3);
-  buf[1] = 0;
+  n = bytes / sizeof (events[0]);
+  for (i = 0; i < n; i++) {
+    edges[i].timestamp_ns = events[i].timestamp_ns;
+    edges[i].pin = events[i].offset;
+    edges[i].level = events[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE ? 1 : 0;
+  }
+
+  if (n > 0)
+    data->level = edges[n - 1].level;
+
+  return n;
+}
+
+static int
+cdev_read_level (LNGPIOPinData *data)
+{
+  struct gpio_v2_line_values values = { 0 };
+
+  values.mask = 1;
+  if (ioctl (data->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) == -1)
+    return -1;
+
+  return values.bits & 1;
+}
+
+/* the kernel timestamps edges on the monotonic clock as they happen */
+static uint64_t
+cdev_due_ns (LNGPIOPinData *data, const LNGPIOEdge *edge)
+{
+  return edge->timestamp_ns;
+}
+
+/* edges replayed from a trace, the fd is a timerfd expiring when the next
+ * edge is due. Replayed edges keep the spacing of the trace but are rebased
+ * to the time the replay started, so pulse lengths do not depend on the
+ * replay speed. */
+typedef struct _LNGPIOReplay
+{
+  LNGPIOTraceReader *reader;
+  /* the pins replayed, the first one is data->pin */
+  int *lines;
+  double speed;
+  uint64_t start_ns;
+  uint64_t first_ns;
+  LNGPIOEdge next;
+  int has_next;
+  int eof;
+} LNGPIOReplay;
+
+static uint64_t
+replay_due_ns (LNGPIOReplay *replay, const LNGPIOEdge *edge)
+{
+  if (replay->speed <= 0)
+    return 0;
+
+  return replay->start_ns +
+      (uint64_t) ((edge->timestamp_ns - replay->first_ns) / replay->speed);
+}
+
+static int
+replay_wants (LNGPIOPinData *data, LNGPIOReplay *replay, int pin)
+{
+  int i;
+
+  if (data->pin < 0)
+    return 1;
+
+  for (i = 0; i < data->n_lines; i++)
+    if (replay->lines[i] == pin)
+      return 1;
+
+  return 0;
+}
 
-  res = atoi (buf);
+static int
+replay_fetch (LNGPIOPinData *data, LNGPIOReplay *replay)
+{
+  while (!replay->has_next && !replay->eof) {
+    if (!lngpio_trace_reader_next (replay->reader, &replay->next)) {
+      replay->eof = 1;
+      break;
+    }
+    if (!replay_wants (data, replay, replay->next.pin))
+      continue;
+    if (replay->first_ns == 0)
+      replay->first_ns = replay->next.timestamp_ns;
+    replay->has_next = 1;
+  }
 
-  return res;
+  return replay->has_next;
 }
 
 static void
-pin_wait_level (int fd, struct pollfd *fds, int level)
+replay_arm (LNGPIOPinData *data, LNGPIOReplay *replay)
 {
-  int res;
+  struct itimerspec spec = { { 0 } };
+  uint64_t due;
+
+  /* an expiry in the past fires at once, this also reports the end of the
+   * trace */
+  if (replay_fetch (data, replay) && (due = replay_due_ns (replay,
+      &replay->next)) != 0) {
+    spec.it_value.tv_sec = due / 1000000000ULL;
+    spec.it_value.tv_nsec = due % 1000000000ULL;
+  } else {
+    spec.it_value.tv_nsec = 1;
+  }
 
-  do {
-    res = pin_get_level (fd, fds);
-  } while (res != level);
+  timerfd_settime (data->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static int
+replay_read_edges (LNGPIOPinData *data, LNGPIOEdge *edges, int max_edges)
+{
+  LNGPIOReplay *replay = data->backend_data;
+  uint64_t expirations;
+  uint64_t now;
+  int n = 0;
+
+  if (read (data->fd, &expirations, sizeof (expirations)) < 0 &&
+      errno != EAGAIN)
+    return -1;
+
+  now = clock_now_ns ();
+  while (n < max_edges && replay_fetch (data, replay) &&
+      replay_due_ns (replay, &replay->next) <= now) {
+    edges[n] = replay->next;
+    edges[n].timestamp_ns = replay->start_ns +
+        (replay->next.timestamp_ns - replay->first_ns);
+    replay->has_next = 0;
+    n++;
+  }
+
+  if (n == 0 && replay->eof)
+    return -1;
+
+  if (n > 0)
+    data->level = edges[n - 1].level;
+
+  replay_arm (data, replay);
+
+  return n;
+}
+
+/* the level of the last replayed edge */
+static int
+replay_read_level (LNGPIOPinData *data)
+{
+  return data->level;
+}
+
+/* replayed edges keep the trace spacing, they were due at the scaled
+ * offset from the start of the replay */
+static uint64_t
+replay_edge_due_ns (LNGPIOPinData *data, const LNGPIOEdge *edge)
+{
+  LNGPIOReplay *replay = data->backend_data;
+
+  if (replay->speed <= 0)
+    return 0;
+
+  return replay->start_ns +
+      (uint64_t) ((edge->timestamp_ns - replay->start_ns) / replay->speed);
+}
+
+static void
+replay_release (LNGPIOPinData *data)
+{
+  LNGPIOReplay *replay = data->backend_data;
+
+  lngpio_trace_reader_close (replay->reader);
+  free (replay->lines);
+  free (replay);
+}
+
+static const LNGPIOBackend sysfs_backend = {
+  POLLPRI,
+  sysfs_read_edges,
+  sysfs_read_level,
+  NULL,
+  NULL,
+};
+
+static const LNGPIOBackend cdev_backend = {
+  POLLIN,
+  cdev_read_edges,
+  cdev_read_level,
+  NULL,
+  cdev_due_ns,
+};
+
+static const LNGPIOBackend replay_backend = {
+  POLLIN,
+  replay_read_edges,
+  replay_read_level,
+  replay_release,
+  replay_edge_due_ns,
+};
+
+/* a replay at the end of its trace, its reads fail without an error */
+static int
+pin_ended (LNGPIOPinData *data)
+{
+  return data->backend == &replay_backend &&
+      ((LNGPIOReplay *) data->backend_data)->eof;
+}
+
+static LNGPIOPinData*
+pin_data_new (int fd, int pin, const LNGPIOBackend *backend)
+{
+  LNGPIOPinData *data;
+
+  data = malloc (sizeof (LNGPIOPinData));
+  data->fd = fd;
+  data->backend = backend;
+  data->backend_data = NULL;
+  data->filter = NULL;
+  data->pin = pin;
+  data->n_lines = 1;
+  data->level = -1;
+  data->n_pending = 0;
+  data->next_pending = 0;
+  data->pulse_start_ns = 0;
+  data->pulse_level = -1;
+  data->failed = 0;
+
+  data->fds[0] = (const struct pollfd) { 0 };
+  data->fds[0].fd = fd;
+  data->fds[0].events = backend->events;
+
+  /* never reset, once cancelled every wait returns at once */
+  data->fds[1] = (const struct pollfd) { 0 };
+  data->fds[1].fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  data->fds[1].events = POLLIN;
+  if (data->fds[1].fd == -1)
+    fprintf (stderr, "Unable to create eventfd, pin %d cannot be "
+        "cancelled\n", pin);
+
+  return data;
 }
 
 LNGPIOPinData*
 lngpio_pin_open (int pin)
 {
-  #define VALUE_MAX 30
-  char path[VALUE_MAX];
   int fd;
   LNGPIOPinData *data;
 
-  snprintf (path, VALUE_MAX, "/sys/class/gpio/gpio%d/value", pin);
-  fd = open (path, O_RDONLY);
+  fd = pin_open_value (pin);
+  if (fd == -1)
+    return NULL;
+
+  data = pin_data_new (fd, pin, &sysfs_backend);
+  data->level = pin_read_level (fd);
+
+  return data;
+}
+
+/* https://www.kernel.org/doc/html/latest/userspace-api/gpio/chardev.html */
+LNGPIOPinData*
+lngpio_pin_open_chip (const char *chip, int line)
+{
+  return lngpio_pin_open_chip_lines (chip, &line, 1);
+}
+
+/* one request for all lines, their edges arrive on one fd in the order they
+ * happened and carry the line they happened on */
+LNGPIOPinData*
+lngpio_pin_open_chip_lines (const char *chip, const int *lines, int n_lines)
+{
+  struct gpio_v2_line_request request = { 0 };
+  struct gpio_v2_line_values values = { 0 };
+  LNGPIOPinData *data;
+  int chip_fd;
+  int i;
+
+  if (n_lines < 1 || n_lines > GPIO_V2_LINES_MAX) {
+    fprintf (stderr, "Unable to request %d lines\n", n_lines);
+    return NULL;
+  }
+
+  chip_fd = open (chip, O_RDONLY | O_CLOEXEC);
+  if (chip_fd == -1) {
+    fprintf (stderr, "Unable to open %s\n", chip);
+    return NULL;
+  }
+
+  for (i = 0; i < n_lines; i++)
+    request.offsets[i] = lines[i];
+  request.num_lines = n_lines;
+  strncpy (request.consumer, "lngpio", sizeof (request.consumer) - 1);
+  request.config.flags = GPIO_V2_LINE_FLAG_INPUT |
+      GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+  request.event_buffer_size = LNGPIO_CDEV_EVENT_BUFFER * n_lines;
+
+  if (ioctl (chip_fd, GPIO_V2_GET_LINE_IOCTL, &request) == -1) {
+    fprintf (stderr, "Unable to request line %d on %s\n", lines[0], chip);
+    close (chip_fd);
+    return NULL;
+  }
+  close (chip_fd);
+
+  fcntl (request.fd, F_SETFL, fcntl (request.fd, F_GETFL) | O_NONBLOCK);
+
+  data = pin_data_new (request.fd, lines[0], &cdev_backend);
+  data->n_lines = n_lines;
+
+  values.mask = 1;
+  if (ioctl (request.fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) == 0)
+    data->level = values.bits & 1;
+
+  return data;
+}
+
+/* replays the edges of pin (all pins if pin is -1) recorded in the trace at
+ * path, see LNGPIO_TRACE_SPEED_*. Returns -1 from lngpio_pin_next_edge ()
+ * once the trace has been replayed. */
+LNGPIOPinData*
+lngpio_pin_open_trace (const char *path, int pin, double speed)
+{
+  return lngpio_pin_open_trace_lines (path, &pin, 1, speed);
+}
+
+LNGPIOPinData*
+lngpio_pin_open_trace_lines (const char *path, const int *lines,
+    int n_lines, double speed)
+{
+  LNGPIOTraceReader *reader;
+  LNGPIOReplay *replay;
+  LNGPIOPinData *data;
+  int fd;
+
+  if (n_lines < 1) {
+    fprintf (stderr, "Unable to replay %d lines\n", n_lines);
+    return NULL;
+  }
+
+  reader = lngpio_trace_reader_open (path);
+  if (reader == NULL)
+    return NULL;
+
+  fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
   if (fd == -1) {
-    fprintf (stderr, "Unable to open %s\n", path);
+    fprintf (stderr, "Unable to create timerfd\n");
+    lngpio_trace_reader_close (reader);
     return NULL;
   }
 
-  data = malloc (sizeof (LNGPIOPinData));
-  data->fd = fd;
+  replay = malloc (sizeof (LNGPIOReplay));
+  *replay = (LNGPIOReplay) { 0 };
+  replay->reader = reader;
+  replay->lines = malloc (n_lines * sizeof (int));
+  memcpy (replay->lines, lines, n_lines * sizeof (int));
+  replay->speed = speed;
+  replay->start_ns = clock_now_ns ();
 
-  data->fds = (const struct pollfd) { 0 };
-  data->fds.fd = fd;
-  data->fds.events = POLLPRI;
+  data = pin_data_new (fd, lines[0], &replay_backend);
+  data->n_lines = n_lines;
+  data->backend_data = replay;
+  replay_arm (data, replay);
 
   return data;
 }
@@ -277,97 +811,915 @@ lngpio_pin_open (int pin)
 int
 lngpio_pin_release (LNGPIOPinData *data)
 {
+  if (data->backend->release != NULL)
+    data->backend->release (data);
+  if (data->fds[1].fd != -1)
+    close (data->fds[1].fd);
+  if (data->filter != NULL)
+    lngpio_edge_filter_free (data->filter);
   close (data->fd);
   free (data);
   return 0;
 }
 
-int
-lngpio_pin_pulse_len (LNGPIOPinData *data, int level)
+/* reads a batch of edges after a wakeup and runs them through the filter,
+ * edges needs room for LNGPIO_EDGE_BATCH + LNGPIO_FILTER_SLACK */
+static int
+pin_read_edges (LNGPIOPinData *data, LNGPIOEdge *edges)
 {
-  struct timeval tn, t1;
-  long micros;
+  LNGPIOEdge raw[LNGPIO_EDGE_BATCH];
+  uint64_t dropped;
+  int n_raw;
+  int n;
+
+  n_raw = data->backend->read_edges (data, data->filter != NULL ? raw :
+      edges, LNGPIO_EDGE_BATCH);
+  air_metrics_count (AIR_METRIC_WAKEUPS, 1);
+  if (n_raw <= 0) {
+    air_metrics_count (AIR_METRIC_SPURIOUS_WAKEUPS, 1);
+    return n_raw;
+  }
+  air_metrics_count (AIR_METRIC_EDGES, n_raw);
 
-  pin_wait_level (data->fd, &data->fds, level);
-  gettimeofday (&t1, NULL);
-  pin_wait_level (data->fd, &data->fds, 1 - level);
-  gettimeofday (&tn, NULL);
+  if (data->filter == NULL)
+    return n_raw;
 
-  micros = (tn.tv_sec - t1.tv_sec) * 1000000L;
-  micros += (tn.tv_usec - t1.tv_usec);
+  /* a batch may pass on more edges than it read, count the drops */
+  dropped = lngpio_edge_filter_count (data->filter, LNGPIO_FILTER_DROPPED);
+  n = lngpio_edge_filter_process (data->filter, raw, n_raw, edges);
+  air_metrics_count (AIR_METRIC_FILTERED_EDGES,
+      lngpio_edge_filter_count (data->filter, LNGPIO_FILTER_DROPPED) -
+      dropped);
 
-  return micros;
+  return n;
 }
 
-static void*
-monitor_thread (void *data)
+/* absolute CLOCK_MONOTONIC deadline of a timeout in ms, 0 for none */
+static uint64_t
+deadline_ns (int timeout_ms)
+{
+  if (timeout_ms < 0)
+    return 0;
+
+  return clock_now_ns () + timeout_ms * 1000000ULL;
+}
+
+static int
+deadline_timeout_ms (uint64_t deadline)
 {
-  LNGPIOPinMonitor *monitor = (LNGPIOPinMonitor *)data;
-  int stop_thread = 0;
-  int latest_status = -1;
+  uint64_t now;
 
-  while (stop_thread == 0) {
-    int status;
+  if (deadline == 0)
+    return -1;
 
-    status = pin_get_level (monitor->pin_data->fd, &monitor->pin_data->fds);
+  now = clock_now_ns ();
+  if (now >= deadline)
+    return 0;
 
-    if (latest_status == -1) {
-      latest_status = status;
-      continue;
+  return (deadline - now + 999999) / 1000000;
+}
+
+static int
+pin_next_edge (LNGPIOPinData *data, LNGPIOEdge *edge, uint64_t deadline)
+{
+  int ret;
+  int n;
+
+  while (data->next_pending == data->n_pending) {
+    if (data->failed)
+      return -1;
+
+    ret = poll (data->fds, 2, deadline_timeout_ms (deadline));
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf (stderr, "Error on poll!\n");
+      return -1;
     }
 
-    if (latest_status != status) {
-      monitor->callback (monitor->pin, status);
-      latest_status = status;
+    if (data->fds[1].revents & POLLIN)
+      return LNGPIO_CANCELLED;
+    if (ret == 0)
+      return LNGPIO_TIMEOUT;
+
+    n = pin_read_edges (data, data->pending);
+    if (n < 0) {
+      data->failed = 1;
+      return -1;
     }
 
-    pthread_mutex_lock (&monitor->lock);
-    stop_thread = monitor->stop_thread;
-    pthread_mutex_unlock (&monitor->lock);
+    data->n_pending = n;
+    data->next_pending = 0;
   }
 
-  return NULL;
+  *edge = data->pending[data->next_pending++];
+
+  return 0;
 }
 
-LNGPIOPinMonitor*
-lngpio_pin_monitor_create (int pin, LNGPIOPinStatusChanged status_changed)
+static int
+pin_wait_edge (LNGPIOPinData *data, int level, LNGPIOEdge *edge,
+    uint64_t deadline)
 {
-  LNGPIOPinMonitor *monitor;
+  int ret;
 
-  monitor = malloc (sizeof (LNGPIOPinMonitor));
-  *monitor = (LNGPIOPinMonitor) { 0 };
-  monitor->pin = pin;
-  monitor->callback = status_changed;
+  do {
+    ret = pin_next_edge (data, edge, deadline);
+    if (ret < 0)
+      return ret;
+  } while (edge->level != level);
 
-  monitor->pin_data = lngpio_pin_open (pin);
+  return 0;
+}
 
-  if (pthread_mutex_init (&monitor->lock, NULL) != 0) {
-    free (monitor);
-    return NULL;
+/* a pulse started before a timeout is completed by the next call */
+static int
+pin_pulse_len (LNGPIOPinData *data, int level, uint64_t deadline)
+{
+  LNGPIOEdge edge;
+  uint64_t start_ns;
+  int ret;
+
+  if (data->pulse_start_ns == 0 || data->pulse_level != level) {
+    ret = pin_wait_edge (data, level, &edge, deadline);
+    if (ret < 0)
+      return ret;
+    data->pulse_start_ns = edge.timestamp_ns;
+    data->pulse_level = level;
   }
 
-  if (pthread_create (&monitor->thread_id, NULL, monitor_thread, monitor)) {
-    pthread_mutex_destroy (&monitor->lock);
-    free (monitor);
-    return NULL;
-  }
+  ret = pin_wait_edge (data, 1 - level, &edge, deadline);
+  if (ret < 0)
+    return ret;
+  start_ns = data->pulse_start_ns;
+  data->pulse_start_ns = 0;
 
-  return monitor;
+  return (edge.timestamp_ns - start_ns) / 1000;
 }
 
 int
-lngpio_pin_monitor_stop (LNGPIOPinMonitor *monitor)
+lngpio_pin_next_edge (LNGPIOPinData *data, LNGPIOEdge *edge)
+{
+  return pin_next_edge (data, edge, 0);
+}
+
+int
+lngpio_pin_next_edge_timeout (LNGPIOPinData *data, LNGPIOEdge *edge,
+    int timeout_ms)
 {
-  pthread_mutex_lock (&monitor->lock);
-  monitor->stop_thread = 1;
-  pthread_mutex_unlock (&monitor->lock);
+  return pin_next_edge (data, edge, deadline_ns (timeout_ms));
+}
 
-  pthread_join (monitor->thread_id, NULL);
-  pthread_mutex_destroy (&monitor->lock);
+int
+lngpio_pin_wait_level (LNGPIOPinData *data, int level, int timeout_ms)
+{
+  LNGPIOEdge edge;
 
-  lngpio_pin_release (monitor->pin_data);
+  if (data->level == level)
+    return 0;
 
-  free (monitor);
+  return pin_wait_edge (data, level, &edge, deadline_ns (timeout_ms));
+}
 
-  return 0;
+int
+lngpio_pin_pulse_len (LNGPIOPinData *data, int level)
+{
+  return pin_pulse_len (data, level, 0);
+}
+
+int
+lngpio_pin_pulse_len_timeout (LNGPIOPinData *data, int level,
+    int timeout_ms)
+{
+  return pin_pulse_len (data, level, deadline_ns (timeout_ms));
+}
+
+/* waits up to timeout_ms for the first pulse, then adds the pulses completed
+ * by the edges already received without waiting again. An error after the
+ * first pulse is left for the next call. */
+int
+lngpio_pin_pulse_len_many (LNGPIOPinData *data, int level, int *pulses_us,
+    int max_pulses, int timeout_ms)
+{
+  uint64_t deadline;
+  int n_pulses;
+  int ret;
+
+  deadline = deadline_ns (timeout_ms);
+  for (n_pulses = 0; n_pulses < max_pulses; n_pulses++) {
+    ret = pin_pulse_len (data, level, deadline);
+    if (ret < 0)
+      return n_pulses > 0 ? n_pulses : ret;
+    pulses_us[n_pulses] = ret;
+    /* only what is already there from now on */
+    deadline = 1;
+  }
+
+  return n_pulses;
+}
+
+int
+lngpio_pin_cancel (LNGPIOPinData *data)
+{
+  uint64_t one = 1;
+
+  if (data->fds[1].fd == -1 ||
+      write (data->fds[1].fd, &one, sizeof (one)) == -1)
+    return (-1);
+
+  return (0);
+}
+
+int
+lngpio_pin_set_filter (LNGPIOPinData *data, const LNGPIOFilter *config)
+{
+  LNGPIOEdgeFilter *filter = NULL;
+
+  if (data->n_lines > 1) {
+    fprintf (stderr, "Filters work on single line pins\n");
+    return (-1);
+  }
+
+  if (config != NULL) {
+    filter = lngpio_edge_filter_create (config);
+    if (filter == NULL)
+      return (-1);
+  }
+
+  if (data->filter != NULL)
+    lngpio_edge_filter_free (data->filter);
+  data->filter = filter;
+
+  return (0);
+}
+
+uint64_t
+lngpio_pin_filter_count (LNGPIOPinData *data, LNGPIOFilterCounter counter)
+{
+  if (data->filter == NULL)
+    return 0;
+
+  return lngpio_edge_filter_count (data->filter, counter);
+}
+
+int
+lngpio_pin_read (LNGPIOPinData *data)
+{
+  return data->backend->read_level (data);
+}
+
+static LNGPIOSampler*
+sampler_new (int n_pins)
+{
+  LNGPIOSampler *sampler;
+
+  sampler = malloc (sizeof (LNGPIOSampler));
+  *sampler = (LNGPIOSampler) { 0 };
+  sampler->n_pins = n_pins;
+
+  return sampler;
+}
+
+LNGPIOSampler*
+lngpio_sampler_create (const int *pins, int n_pins)
+{
+  LNGPIOSampler *sampler;
+  int i;
+
+  sampler = sampler_new (n_pins);
+  sampler->fds = malloc (n_pins * sizeof (int));
+  for (i = 0; i < n_pins; i++) {
+    sampler->fds[i] = pin_open_value (pins[i]);
+    if (sampler->fds[i] == -1) {
+      sampler->n_pins = i;
+      lngpio_sampler_free (sampler);
+      return NULL;
+    }
+  }
+
+  return sampler;
+}
+
+/* https://datasheets.raspberrypi.com/bcm2835/bcm2835-peripherals.pdf, the
+ * GPIO level registers GPLEV0 and GPLEV1 hold one bit per pin */
+LNGPIOSampler*
+lngpio_sampler_create_gpiomem (const char *path, const int *pins,
+    int n_pins)
+{
+  LNGPIOSampler *sampler;
+  struct stat st;
+  void *registers;
+  int fd;
+  int i;
+
+  for (i = 0; i < n_pins; i++) {
+    if (pins[i] < 0 || pins[i] >= GPIOMEM_N_PINS) {
+      fprintf (stderr, "Pin %d has no level register\n", pins[i]);
+      return NULL;
+    }
+  }
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf (stderr, "Unable to open %s\n", path);
+    return NULL;
+  }
+
+  /* a regular file stands in for the registers when testing */
+  if (fstat (fd, &st) == -1 ||
+      (S_ISREG (st.st_mode) && st.st_size < GPIOMEM_SIZE)) {
+    fprintf (stderr, "%s is too small for the GPIO registers\n", path);
+    close (fd);
+    return NULL;
+  }
+
+  registers = mmap (NULL, GPIOMEM_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (registers == MAP_FAILED) {
+    fprintf (stderr, "Unable to map %s\n", path);
+    return NULL;
+  }
+
+  sampler = sampler_new (n_pins);
+  sampler->registers = registers;
+  sampler->words = malloc (n_pins);
+  sampler->bits = malloc (n_pins);
+  sampler->n_words = 1;
+  for (i = 0; i < n_pins; i++) {
+    sampler->words[i] = pins[i] / 32;
+    sampler->bits[i] = pins[i] % 32;
+    if (sampler->words[i] + 1 > sampler->n_words)
+      sampler->n_words = sampler->words[i] + 1;
+  }
+
+  return sampler;
+}
+
+/* one level per pin, in the order the pins were given. The registers are
+ * read once per call so that all levels are from the same instant. */
+int
+lngpio_sampler_read (LNGPIOSampler *sampler, uint8_t *levels)
+{
+  uint32_t words[2];
+  int level;
+  int i;
+
+  if (sampler->fds != NULL) {
+    for (i = 0; i < sampler->n_pins; i++) {
+      level = pin_read_level (sampler->fds[i]);
+      if (level < 0)
+        return (-1);
+      levels[i] = level;
+    }
+    return sampler->n_pins;
+  }
+
+  for (i = 0; i < sampler->n_words; i++)
+    words[i] = sampler->registers[GPIOMEM_GPLEV0 + i];
+
+  for (i = 0; i < sampler->n_pins; i++)
+    levels[i] = (words[sampler->words[i]] >> sampler->bits[i]) & 1;
+
+  return sampler->n_pins;
+}
+
+void
+lngpio_sampler_free (LNGPIOSampler *sampler)
+{
+  int i;
+
+  if (sampler->fds != NULL) {
+    for (i = 0; i < sampler->n_pins; i++)
+      close (sampler->fds[i]);
+    free (sampler->fds);
+  }
+  if (sampler->registers != NULL)
+    munmap ((void *) sampler->registers, GPIOMEM_SIZE);
+  free (sampler->words);
+  free (sampler->bits);
+  free (sampler);
+}
+
+static __thread unsigned int callback_samples;
+
+static LNGPIOEngineSource*
+engine_find_source (LNGPIOEngine *engine, uint64_t id)
+{
+  LNGPIOEngineSource *source;
+
+  for (source = engine->sources; source != NULL; source = source->next) {
+    if (source->id == id)
+      return source;
+  }
+
+  return NULL;
+}
+
+static LNGPIOEngineSource*
+engine_find_pin (LNGPIOEngine *engine, int pin)
+{
+  LNGPIOEngineSource *source;
+
+  for (source = engine->sources; source != NULL; source = source->next) {
+    if (source->pin == pin)
+      return source;
+  }
+
+  return NULL;
+}
+
+static void
+engine_unlink_source (LNGPIOEngine *engine, LNGPIOEngineSource *source)
+{
+  LNGPIOEngineSource **link;
+
+  for (link = &engine->sources; *link != NULL; link = &(*link)->next) {
+    if (*link == source) {
+      *link = source->next;
+      break;
+    }
+  }
+}
+
+static void
+engine_free_source (LNGPIOEngineSource *source)
+{
+  lngpio_pin_release (source->pin_data);
+  free (source);
+}
+
+static int
+engine_arm_source (LNGPIOEngine *engine, LNGPIOEngineSource *source, int op)
+{
+  struct epoll_event event = { 0 };
+
+  /* one shot so that a pin is never dispatched on two threads at once */
+  if (source->pin_data->fds[0].events & POLLPRI)
+    event.events = EPOLLPRI | EPOLLERR | EPOLLONESHOT;
+  else
+    event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.u64 = source->id;
+
+  return epoll_ctl (engine->epoll_fd, op, source->pin_data->fd, &event);
+}
+
+static void
+engine_dispatch (LNGPIOEngine *engine, uint64_t id)
+{
+  LNGPIOEngineSource *source;
+  LNGPIOEdge edges[LNGPIO_EDGE_BATCH + LNGPIO_FILTER_SLACK];
+  uint64_t start_ns = 0;
+  uint64_t due_ns;
+  int sampled;
+  int n;
+  int i;
+
+  pthread_mutex_lock (&engine->lock);
+  source = engine_find_source (engine, id);
+  if (source == NULL || source->removed) {
+    pthread_mutex_unlock (&engine->lock);
+    return;
+  }
+  source->busy = 1;
+  source->dispatcher = pthread_self ();
+  pthread_mutex_unlock (&engine->lock);
+
+  /* edges filtered away do not reach the callback */
+  n = pin_read_edges (source->pin_data, edges);
+  if (n < 0 && !pin_ended (source->pin_data)) {
+    fprintf (stderr, "Unable to read edges of pin %d, no longer watching "
+        "it\n", source->pin);
+    air_metrics_count (AIR_METRIC_PIN_ERRORS, 1);
+  }
+  if (n > 0) {
+    sampled = engine->realtime.priority > 0 ||
+        callback_samples++ % CALLBACK_SAMPLE == 0;
+    if (sampled) {
+      start_ns = air_metrics_now_ns ();
+      /* only kernel and replay timestamps tell when the edge was due */
+      due_ns = source->pin_data->backend->due_ns != NULL ?
+          source->pin_data->backend->due_ns (source->pin_data, &edges[0]) : 0;
+      if (due_ns != 0 && start_ns > due_ns)
+        air_metrics_record (AIR_METRIC_WAKEUP_LATENCY, start_ns - due_ns);
+    }
+    for (i = 0; i < n; i++) {
+      if (source->edge_detected != NULL)
+        source->edge_detected (&edges[i], source->user_data);
+      else
+        source->status_changed (edges[i].pin, edges[i].level);
+    }
+    if (sampled)
+      air_metrics_record_since (AIR_METRIC_CALLBACK, start_ns);
+  }
+
+  pthread_mutex_lock (&engine->lock);
+  source->busy = 0;
+  if (source->orphaned) {
+    /* removed from within the callback, we are the last user */
+    engine_free_source (source);
+  } else if (!source->removed && n >= 0) {
+    /* a failed fd stays readable or in error, rearming it would spin */
+    engine_arm_source (engine, source, EPOLL_CTL_MOD);
+  }
+  pthread_cond_broadcast (&engine->cond);
+  pthread_mutex_unlock (&engine->lock);
+}
+
+/* touches the stack the thread will use so that no page faults happen
+ * once edges come in */
+static void __attribute__ ((noinline))
+engine_prefault_stack (void)
+{
+  volatile char stack[ENGINE_RT_PREFAULT];
+  size_t i;
+
+  for (i = 0; i < sizeof (stack); i += 4096)
+    stack[i] = 0;
+}
+
+static void
+engine_thread_realtime (LNGPIOEngine *engine)
+{
+  LNGPIORealtime *realtime = &engine->realtime;
+  struct sched_param param = { 0 };
+  cpu_set_t cpus;
+
+  if (realtime->cpu >= 0) {
+    CPU_ZERO (&cpus);
+    CPU_SET (realtime->cpu, &cpus);
+    if (pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus) != 0)
+      fprintf (stderr, "Unable to pin engine thread to cpu %d\n",
+          realtime->cpu);
+  }
+
+  if (realtime->priority > 0) {
+    param.sched_priority = realtime->priority;
+    if (pthread_setschedparam (pthread_self (), SCHED_FIFO, &param) != 0)
+      fprintf (stderr, "Unable to set SCHED_FIFO priority %d\n",
+          realtime->priority);
+  }
+
+  if (realtime->lock_memory)
+    engine_prefault_stack ();
+}
+
+static void*
+engine_thread (void *data)
+{
+  LNGPIOEngine *engine = (LNGPIOEngine *)data;
+  struct epoll_event events[ENGINE_MAX_EVENTS];
+  int n;
+  int i;
+
+  engine_thread_realtime (engine);
+
+  while (1) {
+    n = epoll_wait (engine->epoll_fd, events, ENGINE_MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf (stderr, "Error on epoll_wait!\n");
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      /* the wakeup fd is never reset, every thread sees it and exits */
+      if (events[i].data.u64 == ENGINE_WAKEUP_ID)
+        return NULL;
+      engine_dispatch (engine, events[i].data.u64);
+    }
+  }
+
+  return NULL;
+}
+
+LNGPIOEngine*
+lngpio_engine_create (int n_threads)
+{
+  return lngpio_engine_create_full (n_threads, NULL);
+}
+
+LNGPIOEngine*
+lngpio_engine_create_full (int n_threads, const LNGPIORealtime *realtime)
+{
+  LNGPIOEngine *engine;
+  struct epoll_event event = { 0 };
+  pthread_attr_t attr;
+  int i;
+
+  if (n_threads < 1)
+    n_threads = 1;
+
+  engine = malloc (sizeof (LNGPIOEngine));
+  *engine = (LNGPIOEngine) { 0 };
+  engine->next_id = ENGINE_WAKEUP_ID + 1;
+  engine->realtime.cpu = -1;
+  if (realtime != NULL)
+    engine->realtime = *realtime;
+
+  engine->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (engine->epoll_fd == -1) {
+    fprintf (stderr, "Unable to create epoll instance\n");
+    free (engine);
+    return NULL;
+  }
+
+  engine->wakeup_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (engine->wakeup_fd == -1) {
+    fprintf (stderr, "Unable to create eventfd\n");
+    close (engine->epoll_fd);
+    free (engine);
+    return NULL;
+  }
+
+  event.events = EPOLLIN;
+  event.data.u64 = ENGINE_WAKEUP_ID;
+  epoll_ctl (engine->epoll_fd, EPOLL_CTL_ADD, engine->wakeup_fd, &event);
+
+  pthread_mutex_init (&engine->lock, NULL);
+  pthread_cond_init (&engine->cond, NULL);
+
+  pthread_attr_init (&attr);
+  if (engine->realtime.lock_memory) {
+    /* before the threads exist so that their stacks are locked too */
+    if (mlockall (MCL_CURRENT | MCL_FUTURE) == -1)
+      fprintf (stderr, "Unable to lock memory\n");
+    pthread_attr_setstacksize (&attr, ENGINE_RT_STACK_SIZE);
+  }
+
+  engine->threads = malloc (n_threads * sizeof (pthread_t));
+  for (i = 0; i < n_threads; i++) {
+    if (pthread_create (&engine->threads[i], &attr, engine_thread, engine))
+      break;
+  }
+  engine->n_threads = i;
+  pthread_attr_destroy (&attr);
+
+  if (engine->n_threads == 0) {
+    lngpio_engine_stop (engine);
+    return NULL;
+  }
+
+  return engine;
+}
+
+static int
+engine_add_source (LNGPIOEngine *engine, LNGPIOPinData *pin_data,
+    LNGPIOPinStatusChanged status_changed,
+    LNGPIOPinEdgeDetected edge_detected, void *user_data)
+{
+  LNGPIOEngineSource *source;
+
+  source = malloc (sizeof (LNGPIOEngineSource));
+  *source = (LNGPIOEngineSource) { 0 };
+  source->pin_data = pin_data;
+  source->status_changed = status_changed;
+  source->edge_detected = edge_detected;
+  source->user_data = user_data;
+  source->pin = pin_data->pin;
+
+  pthread_mutex_lock (&engine->lock);
+  if (engine_find_pin (engine, source->pin) != NULL) {
+    pthread_mutex_unlock (&engine->lock);
+    fprintf (stderr, "Pin %d already monitored!\n", source->pin);
+    engine_free_source (source);
+    return (-1);
+  }
+
+  source->id = engine->next_id++;
+  if (engine_arm_source (engine, source, EPOLL_CTL_ADD) == -1) {
+    pthread_mutex_unlock (&engine->lock);
+    fprintf (stderr, "Unable to add pin %d to epoll!\n", source->pin);
+    engine_free_source (source);
+    return (-1);
+  }
+  source->next = engine->sources;
+  engine->sources = source;
+  pthread_mutex_unlock (&engine->lock);
+
+  return (0);
+}
+
+int
+lngpio_engine_add_pin (LNGPIOEngine *engine, int pin,
+    LNGPIOPinStatusChanged status_changed)
+{
+  LNGPIOPinData *pin_data;
+
+  pin_data = lngpio_pin_open (pin);
+  if (pin_data == NULL)
+    return (-1);
+
+  return engine_add_source (engine, pin_data, status_changed, NULL, NULL);
+}
+
+int
+lngpio_engine_add_pin_data (LNGPIOEngine *engine, LNGPIOPinData *pin_data,
+    LNGPIOPinEdgeDetected edge_detected, void *user_data)
+{
+  return engine_add_source (engine, pin_data, NULL, edge_detected,
+      user_data);
+}
+
+int
+lngpio_engine_remove_pin (LNGPIOEngine *engine, int pin)
+{
+  LNGPIOEngineSource *source;
+
+  pthread_mutex_lock (&engine->lock);
+  source = engine_find_pin (engine, pin);
+  if (source == NULL) {
+    pthread_mutex_unlock (&engine->lock);
+    return (-1);
+  }
+
+  source->removed = 1;
+  engine_unlink_source (engine, source);
+  epoll_ctl (engine->epoll_fd, EPOLL_CTL_DEL, source->pin_data->fd, NULL);
+
+  if (source->busy && pthread_equal (source->dispatcher, pthread_self ())) {
+    /* called from the callback, engine_dispatch () frees the source */
+    source->orphaned = 1;
+    pthread_mutex_unlock (&engine->lock);
+    return (0);
+  }
+
+  while (source->busy)
+    pthread_cond_wait (&engine->cond, &engine->lock);
+  pthread_mutex_unlock (&engine->lock);
+
+  engine_free_source (source);
+
+  return (0);
+}
+
+static int
+engine_on_thread (LNGPIOEngine *engine)
+{
+  int i;
+
+  for (i = 0; i < engine->n_threads; i++) {
+    if (pthread_equal (engine->threads[i], pthread_self ()))
+      return 1;
+  }
+
+  return 0;
+}
+
+int
+lngpio_engine_stop (LNGPIOEngine *engine)
+{
+  LNGPIOEngineSource *source;
+  uint64_t one = 1;
+  int i;
+
+  if (engine_on_thread (engine)) {
+    /* joining would deadlock and the dispatch still uses the engine */
+    fprintf (stderr, "Unable to stop the engine from its own thread!\n");
+    return (-1);
+  }
+
+  if (-1 == write (engine->wakeup_fd, &one, sizeof (one))) {
+    fprintf (stderr, "Failed to wake up engine threads!\n");
+    return (-1);
+  }
+
+  for (i = 0; i < engine->n_threads; i++)
+    pthread_join (engine->threads[i], NULL);
+
+  while (engine->sources != NULL) {
+    source = engine->sources;
+    engine->sources = source->next;
+    engine_free_source (source);
+  }
+
+  pthread_cond_destroy (&engine->cond);
+  pthread_mutex_destroy (&engine->lock);
+  close (engine->wakeup_fd);
+  close (engine->epoll_fd);
+  free (engine->threads);
+  free (engine);
+
+  return (0);
+}
+
+static LNGPIOEngine*
+default_engine_ref (void)
+{
+  LNGPIOEngine *engine;
+
+  pthread_mutex_lock (&default_engine_lock);
+  if (default_engine == NULL)
+    default_engine = lngpio_engine_create_full (1,
+        &default_engine_realtime);
+  if (default_engine != NULL)
+    default_engine_users++;
+  engine = default_engine;
+  pthread_mutex_unlock (&default_engine_lock);
+
+  return engine;
+}
+
+static void*
+default_engine_reaper (void *engine)
+{
+  lngpio_engine_stop (engine);
+
+  return NULL;
+}
+
+static void
+default_engine_unref (void)
+{
+  pthread_t reaper;
+
+  pthread_mutex_lock (&default_engine_lock);
+  if (--default_engine_users == 0) {
+    if (!engine_on_thread (default_engine))
+      lngpio_engine_stop (default_engine);
+    /* the last monitor was stopped from its callback, the engine is stopped
+     * once the dispatch returns */
+    else if (pthread_create (&reaper, NULL, default_engine_reaper,
+        default_engine) == 0)
+      pthread_detach (reaper);
+    else
+      fprintf (stderr, "Unable to stop the default engine!\n");
+    default_engine = NULL;
+  }
+  pthread_mutex_unlock (&default_engine_lock);
+}
+
+LNGPIOPinMonitor*
+lngpio_pin_monitor_create (int pin, LNGPIOPinStatusChanged status_changed)
+{
+  LNGPIOPinMonitor *monitor;
+  LNGPIOEngine *engine;
+
+  engine = default_engine_ref ();
+  if (engine == NULL)
+    return NULL;
+
+  if (lngpio_engine_add_pin (engine, pin, status_changed) == -1) {
+    default_engine_unref ();
+    return NULL;
+  }
+
+  monitor = malloc (sizeof (LNGPIOPinMonitor));
+  monitor->pin = pin;
+
+  return monitor;
+}
+
+LNGPIOPinMonitor*
+lngpio_pin_monitor_create_full (LNGPIOPinData *data,
+    LNGPIOPinEdgeDetected edge_detected, void *user_data)
+{
+  LNGPIOPinMonitor *monitor;
+  LNGPIOEngine *engine;
+  int pin = data->pin;
+
+  engine = default_engine_ref ();
+  if (engine == NULL) {
+    lngpio_pin_release (data);
+    return NULL;
+  }
+
+  if (lngpio_engine_add_pin_data (engine, data, edge_detected,
+      user_data) == -1) {
+    default_engine_unref ();
+    return NULL;
+  }
+
+  monitor = malloc (sizeof (LNGPIOPinMonitor));
+  monitor->pin = pin;
+
+  return monitor;
+}
+
+int
+lngpio_pin_monitor_stop (LNGPIOPinMonitor *monitor)
+{
+  int ret;
+
+  ret = lngpio_engine_remove_pin (default_engine, monitor->pin);
+  default_engine_unref ();
+
+  free (monitor);
+
+  return ret;
+}
+
+int
+lngpio_pin_monitor_set_realtime (const LNGPIORealtime *realtime)
+{
+  pthread_mutex_lock (&default_engine_lock);
+  if (default_engine != NULL) {
+    pthread_mutex_unlock (&default_engine_lock);
+    fprintf (stderr, "Pin monitors are already running!\n");
+    return (-1);
+  }
+  default_engine_realtime = *realtime;
+  pthread_mutex_unlock (&default_engine_lock);
+
+  return (0);
 }
@@ -18,6 +18,8 @@
 #ifndef __LNGPIO_H__
 #define __LNGPIO_H__
 
+#include <stdint.h>
+
 typedef enum LNGPIOPinDirection
 {
   LNGPIO_PIN_DIRECTION_IN,
@@ -40,17 +42,126 @@ int lngpio_set_direction (int pin, LNGPIOPinDirection direction);
 int lngpio_set_edge (int pin, LNGPIOPinEdge edge);
 int lngpio_read (int pin);
 
+/* A level change on a pin, timestamp is CLOCK_MONOTONIC. The sysfs backend
+ * takes it when the edge is read, the character device backend gets it from
+ * the kernel at the time the edge happened. */
+typedef struct _LNGPIOEdge
+{
+  uint64_t timestamp_ns;
+  int pin;
+  int level;
+} LNGPIOEdge;
+
 typedef struct _LNGPIOPinData LNGPIOPinData;
 
 LNGPIOPinData* lngpio_pin_open (int pin);
+LNGPIOPinData* lngpio_pin_open_chip (const char *chip, int line);
+/* several lines captured through one handle, edges carry their line. The
+ * handle is known by the first line, lngpio_pin_read () reads that one. */
+LNGPIOPinData* lngpio_pin_open_chip_lines (const char *chip,
+    const int *lines, int n_lines);
+/* replay speed, other values scale the trace time */
+#define LNGPIO_TRACE_SPEED_ASAP     0.0
+#define LNGPIO_TRACE_SPEED_REALTIME 1.0
+LNGPIOPinData* lngpio_pin_open_trace (const char *path, int pin,
+    double speed);
+/* replays several pins through one handle known by the first one, like
+ * lngpio_pin_open_chip_lines () */
+LNGPIOPinData* lngpio_pin_open_trace_lines (const char *path,
+    const int *lines, int n_lines, double speed);
 int lngpio_pin_release (LNGPIOPinData *data);
+int lngpio_pin_next_edge (LNGPIOPinData *data, LNGPIOEdge *edge);
 int lngpio_pin_pulse_len (LNGPIOPinData *data, int level);
 
+/* Waiting with a timeout in ms, -1 waits forever. Besides -1 on errors the
+ * waiting calls return LNGPIO_TIMEOUT when the timeout expires and
+ * LNGPIO_CANCELLED once lngpio_pin_cancel () has been called. A pulse whose
+ * start was seen before a timeout is completed by the next call. */
+#define LNGPIO_TIMEOUT   (-2)
+#define LNGPIO_CANCELLED (-3)
+
+int lngpio_pin_next_edge_timeout (LNGPIOPinData *data, LNGPIOEdge *edge,
+    int timeout_ms);
+int lngpio_pin_wait_level (LNGPIOPinData *data, int level, int timeout_ms);
+int lngpio_pin_pulse_len_timeout (LNGPIOPinData *data, int level,
+    int timeout_ms);
+/* waits for the first pulse, then adds the pulses the edges received so far
+ * complete. Returns the number of pulses written to pulses_us, or an error
+ * when there is none. */
+int lngpio_pin_pulse_len_many (LNGPIOPinData *data, int level,
+    int *pulses_us, int max_pulses, int timeout_ms);
+/* wakes up the current and every later wait on the pin, may be called from
+ * any thread and from signal handlers */
+int lngpio_pin_cancel (LNGPIOPinData *data);
+/* current level of the pin without waiting for an edge. On sysfs pins this
+ * consumes the pending edge notification, do not mix it with
+ * lngpio_pin_next_edge () there. */
+int lngpio_pin_read (LNGPIOPinData *data);
+
+/* Samples the levels of many pins in one call, for users polling pins
+ * instead of waiting for edges. lngpio_sampler_create () keeps the sysfs
+ * value files open, lngpio_sampler_create_gpiomem () maps the GPIO
+ * registers of the Raspberry Pi and reads all levels with at most two
+ * loads. Any file laid out like the register block, at least 4096 bytes
+ * with GPLEV0 at offset 0x34, stands in for LNGPIO_GPIOMEM. */
+#define LNGPIO_GPIOMEM "/dev/gpiomem"
+
+typedef struct _LNGPIOSampler LNGPIOSampler;
+
+LNGPIOSampler* lngpio_sampler_create (const int *pins, int n_pins);
+LNGPIOSampler* lngpio_sampler_create_gpiomem (const char *path,
+    const int *pins, int n_pins);
+/* returns the number of levels written or -1 */
+int lngpio_sampler_read (LNGPIOSampler *sampler, uint8_t *levels);
+void lngpio_sampler_free (LNGPIOSampler *sampler);
+
+/* Real-time capture for the engine threads, so that edges are handled on
+ * time on a busy system. priority > 0 runs them SCHED_FIFO, cpu >= 0 pins
+ * them to that core and lock_memory locks the process in memory and
+ * prefaults their stacks. Failures are reported and the engine runs
+ * without the failing setting, SCHED_FIFO and mlockall need CAP_SYS_NICE
+ * and CAP_IPC_LOCK or matching rlimits. With priority > 0 the wakeup
+ * latency of every dispatch of a gpio character device or replayed pin is
+ * recorded, see AIR_METRIC_WAKEUP_LATENCY. Sysfs pins are stamped when the
+ * thread wakes up and have no latency to record. */
+typedef struct _LNGPIORealtime
+{
+  int priority;                 /* 1 to 99, 0 for the default scheduler */
+  int cpu;                      /* -1 for any */
+  int lock_memory;
+} LNGPIORealtime;
+
 typedef struct _LNGPIOPinMonitor LNGPIOPinMonitor;
 typedef void (*LNGPIOPinStatusChanged) (int, int);
+typedef void (*LNGPIOPinEdgeDetected) (const LNGPIOEdge *, void *);
 
 LNGPIOPinMonitor* lngpio_pin_monitor_create (int pin,
     LNGPIOPinStatusChanged status_changed);
+/* takes ownership of data */
+LNGPIOPinMonitor* lngpio_pin_monitor_create_full (LNGPIOPinData *data,
+    LNGPIOPinEdgeDetected edge_detected, void *user_data);
+/* may be called from the callback of the monitor */
 int lngpio_pin_monitor_stop (LNGPIOPinMonitor *monitor);
+/* applies to monitors created afterwards, fails while monitors are running */
+int lngpio_pin_monitor_set_realtime (const LNGPIORealtime *realtime);
+
+/* An engine multiplexes any number of pins over a small pool of epoll driven
+ * event threads. Pins can be added and removed while the engine is running,
+ * the callback is invoked from one of the event threads. */
+typedef struct _LNGPIOEngine LNGPIOEngine;
+
+LNGPIOEngine* lngpio_engine_create (int n_threads);
+LNGPIOEngine* lngpio_engine_create_full (int n_threads,
+    const LNGPIORealtime *realtime);
+int lngpio_engine_add_pin (LNGPIOEngine *engine, int pin,
+    LNGPIOPinStatusChanged status_changed);
+/* takes ownership of pin_data */
+int lngpio_engine_add_pin_data (LNGPIOEngine *engine,
+    LNGPIOPinData *pin_data, LNGPIOPinEdgeDetected edge_detected,
+    void *user_data);
+/* may be called from the callback, also for the pin being dispatched */
+int lngpio_engine_remove_pin (LNGPIOEngine *engine, int pin);
+/* fails when called from one of the event threads */
+int lngpio_engine_stop (LNGPIOEngine *engine);
 
 #endif //__LNGPIO_H__
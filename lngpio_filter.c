@@ -0,0 +1,234 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "lngpio_filter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+struct _LNGPIOEdgeFilter
+{
+  LNGPIOFilter config;
+  int check_pulses;
+  uint64_t debounce_ns;
+
+  /* level and time of the last accepted edge */
+  int level;
+  uint64_t level_ns;
+  /* last edge seen, accepted or not */
+  LNGPIOEdge raw;
+
+  /* start of the pulse being checked */
+  LNGPIOEdge start;
+  int has_start;
+
+  /* widths of the last pulses, for the median */
+  unsigned int widths[LNGPIO_FILTER_MAX_MEDIAN];
+  int n_widths;
+  int next_width;
+
+  atomic_uint_fast64_t counters[LNGPIO_FILTER_COUNTERS];
+};
+
+LNGPIOEdgeFilter*
+lngpio_edge_filter_create (const LNGPIOFilter *config)
+{
+  LNGPIOEdgeFilter *filter;
+
+  if (config->median_window < 0 ||
+      config->median_window > LNGPIO_FILTER_MAX_MEDIAN) {
+    fprintf (stderr, "Median window must be 0 to %d pulses\n",
+        LNGPIO_FILTER_MAX_MEDIAN);
+    return NULL;
+  }
+
+  if (config->median_window > 0 && config->outlier_ratio <= 1.0) {
+    fprintf (stderr, "Outlier ratio must be above 1\n");
+    return NULL;
+  }
+
+  filter = calloc (1, sizeof (LNGPIOEdgeFilter));
+  filter->config = *config;
+  filter->check_pulses = config->min_pulse_us > 0 ||
+      config->max_pulse_us > 0 || config->median_window > 0;
+  filter->debounce_ns = config->debounce_us * 1000ULL;
+  filter->level = -1;
+  filter->raw.level = -1;
+
+  return filter;
+}
+
+void
+lngpio_edge_filter_free (LNGPIOEdgeFilter *filter)
+{
+  free (filter);
+}
+
+static void
+filter_count (LNGPIOEdgeFilter *filter, LNGPIOFilterCounter counter)
+{
+  /* only the thread handling the pin counts */
+  atomic_store_explicit (&filter->counters[counter], atomic_load_explicit (
+      &filter->counters[counter], memory_order_relaxed) + 1,
+      memory_order_relaxed);
+}
+
+static unsigned int
+filter_median (LNGPIOEdgeFilter *filter)
+{
+  unsigned int sorted[LNGPIO_FILTER_MAX_MEDIAN];
+  unsigned int width;
+  int i;
+  int j;
+
+  /* insertion sort, there are at most 15 */
+  for (i = 0; i < filter->n_widths; i++) {
+    width = filter->widths[i];
+    for (j = i; j > 0 && sorted[j - 1] > width; j--)
+      sorted[j] = sorted[j - 1];
+    sorted[j] = width;
+  }
+
+  return sorted[filter->n_widths / 2];
+}
+
+/* the median follows every plausible pulse, outliers included, so that it
+ * catches up when the dust level changes */
+static int
+filter_is_outlier (LNGPIOEdgeFilter *filter, unsigned int width)
+{
+  float median;
+  int outlier = 0;
+
+  if (filter->n_widths == filter->config.median_window) {
+    median = filter_median (filter);
+    outlier = width > median * filter->config.outlier_ratio ||
+        width * filter->config.outlier_ratio < median;
+  }
+
+  filter->widths[filter->next_width] = width;
+  filter->next_width = (filter->next_width + 1) %
+      filter->config.median_window;
+  if (filter->n_widths < filter->config.median_window)
+    filter->n_widths++;
+
+  return outlier;
+}
+
+static int
+filter_accept (LNGPIOEdgeFilter *filter, const LNGPIOEdge *edge,
+    LNGPIOEdge *out)
+{
+  unsigned int width;
+
+  filter->level = edge->level;
+  filter->level_ns = edge->timestamp_ns;
+
+  if (!filter->check_pulses) {
+    out[0] = *edge;
+    return 1;
+  }
+
+  if (edge->level == filter->config.level) {
+    filter->start = *edge;
+    filter->has_start = 1;
+    return 0;
+  }
+
+  /* the end of a pulse whose start we did not see */
+  if (!filter->has_start) {
+    out[0] = *edge;
+    return 1;
+  }
+
+  filter->has_start = 0;
+  width = (edge->timestamp_ns - filter->start.timestamp_ns) / 1000;
+
+  if (width < filter->config.min_pulse_us) {
+    filter_count (filter, LNGPIO_FILTER_GLITCHES);
+    return 0;
+  }
+  if (filter->config.max_pulse_us > 0 &&
+      width > filter->config.max_pulse_us) {
+    filter_count (filter, LNGPIO_FILTER_TOO_LONG);
+    return 0;
+  }
+  if (filter->config.median_window > 0 && filter_is_outlier (filter, width)) {
+    filter_count (filter, LNGPIO_FILTER_OUTLIERS);
+    return 0;
+  }
+
+  filter_count (filter, LNGPIO_FILTER_PASSED);
+  out[0] = filter->start;
+  out[1] = *edge;
+
+  return 2;
+}
+
+/* edges held back for a later batch, the start of a pulse and the edge a
+ * bounce may still settle on */
+static int
+filter_held (LNGPIOEdgeFilter *filter)
+{
+  return filter->has_start +
+      (filter->raw.level != -1 && filter->raw.level != filter->level);
+}
+
+int
+lngpio_edge_filter_process (LNGPIOEdgeFilter *filter,
+    const LNGPIOEdge *edges, int n, LNGPIOEdge *out)
+{
+  int held = filter_held (filter);
+  int n_out = 0;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (filter->level != -1 &&
+        edges[i].timestamp_ns - filter->level_ns < filter->debounce_ns) {
+      filter_count (filter, LNGPIO_FILTER_BOUNCES);
+      filter->raw = edges[i];
+      continue;
+    }
+
+    /* the bounce settled on the other level, it changed with the last
+     * dropped edge */
+    if (filter->raw.level != -1 && filter->raw.level != filter->level)
+      n_out += filter_accept (filter, &filter->raw, &out[n_out]);
+
+    filter->raw = edges[i];
+    if (edges[i].level != filter->level)
+      n_out += filter_accept (filter, &edges[i], &out[n_out]);
+  }
+
+  /* every edge is passed on, held back or dropped */
+  atomic_store_explicit (&filter->counters[LNGPIO_FILTER_DROPPED],
+      atomic_load_explicit (&filter->counters[LNGPIO_FILTER_DROPPED],
+      memory_order_relaxed) + n + held - n_out - filter_held (filter),
+      memory_order_relaxed);
+
+  return n_out;
+}
+
+uint64_t
+lngpio_edge_filter_count (LNGPIOEdgeFilter *filter,
+    LNGPIOFilterCounter counter)
+{
+  return atomic_load_explicit (&filter->counters[counter],
+      memory_order_relaxed);
+}
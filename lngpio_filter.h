@@ -0,0 +1,76 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __LNGPIO_FILTER_H__
+#define __LNGPIO_FILTER_H__
+
+#include "lngpio.h"
+
+/* Filtering of raw edges before they reach the sensors. Level changes
+ * undone within debounce_us are bounce and dropped, the level they settle
+ * on is applied once the next edge shows it held. Pulses of the given
+ * level are then checked as a whole: their start edge is held back until
+ * they end and both edges are dropped when the pulse is shorter than
+ * min_pulse_us, longer than max_pulse_us or, once median_window pulses have
+ * been seen, further than outlier_ratio off their median. Zero disables a
+ * check. */
+typedef struct _LNGPIOFilter
+{
+  int level;                    /* level of the pulses, low for the PPD42 */
+  unsigned int debounce_us;
+  unsigned int min_pulse_us;
+  unsigned int max_pulse_us;
+  int median_window;            /* up to LNGPIO_FILTER_MAX_MEDIAN pulses */
+  float outlier_ratio;
+} LNGPIOFilter;
+
+#define LNGPIO_FILTER_MAX_MEDIAN 15
+/* a batch of n edges may leave the filter as up to n + LNGPIO_FILTER_SLACK
+ * edges, the ones held back from earlier batches */
+#define LNGPIO_FILTER_SLACK 2
+
+typedef enum LNGPIOFilterCounter
+{
+  LNGPIO_FILTER_PASSED,         /* pulses passed on */
+  LNGPIO_FILTER_BOUNCES,        /* edges dropped as bounce */
+  LNGPIO_FILTER_GLITCHES,       /* pulses shorter than min_pulse_us */
+  LNGPIO_FILTER_TOO_LONG,       /* pulses longer than max_pulse_us */
+  LNGPIO_FILTER_OUTLIERS,
+  LNGPIO_FILTER_DROPPED,        /* edges dropped for any of the above */
+  LNGPIO_FILTER_COUNTERS,
+} LNGPIOFilterCounter;
+
+typedef struct _LNGPIOEdgeFilter LNGPIOEdgeFilter;
+
+LNGPIOEdgeFilter* lngpio_edge_filter_create (const LNGPIOFilter *config);
+void lngpio_edge_filter_free (LNGPIOEdgeFilter *filter);
+
+/* filters n edges of one pin into out, returns the number of edges left */
+int lngpio_edge_filter_process (LNGPIOEdgeFilter *filter,
+    const LNGPIOEdge *edges, int n, LNGPIOEdge *out);
+/* may be called from any thread */
+uint64_t lngpio_edge_filter_count (LNGPIOEdgeFilter *filter,
+    LNGPIOFilterCounter counter);
+
+/* filters the edges of the pin from now on, NULL removes the filter. Must
+ * not be called while the pin is monitored. */
+int lngpio_pin_set_filter (LNGPIOPinData *data, const LNGPIOFilter *config);
+/* 0 when the pin has no filter */
+uint64_t lngpio_pin_filter_count (LNGPIOPinData *data,
+    LNGPIOFilterCounter counter);
+
+#endif //__LNGPIO_FILTER_H__
@@ -0,0 +1,136 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "lngpio_ring.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE 64
+
+struct _LNGPIOEdgeRing
+{
+  /* written by the producer only */
+  _Alignas (CACHE_LINE) atomic_uint head;
+  unsigned int cached_tail;
+  atomic_uint_fast64_t overflows;
+
+  /* written by the consumer only */
+  _Alignas (CACHE_LINE) atomic_uint tail;
+  unsigned int cached_head;
+
+  _Alignas (CACHE_LINE) unsigned int mask;
+  LNGPIOEdge *edges;
+};
+
+LNGPIOEdgeRing*
+lngpio_edge_ring_create (unsigned int capacity)
+{
+  LNGPIOEdgeRing *ring;
+  unsigned int size = 2;
+
+  while (size < capacity)
+    size <<= 1;
+
+  if (posix_memalign ((void **) &ring, CACHE_LINE, sizeof (LNGPIOEdgeRing)))
+    return NULL;
+
+  atomic_init (&ring->head, 0);
+  atomic_init (&ring->tail, 0);
+  atomic_init (&ring->overflows, 0);
+  ring->cached_tail = 0;
+  ring->cached_head = 0;
+  ring->mask = size - 1;
+
+  ring->edges = malloc (size * sizeof (LNGPIOEdge));
+  if (ring->edges == NULL) {
+    free (ring);
+    return NULL;
+  }
+
+  return ring;
+}
+
+void
+lngpio_edge_ring_free (LNGPIOEdgeRing *ring)
+{
+  free (ring->edges);
+  free (ring);
+}
+
+int
+lngpio_edge_ring_push (LNGPIOEdgeRing *ring, const LNGPIOEdge *edge)
+{
+  unsigned int head;
+
+  head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+
+  /* only look at the consumer's index when our cached copy says full */
+  if (head - ring->cached_tail > ring->mask) {
+    ring->cached_tail = atomic_load_explicit (&ring->tail,
+        memory_order_acquire);
+    if (head - ring->cached_tail > ring->mask) {
+      atomic_fetch_add_explicit (&ring->overflows, 1, memory_order_relaxed);
+      return (-1);
+    }
+  }
+
+  ring->edges[head & ring->mask] = *edge;
+  atomic_store_explicit (&ring->head, head + 1, memory_order_release);
+
+  return (0);
+}
+
+int
+lngpio_edge_ring_drain (LNGPIOEdgeRing *ring, LNGPIOEdge *edges,
+    int max_edges)
+{
+  unsigned int tail;
+  int n = 0;
+
+  tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+
+  if (ring->cached_head == tail)
+    ring->cached_head = atomic_load_explicit (&ring->head,
+        memory_order_acquire);
+
+  while (n < max_edges && tail != ring->cached_head)
+    edges[n++] = ring->edges[tail++ & ring->mask];
+
+  atomic_store_explicit (&ring->tail, tail, memory_order_release);
+
+  return n;
+}
+
+unsigned int
+lngpio_edge_ring_count (LNGPIOEdgeRing *ring)
+{
+  return atomic_load_explicit (&ring->head, memory_order_acquire) -
+      atomic_load_explicit (&ring->tail, memory_order_acquire);
+}
+
+uint64_t
+lngpio_edge_ring_overflows (LNGPIOEdgeRing *ring)
+{
+  return atomic_load_explicit (&ring->overflows, memory_order_relaxed);
+}
+
+void
+lngpio_edge_ring_edge_detected (const LNGPIOEdge *edge, void *ring)
+{
+  lngpio_edge_ring_push ((LNGPIOEdgeRing *) ring, edge);
+}
@@ -0,0 +1,42 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __LNGPIO_RING_H__
+#define __LNGPIO_RING_H__
+
+#include "lngpio.h"
+
+/* Bounded single producer/single consumer lock-free queue of edges. The
+ * producer is the engine thread delivering edges for one pin, the consumer
+ * drains them at its own pace. Edges arriving while the ring is full are
+ * dropped and counted. */
+typedef struct _LNGPIOEdgeRing LNGPIOEdgeRing;
+
+LNGPIOEdgeRing* lngpio_edge_ring_create (unsigned int capacity);
+void lngpio_edge_ring_free (LNGPIOEdgeRing *ring);
+
+int lngpio_edge_ring_push (LNGPIOEdgeRing *ring, const LNGPIOEdge *edge);
+int lngpio_edge_ring_drain (LNGPIOEdgeRing *ring, LNGPIOEdge *edges,
+    int max_edges);
+
+unsigned int lngpio_edge_ring_count (LNGPIOEdgeRing *ring);
+uint64_t lngpio_edge_ring_overflows (LNGPIOEdgeRing *ring);
+
+/* LNGPIOPinEdgeDetected pushing into the ring passed as user_data */
+void lngpio_edge_ring_edge_detected (const LNGPIOEdge *edge, void *ring);
+
+#endif //__LNGPIO_RING_H__
@@ -0,0 +1,207 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "lngpio_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define TRACE_MAGIC "LNGTRC01"
+#define TRACE_MAGIC_LEN 8
+/* 64 bit varint */
+#define VARINT_MAX 10
+
+struct _LNGPIOTraceWriter
+{
+  FILE *file;
+  /* edges of different pins come from different engine threads */
+  pthread_mutex_t lock;
+  uint64_t last_ns;
+};
+
+struct _LNGPIOTraceReader
+{
+  FILE *file;
+  uint64_t last_ns;
+};
+
+static int
+varint_encode (uint64_t value, unsigned char *buf)
+{
+  int n = 0;
+
+  while (value >= 0x80) {
+    buf[n++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  buf[n++] = value;
+
+  return n;
+}
+
+/* returns 1 and the value, 0 at end of file and -1 on a truncated varint */
+static int
+varint_read (FILE *file, uint64_t *value)
+{
+  int shift = 0;
+  int c;
+
+  *value = 0;
+
+  while ((c = getc (file)) != EOF) {
+    *value |= (uint64_t) (c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return 1;
+    shift += 7;
+    if (shift >= 64)
+      return -1;
+  }
+
+  return shift == 0 ? 0 : -1;
+}
+
+LNGPIOTraceWriter*
+lngpio_trace_writer_create (const char *path)
+{
+  LNGPIOTraceWriter *writer;
+  FILE *file;
+
+  file = fopen (path, "wb");
+  if (file == NULL) {
+    fprintf (stderr, "Unable to create trace %s\n", path);
+    return NULL;
+  }
+
+  if (fwrite (TRACE_MAGIC, TRACE_MAGIC_LEN, 1, file) != 1) {
+    fprintf (stderr, "Unable to write trace %s\n", path);
+    fclose (file);
+    return NULL;
+  }
+
+  writer = malloc (sizeof (LNGPIOTraceWriter));
+  writer->file = file;
+  writer->last_ns = 0;
+  pthread_mutex_init (&writer->lock, NULL);
+
+  return writer;
+}
+
+int
+lngpio_trace_writer_add (LNGPIOTraceWriter *writer, const LNGPIOEdge *edge)
+{
+  unsigned char buf[2 * VARINT_MAX];
+  int64_t delta;
+  int n;
+  int ret = 0;
+
+  pthread_mutex_lock (&writer->lock);
+
+  /* pins dispatched on different threads may be recorded slightly out of
+   * order, zigzag keeps small negative deltas small */
+  delta = (int64_t) (edge->timestamp_ns - writer->last_ns);
+  n = varint_encode (((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63), buf);
+  n += varint_encode (((uint64_t) edge->pin << 1) | (edge->level & 1),
+      buf + n);
+  writer->last_ns = edge->timestamp_ns;
+
+  if (fwrite (buf, n, 1, writer->file) != 1)
+    ret = -1;
+
+  pthread_mutex_unlock (&writer->lock);
+
+  return ret;
+}
+
+int
+lngpio_trace_writer_close (LNGPIOTraceWriter *writer)
+{
+  int ret;
+
+  ret = fclose (writer->file) == 0 ? 0 : -1;
+  if (ret == -1)
+    fprintf (stderr, "Unable to write trace\n");
+
+  pthread_mutex_destroy (&writer->lock);
+  free (writer);
+
+  return ret;
+}
+
+void
+lngpio_trace_writer_edge_detected (const LNGPIOEdge *edge, void *writer)
+{
+  lngpio_trace_writer_add ((LNGPIOTraceWriter *) writer, edge);
+}
+
+LNGPIOTraceReader*
+lngpio_trace_reader_open (const char *path)
+{
+  LNGPIOTraceReader *reader;
+  char magic[TRACE_MAGIC_LEN];
+  FILE *file;
+
+  file = fopen (path, "rb");
+  if (file == NULL) {
+    fprintf (stderr, "Unable to open trace %s\n", path);
+    return NULL;
+  }
+
+  if (fread (magic, TRACE_MAGIC_LEN, 1, file) != 1 ||
+      memcmp (magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+    fprintf (stderr, "%s is not an edge trace\n", path);
+    fclose (file);
+    return NULL;
+  }
+
+  reader = malloc (sizeof (LNGPIOTraceReader));
+  reader->file = file;
+  reader->last_ns = 0;
+
+  return reader;
+}
+
+int
+lngpio_trace_reader_next (LNGPIOTraceReader *reader, LNGPIOEdge *edge)
+{
+  uint64_t delta;
+  uint64_t pin_level;
+  int ret;
+
+  ret = varint_read (reader->file, &delta);
+  if (ret == 0)
+    return 0;
+  if (ret == -1 || varint_read (reader->file, &pin_level) != 1) {
+    fprintf (stderr, "Truncated edge trace\n");
+    return 0;
+  }
+
+  reader->last_ns += (delta >> 1) ^ -(delta & 1);
+  edge->timestamp_ns = reader->last_ns;
+  edge->pin = pin_level >> 1;
+  edge->level = pin_level & 1;
+
+  return 1;
+}
+
+void
+lngpio_trace_reader_close (LNGPIOTraceReader *reader)
+{
+  fclose (reader->file);
+  free (reader);
+}
@@ -0,0 +1,43 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __LNGPIO_TRACE_H__
+#define __LNGPIO_TRACE_H__
+
+#include "lngpio.h"
+
+/* Edge traces. A trace file starts with an 8 byte magic followed by one
+ * record per edge: the zigzag varint encoded time since the previous edge in
+ * ns and the varint encoded (pin << 1 | level). A PPD42 edge typically takes
+ * 5 bytes. Traces are replayed with lngpio_pin_open_trace (). */
+typedef struct _LNGPIOTraceWriter LNGPIOTraceWriter;
+typedef struct _LNGPIOTraceReader LNGPIOTraceReader;
+
+LNGPIOTraceWriter* lngpio_trace_writer_create (const char *path);
+int lngpio_trace_writer_add (LNGPIOTraceWriter *writer,
+    const LNGPIOEdge *edge);
+int lngpio_trace_writer_close (LNGPIOTraceWriter *writer);
+
+/* LNGPIOPinEdgeDetected recording into the writer passed as user_data */
+void lngpio_trace_writer_edge_detected (const LNGPIOEdge *edge, void *writer);
+
+LNGPIOTraceReader* lngpio_trace_reader_open (const char *path);
+/* returns 1 and the next edge, 0 at the end of the trace */
+int lngpio_trace_reader_next (LNGPIOTraceReader *reader, LNGPIOEdge *edge);
+void lngpio_trace_reader_close (LNGPIOTraceReader *reader);
+
+#endif //__LNGPIO_TRACE_H__
@@ -0,0 +1,506 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "mysql_writer.h"
+#include "air_spool.h"
+#include "air_metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* MySQL headers */
+#include <mysql.h>
+
+#define MAX_BATCH_SIZE 64
+#define PARAMS_PER_ROW 4
+#define CONNECT_TIMEOUT_S 5
+#define BACKOFF_MIN_MS 1000
+#define BACKOFF_MAX_MS 60000
+
+/* parameters bound for one row of the multi-row INSERT */
+typedef struct _MySQLRow
+{
+  float concentration_pcs;
+  float concentration_ugm3;
+  int aqi;
+  double timestamp;
+} MySQLRow;
+
+struct _MySQLWriter
+{
+  MySQLWriterConfig config;
+  pthread_t thread_id;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop_thread;
+
+  /* rows not yet stored, either in the spool file or in memory where head
+   * is the oldest one */
+  AirSpool *spool;
+  AirReading *queue;
+  int head;
+  int count;
+  unsigned long dropped;
+  struct timespec flush_deadline;
+
+  /* only used by the writer thread */
+  MYSQL *con;
+  MYSQL_STMT *stmts[MAX_BATCH_SIZE + 1];
+  MYSQL_BIND binds[MAX_BATCH_SIZE * PARAMS_PER_ROW];
+  MySQLRow rows[MAX_BATCH_SIZE];
+  AirReading readings[MAX_BATCH_SIZE];
+  int backoff_ms;
+  struct timespec next_connect;
+};
+
+static void
+timespec_add_ms (struct timespec *ts, long ms)
+{
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+static int
+timespec_passed (const struct timespec *ts)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec > ts->tv_sec ||
+      (now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec);
+}
+
+/* waits for a signal or deadline, NULL waits for a signal only. The spool
+ * is synced when its fsync interval passes first, appends alone never sync
+ * the last records once readings stop coming. */
+static void
+writer_wait (MySQLWriter *writer, const struct timespec *deadline)
+{
+  struct timespec sync;
+  int ret;
+
+  if (writer->spool != NULL &&
+      air_spool_sync_deadline (writer->spool, &sync)) {
+    if (timespec_passed (&sync)) {
+      pthread_mutex_unlock (&writer->lock);
+      ret = air_spool_sync (writer->spool);
+      pthread_mutex_lock (&writer->lock);
+      if (ret == 0)
+        return;
+      /* retried by the next append or wakeup rather than spinning */
+      fprintf (stderr, "Unable to sync the spool\n");
+    } else if (deadline == NULL || sync.tv_sec < deadline->tv_sec ||
+        (sync.tv_sec == deadline->tv_sec &&
+            sync.tv_nsec < deadline->tv_nsec))
+      deadline = &sync;
+  }
+
+  if (deadline == NULL)
+    pthread_cond_wait (&writer->cond, &writer->lock);
+  else
+    pthread_cond_timedwait (&writer->cond, &writer->lock, deadline);
+}
+
+static void
+writer_disconnect (MySQLWriter *writer)
+{
+  int i;
+
+  for (i = 0; i <= MAX_BATCH_SIZE; i++) {
+    if (writer->stmts[i] != NULL) {
+      mysql_stmt_close (writer->stmts[i]);
+      writer->stmts[i] = NULL;
+    }
+  }
+
+  if (writer->con != NULL) {
+    mysql_close (writer->con);
+    writer->con = NULL;
+  }
+}
+
+static int
+writer_connect (MySQLWriter *writer)
+{
+  unsigned int timeout = CONNECT_TIMEOUT_S;
+
+  writer->con = mysql_init (NULL);
+  if (writer->con == NULL) {
+    fprintf (stderr, "mysql_init failed\n");
+    return (-1);
+  }
+
+  mysql_options (writer->con, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+
+  if (mysql_real_connect (writer->con, writer->config.host,
+      writer->config.user, writer->config.password, writer->config.database,
+      writer->config.port, NULL, 0) == NULL) {
+    fprintf (stderr, "%s\n", mysql_error (writer->con));
+    writer_disconnect (writer);
+    return (-1);
+  }
+
+  return (0);
+}
+
+static MYSQL_STMT*
+writer_prepare (MySQLWriter *writer, int n_rows)
+{
+  MYSQL_STMT *stmt;
+  char *query;
+  size_t len;
+  int i;
+
+  if (writer->stmts[n_rows] != NULL)
+    return writer->stmts[n_rows];
+
+  query = malloc (128 + n_rows * 40);
+  len = sprintf (query, "INSERT INTO ParticlePM25 (concentration_pcs,"
+      " concentration_ugm3, aqi, ts_created) VALUES ");
+  for (i = 0; i < n_rows; i++) {
+    len += sprintf (query + len, "%s(?, ?, ?, FROM_UNIXTIME(?))",
+        i == 0 ? "" : ", ");
+  }
+
+  stmt = mysql_stmt_init (writer->con);
+  if (stmt == NULL) {
+    free (query);
+    return NULL;
+  }
+
+  if (mysql_stmt_prepare (stmt, query, len) ||
+      mysql_stmt_bind_param (stmt, writer->binds)) {
+    fprintf (stderr, "%s\n", mysql_stmt_error (stmt));
+    mysql_stmt_close (stmt);
+    free (query);
+    return NULL;
+  }
+
+  free (query);
+  writer->stmts[n_rows] = stmt;
+
+  return stmt;
+}
+
+static int
+writer_insert (MySQLWriter *writer, int n_rows)
+{
+  MYSQL_STMT *stmt;
+  uint64_t start_ns;
+
+  stmt = writer_prepare (writer, n_rows);
+  if (stmt == NULL) {
+    air_metrics_count (AIR_METRIC_DB_ERRORS, 1);
+    return (-1);
+  }
+
+  start_ns = air_metrics_now_ns ();
+  if (mysql_stmt_execute (stmt)) {
+    fprintf (stderr, "%s\n", mysql_stmt_error (stmt));
+    air_metrics_count (AIR_METRIC_DB_ERRORS, 1);
+    return (-1);
+  }
+  air_metrics_record_since (AIR_METRIC_DB_WRITE, start_ns);
+
+  return (0);
+}
+
+/* must be called with the lock held */
+static int
+writer_pending (MySQLWriter *writer)
+{
+  if (writer->spool != NULL)
+    return air_spool_count (writer->spool);
+
+  return writer->count;
+}
+
+/* copies the n oldest pending rows into the bound parameters */
+static int
+writer_fetch (MySQLWriter *writer, int n)
+{
+  AirReading *reading;
+  int i;
+
+  if (writer->spool != NULL) {
+    n = air_spool_peek (writer->spool, writer->readings, n);
+  } else {
+    for (i = 0; i < n; i++) {
+      writer->readings[i] =
+          writer->queue[(writer->head + i) % writer->config.queue_size];
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    reading = &writer->readings[i];
+    writer->rows[i].concentration_pcs = reading->concentration_pcs;
+    writer->rows[i].concentration_ugm3 = reading->concentration_ugm3;
+    writer->rows[i].aqi = reading->aqi;
+    writer->rows[i].timestamp = reading->timestamp_ms / 1000.0;
+  }
+
+  return n;
+}
+
+/* drops the n oldest pending rows, they have been stored or rejected */
+static void
+writer_consume (MySQLWriter *writer, int n)
+{
+  if (writer->spool != NULL) {
+    air_spool_ack (writer->spool, n);
+  } else {
+    writer->head = (writer->head + n) % writer->config.queue_size;
+    writer->count -= n;
+  }
+}
+
+static void*
+writer_thread (void *data)
+{
+  MySQLWriter *writer = (MySQLWriter *)data;
+  int n;
+
+  mysql_thread_init ();
+
+  pthread_mutex_lock (&writer->lock);
+  while (1) {
+    while (!writer->stop_thread &&
+        writer_pending (writer) < writer->config.batch_size &&
+        (writer_pending (writer) == 0 ||
+            !timespec_passed (&writer->flush_deadline))) {
+      writer_wait (writer, writer_pending (writer) == 0 ? NULL :
+          &writer->flush_deadline);
+    }
+
+    n = writer_pending (writer);
+    if (n == 0) {
+      if (writer->stop_thread)
+        break;
+      continue;
+    }
+
+    if (writer->con == NULL) {
+      if (!timespec_passed (&writer->next_connect) && !writer->stop_thread) {
+        writer_wait (writer, &writer->next_connect);
+        continue;
+      }
+
+      pthread_mutex_unlock (&writer->lock);
+      if (writer_connect (writer) == -1) {
+        pthread_mutex_lock (&writer->lock);
+        if (writer->stop_thread) {
+          if (writer->spool == NULL) {
+            fprintf (stderr, "Discarding %d unstored readings\n", n);
+            writer->dropped += n;
+            writer_consume (writer, n);
+          }
+          break;
+        }
+        clock_gettime (CLOCK_MONOTONIC, &writer->next_connect);
+        timespec_add_ms (&writer->next_connect, writer->backoff_ms);
+        writer->backoff_ms *= 2;
+        if (writer->backoff_ms > BACKOFF_MAX_MS)
+          writer->backoff_ms = BACKOFF_MAX_MS;
+        continue;
+      }
+      pthread_mutex_lock (&writer->lock);
+      writer->backoff_ms = BACKOFF_MIN_MS;
+    }
+
+    if (n > writer->config.batch_size)
+      n = writer->config.batch_size;
+    n = writer_fetch (writer, n);
+    pthread_mutex_unlock (&writer->lock);
+
+    if (writer_insert (writer, n) == 0) {
+      pthread_mutex_lock (&writer->lock);
+    } else if (mysql_ping (writer->con) != 0) {
+      /* connection lost, keep the rows and retry after reconnecting */
+      writer_disconnect (writer);
+      pthread_mutex_lock (&writer->lock);
+      continue;
+    } else {
+      /* the server rejected the rows themselves, retrying will not help */
+      pthread_mutex_lock (&writer->lock);
+      fprintf (stderr, "Discarding %d rejected readings\n", n);
+      writer->dropped += n;
+    }
+
+    writer_consume (writer, n);
+  }
+  pthread_mutex_unlock (&writer->lock);
+
+  writer_disconnect (writer);
+  mysql_thread_end ();
+
+  return NULL;
+}
+
+MySQLWriter*
+mysql_writer_create (const MySQLWriterConfig *config)
+{
+  MySQLWriter *writer;
+  pthread_condattr_t attr;
+  MYSQL_BIND *bind;
+  int i;
+
+  if (mysql_library_init (0, NULL, NULL)) {
+    fprintf (stderr, "Unable to initialize MySQL client library\n");
+    return NULL;
+  }
+
+  writer = calloc (1, sizeof (MySQLWriter));
+
+  if (config->spool_path != NULL) {
+    writer->spool = air_spool_open (config->spool_path,
+        config->spool_fsync_records, config->spool_fsync_interval_ms);
+    if (writer->spool == NULL) {
+      free (writer);
+      return NULL;
+    }
+  }
+
+  writer->config = *config;
+  writer->config.spool_path = NULL;
+  writer->config.host = config->host ? strdup (config->host) : NULL;
+  writer->config.user = config->user ? strdup (config->user) : NULL;
+  writer->config.password = config->password ? strdup (config->password) :
+      NULL;
+  writer->config.database = config->database ? strdup (config->database) :
+      NULL;
+
+  if (writer->config.batch_size < 1)
+    writer->config.batch_size = 1;
+  if (writer->config.batch_size > MAX_BATCH_SIZE)
+    writer->config.batch_size = MAX_BATCH_SIZE;
+  if (writer->config.queue_size < writer->config.batch_size)
+    writer->config.queue_size = writer->config.batch_size;
+
+  writer->queue = malloc (writer->config.queue_size * sizeof (AirReading));
+  writer->backoff_ms = BACKOFF_MIN_MS;
+
+  /* every prepared statement binds a prefix of the same parameter array */
+  for (i = 0; i < MAX_BATCH_SIZE; i++) {
+    bind = &writer->binds[i * PARAMS_PER_ROW];
+    bind[0].buffer_type = MYSQL_TYPE_FLOAT;
+    bind[0].buffer = &writer->rows[i].concentration_pcs;
+    bind[1].buffer_type = MYSQL_TYPE_FLOAT;
+    bind[1].buffer = &writer->rows[i].concentration_ugm3;
+    bind[2].buffer_type = MYSQL_TYPE_LONG;
+    bind[2].buffer = &writer->rows[i].aqi;
+    bind[3].buffer_type = MYSQL_TYPE_DOUBLE;
+    bind[3].buffer = &writer->rows[i].timestamp;
+  }
+
+  pthread_mutex_init (&writer->lock, NULL);
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&writer->cond, &attr);
+  pthread_condattr_destroy (&attr);
+
+  if (pthread_create (&writer->thread_id, NULL, writer_thread, writer)) {
+    mysql_writer_stop (writer);
+    return NULL;
+  }
+
+  return writer;
+}
+
+int
+mysql_writer_push (MySQLWriter *writer, const AirReading *reading)
+{
+  int queue_size = writer->config.queue_size;
+
+  pthread_mutex_lock (&writer->lock);
+  if (writer->spool == NULL && writer->count == queue_size) {
+    writer->dropped++;
+    pthread_mutex_unlock (&writer->lock);
+    return (-1);
+  }
+
+  if (writer_pending (writer) == 0) {
+    clock_gettime (CLOCK_MONOTONIC, &writer->flush_deadline);
+    timespec_add_ms (&writer->flush_deadline, writer->config.flush_interval_ms);
+  }
+
+  if (writer->spool != NULL) {
+    if (air_spool_append (writer->spool, reading) == -1) {
+      writer->dropped++;
+      pthread_mutex_unlock (&writer->lock);
+      return (-1);
+    }
+  } else {
+    writer->queue[(writer->head + writer->count) % queue_size] = *reading;
+    writer->count++;
+  }
+
+  /* the first reading moves the thread on to wait for the flush deadline */
+  if (writer_pending (writer) == 1 ||
+      writer_pending (writer) >= writer->config.batch_size)
+    pthread_cond_signal (&writer->cond);
+  pthread_mutex_unlock (&writer->lock);
+
+  return (0);
+}
+
+unsigned long
+mysql_writer_dropped (MySQLWriter *writer)
+{
+  unsigned long dropped;
+
+  pthread_mutex_lock (&writer->lock);
+  dropped = writer->dropped;
+  pthread_mutex_unlock (&writer->lock);
+
+  return dropped;
+}
+
+/* stores whatever is still queued, then stops the writer thread */
+int
+mysql_writer_stop (MySQLWriter *writer)
+{
+  if (writer->thread_id) {
+    pthread_mutex_lock (&writer->lock);
+    writer->stop_thread = 1;
+    pthread_cond_signal (&writer->cond);
+    pthread_mutex_unlock (&writer->lock);
+
+    pthread_join (writer->thread_id, NULL);
+  }
+
+  pthread_cond_destroy (&writer->cond);
+  pthread_mutex_destroy (&writer->lock);
+
+  free ((char *) writer->config.host);
+  free ((char *) writer->config.user);
+  free ((char *) writer->config.password);
+  free ((char *) writer->config.database);
+  if (writer->spool != NULL)
+    air_spool_close (writer->spool);
+  free (writer->queue);
+  free (writer);
+
+  return (0);
+}
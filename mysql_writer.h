@@ -0,0 +1,54 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __MYSQL_WRITER_H__
+#define __MYSQL_WRITER_H__
+
+#include "air_utils.h"
+
+/* Stores readings into the ParticlePM25 table from a background thread over
+ * a persistent connection. Rows are queued by mysql_writer_push () and
+ * written with prepared multi-row INSERTs once batch_size rows are pending
+ * or flush_interval_ms has passed. While the database is unreachable rows
+ * stay queued and the writer reconnects with exponential backoff, rows not
+ * fitting in the queue are dropped and counted.
+ * When spool_path is set rows are queued in an AirSpool file instead of
+ * memory, so they survive restarts and power loss and are sent in order once
+ * the database is back. */
+typedef struct _MySQLWriterConfig
+{
+  const char *host;
+  const char *user;
+  const char *password;
+  const char *database;
+  unsigned int port;
+  int batch_size;
+  int flush_interval_ms;
+  int queue_size;
+  const char *spool_path;
+  int spool_fsync_records;
+  int spool_fsync_interval_ms;
+} MySQLWriterConfig;
+
+typedef struct _MySQLWriter MySQLWriter;
+
+MySQLWriter* mysql_writer_create (const MySQLWriterConfig *config);
+int mysql_writer_push (MySQLWriter *writer, const AirReading *reading);
+unsigned long mysql_writer_dropped (MySQLWriter *writer);
+int mysql_writer_stop (MySQLWriter *writer);
+
+#endif //__MYSQL_WRITER_H__
@@ -0,0 +1,117 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "occupancy.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct _OccupancyWindow
+{
+  unsigned int window_ms;
+  unsigned int hop_ms;
+  int n_slots;
+  /* low pulse time in μs per hop, current is still being filled */
+  uint64_t *slots;
+  uint64_t total;
+  int current;
+  int64_t slot_end;
+  int filled;
+  int completed;
+};
+
+OccupancyWindow*
+occupancy_window_create (unsigned int window_ms, unsigned int hop_ms)
+{
+  OccupancyWindow *window;
+
+  if (hop_ms == 0 || hop_ms > window_ms)
+    hop_ms = window_ms;
+
+  window = calloc (1, sizeof (OccupancyWindow));
+  window->n_slots = (window_ms + hop_ms - 1) / hop_ms;
+  window->hop_ms = hop_ms;
+  window->window_ms = window->n_slots * hop_ms;
+  /* one more slot for the hop being filled */
+  window->slots = calloc (window->n_slots + 1, sizeof (uint64_t));
+  window->slot_end = -1;
+
+  return window;
+}
+
+void
+occupancy_window_free (OccupancyWindow *window)
+{
+  free (window->slots);
+  free (window);
+}
+
+static void
+window_advance (OccupancyWindow *window, int64_t now_ms)
+{
+  int n_slots = window->n_slots + 1;
+
+  if (window->slot_end == -1) {
+    window->slot_end = now_ms + window->hop_ms;
+    return;
+  }
+
+  /* nothing happened for longer than a window, start over */
+  if (now_ms - window->slot_end >= window->window_ms + window->hop_ms) {
+    memset (window->slots, 0, n_slots * sizeof (uint64_t));
+    window->total = 0;
+    window->slot_end += ((now_ms - window->slot_end) / window->hop_ms) *
+        window->hop_ms;
+  }
+
+  while (now_ms >= window->slot_end) {
+    window->current = (window->current + 1) % n_slots;
+    window->total -= window->slots[window->current];
+    window->slots[window->current] = 0;
+    window->slot_end += window->hop_ms;
+    if (window->filled < window->n_slots)
+      window->filled++;
+    window->completed = 1;
+  }
+}
+
+void
+occupancy_window_add_pulse (OccupancyWindow *window, int64_t now_ms,
+    unsigned long duration_us)
+{
+  window_advance (window, now_ms);
+
+  window->slots[window->current] += duration_us;
+  window->total += duration_us;
+}
+
+/* returns 1 and the ratio over the last complete window when a hop has
+ * completed since the last call */
+int
+occupancy_window_poll (OccupancyWindow *window, int64_t now_ms, float *ratio)
+{
+  window_advance (window, now_ms);
+
+  if (!window->completed || window->filled < window->n_slots)
+    return 0;
+
+  window->completed = 0;
+  *ratio = (window->total - window->slots[window->current]) /
+      (window->window_ms * 10.0);
+
+  return 1;
+}
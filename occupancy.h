@@ -0,0 +1,38 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __OCCUPANCY_H__
+#define __OCCUPANCY_H__
+
+#include <stdint.h>
+
+/* Sliding window low pulse occupancy. The window is split into hops, low
+ * pulses are accounted to the hop they end in and every time a hop completes
+ * the occupancy ratio (in percent) over the last window_ms is available.
+ * Updates are O(1), with hop_ms == window_ms this is the classic tumbling
+ * window. */
+typedef struct _OccupancyWindow OccupancyWindow;
+
+OccupancyWindow* occupancy_window_create (unsigned int window_ms,
+    unsigned int hop_ms);
+void occupancy_window_free (OccupancyWindow *window);
+void occupancy_window_add_pulse (OccupancyWindow *window, int64_t now_ms,
+    unsigned long duration_us);
+int occupancy_window_poll (OccupancyWindow *window, int64_t now_ms,
+    float *ratio);
+
+#endif //__OCCUPANCY_H__
@@ -0,0 +1,344 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ppd42.h"
+#include "occupancy.h"
+#include "air_metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+
+#define LOW  0
+#define HIGH 1
+
+struct _PPD42Sensor
+{
+  int pin;
+  OccupancyWindow *window;
+  /* start of the current low pulse, 0 until the first falling edge */
+  uint64_t t_low;
+  /* time of the latest edge or pulse fed, drives the window */
+  int64_t now_ms;
+  uint64_t out_of_bounds;
+  /* low pulse occupancy of the latest reading, in percent */
+  float ratio;
+};
+
+struct _PPD42DualSensor
+{
+  PPD42Sensor *p1;
+  PPD42Sensor *p2;
+};
+
+static int64_t
+monotonic_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t
+realtime_ms (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+
+  return (int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* opens the sensor output, prefering the GPIO character device and falling
+ * back to sysfs on old kernels, use_sysfs tells the caller to unexport */
+LNGPIOPinData*
+ppd42_pin_open (const char *chip, int pin, int *use_sysfs)
+{
+  LNGPIOPinData *data;
+
+  *use_sysfs = 0;
+
+  if (chip != NULL) {
+    data = lngpio_pin_open_chip (chip, pin);
+    if (NULL != data)
+      return data;
+  }
+
+  *use_sysfs = 1;
+
+  if (lngpio_is_exported (pin))
+    lngpio_unexport (pin);
+
+  if (-1 == lngpio_export (pin))
+    return NULL;
+
+  if (-1 == lngpio_wait_for_pin (pin))
+    return NULL;
+
+  if (-1 == lngpio_set_direction (pin, LNGPIO_PIN_DIRECTION_IN))
+    return NULL;
+
+  if (-1 == lngpio_set_edge (pin, LNGPIO_PIN_EDGE_BOTH))
+    return NULL;
+
+  return lngpio_pin_open (pin);
+}
+
+PPD42Sensor*
+ppd42_sensor_create (int pin, unsigned int window_ms, unsigned int hop_ms)
+{
+  PPD42Sensor *sensor;
+
+  if (window_ms == 0) {
+    fprintf (stderr, "Invalid sampling window for pin %d\n", pin);
+    return NULL;
+  }
+
+  sensor = calloc (1, sizeof (PPD42Sensor));
+  sensor->pin = pin;
+  sensor->window = occupancy_window_create (window_ms, hop_ms);
+
+  return sensor;
+}
+
+void
+ppd42_sensor_free (PPD42Sensor *sensor)
+{
+  occupancy_window_free (sensor->window);
+  free (sensor);
+}
+
+static int
+sensor_add_pulse (PPD42Sensor *sensor, int64_t now_ms,
+    unsigned long duration_us)
+{
+  sensor->now_ms = now_ms;
+  occupancy_window_add_pulse (sensor->window, now_ms, duration_us);
+  air_metrics_count (AIR_METRIC_PULSES, 1);
+
+  if (duration_us > PPD42_PULSE_MAX_US || duration_us < PPD42_PULSE_MIN_US) {
+    sensor->out_of_bounds++;
+    air_metrics_count (AIR_METRIC_OUT_OF_BOUNDS, 1);
+    return (-1);
+  }
+
+  return (0);
+}
+
+/* returns -1 when the edge completes a low pulse out of the sensor's range,
+ * the pulse is accounted anyway */
+int
+ppd42_sensor_feed_edge (PPD42Sensor *sensor, const LNGPIOEdge *edge)
+{
+  uint64_t t_low;
+
+  if (edge->level == LOW) {
+    sensor->t_low = edge->timestamp_ns;
+    return (0);
+  }
+
+  if (sensor->t_low == 0 || edge->timestamp_ns < sensor->t_low)
+    return (0);
+
+  t_low = sensor->t_low;
+  sensor->t_low = 0;
+
+  return sensor_add_pulse (sensor, edge->timestamp_ns / 1000000,
+      (edge->timestamp_ns - t_low) / 1000);
+}
+
+/* for pulses measured with lngpio_pin_pulse_len (), ending now */
+int
+ppd42_sensor_feed_pulse (PPD42Sensor *sensor, unsigned long duration_us)
+{
+  return sensor_add_pulse (sensor, monotonic_ms (), duration_us);
+}
+
+/* returns 1 and fills reading once per hop, when a new value is available */
+int
+ppd42_sensor_poll (PPD42Sensor *sensor, AirReading *reading)
+{
+  uint64_t start_ns;
+  float ratio;
+
+  if (sensor->now_ms == 0)
+    return (0);
+
+  if (!occupancy_window_poll (sensor->window, sensor->now_ms, &ratio))
+    return (0);
+
+  start_ns = air_metrics_now_ns ();
+  sensor->ratio = ratio;
+  reading->timestamp_ms = realtime_ms ();
+  reading->pin = sensor->pin;
+  reading->concentration_pcs = ppd42_ratio2pcs (ratio);
+  reading->concentration_ugm3 = pm25pcs2ugm3 (reading->concentration_pcs);
+  reading->aqi = pm25ugm32aqi (reading->concentration_ugm3);
+  air_metrics_record_since (AIR_METRIC_READING, start_ns);
+  air_metrics_count (AIR_METRIC_READINGS, 1);
+
+  return (1);
+}
+
+/* for recomputing the reading with another calibration, see air_calib.h */
+float
+ppd42_sensor_ratio (PPD42Sensor *sensor)
+{
+  return sensor->ratio;
+}
+
+uint64_t
+ppd42_sensor_out_of_bounds (PPD42Sensor *sensor)
+{
+  return sensor->out_of_bounds;
+}
+
+/* PPD42NS spec sheet curve, ratio is the low pulse occupancy in percent */
+float
+ppd42_ratio2pcs (float ratio)
+{
+  return ((1.1f * ratio - 3.8f) * ratio + 520.0f) * ratio + 0.62f;
+}
+
+LNGPIOPinData*
+ppd42_dual_pin_open (const char *chip, int pin_p1, int pin_p2)
+{
+  int lines[2] = { pin_p1, pin_p2 };
+
+  if (chip == NULL) {
+    fprintf (stderr, "Pins %d and %d need a GPIO character device\n",
+        pin_p1, pin_p2);
+    return NULL;
+  }
+
+  return lngpio_pin_open_chip_lines (chip, lines, 2);
+}
+
+PPD42DualSensor*
+ppd42_dual_sensor_create (int pin_p1, int pin_p2, unsigned int window_ms,
+    unsigned int hop_ms)
+{
+  PPD42DualSensor *sensor;
+
+  if (pin_p1 == pin_p2) {
+    fprintf (stderr, "P1 and P2 both on pin %d\n", pin_p1);
+    return NULL;
+  }
+
+  sensor = calloc (1, sizeof (PPD42DualSensor));
+  sensor->p1 = ppd42_sensor_create (pin_p1, window_ms, hop_ms);
+  sensor->p2 = ppd42_sensor_create (pin_p2, window_ms, hop_ms);
+  if (sensor->p1 == NULL || sensor->p2 == NULL) {
+    ppd42_dual_sensor_free (sensor);
+    return NULL;
+  }
+
+  return sensor;
+}
+
+void
+ppd42_dual_sensor_free (PPD42DualSensor *sensor)
+{
+  if (sensor->p1 != NULL)
+    ppd42_sensor_free (sensor->p1);
+  if (sensor->p2 != NULL)
+    ppd42_sensor_free (sensor->p2);
+  free (sensor);
+}
+
+int
+ppd42_dual_sensor_feed_edge (PPD42DualSensor *sensor, const LNGPIOEdge *edge)
+{
+  PPD42Sensor *channel;
+  int64_t now_ms;
+
+  if (edge->pin == sensor->p1->pin)
+    channel = sensor->p1;
+  else if (edge->pin == sensor->p2->pin)
+    channel = sensor->p2;
+  else
+    return (0);
+
+  /* every edge moves both windows, a clean channel sees no edges for long
+   * stretches and its hops would close late or not at all */
+  now_ms = edge->timestamp_ns / 1000000;
+  if (now_ms > sensor->p1->now_ms) {
+    sensor->p1->now_ms = now_ms;
+    occupancy_window_add_pulse (sensor->p1->window, now_ms, 0);
+  }
+  if (now_ms > sensor->p2->now_ms) {
+    sensor->p2->now_ms = now_ms;
+    occupancy_window_add_pulse (sensor->p2->window, now_ms, 0);
+  }
+
+  return ppd42_sensor_feed_edge (channel, edge);
+}
+
+/* returns 1 and fills reading once per hop, with the pcs/0.01cf of the
+ * PPD42NS curve split into fractions, see air_calib_split () for other
+ * calibrations */
+int
+ppd42_dual_sensor_poll (PPD42DualSensor *sensor, PPD42DualReading *reading)
+{
+  float ratio_p1;
+  float ratio_p2;
+  float pcs_p1;
+  float pcs_p2;
+
+  if (sensor->p1->now_ms == 0)
+    return (0);
+
+  /* the windows started and advance together, when one closes a hop so
+   * does the other */
+  if (!occupancy_window_poll (sensor->p1->window, sensor->p1->now_ms,
+          &ratio_p1) |
+      !occupancy_window_poll (sensor->p2->window, sensor->p2->now_ms,
+          &ratio_p2))
+    return (0);
+
+  sensor->p1->ratio = ratio_p1;
+  sensor->p2->ratio = ratio_p2;
+  reading->ratio_p1 = ratio_p1;
+  reading->ratio_p2 = ratio_p2;
+
+  pcs_p1 = ppd42_ratio2pcs (ratio_p1);
+  pcs_p2 = ppd42_ratio2pcs (ratio_p2);
+
+  reading->pm25.timestamp_ms = realtime_ms ();
+  reading->pm25.pin = sensor->p1->pin;
+  reading->pm25.concentration_pcs = pcs_p1 > pcs_p2 ? pcs_p1 - pcs_p2 : 0;
+  reading->pm25.concentration_ugm3 =
+      pm25pcs2ugm3 (reading->pm25.concentration_pcs);
+  reading->pm25.aqi = pm25ugm32aqi (reading->pm25.concentration_ugm3);
+
+  reading->pm10.timestamp_ms = reading->pm25.timestamp_ms;
+  reading->pm10.pin = sensor->p2->pin;
+  reading->pm10.concentration_pcs = reading->pm25.concentration_pcs + pcs_p2;
+  reading->pm10.concentration_ugm3 = reading->pm25.concentration_ugm3 +
+      pm10pcs2ugm3 (pcs_p2);
+  reading->pm10.aqi = pm10ugm32aqi (reading->pm10.concentration_ugm3);
+  air_metrics_count (AIR_METRIC_READINGS, 2);
+
+  return (1);
+}
+
+uint64_t
+ppd42_dual_sensor_out_of_bounds (PPD42DualSensor *sensor)
+{
+  return sensor->p1->out_of_bounds + sensor->p2->out_of_bounds;
+}
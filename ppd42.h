@@ -0,0 +1,80 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __PPD42_H__
+#define __PPD42_H__
+
+#include "lngpio.h"
+#include "air_utils.h"
+
+/* Shinyei PPD42NS dust sensor. The sensor pulls its output low while
+ * particles are detected, the low pulse occupancy over a sliding window maps
+ * to a particle concentration. All state lives in the PPD42Sensor so that a
+ * process can drive any number of sensors, feeding edges or pulses does not
+ * allocate. Time is CLOCK_MONOTONIC, the same clock edges are stamped with. */
+typedef struct _PPD42Sensor PPD42Sensor;
+
+/* low pulses outside of this range do not come from the sensor */
+#define PPD42_PULSE_MIN_US 8500
+#define PPD42_PULSE_MAX_US 95000
+
+LNGPIOPinData* ppd42_pin_open (const char *chip, int pin, int *use_sysfs);
+
+PPD42Sensor* ppd42_sensor_create (int pin, unsigned int window_ms,
+    unsigned int hop_ms);
+void ppd42_sensor_free (PPD42Sensor *sensor);
+
+int ppd42_sensor_feed_edge (PPD42Sensor *sensor, const LNGPIOEdge *edge);
+int ppd42_sensor_feed_pulse (PPD42Sensor *sensor, unsigned long duration_us);
+int ppd42_sensor_poll (PPD42Sensor *sensor, AirReading *reading);
+float ppd42_sensor_ratio (PPD42Sensor *sensor);
+
+uint64_t ppd42_sensor_out_of_bounds (PPD42Sensor *sensor);
+
+float ppd42_ratio2pcs (float ratio);
+
+/* Both outputs of a sensor, P1 (particles above 1 μm) and P2 (above
+ * 2.5 μm), captured through one character device handle so that their
+ * edges come in order from a single fd. The two occupancy windows advance
+ * together and give their readings for the same hop. */
+typedef struct _PPD42DualSensor PPD42DualSensor;
+
+typedef struct _PPD42DualReading
+{
+  AirReading pm25;              /* pin is the P1 pin */
+  AirReading pm10;              /* pin is the P2 pin */
+  float ratio_p1;
+  float ratio_p2;
+} PPD42DualReading;
+
+/* there is no sysfs fallback, sysfs has no multi-line handles */
+LNGPIOPinData* ppd42_dual_pin_open (const char *chip, int pin_p1,
+    int pin_p2);
+
+PPD42DualSensor* ppd42_dual_sensor_create (int pin_p1, int pin_p2,
+    unsigned int window_ms, unsigned int hop_ms);
+void ppd42_dual_sensor_free (PPD42DualSensor *sensor);
+
+/* edges of other pins are ignored */
+int ppd42_dual_sensor_feed_edge (PPD42DualSensor *sensor,
+    const LNGPIOEdge *edge);
+int ppd42_dual_sensor_poll (PPD42DualSensor *sensor,
+    PPD42DualReading *reading);
+
+uint64_t ppd42_dual_sensor_out_of_bounds (PPD42DualSensor *sensor);
+
+#endif //__PPD42_H__
@@ -0,0 +1,210 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ppd42_gen.h"
+#include "ppd42.h"
+#include "lngpio_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOW  0
+#define HIGH 1
+
+/* generated time starts here, 0 is taken as "no edge yet" by consumers */
+#define GEN_START_NS 1000000000ULL
+
+/* pulses the sensor cannot produce */
+#define GEN_SHORT_PULSE_US 2000
+#define GEN_LONG_PULSE_US  150000
+
+struct _PPD42Gen
+{
+  PPD42GenConfig config;
+  uint64_t rng;
+  uint64_t now_ns;
+  uint64_t end_ns;
+  unsigned long pulse_us;
+  int level;
+};
+
+/* xorshift64*, good enough for signal shapes and private to each generator */
+static uint64_t
+gen_random (PPD42Gen *gen)
+{
+  gen->rng ^= gen->rng >> 12;
+  gen->rng ^= gen->rng << 25;
+  gen->rng ^= gen->rng >> 27;
+
+  return gen->rng * 0x2545f4914f6cdd1dULL;
+}
+
+/* uniform in [0, 1) */
+static double
+gen_uniform (PPD42Gen *gen)
+{
+  return (gen_random (gen) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static long
+gen_jitter (PPD42Gen *gen)
+{
+  if (gen->config.jitter_us == 0)
+    return 0;
+
+  return (long) ((gen_uniform (gen) * 2.0 - 1.0) * gen->config.jitter_us);
+}
+
+static float
+gen_ratio (PPD42Gen *gen)
+{
+  double progress;
+  float ratio;
+
+  progress = (double) (gen->now_ns - GEN_START_NS) /
+      (gen->end_ns - GEN_START_NS);
+  ratio = gen->config.ratio_start +
+      (gen->config.ratio_end - gen->config.ratio_start) * progress;
+
+  if (ratio < 0.01)
+    ratio = 0.01;
+  if (ratio > 90)
+    ratio = 90;
+
+  return ratio;
+}
+
+static unsigned long
+gen_pulse_us (PPD42Gen *gen)
+{
+  long pulse;
+
+  if (gen_uniform (gen) < gen->config.out_of_bounds) {
+    if (gen_random (gen) & 1)
+      return GEN_SHORT_PULSE_US;
+    return GEN_LONG_PULSE_US;
+  }
+
+  pulse = PPD42_GEN_PULSE_US + gen_jitter (gen);
+  if (pulse < PPD42_PULSE_MIN_US)
+    pulse = PPD42_PULSE_MIN_US;
+  if (pulse > PPD42_PULSE_MAX_US)
+    pulse = PPD42_PULSE_MAX_US;
+
+  return pulse;
+}
+
+static unsigned long
+gen_gap_us (PPD42Gen *gen)
+{
+  long gap;
+
+  gap = gen->pulse_us * (100.0 / gen_ratio (gen) - 1.0) + gen_jitter (gen);
+  if (gap < 1000)
+    gap = 1000;
+
+  return gap;
+}
+
+PPD42Gen*
+ppd42_gen_create (const PPD42GenConfig *config)
+{
+  PPD42Gen *gen;
+
+  if (config->duration_ms == 0) {
+    fprintf (stderr, "Invalid generator duration\n");
+    return NULL;
+  }
+
+  gen = malloc (sizeof (PPD42Gen));
+  gen->config = *config;
+  /* xorshift must not start from 0 */
+  gen->rng = config->seed ^ 0x9e3779b97f4a7c15ULL;
+  if (gen->rng == 0)
+    gen->rng = 1;
+  gen->now_ns = GEN_START_NS;
+  gen->end_ns = GEN_START_NS + (uint64_t) config->duration_ms * 1000000ULL;
+  gen->pulse_us = 0;
+  gen->level = HIGH;
+
+  return gen;
+}
+
+void
+ppd42_gen_free (PPD42Gen *gen)
+{
+  free (gen);
+}
+
+int
+ppd42_gen_next (PPD42Gen *gen, LNGPIOEdge *edge)
+{
+  if (gen->level == HIGH) {
+    /* never start a pulse that would end after the signal */
+    gen->pulse_us = gen_pulse_us (gen);
+    if (gen->now_ns + gen->pulse_us * 1000ULL >= gen->end_ns)
+      return 0;
+    gen->level = LOW;
+  } else {
+    gen->level = HIGH;
+  }
+
+  edge->timestamp_ns = gen->now_ns;
+  edge->pin = gen->config.pin;
+  edge->level = gen->level;
+
+  if (gen->level == LOW)
+    gen->now_ns += gen->pulse_us * 1000ULL;
+  else
+    gen->now_ns += gen_gap_us (gen) * 1000ULL;
+
+  return 1;
+}
+
+int64_t
+ppd42_gen_write_trace (const PPD42GenConfig *config, const char *path)
+{
+  LNGPIOTraceWriter *writer;
+  PPD42Gen *gen;
+  LNGPIOEdge edge;
+  int64_t n_edges = 0;
+
+  gen = ppd42_gen_create (config);
+  if (gen == NULL)
+    return (-1);
+
+  writer = lngpio_trace_writer_create (path);
+  if (writer == NULL) {
+    ppd42_gen_free (gen);
+    return (-1);
+  }
+
+  while (ppd42_gen_next (gen, &edge)) {
+    if (lngpio_trace_writer_add (writer, &edge) == -1) {
+      n_edges = -1;
+      break;
+    }
+    n_edges++;
+  }
+
+  ppd42_gen_free (gen);
+
+  if (lngpio_trace_writer_close (writer) == -1)
+    return (-1);
+
+  return n_edges;
+}
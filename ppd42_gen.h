@@ -0,0 +1,52 @@
+/*
+ * otonchev/grove_dust
+ * Copyright (C) 2016 Ognyan Tonchev otonchev@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __PPD42_GEN_H__
+#define __PPD42_GEN_H__
+
+#include "lngpio.h"
+
+/* Synthetic PPD42NS output. Low pulses of about PPD42_GEN_PULSE_US are
+ * spaced so that the low pulse occupancy follows a linear ramp from
+ * ratio_start to ratio_end percent, pulse and gap lengths get uniform jitter
+ * and a fraction of the pulses falls outside of the sensor's range. The
+ * sequence only depends on the config, so runs are reproducible. */
+typedef struct _PPD42Gen PPD42Gen;
+
+#define PPD42_GEN_PULSE_US 30000
+
+typedef struct _PPD42GenConfig
+{
+  uint64_t seed;
+  int pin;
+  unsigned int duration_ms;
+  float ratio_start;
+  float ratio_end;
+  unsigned int jitter_us;
+  float out_of_bounds;
+} PPD42GenConfig;
+
+PPD42Gen* ppd42_gen_create (const PPD42GenConfig *config);
+void ppd42_gen_free (PPD42Gen *gen);
+/* returns 1 and the next edge, 0 once duration_ms has been generated */
+int ppd42_gen_next (PPD42Gen *gen, LNGPIOEdge *edge);
+
+/* writes the whole signal as a trace, returns the number of edges */
+int64_t ppd42_gen_write_trace (const PPD42GenConfig *config,
+    const char *path);
+
+#endif //__PPD42_GEN_H__
@@ -6,94 +6,89 @@
  */
 #include "lngpio.h"
 #include "air_utils.h"
+#include "ppd42.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <math.h>
+#include <signal.h>
 
 #define LOW  0
 #define HIGH 1
 
 #define PIN  17
+#define GPIO_CHIP "/dev/gpiochip0"
 
-unsigned long starttime;
-unsigned long sampletime_ms = 30000; /* 30s */
-unsigned long lowpulseoccupancy;
+#define SAMPLETIME_MS 30000 /* 30s */
+#define HOPTIME_MS    30000 /* new reading every hop */
+#define MAX_PULSES    16
 
-long
-millis ()
-{
-  struct timeval  tv;
-  gettimeofday (&tv, NULL);
-
-  return (tv.tv_sec) * 1000 + (tv.tv_usec) / 1000 ;
-}
+static LNGPIOPinData *running;
 
 static void
-loop (LNGPIOPinData *data)
+stop (int signum)
 {
-  unsigned long pulse_duration;
-
-  pulse_duration = lngpio_pin_pulse_len (data, LOW);
-  if (pulse_duration > 95000 || pulse_duration < 8500)
-     printf ("pulse duration out of bounds: %ld\n", pulse_duration);
-
-  lowpulseoccupancy = lowpulseoccupancy + pulse_duration;
-
-  if ((millis () - starttime) > sampletime_ms) {
-    float ratio;
-    float concentration_pcs;
-    float concentration_ugm3;
-    int aqi;
+  lngpio_pin_cancel (running);
+}
 
-    ratio = lowpulseoccupancy / (sampletime_ms * 10.0);
-    concentration_pcs =
-        1.1 * pow (ratio, 3) - 3.8 * pow (ratio, 2) + 520 * ratio + 0.62;
-    concentration_ugm3 = pm25pcs2ugm3 (concentration_pcs);
-    aqi = pm25ugm32aqi (concentration_ugm3);
+static int
+loop (LNGPIOPinData *data, PPD42Sensor *sensor)
+{
+  int pulses[MAX_PULSES];
+  AirReading reading;
+  int n;
+  int i;
+
+  /* a sensor seeing no dust, or no sensor, does not pull the pin low */
+  n = lngpio_pin_pulse_len_many (data, LOW, pulses, MAX_PULSES, HOPTIME_MS);
+  if (n == LNGPIO_TIMEOUT) {
+    printf ("no pulse for %d s\n", HOPTIME_MS / 1000);
+    return (0);
+  }
+  if (n < 0)
+    return (-1);
 
-    printf ("%f pcs/0.01cf, %f μg/m3, %d AQI\n", concentration_pcs,
-        concentration_ugm3, aqi);
+  for (i = 0; i < n; i++) {
+    if (-1 == ppd42_sensor_feed_pulse (sensor, pulses[i]))
+       printf ("pulse duration out of bounds: %d\n", pulses[i]);
+  }
 
-    lowpulseoccupancy = 0;
-    starttime = millis ();
+  if (ppd42_sensor_poll (sensor, &reading)) {
+    printf ("%f pcs/0.01cf, %f μg/m3, %d AQI\n", reading.concentration_pcs,
+        reading.concentration_ugm3, reading.aqi);
   }
+
+  return (0);
 }
 
 int
 main (int argc, char * argv[])
 {
   LNGPIOPinData *data;
+  PPD42Sensor *sensor;
+  int use_sysfs;
 
-  if (lngpio_is_exported (PIN))
-    lngpio_unexport (PIN);
-
-  if (-1 == lngpio_export (PIN))
-    return (1);
-
-  if (-1 == lngpio_wait_for_pin (PIN))
-    return (1);
-
-  if (-1 == lngpio_set_direction (PIN, LNGPIO_PIN_DIRECTION_IN))
+  sensor = ppd42_sensor_create (PIN, SAMPLETIME_MS, HOPTIME_MS);
+  if (NULL == sensor)
     return (1);
 
-  if (-1 == lngpio_set_edge (PIN, LNGPIO_PIN_EDGE_BOTH))
-    return (1);
-
-  data = lngpio_pin_open (PIN);
+  data = ppd42_pin_open (GPIO_CHIP, PIN, &use_sysfs);
   if (NULL == data)
     return (1);
 
-  while (1) {
-    loop (data);
-  }
+  running = data;
+  signal (SIGINT, stop);
+  signal (SIGTERM, stop);
+
+  while (loop (data, sensor) == 0);
 
   if (-1 == lngpio_pin_release (data))
     return (1);
 
-  if (-1 == lngpio_unexport (PIN))
+  if (use_sysfs && -1 == lngpio_unexport (PIN))
     return (1);
 
+  ppd42_sensor_free (sensor);
+
   return (0);
 }
@@ -2,77 +2,68 @@
  * (c) 2016 Ognyan Tonchev otonchev@gmail.com
  * Example application monitoring Fine particle (PM2.5) with Grove Dust sensor
  * (Shinyei PPD42NS) and a Raspberry Pi.
- * The app uses lngpio's asynchronous API.
+ * The app uses lngpio's asynchronous API. Readings are stored into a local
+ * time series database in TSDB_DIR together with 1 minute, 1 hour and 1 day
+ * rollups. Readings are served over HTTP on HTTPD_PORT, see air_httpd.h.
+ *
+ * usage: test_async [-r trace] [-p trace [-s speed]] [-R priority] [-C cpu]
+ *   -r  record the edges of the sensor into a trace file
+ *   -p  replay a recorded trace instead of reading the sensor
+ *   -s  replay speed, 1 is real time and 0 as fast as possible
+ *   -R  run the engine threads SCHED_FIFO with priority and locked memory
+ *   -C  pin the engine threads to cpu
  */
 #include "lngpio.h"
+#include "lngpio_trace.h"
 #include "air_utils.h"
+#include "ppd42.h"
+#include "air_tsdb.h"
+#include "air_rollup.h"
+#include "air_httpd.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <math.h>
+#include <getopt.h>
 
 #define LOW  0
 #define HIGH 1
 
 #define PIN  17
+#define GPIO_CHIP "/dev/gpiochip0"
+#define TSDB_DIR "airquality.tsdb"
 
-static unsigned long starttime;
-static unsigned long sampletime_ms = 30000; /* 30s */
-static unsigned long lowpulseoccupancy;
-static struct timeval t_low, t_high;
+#define SAMPLETIME_MS 30000 /* 30s */
+#define HOPTIME_MS    5000 /* new reading every hop */
 
-static long
-millis ()
-{
-  struct timeval  tv;
-  gettimeofday (&tv, NULL);
+#define HTTPD_PORT 8080
+/* 24h of readings at one per hop */
+#define HTTPD_HISTORY (24 * 3600 * 1000 / HOPTIME_MS)
 
-  return (tv.tv_sec) * 1000 + (tv.tv_usec) / 1000 ;
-}
+static AirTSDB *tsdb;
+static AirRollup *rollup;
+static LNGPIOTraceWriter *trace;
+static AirHTTPD *httpd;
 
 static void
-pulse_detected (unsigned long pulse_duration)
+edge_detected (const LNGPIOEdge *edge, void *user_data)
 {
-  lowpulseoccupancy = lowpulseoccupancy + pulse_duration;
+  PPD42Sensor *sensor = (PPD42Sensor *)user_data;
+  AirReading reading;
 
-  if ((millis () - starttime) > sampletime_ms) {
-    float ratio;
-    float concentration_pcs;
-    float concentration_ugm3;
-    int aqi;
+  if (NULL != trace)
+    lngpio_trace_writer_add (trace, edge);
 
-    ratio = lowpulseoccupancy / (sampletime_ms * 10.0);
-    concentration_pcs =
-        1.1 * pow (ratio, 3) - 3.8 * pow (ratio, 2) + 520 * ratio + 0.62;
-    concentration_ugm3 = pm25pcs2ugm3 (concentration_pcs);
-    aqi = pm25ugm32aqi (concentration_ugm3);
+  if (-1 == ppd42_sensor_feed_edge (sensor, edge))
+    printf ("pulse duration out of bounds on pin %d\n", edge->pin);
 
-    printf ("%f pcs/0.01cf, %f μg/m3, %d AQI\n", concentration_pcs,
-        concentration_ugm3, aqi);
+  if (ppd42_sensor_poll (sensor, &reading)) {
+    printf ("%f pcs/0.01cf, %f μg/m3, %d AQI\n", reading.concentration_pcs,
+        reading.concentration_ugm3, reading.aqi);
 
-    lowpulseoccupancy = 0;
-    starttime = millis ();
-  }
-}
-
-static void
-status_changed (int pin, int status)
-{
-  long micros;
-
-  if (status == 0) {
-    gettimeofday (&t_low, NULL);
-  } else if (status == 1) {
-    gettimeofday (&t_high, NULL);
-
-    micros = (t_high.tv_sec - t_low.tv_sec) * 1000000L;
-    micros += (t_high.tv_usec - t_low.tv_usec);
-
-    if (micros > 95000 || micros < 8500)
-      printf ("pulse duration out of bounds: %ld\n", micros);
-
-    pulse_detected (micros);
+    air_tsdb_append (tsdb, &reading);
+    air_rollup_add (rollup, &reading);
+    air_httpd_publish (httpd, &reading);
   }
 }
 
@@ -80,23 +71,78 @@ int
 main (int argc, char * argv[])
 {
   LNGPIOPinMonitor *monitor;
+  LNGPIOPinData *data;
+  PPD42Sensor *sensor;
+  AirHTTPDConfig httpd_config = { 0 };
+  LNGPIORealtime realtime = { 0, -1, 0 };
+  const char *record_path = NULL;
+  const char *replay_path = NULL;
+  double speed = LNGPIO_TRACE_SPEED_REALTIME;
+  int use_sysfs = 0;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "r:p:s:R:C:")) != -1) {
+    switch (opt) {
+      case 'r':
+        record_path = optarg;
+        break;
+      case 'p':
+        replay_path = optarg;
+        break;
+      case 's':
+        speed = atof (optarg);
+        break;
+      case 'R':
+        realtime.priority = atoi (optarg);
+        realtime.lock_memory = 1;
+        break;
+      case 'C':
+        realtime.cpu = atoi (optarg);
+        break;
+      default:
+        fprintf (stderr, "usage: %s [-r trace] [-p trace [-s speed]] "
+            "[-R priority] [-C cpu]\n", argv[0]);
+        return (1);
+    }
+  }
 
-  if (lngpio_is_exported (PIN))
-    lngpio_unexport (PIN);
+  sensor = ppd42_sensor_create (PIN, SAMPLETIME_MS, HOPTIME_MS);
+  if (NULL == sensor)
+    return (1);
 
-  if (-1 == lngpio_export (PIN))
+  tsdb = air_tsdb_open (TSDB_DIR);
+  if (NULL == tsdb)
     return (1);
 
-  if (-1 == lngpio_wait_for_pin (PIN))
+  rollup = air_rollup_open (TSDB_DIR);
+  if (NULL == rollup)
     return (1);
 
-  if (-1 == lngpio_set_direction (PIN, LNGPIO_PIN_DIRECTION_IN))
+  httpd_config.port = HTTPD_PORT;
+  httpd_config.history_size = HTTPD_HISTORY;
+  httpd_config.tsdb = tsdb;
+  httpd_config.rollup = rollup;
+  httpd = air_httpd_create (&httpd_config);
+  if (NULL == httpd)
     return (1);
 
-  if (-1 == lngpio_set_edge (PIN, LNGPIO_PIN_EDGE_BOTH))
+  if (NULL != record_path) {
+    trace = lngpio_trace_writer_create (record_path);
+    if (NULL == trace)
+      return (1);
+  }
+
+  if (NULL != replay_path)
+    data = lngpio_pin_open_trace (replay_path, PIN, speed);
+  else
+    data = ppd42_pin_open (GPIO_CHIP, PIN, &use_sysfs);
+  if (NULL == data)
     return (1);
 
-  monitor = lngpio_pin_monitor_create (PIN, status_changed);
+  if (-1 == lngpio_pin_monitor_set_realtime (&realtime))
+    return (1);
+
+  monitor = lngpio_pin_monitor_create_full (data, edge_detected, sensor);
   if (NULL == monitor)
     return (1);
 
@@ -107,8 +153,16 @@ main (int argc, char * argv[])
   if (-1 == lngpio_pin_monitor_stop (monitor))
     return (1);
 
-  if (-1 == lngpio_unexport (PIN))
+  if (use_sysfs && -1 == lngpio_unexport (PIN))
     return (1);
 
+  if (NULL != trace)
+    lngpio_trace_writer_close (trace);
+
+  air_httpd_stop (httpd);
+  air_rollup_close (rollup);
+  air_tsdb_close (tsdb);
+  ppd42_sensor_free (sensor);
+
   return (0);
 }
@@ -16,123 +16,61 @@
  *
  * Also change MYSQL_DATABASE, MYSQL_USER, MYSQL_PASS below correspondingly.
  *
- * The app uses lngpio's asynchronous API.
+ * The app uses lngpio's asynchronous API. Edges are queued by the monitor
+ * thread and processed from the main loop so that slow database writes never
+ * delay edge detection.
  */
 #include "lngpio.h"
+#include "lngpio_ring.h"
 #include "air_utils.h"
+#include "ppd42.h"
+#include "mysql_writer.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <math.h>
-
-/* MySQL headers */
-#include <my_global.h>
-#include <mysql.h>
 
 #define LOW  0
 #define HIGH 1
 
 #define PIN  17
+#define GPIO_CHIP "/dev/gpiochip0"
+
+#define SAMPLETIME_MS 30000 /* 30s */
+#define HOPTIME_MS    30000 /* new reading every hop */
+
+/* enough edges to ride out a database stall of a couple of minutes */
+#define EDGE_RING_SIZE 16384
+#define EDGE_BATCH     64
 
 /* MySQL database setup */
 #define MYSQL_DATABASE "AirQuality"
 #define MYSQL_USER "root"
 #define MYSQL_PASS "pass"
+#define MYSQL_BATCH_SIZE 16
+#define MYSQL_FLUSH_INTERVAL_MS 60000
+#define MYSQL_QUEUE_SIZE 8192
 
-static unsigned long starttime;
-static unsigned long sampletime_ms = 30000; /* 30s */
-static unsigned long lowpulseoccupancy;
-static struct timeval t_low, t_high;
-
-static long
-millis ()
-{
-  struct timeval  tv;
-  gettimeofday (&tv, NULL);
-
-  return (tv.tv_sec) * 1000 + (tv.tv_usec) / 1000 ;
-}
+/* readings are spooled here until the database has them */
+#define SPOOL_PATH "test_mysql.spool"
+#define SPOOL_FSYNC_RECORDS 1
+#define SPOOL_FSYNC_INTERVAL_MS 0
 
 static void
-finish_with_error (MYSQL *con)
+edge_detected (const LNGPIOEdge *edge, PPD42Sensor *sensor,
+    MySQLWriter *writer)
 {
-  fprintf (stderr, "%s\n", mysql_error (con));
-  mysql_close (con);
-  exit (1);
-}
+  AirReading reading;
 
-static void
-store_data (float concentration_pcs, float concentration_ugm3, int aqi)
-{
-  MYSQL *con = mysql_init (NULL);
-  char query[1024];
+  if (-1 == ppd42_sensor_feed_edge (sensor, edge))
+    printf ("pulse duration out of bounds on pin %d\n", edge->pin);
 
-  if (con == NULL) {
-      fprintf (stderr, "%s\n", mysql_error (con));
-      exit (1);
-  }
+  if (ppd42_sensor_poll (sensor, &reading)) {
+    printf ("%f pcs/0.01cf, %f μg/m3, %d AQI\n", reading.concentration_pcs,
+        reading.concentration_ugm3, reading.aqi);
 
-  if (mysql_real_connect (con, "localhost", MYSQL_USER, MYSQL_PASS,
-      MYSQL_DATABASE, 0, NULL, 0) == NULL) {
-      finish_with_error (con);
-  }
-
-  sprintf (query, "INSERT INTO ParticlePM25 (concentration_pcs,"
-      " concentration_ugm3, aqi) VALUES (%f, %f, %d)",
-      concentration_pcs, concentration_ugm3, aqi);
-
-  if (mysql_query (con, query)) {
-      finish_with_error (con);
-  }
-
-  mysql_close (con);
-}
-
-static void
-pulse_detected (unsigned long pulse_duration)
-{
-  lowpulseoccupancy = lowpulseoccupancy + pulse_duration;
-
-  if ((millis () - starttime) > sampletime_ms) {
-    float ratio;
-    float concentration_pcs;
-    float concentration_ugm3;
-    int aqi;
-
-    ratio = lowpulseoccupancy / (sampletime_ms * 10.0);
-    concentration_pcs =
-        1.1 * pow (ratio, 3) - 3.8 * pow (ratio, 2) + 520 * ratio + 0.62;
-    concentration_ugm3 = pm25pcs2ugm3 (concentration_pcs);
-    aqi = pm25ugm32aqi (concentration_ugm3);
-
-    printf ("%f pcs/0.01cf, %f μg/m3, %d AQI\n", concentration_pcs,
-        concentration_ugm3, aqi);
-
-    store_data (concentration_pcs, concentration_ugm3, aqi);
-
-    lowpulseoccupancy = 0;
-    starttime = millis ();
-  }
-}
-
-static void
-status_changed (int pin, int status)
-{
-  long micros;
-
-  if (status == 0) {
-    gettimeofday (&t_low, NULL);
-  } else if (status == 1) {
-    gettimeofday (&t_high, NULL);
-
-    micros = (t_high.tv_sec - t_low.tv_sec) * 1000000L;
-    micros += (t_high.tv_usec - t_low.tv_usec);
-
-    if (micros > 95000 || micros < 8500)
-      printf ("pulse duration out of bounds: %ld\n", micros);
-
-    pulse_detected (micros);
+    if (-1 == mysql_writer_push (writer, &reading))
+      fprintf (stderr, "Unable to queue reading for MySQL\n");
   }
 }
 
@@ -140,35 +78,73 @@ int
 main (int argc, char * argv[])
 {
   LNGPIOPinMonitor *monitor;
-
-  if (lngpio_is_exported (PIN))
-    lngpio_unexport (PIN);
-
-  if (-1 == lngpio_export (PIN))
+  LNGPIOPinData *data;
+  LNGPIOEdgeRing *ring;
+  LNGPIOEdge edges[EDGE_BATCH];
+  uint64_t overflows = 0;
+  MySQLWriterConfig config = { 0 };
+  MySQLWriter *writer;
+  PPD42Sensor *sensor;
+  int use_sysfs;
+  int n;
+  int i;
+
+  sensor = ppd42_sensor_create (PIN, SAMPLETIME_MS, HOPTIME_MS);
+  if (NULL == sensor)
     return (1);
 
-  if (-1 == lngpio_wait_for_pin (PIN))
+  config.host = "localhost";
+  config.user = MYSQL_USER;
+  config.password = MYSQL_PASS;
+  config.database = MYSQL_DATABASE;
+  config.batch_size = MYSQL_BATCH_SIZE;
+  config.flush_interval_ms = MYSQL_FLUSH_INTERVAL_MS;
+  config.queue_size = MYSQL_QUEUE_SIZE;
+  config.spool_path = SPOOL_PATH;
+  config.spool_fsync_records = SPOOL_FSYNC_RECORDS;
+  config.spool_fsync_interval_ms = SPOOL_FSYNC_INTERVAL_MS;
+
+  writer = mysql_writer_create (&config);
+  if (NULL == writer)
     return (1);
 
-  if (-1 == lngpio_set_direction (PIN, LNGPIO_PIN_DIRECTION_IN))
+  ring = lngpio_edge_ring_create (EDGE_RING_SIZE);
+  if (NULL == ring)
     return (1);
 
-  if (-1 == lngpio_set_edge (PIN, LNGPIO_PIN_EDGE_BOTH))
+  data = ppd42_pin_open (GPIO_CHIP, PIN, &use_sysfs);
+  if (NULL == data)
     return (1);
 
-  monitor = lngpio_pin_monitor_create (PIN, status_changed);
+  monitor = lngpio_pin_monitor_create_full (data,
+      lngpio_edge_ring_edge_detected, ring);
   if (NULL == monitor)
     return (1);
 
   while (1) {
-    usleep (100000);
+    n = lngpio_edge_ring_drain (ring, edges, EDGE_BATCH);
+    for (i = 0; i < n; i++)
+      edge_detected (&edges[i], sensor, writer);
+
+    if (overflows != lngpio_edge_ring_overflows (ring)) {
+      overflows = lngpio_edge_ring_overflows (ring);
+      fprintf (stderr, "edge ring overflow, %llu edges dropped\n",
+          (unsigned long long) overflows);
+    }
+
+    if (n < EDGE_BATCH)
+      usleep (10000);
   }
 
   if (-1 == lngpio_pin_monitor_stop (monitor))
     return (1);
 
-  if (-1 == lngpio_unexport (PIN))
+  if (use_sysfs && -1 == lngpio_unexport (PIN))
     return (1);
 
+  mysql_writer_stop (writer);
+  lngpio_edge_ring_free (ring);
+  ppd42_sensor_free (sensor);
+
   return (0);
 }